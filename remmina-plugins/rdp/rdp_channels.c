@@ -35,10 +35,15 @@
 #include "rdp_plugin.h"
 #include "rdp_cliprdr.h"
 #include "rdp_channels.h"
+#include "rdp_gdi.h"
+#include "rdp_record.h"
+#include "rdp_tsmf.h"
 
 #include <freerdp/freerdp.h>
 #include <freerdp/channels/channels.h>
 #include <freerdp/client/cliprdr.h>
+#include <freerdp/client/disp.h>
+#include <freerdp/gdi/gfx.h>
 
 void remmina_rdp_OnChannelConnectedEventHandler(rdpContext* context, ChannelConnectedEventArgs* e)
 {
@@ -51,18 +56,15 @@ void remmina_rdp_OnChannelConnectedEventHandler(rdpContext* context, ChannelConn
 	}
 	else if (g_strcmp0(e->name, TSMF_DVC_CHANNEL_NAME) == 0)
 	{
-		g_print("Unimplemented: channel %s connected but we can't use it\n", e->name);
-		// xf_tsmf_init(xfc, (TsmfClientContext*) e->pInterface);
+		remmina_rdp_tsmf_init(rfi, (TsmfClientContext*) e->pInterface);
 	}
 	else if (g_strcmp0(e->name, RDPGFX_DVC_CHANNEL_NAME) == 0)
 	{
-		g_print("Unimplemented: channel %s connected but we can't use it\n", e->name);
-		/*
-		if (settings->SoftwareGdi)
-			gdi_graphics_pipeline_init(context->gdi, (RdpgfxClientContext*) e->pInterface);
-		else
-			xf_graphics_pipeline_init(xfc, (RdpgfxClientContext*) e->pInterface);
-		*/
+		/* The GDI decodes the surfaces and outputs them to the primary
+		 * buffer at every end of frame, through rf_end_paint() */
+		gdi_graphics_pipeline_init(context->gdi, (RdpgfxClientContext*) e->pInterface);
+		rf_record_gfx_open(rfi, (RdpgfxClientContext*) e->pInterface);
+		rf_gdi_gfx_init(rfi, (RdpgfxClientContext*) e->pInterface);
 	}
 	else if (g_strcmp0(e->name, RAIL_SVC_CHANNEL_NAME) == 0)
 	{
@@ -73,6 +75,10 @@ void remmina_rdp_OnChannelConnectedEventHandler(rdpContext* context, ChannelConn
 	{
 		remmina_rdp_cliprdr_init( rfi, (CliprdrClientContext*) e->pInterface);
 	}
+	else if (g_strcmp0(e->name, DISP_DVC_CHANNEL_NAME) == 0)
+	{
+		rfi->dispcontext = (DispClientContext*) e->pInterface;
+	}
 	else if (g_strcmp0(e->name, ENCOMSP_SVC_CHANNEL_NAME) == 0)
 	{
 		g_print("Unimplemented: channel %s connected but we can't use it\n", e->name);
@@ -82,5 +88,14 @@ void remmina_rdp_OnChannelConnectedEventHandler(rdpContext* context, ChannelConn
 
 void remmina_rdp_OnChannelDisconnectedEventHandler(rdpContext* context, ChannelConnectedEventArgs* e)
 {
+	rfContext* rfi = (rfContext*) context;
 
+	if (g_strcmp0(e->name, DISP_DVC_CHANNEL_NAME) == 0)
+	{
+		rfi->dispcontext = NULL;
+	}
+	else if (g_strcmp0(e->name, RDPGFX_DVC_CHANNEL_NAME) == 0)
+	{
+		gdi_graphics_pipeline_uninit(context->gdi, (RdpgfxClientContext*) e->pInterface);
+	}
 }
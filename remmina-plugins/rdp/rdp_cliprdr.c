@@ -35,13 +35,18 @@
 
 #include "rdp_plugin.h"
 #include "rdp_cliprdr.h"
+#include "rdp_cliprdr_file.h"
+#include "rdp_cliprdr_text.h"
 
 #include <freerdp/freerdp.h>
 #include <freerdp/channels/channels.h>
 #include <freerdp/client/cliprdr.h>
-#include <sys/time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#define CLIPBOARD_TRANSFER_WAIT_TIME 2
+#define BI_RGB		0
+#define BI_BITFIELDS	3
 
 UINT32 remmina_rdp_cliprdr_get_format_from_gdkatom(GdkAtom atom)
 {
@@ -71,6 +76,10 @@ UINT32 remmina_rdp_cliprdr_get_format_from_gdkatom(GdkAtom atom)
 	{
 		return CF_DIB;
 	}
+	if (g_strcmp0("text/uri-list", name) == 0)
+	{
+		return REMMINA_RDP_CLIPRDR_FORMAT_FILES;
+	}
 	return 0;
 }
 
@@ -95,218 +104,241 @@ void remmina_rdp_cliprdr_get_target_types(UINT32** formats, UINT16* size, GdkAto
 	*formats = realloc(*formats, sizeof(UINT32) * (*size));
 }
 
-static UINT8* lf2crlf(UINT8* data, int* size)
+/* Swap the first and third byte of count 32 bit pixels, turning BGRA into
+ * RGBA and back. When opaque is set, the fourth byte is forced to 0xff. */
+static void remmina_rdp_cliprdr_swap_rb(const UINT8* src, UINT8* dst, gint count, gboolean opaque)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_swap_rb");
+	UINT32 alpha = opaque ? 0xFF000000 : 0;
+	UINT32 v;
+	gint i = 0;
+
+#ifdef __SSE2__
+	__m128i ga = _mm_set1_epi32(0xFF00FF00);
+	__m128i lo = _mm_set1_epi32(0x000000FF);
+	__m128i a = _mm_set1_epi32(alpha);
+	__m128i px;
+
+	for (; i + 4 <= count; i += 4)
+	{
+		px = _mm_loadu_si128((const __m128i*) (src + i * 4));
+		px = _mm_or_si128(_mm_or_si128(_mm_and_si128(px, ga), a),
+			_mm_or_si128(_mm_and_si128(_mm_srli_epi32(px, 16), lo),
+				_mm_slli_epi32(_mm_and_si128(px, lo), 16)));
+		_mm_storeu_si128((__m128i*) (dst + i * 4), px);
+	}
+#endif
+	for (; i < count; i++)
+	{
+		memcpy(&v, src + i * 4, 4);
+		v = (v & 0xFF00FF00) | alpha | ((v >> 16) & 0xFF) | ((v & 0xFF) << 16);
+		memcpy(dst + i * 4, &v, 4);
+	}
+}
+
+/* Convert a CF_DIB/CF_DIBV5 packed bitmap straight into a pixbuf. Only
+ * the uncompressed 24 and 32 bpp layouts are handled here, NULL is
+ * returned for anything else and the caller falls back to the pixbuf
+ * loader. */
+static GdkPixbuf* remmina_rdp_cliprdr_dib_to_pixbuf(const UINT8* data, size_t size)
 {
-	TRACE_CALL("lf2crlf");
-	UINT8 c;
-	UINT8* outbuf;
-	UINT8* out;
-	UINT8* in_end;
-	UINT8* in;
-	int out_size;
-
-	out_size = (*size) * 2 + 1;
-	outbuf = (UINT8*) malloc(out_size);
-	out = outbuf;
-	in = data;
-	in_end = data + (*size);
-
-	while (in < in_end)
-	{
-		c = *in++;
-		if (c == '\n')
+	TRACE_CALL("remmina_rdp_cliprdr_dib_to_pixbuf");
+	const BITMAPINFOHEADER* pbi;
+	const BITMAPV5HEADER* pbi5 = NULL;
+	const UINT8* bits;
+	const UINT8* src;
+	const UINT8* masks;
+	GdkPixbuf* pixbuf;
+	UINT8* pixels;
+	UINT8* dst;
+	gboolean opaque = TRUE;
+	gint width, height, stride, rowstride, x, y;
+	size_t offset;
+
+	if (size < sizeof(BITMAPINFOHEADER))
+		return NULL;
+	pbi = (const BITMAPINFOHEADER*) data;
+	if (pbi->biSize < sizeof(BITMAPINFOHEADER) || pbi->biSize > size || pbi->biPlanes != 1)
+		return NULL;
+	if (pbi->biSize >= sizeof(BITMAPV5HEADER))
+		pbi5 = (const BITMAPV5HEADER*) data;
+
+	width = pbi->biWidth;
+	height = pbi->biHeight < 0 ? -pbi->biHeight : pbi->biHeight;
+	if (width <= 0 || height <= 0 || width > 32768 || height > 32768)
+		return NULL;
+
+	offset = pbi->biSize;
+	if (pbi->biCompression == BI_BITFIELDS)
+	{
+		if (pbi->biBitCount != 32)
+			return NULL;
+		if (pbi->biSize == sizeof(BITMAPINFOHEADER))
 		{
-			*out++ = '\r';
-			*out++ = '\n';
+			masks = data + offset;
+			offset += 12;
 		}
 		else
 		{
-			*out++ = c;
+			masks = data + 40;
 		}
+		if (offset > size)
+			return NULL;
+		/* Only the usual BGRX layout is worth a fast path */
+		if (masks[0] != 0x00 || masks[1] != 0x00 || masks[2] != 0xFF || masks[3] != 0x00 ||
+			masks[4] != 0x00 || masks[5] != 0xFF || masks[6] != 0x00 || masks[7] != 0x00 ||
+			masks[8] != 0xFF || masks[9] != 0x00 || masks[10] != 0x00 || masks[11] != 0x00)
+			return NULL;
 	}
+	else if (pbi->biCompression != BI_RGB || (pbi->biBitCount != 24 && pbi->biBitCount != 32))
+	{
+		return NULL;
+	}
+	offset += sizeof(RGBQUAD) * pbi->biClrUsed;
+	if (pbi5 && pbi5->bV5ProfileData <= offset)
+		offset += pbi5->bV5ProfileSize;
 
-	*out++ = 0;
-	*size = out - outbuf;
-
-	return outbuf;
-}
+	if (pbi->biBitCount == 32 && pbi5 && pbi5->bV5AlphaMask == 0xFF000000)
+		opaque = FALSE;
 
-static void crlf2lf(UINT8* data, size_t* size)
-{
-	TRACE_CALL("crlf2lf");
-	UINT8 c;
-	UINT8* out;
-	UINT8* in;
-	UINT8* in_end;
+	stride = ((width * pbi->biBitCount + 31) / 32) * 4;
+	if (offset > size || (size - offset) / stride < (size_t) height)
+		return NULL;
+	bits = data + offset;
 
-	out = data;
-	in = data;
-	in_end = data + (*size);
+	pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, width, height);
+	if (!pixbuf)
+		return NULL;
+	pixels = gdk_pixbuf_get_pixels(pixbuf);
+	rowstride = gdk_pixbuf_get_rowstride(pixbuf);
 
-	while (in < in_end)
+	for (y = 0; y < height; y++)
 	{
-		c = *in++;
-		if (c != '\r')
-			*out++ = c;
+		/* Positive heights are bottom-up DIBs */
+		src = bits + (size_t) stride * (pbi->biHeight < 0 ? y : height - 1 - y);
+		dst = pixels + (size_t) rowstride * y;
+		if (pbi->biBitCount == 32)
+		{
+			remmina_rdp_cliprdr_swap_rb(src, dst, width, opaque);
+		}
+		else
+		{
+			for (x = 0; x < width; x++, src += 3, dst += 4)
+			{
+				dst[0] = src[2];
+				dst[1] = src[1];
+				dst[2] = src[0];
+				dst[3] = 0xFF;
+			}
+		}
 	}
 
-	*size = out - data;
+	return pixbuf;
 }
 
-int remmina_rdp_cliprdr_server_file_contents_request(CliprdrClientContext* context, CLIPRDR_FILE_CONTENTS_REQUEST* fileContentsRequest)
+/* Build a 32 bpp bottom-up CF_DIB from a pixbuf. Returns a malloc'ed
+ * buffer of *size bytes. */
+static UINT8* remmina_rdp_cliprdr_pixbuf_to_dib(GdkPixbuf* pixbuf, int* size)
 {
-	TRACE_CALL("remmina_rdp_cliprdr_server_file_contents_request");
-/*	UINT32 uSize = 0;
-	BYTE* pData = NULL;
-	HRESULT hRet = S_OK;
-	FORMATETC vFormatEtc;
-	LPDATAOBJECT pDataObj = NULL;
-	STGMEDIUM vStgMedium;
-	LPSTREAM pStream = NULL;
-	BOOL bIsStreamFile = TRUE;
-	static LPSTREAM pStreamStc = NULL;
-	static UINT32 uStreamIdStc = 0;
-	wfClipboard* clipboard = (wfClipboard*) context->custom;
-	if (fileContentsRequest->dwFlags == FILECONTENTS_SIZE)
-	fileContentsRequest->cbRequested = sizeof(UINT64);
-	pData = (BYTE*) calloc(1, fileContentsRequest->cbRequested);
-	if (!pData)
-	goto error;
-	hRet = OleGetClipboard(&pDataObj);
-	if (!SUCCEEDED(hRet))
-	{
-	WLog_ERR(TAG, "filecontents: get ole clipboard failed.");
-	goto error;
-	}
-	ZeroMemory(&vFormatEtc, sizeof(FORMATETC));
-	ZeroMemory(&vStgMedium, sizeof(STGMEDIUM));
-	vFormatEtc.cfFormat = clipboard->ID_FILECONTENTS;
-	vFormatEtc.tymed = TYMED_ISTREAM;
-	vFormatEtc.dwAspect = 1;
-	vFormatEtc.lindex = fileContentsRequest->listIndex;
-	vFormatEtc.ptd = NULL;
-	if ((uStreamIdStc != fileContentsRequest->streamId) || !pStreamStc)
-	{
-	LPENUMFORMATETC pEnumFormatEtc;
-	ULONG CeltFetched;
-	FORMATETC vFormatEtc2;
-	if (pStreamStc)
-	{
-	IStream_Release(pStreamStc);
-	pStreamStc = NULL;
-	}
-	bIsStreamFile = FALSE;
-	hRet = IDataObject_EnumFormatEtc(pDataObj, DATADIR_GET, &pEnumFormatEtc);
-	if (hRet == S_OK)
-	{
-	do
-	{
-	hRet = IEnumFORMATETC_Next(pEnumFormatEtc, 1, &vFormatEtc2, &CeltFetched);
-	if (hRet == S_OK)
+	TRACE_CALL("remmina_rdp_cliprdr_pixbuf_to_dib");
+	const UINT8* pixels;
+	const UINT8* src;
+	UINT8* dst;
+	wStream* s;
+	UINT8* dib;
+	gint width, height, rowstride, n_channels, x, y;
+	UINT32 image_size;
+
+	if (gdk_pixbuf_get_colorspace(pixbuf) != GDK_COLORSPACE_RGB || gdk_pixbuf_get_bits_per_sample(pixbuf) != 8)
+		return NULL;
+
+	width = gdk_pixbuf_get_width(pixbuf);
+	height = gdk_pixbuf_get_height(pixbuf);
+	rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+	n_channels = gdk_pixbuf_get_n_channels(pixbuf);
+	pixels = gdk_pixbuf_get_pixels(pixbuf);
+	image_size = width * height * 4;
+
+	s = Stream_New(NULL, sizeof(BITMAPINFOHEADER) + image_size);
+	if (!s)
+		return NULL;
+	Stream_Write_UINT32(s, sizeof(BITMAPINFOHEADER));	/* biSize */
+	Stream_Write_UINT32(s, width);				/* biWidth */
+	Stream_Write_UINT32(s, height);				/* biHeight, bottom-up */
+	Stream_Write_UINT16(s, 1);				/* biPlanes */
+	Stream_Write_UINT16(s, 32);				/* biBitCount */
+	Stream_Write_UINT32(s, BI_RGB);				/* biCompression */
+	Stream_Write_UINT32(s, image_size);			/* biSizeImage */
+	Stream_Write_UINT32(s, 0);				/* biXPelsPerMeter */
+	Stream_Write_UINT32(s, 0);				/* biYPelsPerMeter */
+	Stream_Write_UINT32(s, 0);				/* biClrUsed */
+	Stream_Write_UINT32(s, 0);				/* biClrImportant */
+
+	for (y = 0; y < height; y++)
 	{
-	if (vFormatEtc2.cfFormat == clipboard->ID_FILECONTENTS)
-	{
-	hRet = IDataObject_GetData(pDataObj, &vFormatEtc, &vStgMedium);
-	if (hRet == S_OK)
-	{
-	pStreamStc = vStgMedium.pstm;
-	uStreamIdStc = fileContentsRequest->streamId;
-	bIsStreamFile = TRUE;
-	}
-	break;
-	}
-	}
-	}
-	while (hRet == S_OK);
-	}
-	}
-	if (bIsStreamFile == TRUE)
-	{
-	if (fileContentsRequest->dwFlags == FILECONTENTS_SIZE)
-	{
-	STATSTG vStatStg;
-	ZeroMemory(&vStatStg, sizeof(STATSTG));
-	hRet = IStream_Stat(pStreamStc, &vStatStg, STATFLAG_NONAME);
-	if (hRet == S_OK)
-	{
-	*((UINT32*) &pData[0]) = vStatStg.cbSize.LowPart;
-	*((UINT32*) &pData[4]) = vStatStg.cbSize.HighPart;
-	uSize = fileContentsRequest->cbRequested;
-	}
-	}
-	else if (fileContentsRequest->dwFlags == FILECONTENTS_RANGE)
-	{
-	LARGE_INTEGER dlibMove;
-	ULARGE_INTEGER dlibNewPosition;
-	dlibMove.HighPart = fileContentsRequest->nPositionHigh;
-	dlibMove.LowPart = fileContentsRequest->nPositionLow;
-	hRet = IStream_Seek(pStreamStc, dlibMove, STREAM_SEEK_SET, &dlibNewPosition);
-	if (SUCCEEDED(hRet))
-	{
-	hRet = IStream_Read(pStreamStc, pData, fileContentsRequest->cbRequested, (PULONG) &uSize);
-	}
-	}
-	}
-	else
-	{
-	if (fileContentsRequest->dwFlags == FILECONTENTS_SIZE)
-	{
-	*((UINT32*) &pData[0]) = clipboard->fileDescriptor[fileContentsRequest->listIndex]->nFileSizeLow;
-	*((UINT32*) &pData[4]) = clipboard->fileDescriptor[fileContentsRequest->listIndex]->nFileSizeHigh;
-	uSize = fileContentsRequest->cbRequested;
-	}
-	else if (fileContentsRequest->dwFlags == FILECONTENTS_RANGE)
-	{
-	BOOL bRet;
-	bRet = wf_cliprdr_get_file_contents(clipboard->file_names[fileContentsRequest->listIndex], pData,
-	fileContentsRequest->nPositionLow, fileContentsRequest->nPositionHigh,
-	fileContentsRequest->cbRequested, &uSize);
-	if (bRet == FALSE)
-	{
-	WLog_ERR(TAG, "get file contents failed.");
-	uSize = 0;
-	goto error;
-	}
-	}
-	}
-	IDataObject_Release(pDataObj);
-	if (uSize == 0)
-	{
-	free(pData);
-	pData = NULL;
-	}
-	cliprdr_send_response_filecontents(clipboard, fileContentsRequest->streamId, uSize, pData);
-	free(pData);
-	return 1;
-	error:
-	if (pData)
-	{
-	free(pData);
-	pData = NULL;
-	}
-	if (pDataObj)
-	{
-	IDataObject_Release(pDataObj);
-	pDataObj = NULL;
+		src = pixels + (size_t) rowstride * (height - 1 - y);
+		dst = Stream_Pointer(s);
+		if (n_channels == 4)
+		{
+			remmina_rdp_cliprdr_swap_rb(src, dst, width, FALSE);
+		}
+		else
+		{
+			for (x = 0; x < width; x++, src += n_channels, dst += 4)
+			{
+				dst[0] = src[2];
+				dst[1] = src[1];
+				dst[2] = src[0];
+				dst[3] = 0xFF;
+			}
+		}
+		Stream_Seek(s, width * 4);
 	}
-	WLog_ERR(TAG, "filecontents: send failed response.");
-	cliprdr_send_response_filecontents(clipboard, fileContentsRequest->streamId, 0, NULL);
-	*/
-	return -1;
+
+	*size = Stream_GetPosition(s);
+	dib = Stream_Buffer(s);
+	Stream_Free(s, FALSE);
+
+	return dib;
 }
-int remmina_rdp_cliprdr_server_file_contents_response(CliprdrClientContext* context, CLIPRDR_FILE_CONTENTS_RESPONSE* fileContentsResponse)
+
+gboolean remmina_rdp_cliprdr_format_is_image(UINT32 format)
 {
-	TRACE_CALL("remmina_rdp_cliprdr_server_file_contents_response");
-	/*
-	wfClipboard* clipboard = (wfClipboard*) context->custom;
-	clipboard->req_fsize = fileContentsResponse->cbRequested;
-	clipboard->req_fdata = (char*) malloc(fileContentsResponse->cbRequested);
-	CopyMemory(clipboard->req_fdata, fileContentsResponse->requestedData, fileContentsResponse->cbRequested);
-	SetEvent(clipboard->req_fevent);
-	*/
-	return 1;
+	TRACE_CALL("remmina_rdp_cliprdr_format_is_image");
+	return (format == CB_FORMAT_PNG || format == CF_DIB || format == CF_DIBV5 || format == CB_FORMAT_JPEG);
 }
 
+void remmina_rdp_cliprdr_free_data(UINT32 format, gpointer data)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_free_data");
+	if (data == NULL)
+		return;
+	if (remmina_rdp_cliprdr_format_is_image(format))
+		g_object_unref(data);
+	else
+		free(data);
+}
+
+static void remmina_rdp_cliprdr_send_data_request(rfClipboard* clipboard, UINT32 format)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_send_data_request");
+	/* Must be called with transfer_clip_mutex held. The server answers
+	 * requests in order, so the queue tells which serial and format each
+	 * response belongs to. */
+	CLIPRDR_FORMAT_DATA_REQUEST request;
+	rfClipboardRequest* req;
+
+	req = g_new(rfClipboardRequest, 1);
+	req->serial = clipboard->srv_serial;
+	req->format = format;
+	g_queue_push_tail(clipboard->srv_requests, req);
+
+	ZeroMemory(&request, sizeof(CLIPRDR_FORMAT_DATA_REQUEST));
+	request.requestedFormatId = format;
+	request.msgFlags = CB_RESPONSE_OK;
+	request.msgType = CB_FORMAT_DATA_REQUEST;
+	clipboard->context->ClientFormatDataRequest(clipboard->context, &request);
+}
 
 static int remmina_rdp_cliprdr_monitor_ready(CliprdrClientContext* context, CLIPRDR_MONITOR_READY* monitorReady)
 {
@@ -317,7 +349,7 @@ static int remmina_rdp_cliprdr_monitor_ready(CliprdrClientContext* context, CLIP
 
 	gp = clipboard->rfi->protocol_widget;
 
-	ui = g_new0(RemminaPluginRdpUiObject, 1);
+	ui = rf_object_new(gp);
 	ui->type = REMMINA_RDP_UI_CLIPBOARD;
 	ui->clipboard.clipboard = clipboard;
 	ui->clipboard.type = REMMINA_RDP_UI_CLIPBOARD_MONITORREADY;
@@ -341,10 +373,15 @@ static int remmina_rdp_cliprdr_server_format_list(CliprdrClientContext* context,
 	 * the server send us and then setup the local clipboard with the appropiate
 	 * functions to request server data */
 
+	static const UINT32 prefetch_formats[] = {
+		CF_UNICODETEXT, CF_TEXT, CB_FORMAT_HTML, CB_FORMAT_PNG, CF_DIB, CF_DIBV5, CB_FORMAT_JPEG
+	};
 	RemminaPluginRdpUiObject* ui;
 	RemminaProtocolWidget* gp;
 	rfClipboard* clipboard;
 	CLIPRDR_FORMAT* format;
+	guint best_rank, j;
+	UINT32 file_format = 0;
 
 	int i;
 
@@ -352,9 +389,18 @@ static int remmina_rdp_cliprdr_server_format_list(CliprdrClientContext* context,
 	gp = clipboard->rfi->protocol_widget;
 	GtkTargetList* list = gtk_target_list_new (NULL, 0);
 
+	best_rank = G_N_ELEMENTS(prefetch_formats);
 	for (i = 0; i < formatList->numFormats; i++)
 	{
 		format = &formatList->formats[i];
+		for (j = 0; j < best_rank; j++)
+		{
+			if (prefetch_formats[j] == format->formatId)
+			{
+				best_rank = j;
+				break;
+			}
+		}
 		if (format->formatId == CF_UNICODETEXT)
 		{
 			GdkAtom atom = gdk_atom_intern("UTF8_STRING", TRUE);
@@ -390,9 +436,40 @@ static int remmina_rdp_cliprdr_server_format_list(CliprdrClientContext* context,
 			GdkAtom atom = gdk_atom_intern("text/html", TRUE);
 			gtk_target_list_add(list, atom, 0, CB_FORMAT_HTML);
 		}
+		else if (format->formatName && strcmp(format->formatName, "FileGroupDescriptorW") == 0)
+		{
+			file_format = format->formatId;
+			gtk_target_list_add(list, gdk_atom_intern("text/uri-list", FALSE), 0, file_format);
+			gtk_target_list_add(list, gdk_atom_intern("x-special/gnome-copied-files", FALSE), 0, file_format);
+		}
 	}
 
-	ui = g_new0(RemminaPluginRdpUiObject, 1);
+	/* Newer remote content: drop what we had and prefetch the best format
+	 * right away, so a paste on the client never has to wait for it */
+	pthread_mutex_lock(&clipboard->transfer_clip_mutex);
+	clipboard->srv_serial++;
+	remmina_rdp_cliprdr_free_data(clipboard->srv_format, clipboard->srv_data);
+	clipboard->srv_data = NULL;
+	remmina_rdp_cliprdr_file_cancel(clipboard);
+	clipboard->srv_file_format = file_format;
+	if (best_rank < G_N_ELEMENTS(prefetch_formats))
+	{
+		clipboard->srv_clip_data_wait = SCDW_FETCHING;
+		remmina_rdp_cliprdr_send_data_request(clipboard, prefetch_formats[best_rank]);
+	}
+	else if (file_format != 0)
+	{
+		/* Only the file list, the files are downloaded on paste */
+		clipboard->srv_clip_data_wait = SCDW_FETCHING;
+		remmina_rdp_cliprdr_send_data_request(clipboard, file_format);
+	}
+	else
+	{
+		clipboard->srv_clip_data_wait = SCDW_NONE;
+	}
+	pthread_mutex_unlock(&clipboard->transfer_clip_mutex);
+
+	ui = rf_object_new(gp);
 	ui->type = REMMINA_RDP_UI_CLIPBOARD;
 	ui->clipboard.clipboard = clipboard;
 	ui->clipboard.type = REMMINA_RDP_UI_CLIPBOARD_SET_DATA;
@@ -420,7 +497,7 @@ static int remmina_rdp_cliprdr_server_format_data_request(CliprdrClientContext*
 	clipboard = (rfClipboard*)context->custom;
 	gp = clipboard->rfi->protocol_widget;
 
-	ui = g_new0(RemminaPluginRdpUiObject, 1);
+	ui = rf_object_new(gp);
 	ui->type = REMMINA_RDP_UI_CLIPBOARD;
 	ui->clipboard.clipboard = clipboard;
 	ui->clipboard.type = REMMINA_RDP_UI_CLIPBOARD_GET_DATA;
@@ -435,16 +512,24 @@ static int remmina_rdp_cliprdr_server_format_data_response(CliprdrClientContext*
 	TRACE_CALL("remmina_rdp_cliprdr_server_format_data_response");
 	UINT8* data;
 	size_t size;
-	rfContext* rfi;
 	RemminaProtocolWidget* gp;
 	rfClipboard* clipboard;
 	GdkPixbufLoader *pixbuf;
 	gpointer output = NULL;
 	RemminaPluginRdpUiObject *ui;
+	rfClipboardRequest* req;
 
 	clipboard = (rfClipboard*)context->custom;
 	gp = clipboard->rfi->protocol_widget;
-	rfi = GET_PLUGIN_DATA(gp);
+
+	pthread_mutex_lock(&clipboard->transfer_clip_mutex);
+	req = g_queue_pop_head(clipboard->srv_requests);
+	pthread_mutex_unlock(&clipboard->transfer_clip_mutex);
+	if (req == NULL)
+	{
+		remmina_plugin_service->log_printf("[RDP] rdp_cliprdr: unexpected format data response\n");
+		return 1;
+	}
 
 	data = formatDataResponse->requestedFormatData;
 	size = formatDataResponse->dataLen;
@@ -453,14 +538,13 @@ static int remmina_rdp_cliprdr_server_format_data_response(CliprdrClientContext*
 	//  by freerdp and freed after returning from this callback function.
 	//  So we must make a copy if we need to preserve it
 
-	if (size > 0)
+	if (size > 0 && formatDataResponse->msgFlags == CB_RESPONSE_OK)
 	{
-		switch (rfi->clipboard.format)
+		switch (req->format)
 		{
 			case CF_UNICODETEXT:
 			{
-				size = ConvertFromUnicode(CP_UTF8, 0, (WCHAR*)data, size / 2, (CHAR**)&output, 0, NULL, NULL);
-				crlf2lf(output, &size);
+				output = remmina_rdp_cliprdr_utf16_to_utf8(data, size, &size);
 				break;
 			}
 
@@ -470,7 +554,7 @@ static int remmina_rdp_cliprdr_server_format_data_response(CliprdrClientContext*
 				output = (gpointer)calloc(1, size + 1);
 				if (output) {
 					memcpy(output, data, size);
-					crlf2lf(output, &size);
+					remmina_rdp_cliprdr_crlf2lf(output, &size);
 				}
 				break;
 			}
@@ -484,6 +568,11 @@ static int remmina_rdp_cliprdr_server_format_data_response(CliprdrClientContext*
 				BITMAPINFOHEADER* pbi;
 				BITMAPV5HEADER* pbi5;
 
+				output = remmina_rdp_cliprdr_dib_to_pixbuf(data, size);
+				if (output != NULL)
+					break;
+
+				/* Unusual layouts go through the BMP loader */
 				pbi = (BITMAPINFOHEADER*)data;
 
 				// offset calculation inspired by http://downloads.poolelan.com/MSDN/MSDNLibrary6/Disk1/Samples/VC/OS/WindowsXP/GetImage/BitmapUtil.cpp
@@ -493,7 +582,7 @@ static int remmina_rdp_cliprdr_server_format_data_response(CliprdrClientContext*
 				else if (pbi->biBitCount <= 8)
 					offset += sizeof(RGBQUAD) * (1 << pbi->biBitCount);
 				if (pbi->biSize == sizeof(BITMAPINFOHEADER)) {
-					if (pbi->biCompression == 3) // BI_BITFIELDS is 3
+					if (pbi->biCompression == BI_BITFIELDS)
 							offset += 12;
 				} else if (pbi->biSize >= sizeof(BITMAPV5HEADER)) {
 					pbi5 = (BITMAPV5HEADER*)pbi;
@@ -522,9 +611,9 @@ static int remmina_rdp_cliprdr_server_format_data_response(CliprdrClientContext*
 						remmina_plugin_service->log_printf("[RDP] rdp_cliprdr: gdk_pixbuf_loader_close() returned error %s\n", perr->message);
 						perr = NULL;
 					}
-					Stream_Free(s, TRUE);
 					output = g_object_ref(gdk_pixbuf_loader_get_pixbuf(pixbuf));
 				}
+				Stream_Free(s, TRUE);
 				g_object_unref(pixbuf);
 				break;
 			}
@@ -543,28 +632,48 @@ static int remmina_rdp_cliprdr_server_format_data_response(CliprdrClientContext*
 	}
 
 	pthread_mutex_lock(&clipboard->transfer_clip_mutex);
-	pthread_cond_signal(&clipboard->transfer_clip_cond);
-	if ( clipboard->srv_clip_data_wait == SCDW_BUSY_WAIT ) {
-		clipboard->srv_data = output;
+	if (req->serial != clipboard->srv_serial)
+	{
+		/* Newer content replaced the one this request was for */
+		remmina_rdp_cliprdr_free_data(req->format, output);
+	}
+	else if (req->format == clipboard->srv_file_format)
+	{
+		remmina_rdp_cliprdr_file_set_descriptor(clipboard, req->serial, formatDataResponse->requestedFormatData,
+			formatDataResponse->msgFlags == CB_RESPONSE_OK ? formatDataResponse->dataLen : 0);
+		if (clipboard->srv_clip_data_wait == SCDW_ASYNCWAIT && clipboard->srv_files)
+			remmina_rdp_cliprdr_file_download_start(clipboard);
+		else
+			clipboard->srv_clip_data_wait = SCDW_NONE;
 	}
 	else
 	{
-		// Clipboard data arrived from server when we are not busywaiting.
-		// Just put it on the local clipboard
-
-		ui = g_new0(RemminaPluginRdpUiObject, 1);
-		ui->type = REMMINA_RDP_UI_CLIPBOARD;
-		ui->clipboard.clipboard = clipboard;
-		ui->clipboard.type = REMMINA_RDP_UI_CLIPBOARD_SET_CONTENT;
-		ui->clipboard.data = output;
-		ui->clipboard.format = clipboard->format;
-		rf_queue_ui(gp, ui);
+		remmina_rdp_cliprdr_free_data(clipboard->srv_format, clipboard->srv_data);
+		clipboard->srv_data = output;
+		clipboard->srv_format = req->format;
 
+		if (output != NULL && clipboard->srv_clip_data_wait == SCDW_ASYNCWAIT)
+		{
+			// Someone tried to paste while the data was still on its way.
+			// Put it on the local clipboard, so the next paste gets it
+
+			ui = rf_object_new(gp);
+			ui->type = REMMINA_RDP_UI_CLIPBOARD;
+			ui->clipboard.clipboard = clipboard;
+			ui->clipboard.type = REMMINA_RDP_UI_CLIPBOARD_SET_CONTENT;
+			ui->clipboard.format = req->format;
+			if (remmina_rdp_cliprdr_format_is_image(req->format))
+				ui->clipboard.data = g_object_ref(output);
+			else
+				ui->clipboard.data = g_strdup(output);
+			rf_queue_ui(gp, ui);
+		}
 		clipboard->srv_clip_data_wait = SCDW_NONE;
-
 	}
 	pthread_mutex_unlock(&clipboard->transfer_clip_mutex);
 
+	g_free(req);
+
 	return 1;
 }
 
@@ -572,81 +681,80 @@ void remmina_rdp_cliprdr_request_data(GtkClipboard *gtkClipboard, GtkSelectionDa
 {
 	TRACE_CALL("remmina_rdp_cliprdr_request_data");
 	/* Called when someone press "Paste" on the client side.
-	 * We ask to the server the data we need */
+	 * This runs on the GTK thread and must never block on the server:
+	 * we hand over the prefetched data if we have it, otherwise the data is
+	 * put on the local clipboard as soon as it arrives. Files are waited
+	 * for in a nested main loop, behind a progress dialog. */
 
-	GdkAtom target;
-	CLIPRDR_FORMAT_DATA_REQUEST request;
 	rfClipboard* clipboard;
 	rfContext* rfi = GET_PLUGIN_DATA(gp);
-	struct timespec to;
-	struct timeval tv;
-	int rc;
+	gboolean match;
 
 	clipboard = &(rfi->clipboard);
-	if ( clipboard->srv_clip_data_wait != SCDW_NONE ) {
-		remmina_plugin_service->log_printf("[RDP] Cannot paste now, I'm transferring clipboard data from server. Try again later\n");
-		return;
-	}
-
-
-	target = gtk_selection_data_get_target(selection_data);
-	// clipboard->format = remmina_rdp_cliprdr_get_format_from_gdkatom(target);
-	clipboard->format = info;
-
-
-	/* Request Clipboard content from the server */
-	ZeroMemory(&request, sizeof(CLIPRDR_FORMAT_DATA_REQUEST));
-	request.requestedFormatId = clipboard->format;
-	request.msgFlags = CB_RESPONSE_OK;
-	request.msgType = CB_FORMAT_DATA_REQUEST;
-
 
 	pthread_mutex_lock(&clipboard->transfer_clip_mutex);
 
-	clipboard->srv_clip_data_wait = SCDW_BUSY_WAIT;
-	clipboard->context->ClientFormatDataRequest(clipboard->context, &request);
-
-	/* Busy wait clibpoard data for CLIPBOARD_TRANSFER_WAIT_TIME seconds */
-	gettimeofday(&tv, NULL);
-	to.tv_sec = tv.tv_sec + CLIPBOARD_TRANSFER_WAIT_TIME;
-	to.tv_nsec = tv.tv_usec * 1000;
-	rc = pthread_cond_timedwait(&clipboard->transfer_clip_cond,&clipboard->transfer_clip_mutex, &to);
-
-	if ( rc == 0 ) {
-		/* Data has arrived without timeout */
-		if (clipboard->srv_data != NULL)
+	if (info != 0 && info == clipboard->srv_file_format)
+	{
+		/* Files are downloaded on the first paste */
+		if (clipboard->srv_data != NULL && clipboard->srv_format == info)
 		{
-			if (info == CB_FORMAT_PNG || info == CF_DIB || info == CF_DIBV5 || info == CB_FORMAT_JPEG)
-			{
-				gtk_selection_data_set_pixbuf(selection_data, clipboard->srv_data);
-				g_object_unref(clipboard->srv_data);
-			}
-			else
-			{
-				gtk_selection_data_set_text(selection_data, clipboard->srv_data, -1);
-				free(clipboard->srv_data);
-			}
-		}
-		clipboard->srv_clip_data_wait = SCDW_NONE;
-	} else {
-		clipboard->srv_clip_data_wait = SCDW_ASYNCWAIT;
-		if ( rc == ETIMEDOUT ) {
-			remmina_plugin_service->log_printf("[RDP] Clipboard data has not been transfered from the server in %d seconds. Try to paste later.\n",
-				CLIPBOARD_TRANSFER_WAIT_TIME);
+			remmina_rdp_cliprdr_file_set_selection(clipboard, selection_data);
 		}
-		else {
-			remmina_plugin_service->log_printf("[RDP] internal error: pthread_cond_timedwait() returned %d\n",rc);
-			clipboard->srv_clip_data_wait = SCDW_NONE;
+		else
+		{
+			if (clipboard->srv_files == NULL && clipboard->srv_clip_data_wait == SCDW_NONE)
+				remmina_rdp_cliprdr_send_data_request(clipboard, info);
+			clipboard->srv_clip_data_wait = SCDW_ASYNCWAIT;
+			if (clipboard->srv_files != NULL)
+				remmina_rdp_cliprdr_file_download_start(clipboard);
+			if (!remmina_rdp_cliprdr_file_wait(clipboard))
+				return;
+			pthread_mutex_lock(&clipboard->transfer_clip_mutex);
+			if (clipboard->srv_data != NULL && clipboard->srv_format == info)
+				remmina_rdp_cliprdr_file_set_selection(clipboard, selection_data);
 		}
+		pthread_mutex_unlock(&clipboard->transfer_clip_mutex);
+		return;
 	}
-	pthread_mutex_unlock(&clipboard->transfer_clip_mutex);
 
+	match = (clipboard->srv_data != NULL &&
+		remmina_rdp_cliprdr_format_is_image(info) == remmina_rdp_cliprdr_format_is_image(clipboard->srv_format) &&
+		(info == CB_FORMAT_HTML) == (clipboard->srv_format == CB_FORMAT_HTML));
+
+	if (match)
+	{
+		if (remmina_rdp_cliprdr_format_is_image(info))
+			gtk_selection_data_set_pixbuf(selection_data, clipboard->srv_data);
+		else
+			gtk_selection_data_set_text(selection_data, clipboard->srv_data, -1);
+	}
+	else
+	{
+		if (clipboard->srv_clip_data_wait == SCDW_NONE)
+			remmina_rdp_cliprdr_send_data_request(clipboard, info);
+		clipboard->srv_clip_data_wait = SCDW_ASYNCWAIT;
+		remmina_plugin_service->log_printf("[RDP] Clipboard data is still being transferred from the server. Try to paste again shortly.\n");
+	}
+
+	pthread_mutex_unlock(&clipboard->transfer_clip_mutex);
 }
 
 void remmina_rdp_cliprdr_empty_clipboard(GtkClipboard *gtkClipboard, rfClipboard *clipboard)
 {
 	TRACE_CALL("remmina_rdp_cliprdr_empty_clipboard");
-	/* No need to do anything here */
+	/* Another application took the local clipboard: cancel any pending
+	 * transfer, its data would overwrite newer content */
+	if (clipboard->owner_set)
+		return;
+
+	pthread_mutex_lock(&clipboard->transfer_clip_mutex);
+	clipboard->srv_serial++;
+	remmina_rdp_cliprdr_free_data(clipboard->srv_format, clipboard->srv_data);
+	clipboard->srv_data = NULL;
+	remmina_rdp_cliprdr_file_cancel(clipboard);
+	clipboard->srv_clip_data_wait = SCDW_NONE;
+	pthread_mutex_unlock(&clipboard->transfer_clip_mutex);
 }
 
 int remmina_rdp_cliprdr_send_client_capabilities(rfClipboard* clipboard)
@@ -662,7 +770,7 @@ int remmina_rdp_cliprdr_send_client_capabilities(rfClipboard* clipboard)
 	generalCapabilitySet.capabilitySetLength = 12;
 
 	generalCapabilitySet.version = CB_CAPS_VERSION_2;
-	generalCapabilitySet.generalFlags = CB_USE_LONG_FORMAT_NAMES;
+	generalCapabilitySet.generalFlags = CB_USE_LONG_FORMAT_NAMES | CB_STREAM_FILECLIP_ENABLED | CB_FILECLIP_NO_FILE_PATHS;
 
 	clipboard->context->ClientCapabilities(clipboard->context, &capabilities);
 
@@ -703,7 +811,7 @@ int remmina_rdp_cliprdr_mt_send_format_list(RemminaProtocolWidget* gp, RemminaPl
 			formatId = remmina_rdp_cliprdr_get_format_from_gdkatom(targets[i]);
 			if ( formatId != 0 ) {
 				formats[srvcount].formatId = formatId;
-				formats[srvcount].formatName = NULL;
+				formats[srvcount].formatName = (formatId == REMMINA_RDP_CLIPRDR_FORMAT_FILES ? (char*) "FileGroupDescriptorW" : NULL);
 				srvcount ++;
 			}
 		}
@@ -768,7 +876,13 @@ void remmina_rdp_cliprdr_get_clipboard_data(RemminaProtocolWidget* gp, RemminaPl
 
 	clipboard = ui->clipboard.clipboard;
 	gtkClipboard = gtk_widget_get_clipboard(rfi->drawing_area, GDK_SELECTION_CLIPBOARD);
-	if (gtkClipboard)
+	if (gtkClipboard && ui->clipboard.format == REMMINA_RDP_CLIPRDR_FORMAT_FILES)
+	{
+		gchar** uris = gtk_clipboard_wait_for_uris(gtkClipboard);
+		outbuf = remmina_rdp_cliprdr_file_build_descriptor(clipboard, uris, &size);
+		g_strfreev(uris);
+	}
+	else if (gtkClipboard)
 	{
 		switch (ui->clipboard.format)
 		{
@@ -800,14 +914,13 @@ void remmina_rdp_cliprdr_get_clipboard_data(RemminaProtocolWidget* gp, RemminaPl
 			case CB_FORMAT_HTML:
 			{
 				size = strlen((char*)inbuf);
-				outbuf = lf2crlf(inbuf, &size);
+				outbuf = remmina_rdp_cliprdr_lf2crlf(inbuf, &size);
+				g_free(inbuf);
 				break;
 			}
 			case CF_UNICODETEXT:
 			{
-				size = strlen((char*)inbuf);
-				inbuf = lf2crlf(inbuf, &size);
-				size = (ConvertToUnicode(CP_UTF8, 0, (CHAR*)inbuf, -1, (WCHAR**)&outbuf, 0) + 1) * 2;
+				outbuf = remmina_rdp_cliprdr_utf8_to_utf16(inbuf, strlen((char*)inbuf), &size);
 				g_free(inbuf);
 				break;
 			}
@@ -819,6 +932,7 @@ void remmina_rdp_cliprdr_get_clipboard_data(RemminaProtocolWidget* gp, RemminaPl
 				outbuf = (UINT8*) malloc(buffersize);
 				memcpy(outbuf, data, buffersize);
 				size = buffersize;
+				g_free(data);
 				g_object_unref(image);
 				break;
 			}
@@ -830,18 +944,14 @@ void remmina_rdp_cliprdr_get_clipboard_data(RemminaProtocolWidget* gp, RemminaPl
 				outbuf = (UINT8*) malloc(buffersize);
 				memcpy(outbuf, data, buffersize);
 				size = buffersize;
+				g_free(data);
 				g_object_unref(image);
 				break;
 			}
 			case CF_DIB:
 			case CF_DIBV5:
 			{
-				gchar* data;
-				gsize buffersize;
-				gdk_pixbuf_save_to_buffer(image, &data, &buffersize, "bmp", NULL, NULL);
-				size = buffersize - 14;
-				outbuf = (UINT8*) malloc(size);
-				memcpy(outbuf, data + 14, size);
+				outbuf = remmina_rdp_cliprdr_pixbuf_to_dib(image, &size);
 				g_object_unref(image);
 				break;
 			}
@@ -849,6 +959,7 @@ void remmina_rdp_cliprdr_get_clipboard_data(RemminaProtocolWidget* gp, RemminaPl
 	}
 
 	remmina_rdp_cliprdr_send_data_response(clipboard, outbuf, size);
+	free(outbuf);
 }
 void remmina_rdp_cliprdr_set_clipboard_content(RemminaProtocolWidget* gp, RemminaPluginRdpUiObject* ui)
 {
@@ -856,15 +967,31 @@ void remmina_rdp_cliprdr_set_clipboard_content(RemminaProtocolWidget* gp, Remmin
 	GtkClipboard* gtkClipboard;
 	rfContext* rfi = GET_PLUGIN_DATA(gp);
 
+	rfClipboard* clipboard = ui->clipboard.clipboard;
+
 	gtkClipboard = gtk_widget_get_clipboard(rfi->drawing_area, GDK_SELECTION_CLIPBOARD);
-	if (ui->clipboard.format == CB_FORMAT_PNG || ui->clipboard.format == CF_DIB || ui->clipboard.format == CF_DIBV5 || ui->clipboard.format == CB_FORMAT_JPEG) {
+	clipboard->clipboard_wait = TRUE;
+	clipboard->owner_set = TRUE;
+	if (ui->clipboard.format != 0 && ui->clipboard.format == clipboard->srv_file_format) {
+		/* Downloaded files: take the clipboard again, the URIs are
+		 * given by remmina_rdp_cliprdr_request_data() */
+		GtkTargetEntry targets[] = {
+			{ "text/uri-list", 0, ui->clipboard.format },
+			{ "x-special/gnome-copied-files", 0, ui->clipboard.format }
+		};
+		gtk_clipboard_set_with_owner(gtkClipboard, targets, G_N_ELEMENTS(targets),
+				(GtkClipboardGetFunc) remmina_rdp_cliprdr_request_data,
+				(GtkClipboardClearFunc) remmina_rdp_cliprdr_empty_clipboard, G_OBJECT(gp));
+	}
+	else if (remmina_rdp_cliprdr_format_is_image(ui->clipboard.format)) {
 		gtk_clipboard_set_image( gtkClipboard, ui->clipboard.data );
 		g_object_unref(ui->clipboard.data);
 	}
 	else {
 		gtk_clipboard_set_text( gtkClipboard, ui->clipboard.data, -1 );
-		free(ui->clipboard.data);
+		g_free(ui->clipboard.data);
 	}
+	clipboard->owner_set = FALSE;
 
 }
 
@@ -883,9 +1010,11 @@ void remmina_rdp_cliprdr_set_clipboard_data(RemminaProtocolWidget* gp, RemminaPl
 	if (gtkClipboard && targets)
 	{
 		clipboard->clipboard_wait = TRUE;
+		clipboard->owner_set = TRUE;
 		gtk_clipboard_set_with_owner(gtkClipboard, targets, n_targets,
 				(GtkClipboardGetFunc) remmina_rdp_cliprdr_request_data,
 				(GtkClipboardClearFunc) remmina_rdp_cliprdr_empty_clipboard, G_OBJECT(gp));
+		clipboard->owner_set = FALSE;
 		gtk_target_table_free(targets, n_targets);
 	}
 }
@@ -915,18 +1044,31 @@ void remmina_rdp_event_process_clipboard(RemminaProtocolWidget* gp, RemminaPlugi
 			remmina_rdp_cliprdr_set_clipboard_content(gp, ui);
 			break;
 
+		case REMMINA_RDP_UI_CLIPBOARD_UPLOAD_PROGRESS:
+			remmina_rdp_cliprdr_file_upload_show(ui->clipboard.clipboard);
+			break;
+
 	}
 }
 
 void remmina_rdp_clipboard_init(rfContext *rfi)
 {
 	TRACE_CALL("remmina_rdp_clipboard_init");
-	// Future: initialize rfi->clipboard
+	rfi->clipboard.local_fd = -1;
 }
 void remmina_rdp_clipboard_free(rfContext *rfi)
 {
 	TRACE_CALL("remmina_rdp_clipboard_free");
-	// Future: deinitialize rfi->clipboard
+	rfClipboard* clipboard = &(rfi->clipboard);
+
+	if (clipboard->srv_requests)
+	{
+		g_queue_free_full(clipboard->srv_requests, g_free);
+		clipboard->srv_requests = NULL;
+	}
+	remmina_rdp_cliprdr_free_data(clipboard->srv_format, clipboard->srv_data);
+	clipboard->srv_data = NULL;
+	remmina_rdp_cliprdr_file_free(clipboard);
 }
 
 
@@ -941,8 +1083,8 @@ void remmina_rdp_cliprdr_init(rfContext* rfi, CliprdrClientContext* cliprdr)
 
 	clipboard->context = cliprdr;
 	pthread_mutex_init(&clipboard->transfer_clip_mutex, NULL);
-	pthread_cond_init(&clipboard->transfer_clip_cond,NULL);
 	clipboard->srv_clip_data_wait = SCDW_NONE;
+	clipboard->srv_requests = g_queue_new();
 
 	cliprdr->MonitorReady = remmina_rdp_cliprdr_monitor_ready;
 	cliprdr->ServerCapabilities = remmina_rdp_cliprdr_server_capabilities;
@@ -951,8 +1093,8 @@ void remmina_rdp_cliprdr_init(rfContext* rfi, CliprdrClientContext* cliprdr)
 	cliprdr->ServerFormatDataRequest = remmina_rdp_cliprdr_server_format_data_request;
 	cliprdr->ServerFormatDataResponse = remmina_rdp_cliprdr_server_format_data_response;
 
-//	cliprdr->ServerFileContentsRequest = remmina_rdp_cliprdr_server_file_contents_request;
-//	cliprdr->ServerFileContentsResponse = remmina_rdp_cliprdr_server_file_contents_response;
+	cliprdr->ServerFileContentsRequest = remmina_rdp_cliprdr_server_file_contents_request;
+	cliprdr->ServerFileContentsResponse = remmina_rdp_cliprdr_server_file_contents_response;
 
 }
 
@@ -46,6 +46,8 @@ void remmina_rdp_clipboard_free(rfContext* rfi);
 void remmina_rdp_cliprdr_init(rfContext* rfc, CliprdrClientContext* cliprdr);
 void remmina_rdp_channel_cliprdr_process(RemminaProtocolWidget* gp, wMessage* event);
 void remmina_rdp_event_process_clipboard(RemminaProtocolWidget* gp, RemminaPluginRdpUiObject* ui);
+gboolean remmina_rdp_cliprdr_format_is_image(UINT32 format);
+void remmina_rdp_cliprdr_free_data(UINT32 format, gpointer data);
 
 
 #endif
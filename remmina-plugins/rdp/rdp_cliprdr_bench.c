@@ -0,0 +1,224 @@
+/*
+ * Remmina - The GTK+ Remote Desktop Client
+ * Copyright (C) 2010-2011 Vic Lee
+ * Copyright (C) 2012-2012 Jean-Louis Dupond
+ * Copyright (C) 2014-2015 Antenore Gatta, Fabio Castelli, Giovanni Panozzo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL. *  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so. *  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version. *  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ *
+ */
+
+/* Throughput of the clipboard text conversions of rdp_cliprdr_text.c.
+ *
+ *   remmina-rdp-cliprdr-bench [--size=BYTES] [--iterations=N]
+ *
+ * Each converter runs on two inputs of the given size: plain ASCII text
+ * with a line ending every 60 characters, the common case the SSE2 block
+ * copies are for, and text where one character in eight is not ASCII,
+ * which goes through the scalar path. */
+
+#include "config.h"
+#include "remmina/remmina_trace_calls.h"
+#include "rdp_cliprdr_text.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum
+{
+	RF_BENCH_LF2CRLF,
+	RF_BENCH_CRLF2LF,
+	RF_BENCH_UTF8_TO_UTF16,
+	RF_BENCH_UTF16_TO_UTF8,
+	RF_BENCH_CONVERTERS
+} rfBenchConverter;
+
+static const gchar* rf_bench_names[RF_BENCH_CONVERTERS] =
+{
+	"lf2crlf",
+	"crlf2lf",
+	"utf8 to utf16",
+	"utf16 to utf8"
+};
+
+/* UTF-8 text of about size bytes, LF line endings unless crlf is set */
+static gchar* rf_bench_text(gsize size, gboolean mixed, gboolean crlf)
+{
+	TRACE_CALL("rf_bench_text");
+	GString* text;
+	gsize column = 0;
+	guint i = 0;
+
+	text = g_string_sized_new(size + 8);
+	while (text->len < size)
+	{
+		if (column == 60)
+		{
+			if (crlf)
+				g_string_append_c(text, '\r');
+			g_string_append_c(text, '\n');
+			column = 0;
+		}
+		else if (mixed && i % 8 == 7)
+		{
+			g_string_append_unichar(text, 0x00E0 + i % 16);
+			column++;
+		}
+		else
+		{
+			g_string_append_c(text, 'a' + i % 26);
+			column++;
+		}
+		i++;
+	}
+
+	return g_string_free(text, FALSE);
+}
+
+/* Average microseconds per call of one converter on text */
+static gdouble rf_bench_run(rfBenchConverter converter, const gchar* text, gint iterations)
+{
+	TRACE_CALL("rf_bench_run");
+	UINT8* utf16;
+	UINT8* copy;
+	UINT8* out;
+	size_t len, out_size;
+	int size;
+	gint64 t, elapsed = 0;
+	gint i;
+
+	len = strlen(text);
+	utf16 = remmina_rdp_cliprdr_utf8_to_utf16((const UINT8*) text, len, &size);
+	copy = (UINT8*) malloc(len + 1);
+
+	for (i = 0; i < iterations; i++)
+	{
+		switch (converter)
+		{
+			case RF_BENCH_LF2CRLF:
+				size = len;
+				t = g_get_monotonic_time();
+				out = remmina_rdp_cliprdr_lf2crlf((UINT8*) text, &size);
+				elapsed += g_get_monotonic_time() - t;
+				free(out);
+				break;
+
+			case RF_BENCH_CRLF2LF:
+				/* The conversion is in place, restore the input first */
+				memcpy(copy, text, len + 1);
+				out_size = len;
+				t = g_get_monotonic_time();
+				remmina_rdp_cliprdr_crlf2lf(copy, &out_size);
+				elapsed += g_get_monotonic_time() - t;
+				break;
+
+			case RF_BENCH_UTF8_TO_UTF16:
+				t = g_get_monotonic_time();
+				out = remmina_rdp_cliprdr_utf8_to_utf16((const UINT8*) text, len, &size);
+				elapsed += g_get_monotonic_time() - t;
+				free(out);
+				break;
+
+			case RF_BENCH_UTF16_TO_UTF8:
+				t = g_get_monotonic_time();
+				out = (UINT8*) remmina_rdp_cliprdr_utf16_to_utf8(utf16, size, &out_size);
+				elapsed += g_get_monotonic_time() - t;
+				free(out);
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	free(copy);
+	free(utf16);
+
+	return (gdouble) elapsed / iterations;
+}
+
+int main(int argc, char* argv[])
+{
+	TRACE_CALL("main");
+	gint size = 1024 * 1024;
+	gint iterations = 100;
+	GOptionEntry entries[] =
+	{
+		{ "size", 's', 0, G_OPTION_ARG_INT, &size, "Size of the text converted, 1 MiB by default", "BYTES" },
+		{ "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations, "Conversions timed per converter and input, 100 by default", "N" },
+		{ NULL }
+	};
+	GOptionContext* option_context;
+	GError* error = NULL;
+	gchar* text[2][2];
+	const gchar* input;
+	gdouble us;
+	gint converter, mixed;
+
+	option_context = g_option_context_new("- measure the clipboard text conversions");
+	g_option_context_add_main_entries(option_context, entries, NULL);
+	if (!g_option_context_parse(option_context, &argc, &argv, &error) || size <= 0 || iterations <= 0)
+	{
+		fprintf(stderr, "%s\n", error ? error->message : "The size and the iterations must be positive");
+		return 1;
+	}
+	g_option_context_free(option_context);
+
+	for (mixed = 0; mixed < 2; mixed++)
+	{
+		text[mixed][0] = rf_bench_text(size, mixed, FALSE);
+		text[mixed][1] = rf_bench_text(size, mixed, TRUE);
+	}
+
+#ifdef __SSE2__
+	printf("SSE2 build, %d bytes, %d iterations\n", size, iterations);
+#else
+	printf("Scalar build, %d bytes, %d iterations\n", size, iterations);
+#endif
+	for (converter = 0; converter < RF_BENCH_CONVERTERS; converter++)
+	{
+		for (mixed = 0; mixed < 2; mixed++)
+		{
+			/* crlf2lf is given Windows line endings, the others Unix ones */
+			input = text[mixed][converter == RF_BENCH_CRLF2LF];
+			us = rf_bench_run(converter, input, iterations);
+			printf("%-14s %-6s %10.1f us/call %10.1f MB/s\n", rf_bench_names[converter],
+				mixed ? "mixed" : "ascii", us, us > 0 ? strlen(input) / us : 0.0);
+		}
+	}
+
+	for (mixed = 0; mixed < 2; mixed++)
+	{
+		g_free(text[mixed][0]);
+		g_free(text[mixed][1]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,1217 @@
+/*
+ * Remmina - The GTK+ Remote Desktop Client
+ * Copyright (C) 2010-2011 Vic Lee
+ * Copyright (C) 2014-2015 Antenore Gatta, Fabio Castelli, Giovanni Panozzo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL. *  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so. *  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version. *  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ *
+ */
+
+
+/* File copy and paste through the clipboard channel.
+ *
+ * The file list travels as a FileGroupDescriptorW clipboard format, the
+ * file data with FILECONTENTS requests and responses. Files are moved in
+ * chunks between the channel and the disk, and are never held in memory
+ * as a whole.
+ *
+ * Server files are downloaded on the first paste into a per connection
+ * directory below the user cache directory, one file at a time with a few
+ * range requests in flight. The paste waits for them behind a progress
+ * dialog that can cancel the transfer, then gets their URIs. A newer
+ * clipboard content cancels an unfinished download.
+ *
+ * Local files are read as the server asks for them. A progress dialog
+ * shows up with the first range request and can refuse the rest of the
+ * transfer. */
+
+#include "rdp_plugin.h"
+#include "rdp_cliprdr.h"
+#include "rdp_cliprdr_file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <glib/gstdio.h>
+#include <freerdp/client/cliprdr.h>
+#include <winpr/stream.h>
+
+#define FILE_DESCRIPTOR_SIZE		592
+#define FILE_DESCRIPTOR_NAME_LENGTH	260
+
+#ifndef FD_ATTRIBUTES
+#define FD_ATTRIBUTES		0x00000004
+#endif
+#ifndef FD_WRITESTIME
+#define FD_WRITESTIME		0x00000020
+#endif
+#ifndef FD_FILESIZE
+#define FD_FILESIZE		0x00000040
+#endif
+#ifndef FD_SHOWPROGRESSUI
+#define FD_SHOWPROGRESSUI	0x00004000
+#endif
+
+#define ATTRIBUTE_DIRECTORY	0x00000010
+#define ATTRIBUTE_NORMAL	0x00000080
+
+/* Seconds between 1601-01-01 and 1970-01-01 */
+#define FILETIME_UNIX_EPOCH	11644473600ULL
+
+/* Size of the ranges requested to the server, and largest range sent */
+#define FILE_CHUNK_SIZE		(256 * 1024)
+#define FILE_CHUNK_SIZE_MAX	(4 * 1024 * 1024)
+
+/* Range requests in flight during a download, each with its own stream id,
+ * so that the server is not idle for a round trip after every chunk */
+#define FILE_REQUESTS_MAX	4
+
+typedef struct rf_clipboard_file
+{
+	gchar* path;
+	gchar* name;
+	UINT64 size;
+	gboolean has_size;
+	gboolean is_dir;
+	gboolean top_level;
+	time_t mtime;
+} rfClipboardFile;
+
+typedef struct rf_clipboard_files_request
+{
+	UINT32 stream_id;
+	UINT32 flags;
+	UINT64 offset;
+	UINT32 length;
+} rfClipboardFilesRequest;
+
+struct rf_clipboard_files
+{
+	guint serial;
+	gchar* dir;
+	guint count;
+	rfClipboardFile* files;
+
+	gboolean started;
+	gboolean complete;
+	guint current;
+	gint fd;
+	/* Next range of the current file to request */
+	UINT64 offset;
+	rfClipboardFilesRequest requests[FILE_REQUESTS_MAX];
+	guint nrequests;
+
+	UINT64 total;
+	UINT64 done;
+	gint progress;
+};
+
+/* A paste waiting for the download, lives on the stack of
+ * remmina_rdp_cliprdr_file_wait() */
+struct rf_clipboard_files_wait
+{
+	rfClipboard* clipboard;
+	guint serial;
+	GMainLoop* loop;
+	GtkWidget* dialog;
+	GtkWidget* progress;
+	gboolean ready;
+};
+
+/* Progress of the files being sent, owned by the GTK thread */
+struct rf_clipboard_files_upload
+{
+	rfClipboard* clipboard;
+	guint serial;
+	GtkWidget* dialog;
+	GtkWidget* progress;
+	guint timer;
+};
+
+static void remmina_rdp_cliprdr_file_remove_dir(const gchar* path)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_file_remove_dir");
+	GDir* dir;
+	const gchar* name;
+	gchar* child;
+	struct stat st;
+
+	dir = g_dir_open(path, 0, NULL);
+	if (dir)
+	{
+		while ((name = g_dir_read_name(dir)) != NULL)
+		{
+			child = g_build_filename(path, name, NULL);
+			if (lstat(child, &st) == 0 && S_ISDIR(st.st_mode))
+				remmina_rdp_cliprdr_file_remove_dir(child);
+			else
+				g_unlink(child);
+			g_free(child);
+		}
+		g_dir_close(dir);
+	}
+	g_rmdir(path);
+}
+
+static void remmina_rdp_cliprdr_file_files_free(rfClipboardFiles* files, gboolean remove)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_file_files_free");
+	guint i;
+
+	if (files->fd >= 0)
+		close(files->fd);
+	if (remove)
+		remmina_rdp_cliprdr_file_remove_dir(files->dir);
+	for (i = 0; i < files->count; i++)
+	{
+		g_free(files->files[i].path);
+		g_free(files->files[i].name);
+	}
+	g_free(files->files);
+	g_free(files->dir);
+	g_free(files);
+}
+
+/* A relative name from the server is usable if none of its components
+ * could escape the download directory */
+static gboolean remmina_rdp_cliprdr_file_name_is_safe(const gchar* name)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_file_name_is_safe");
+	gchar** parts;
+	gboolean safe = TRUE;
+	gint i;
+
+	if (name[0] == '\0' || name[0] == '/')
+		return FALSE;
+
+	parts = g_strsplit(name, "/", -1);
+	for (i = 0; parts[i]; i++)
+	{
+		if (parts[i][0] == '\0' || g_strcmp0(parts[i], ".") == 0 || g_strcmp0(parts[i], "..") == 0)
+			safe = FALSE;
+	}
+	g_strfreev(parts);
+
+	return safe;
+}
+
+static const gchar* remmina_rdp_cliprdr_file_get_dir(rfClipboard* clipboard)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_file_get_dir");
+	gchar* base;
+
+	if (clipboard->files_dir)
+		return clipboard->files_dir;
+
+	base = g_build_filename(g_get_user_cache_dir(), "remmina", NULL);
+	g_mkdir_with_parents(base, 0700);
+	clipboard->files_dir = g_build_filename(base, "rdp-clipboard-XXXXXX", NULL);
+	g_free(base);
+
+	if (!g_mkdtemp(clipboard->files_dir))
+	{
+		remmina_plugin_service->log_printf("[RDP] rdp_cliprdr: unable to create a directory for clipboard files: %s\n", g_strerror(errno));
+		g_free(clipboard->files_dir);
+		clipboard->files_dir = NULL;
+	}
+
+	return clipboard->files_dir;
+}
+
+void remmina_rdp_cliprdr_file_set_descriptor(rfClipboard* clipboard, guint serial, const UINT8* data, size_t size)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_file_set_descriptor");
+	rfClipboardFiles* files;
+	rfClipboardFile* file;
+	const UINT8* fd;
+	const gchar* base;
+	gchar* name;
+	UINT32 count, flags, attributes, i;
+	UINT16 length;
+
+	remmina_rdp_cliprdr_file_cancel(clipboard);
+
+	if (size < 4)
+		return;
+	count = data[0] | (data[1] << 8) | (data[2] << 16) | ((UINT32) data[3] << 24);
+	if (count == 0 || count > (size - 4) / FILE_DESCRIPTOR_SIZE)
+	{
+		remmina_plugin_service->log_printf("[RDP] rdp_cliprdr: invalid file list from the server\n");
+		return;
+	}
+
+	base = remmina_rdp_cliprdr_file_get_dir(clipboard);
+	if (!base)
+		return;
+
+	files = g_new0(rfClipboardFiles, 1);
+	files->serial = serial;
+	files->dir = g_strdup_printf("%s/%u", base, serial);
+	files->files = g_new0(rfClipboardFile, count);
+	files->fd = -1;
+
+	for (i = 0; i < count; i++)
+	{
+		fd = data + 4 + i * FILE_DESCRIPTOR_SIZE;
+		flags = fd[0] | (fd[1] << 8) | (fd[2] << 16) | ((UINT32) fd[3] << 24);
+		attributes = fd[36] | (fd[37] << 8) | (fd[38] << 16) | ((UINT32) fd[39] << 24);
+
+		for (length = 0; length < FILE_DESCRIPTOR_NAME_LENGTH; length++)
+		{
+			if (fd[72 + length * 2] == 0 && fd[73 + length * 2] == 0)
+				break;
+		}
+		name = g_utf16_to_utf8((const gunichar2*) (fd + 72), length, NULL, NULL, NULL);
+		if (!name)
+			continue;
+		g_strdelimit(name, "\\", '/');
+		if (!remmina_rdp_cliprdr_file_name_is_safe(name))
+		{
+			remmina_plugin_service->log_printf("[RDP] rdp_cliprdr: skipping unsafe file name %s\n", name);
+			g_free(name);
+			continue;
+		}
+
+		file = &files->files[files->count++];
+		file->name = name;
+		file->path = g_build_filename(files->dir, name, NULL);
+		file->top_level = (strchr(name, '/') == NULL);
+		file->is_dir = (flags & FD_ATTRIBUTES) && (attributes & ATTRIBUTE_DIRECTORY);
+		if (flags & FD_FILESIZE)
+		{
+			file->size = ((UINT64) (fd[64] | (fd[65] << 8) | (fd[66] << 16) | ((UINT32) fd[67] << 24)) << 32) |
+				(fd[68] | (fd[69] << 8) | (fd[70] << 16) | ((UINT32) fd[71] << 24));
+			file->has_size = TRUE;
+			files->total += file->size;
+		}
+	}
+
+	clipboard->srv_files = files;
+}
+
+/* Whether the disk holding the download has room for what is left of it */
+static gboolean remmina_rdp_cliprdr_file_check_space(rfClipboardFiles* files)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_file_check_space");
+	struct statvfs st;
+	UINT64 available;
+	gchar* needed_str;
+	gchar* available_str;
+
+	if (statvfs(files->dir, &st) != 0)
+		return TRUE;
+
+	available = (UINT64) st.f_bavail * st.f_frsize;
+	if (files->done >= files->total || files->total - files->done <= available)
+		return TRUE;
+
+	needed_str = g_format_size(files->total - files->done);
+	available_str = g_format_size(available);
+	remmina_plugin_service->log_printf("[RDP] rdp_cliprdr: not enough space in %s for the files from the server, %s needed, %s available\n",
+		files->dir, needed_str, available_str);
+	g_free(needed_str);
+	g_free(available_str);
+
+	return FALSE;
+}
+
+static void remmina_rdp_cliprdr_file_send_request(rfClipboard* clipboard, UINT32 flags, UINT64 offset, UINT32 length)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_file_send_request");
+	CLIPRDR_FILE_CONTENTS_REQUEST request;
+	rfClipboardFiles* files = clipboard->srv_files;
+	rfClipboardFilesRequest* pending;
+
+	pending = &files->requests[files->nrequests++];
+	pending->stream_id = ++clipboard->stream_id;
+	pending->flags = flags;
+	pending->offset = offset;
+	pending->length = length;
+
+	ZeroMemory(&request, sizeof(CLIPRDR_FILE_CONTENTS_REQUEST));
+	request.msgType = CB_FILECONTENTS_REQUEST;
+	request.msgFlags = 0;
+	request.streamId = pending->stream_id;
+	request.listIndex = files->current;
+	request.dwFlags = flags;
+	request.nPositionLow = offset & 0xFFFFFFFF;
+	request.nPositionHigh = offset >> 32;
+	request.cbRequested = length;
+	clipboard->context->ClientFileContentsRequest(clipboard->context, &request);
+}
+
+static void remmina_rdp_cliprdr_file_complete(rfClipboard* clipboard)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_file_complete");
+	rfClipboardFiles* files = clipboard->srv_files;
+	RemminaProtocolWidget* gp = clipboard->rfi->protocol_widget;
+	RemminaPluginRdpUiObject* ui;
+	GString* uris;
+	gchar* uri;
+	guint i;
+
+	files->complete = TRUE;
+	remmina_plugin_service->log_printf("[RDP] rdp_cliprdr: %u files received from the server\n", files->count);
+
+	/* text/uri-list, as described in RFC 2483 */
+	uris = g_string_new(NULL);
+	for (i = 0; i < files->count; i++)
+	{
+		if (!files->files[i].top_level)
+			continue;
+		uri = g_filename_to_uri(files->files[i].path, NULL, NULL);
+		if (uri)
+		{
+			g_string_append(uris, uri);
+			g_string_append(uris, "\r\n");
+			g_free(uri);
+		}
+	}
+
+	remmina_rdp_cliprdr_free_data(clipboard->srv_format, clipboard->srv_data);
+	clipboard->srv_data = strdup(uris->str);
+	clipboard->srv_format = clipboard->srv_file_format;
+	g_string_free(uris, TRUE);
+
+	/* A waiting paste gets the URIs directly */
+	if (clipboard->srv_clip_data_wait == SCDW_ASYNCWAIT && !clipboard->files_wait)
+	{
+		ui = rf_object_new(gp);
+		ui->type = REMMINA_RDP_UI_CLIPBOARD;
+		ui->clipboard.clipboard = clipboard;
+		ui->clipboard.type = REMMINA_RDP_UI_CLIPBOARD_SET_CONTENT;
+		ui->clipboard.format = clipboard->srv_file_format;
+		rf_queue_ui(gp, ui);
+	}
+	clipboard->srv_clip_data_wait = SCDW_NONE;
+}
+
+static void remmina_rdp_cliprdr_file_abort(rfClipboard* clipboard)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_file_abort");
+	remmina_rdp_cliprdr_file_cancel(clipboard);
+	clipboard->srv_clip_data_wait = SCDW_NONE;
+}
+
+/* Keep the server busy with the next pieces of data, or finish the
+ * transfer */
+static void remmina_rdp_cliprdr_file_download_next(rfClipboard* clipboard)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_file_download_next");
+	rfClipboardFiles* files = clipboard->srv_files;
+	rfClipboardFile* file;
+	UINT32 length;
+
+	while (files->current < files->count)
+	{
+		file = &files->files[files->current];
+		if (file->is_dir)
+		{
+			files->current++;
+			continue;
+		}
+		if (!file->has_size)
+		{
+			if (files->nrequests == 0)
+				remmina_rdp_cliprdr_file_send_request(clipboard, FILECONTENTS_SIZE, 0, 8);
+			return;
+		}
+		if (files->fd < 0)
+		{
+			files->fd = open(file->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+			if (files->fd < 0)
+			{
+				remmina_plugin_service->log_printf("[RDP] rdp_cliprdr: unable to create %s: %s\n", file->path, g_strerror(errno));
+				remmina_rdp_cliprdr_file_abort(clipboard);
+				return;
+			}
+		}
+		while (files->nrequests < FILE_REQUESTS_MAX && files->offset < file->size)
+		{
+			length = MIN(FILE_CHUNK_SIZE, file->size - files->offset);
+			remmina_rdp_cliprdr_file_send_request(clipboard, FILECONTENTS_RANGE, files->offset, length);
+			files->offset += length;
+		}
+		/* The next file is opened once all of this one is written */
+		if (files->nrequests > 0)
+			return;
+		close(files->fd);
+		files->fd = -1;
+		files->offset = 0;
+		files->current++;
+	}
+
+	remmina_rdp_cliprdr_file_complete(clipboard);
+}
+
+void remmina_rdp_cliprdr_file_download_start(rfClipboard* clipboard)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_file_download_start");
+	rfClipboardFiles* files = clipboard->srv_files;
+	gchar* parent;
+	guint i;
+
+	if (!files || files->started)
+		return;
+	files->started = TRUE;
+
+	if (g_mkdir(files->dir, 0700) != 0 && errno != EEXIST)
+	{
+		remmina_plugin_service->log_printf("[RDP] rdp_cliprdr: unable to create %s: %s\n", files->dir, g_strerror(errno));
+		remmina_rdp_cliprdr_file_abort(clipboard);
+		return;
+	}
+	if (!remmina_rdp_cliprdr_file_check_space(files))
+	{
+		remmina_rdp_cliprdr_file_abort(clipboard);
+		return;
+	}
+	for (i = 0; i < files->count; i++)
+	{
+		if (files->files[i].is_dir)
+		{
+			g_mkdir_with_parents(files->files[i].path, 0700);
+		}
+		else
+		{
+			parent = g_path_get_dirname(files->files[i].path);
+			g_mkdir_with_parents(parent, 0700);
+			g_free(parent);
+		}
+	}
+
+	remmina_plugin_service->log_printf("[RDP] rdp_cliprdr: receiving %u files from the server\n", files->count);
+	remmina_rdp_cliprdr_file_download_next(clipboard);
+}
+
+void remmina_rdp_cliprdr_file_cancel(rfClipboard* clipboard)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_file_cancel");
+	rfClipboardFiles* files = clipboard->srv_files;
+
+	if (!files)
+		return;
+
+	/* Finished downloads stay until the end of the connection, the files
+	 * may be still being copied from there */
+	if (files->started && !files->complete)
+		remmina_plugin_service->log_printf("[RDP] rdp_cliprdr: file transfer from the server cancelled\n");
+	remmina_rdp_cliprdr_file_files_free(files, files->started && !files->complete);
+	clipboard->srv_files = NULL;
+}
+
+void remmina_rdp_cliprdr_file_set_selection(rfClipboard* clipboard, GtkSelectionData* selection_data)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_file_set_selection");
+	GdkAtom target;
+	gchar* name;
+	gchar* text;
+	gchar* list;
+	gchar** uris;
+
+	target = gtk_selection_data_get_target(selection_data);
+	name = gdk_atom_name(target);
+
+	if (g_strcmp0(name, "x-special/gnome-copied-files") == 0)
+	{
+		/* "copy" followed by the URIs, one per line */
+		text = g_strchomp(g_strdup(clipboard->srv_data));
+		uris = g_strsplit(text, "\r\n", -1);
+		list = g_strjoinv("\n", uris);
+		g_free(text);
+		text = g_strconcat("copy\n", list, NULL);
+		gtk_selection_data_set(selection_data, target, 8, (const guchar*) text, strlen(text));
+		g_free(text);
+		g_free(list);
+		g_strfreev(uris);
+	}
+	else
+	{
+		gtk_selection_data_set(selection_data, target, 8, clipboard->srv_data, strlen(clipboard->srv_data));
+	}
+	g_free(name);
+}
+
+static gboolean remmina_rdp_cliprdr_file_wait_update(gpointer data)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_file_wait_update");
+	rfClipboardFilesWait* wait = (rfClipboardFilesWait*) data;
+	rfClipboard* clipboard = wait->clipboard;
+	rfClipboardFiles* files;
+	gchar* done_str;
+	gchar* total_str;
+	gchar* text;
+
+	if (!clipboard)
+		return FALSE;
+
+	pthread_mutex_lock(&clipboard->transfer_clip_mutex);
+
+	files = clipboard->srv_files;
+	if (clipboard->srv_data && clipboard->srv_format == clipboard->srv_file_format)
+	{
+		wait->ready = TRUE;
+		g_main_loop_quit(wait->loop);
+	}
+	else if (clipboard->srv_serial != wait->serial || (!files && clipboard->srv_clip_data_wait == SCDW_NONE))
+	{
+		/* Replaced, cancelled or failed */
+		g_main_loop_quit(wait->loop);
+	}
+	else if (!wait->dialog)
+	{
+		/* Destroyed with its parent window */
+	}
+	else if (files && files->total > 0)
+	{
+		done_str = g_format_size(files->done);
+		total_str = g_format_size(files->total);
+		text = g_strdup_printf(_("%s of %s"), done_str, total_str);
+		gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(wait->progress), (gdouble) files->done / files->total);
+		gtk_progress_bar_set_text(GTK_PROGRESS_BAR(wait->progress), text);
+		g_free(text);
+		g_free(done_str);
+		g_free(total_str);
+	}
+	else
+	{
+		gtk_progress_bar_pulse(GTK_PROGRESS_BAR(wait->progress));
+	}
+
+	pthread_mutex_unlock(&clipboard->transfer_clip_mutex);
+
+	return TRUE;
+}
+
+static void remmina_rdp_cliprdr_file_wait_response(GtkDialog* dialog, gint response_id, rfClipboardFilesWait* wait)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_file_wait_response");
+	rfClipboard* clipboard = wait->clipboard;
+
+	if (!clipboard)
+		return;
+
+	pthread_mutex_lock(&clipboard->transfer_clip_mutex);
+	if (clipboard->srv_serial == wait->serial)
+		remmina_rdp_cliprdr_file_abort(clipboard);
+	pthread_mutex_unlock(&clipboard->transfer_clip_mutex);
+
+	g_main_loop_quit(wait->loop);
+}
+
+gboolean remmina_rdp_cliprdr_file_wait(rfClipboard* clipboard)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_file_wait");
+	rfClipboardFilesWait wait;
+	GtkWidget* toplevel;
+	GtkWidget* content;
+	GtkWidget* label;
+	guint timer;
+
+	/* Nested pastes are not waited for */
+	if (clipboard->files_wait)
+	{
+		pthread_mutex_unlock(&clipboard->transfer_clip_mutex);
+		return FALSE;
+	}
+
+	ZeroMemory(&wait, sizeof(rfClipboardFilesWait));
+	wait.clipboard = clipboard;
+	wait.serial = clipboard->srv_serial;
+	wait.loop = g_main_loop_new(NULL, FALSE);
+	clipboard->files_wait = &wait;
+
+	toplevel = gtk_widget_get_toplevel(GTK_WIDGET(clipboard->rfi->protocol_widget));
+	wait.dialog = gtk_dialog_new_with_buttons(_("Receiving files"),
+		gtk_widget_is_toplevel(toplevel) ? GTK_WINDOW(toplevel) : NULL,
+		GTK_DIALOG_DESTROY_WITH_PARENT, _("_Cancel"), GTK_RESPONSE_CANCEL, NULL);
+	content = gtk_dialog_get_content_area(GTK_DIALOG(wait.dialog));
+	gtk_container_set_border_width(GTK_CONTAINER(content), 12);
+	gtk_box_set_spacing(GTK_BOX(content), 6);
+	label = gtk_label_new(_("Receiving the copied files from the server"));
+	gtk_box_pack_start(GTK_BOX(content), label, FALSE, FALSE, 0);
+	wait.progress = gtk_progress_bar_new();
+	gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(wait.progress), TRUE);
+	gtk_box_pack_start(GTK_BOX(content), wait.progress, FALSE, FALSE, 0);
+	g_signal_connect(wait.dialog, "response", G_CALLBACK(remmina_rdp_cliprdr_file_wait_response), &wait);
+	g_signal_connect(wait.dialog, "destroy", G_CALLBACK(gtk_widget_destroyed), &wait.dialog);
+	gtk_widget_show_all(wait.dialog);
+
+	timer = g_timeout_add(100, remmina_rdp_cliprdr_file_wait_update, &wait);
+
+	pthread_mutex_unlock(&clipboard->transfer_clip_mutex);
+	g_main_loop_run(wait.loop);
+
+	g_source_remove(timer);
+	g_main_loop_unref(wait.loop);
+
+	/* The connection was closed meanwhile, clipboard is gone */
+	if (!wait.clipboard)
+		return FALSE;
+
+	if (wait.dialog)
+		gtk_widget_destroy(wait.dialog);
+	pthread_mutex_lock(&clipboard->transfer_clip_mutex);
+	clipboard->files_wait = NULL;
+	pthread_mutex_unlock(&clipboard->transfer_clip_mutex);
+
+	return wait.ready;
+}
+
+int remmina_rdp_cliprdr_server_file_contents_response(CliprdrClientContext* context, CLIPRDR_FILE_CONTENTS_RESPONSE* fileContentsResponse)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_server_file_contents_response");
+	rfClipboard* clipboard = (rfClipboard*) context->custom;
+	rfClipboardFiles* files;
+	rfClipboardFile* file;
+	rfClipboardFilesRequest request;
+	const BYTE* data;
+	UINT32 length;
+	UINT64 offset, end;
+	ssize_t written;
+	gint progress;
+	guint i;
+
+	pthread_mutex_lock(&clipboard->transfer_clip_mutex);
+
+	files = clipboard->srv_files;
+	for (i = 0; files && i < files->nrequests; i++)
+	{
+		if (files->requests[i].stream_id == fileContentsResponse->streamId)
+			break;
+	}
+	if (!files || files->complete || files->serial != clipboard->srv_serial || i == files->nrequests)
+	{
+		/* Answer to a cancelled transfer, or to a range past the end of a
+		 * file that shrank */
+		pthread_mutex_unlock(&clipboard->transfer_clip_mutex);
+		return 1;
+	}
+	request = files->requests[i];
+	files->requests[i] = files->requests[--files->nrequests];
+
+	file = &files->files[files->current];
+	if (fileContentsResponse->msgFlags != CB_RESPONSE_OK)
+	{
+		remmina_plugin_service->log_printf("[RDP] rdp_cliprdr: the server failed to send %s\n", file->name);
+		remmina_rdp_cliprdr_file_abort(clipboard);
+		pthread_mutex_unlock(&clipboard->transfer_clip_mutex);
+		return 1;
+	}
+
+	data = fileContentsResponse->requestedData;
+	length = fileContentsResponse->cbRequested;
+
+	if (request.flags & FILECONTENTS_SIZE)
+	{
+		if (length < 8)
+		{
+			remmina_plugin_service->log_printf("[RDP] rdp_cliprdr: invalid size of %s from the server\n", file->name);
+			remmina_rdp_cliprdr_file_abort(clipboard);
+			pthread_mutex_unlock(&clipboard->transfer_clip_mutex);
+			return 1;
+		}
+		file->size = ((UINT64) (data[4] | (data[5] << 8) | (data[6] << 16) | ((UINT32) data[7] << 24)) << 32) |
+			(data[0] | (data[1] << 8) | (data[2] << 16) | ((UINT32) data[3] << 24));
+		file->has_size = TRUE;
+		files->total += file->size;
+		if (!remmina_rdp_cliprdr_file_check_space(files))
+		{
+			remmina_rdp_cliprdr_file_abort(clipboard);
+			pthread_mutex_unlock(&clipboard->transfer_clip_mutex);
+			return 1;
+		}
+	}
+	else if (length == 0)
+	{
+		/* Early end of file, the file shrank on the server. The ranges
+		 * requested past its new end are forgotten. */
+		file->size = MIN(file->size, request.offset);
+		files->offset = MIN(files->offset, file->size);
+		for (i = 0; i < files->nrequests; )
+		{
+			if (files->requests[i].offset >= file->size)
+				files->requests[i] = files->requests[--files->nrequests];
+			else
+				i++;
+		}
+	}
+	else
+	{
+		/* Written with the lock held, so that a cancellation cannot close
+		 * the file under our feet. Chunks are small enough to keep the GTK
+		 * thread from noticing. */
+		length = MIN(length, request.length);
+		offset = request.offset;
+		while (length > 0)
+		{
+			written = pwrite(files->fd, data, length, offset);
+			if (written < 0 && errno == EINTR)
+				continue;
+			if (written <= 0)
+			{
+				remmina_plugin_service->log_printf("[RDP] rdp_cliprdr: unable to write %s: %s\n", file->path, g_strerror(errno));
+				remmina_rdp_cliprdr_file_abort(clipboard);
+				pthread_mutex_unlock(&clipboard->transfer_clip_mutex);
+				return 1;
+			}
+			data += written;
+			length -= written;
+			offset += written;
+			files->done += written;
+		}
+
+		/* The server may answer with less than asked, ask for the rest */
+		end = MIN(request.offset + request.length, file->size);
+		if (offset < end)
+			remmina_rdp_cliprdr_file_send_request(clipboard, FILECONTENTS_RANGE, offset, end - offset);
+
+		if (files->total > 0)
+		{
+			progress = (files->done * 10) / files->total;
+			if (progress > files->progress)
+			{
+				files->progress = progress;
+				remmina_plugin_service->log_printf("[RDP] rdp_cliprdr: %d%% of the files received from the server\n", progress * 10);
+			}
+		}
+	}
+
+	remmina_rdp_cliprdr_file_download_next(clipboard);
+
+	pthread_mutex_unlock(&clipboard->transfer_clip_mutex);
+
+	return 1;
+}
+
+static void remmina_rdp_cliprdr_file_local_free(gpointer data)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_file_local_free");
+	rfClipboardFile* file = (rfClipboardFile*) data;
+
+	g_free(file->path);
+	g_free(file->name);
+	g_free(file);
+}
+
+static void remmina_rdp_cliprdr_file_local_add(GPtrArray* list, const gchar* path, const gchar* name)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_file_local_add");
+	rfClipboardFile* file;
+	struct stat st;
+	GDir* dir;
+	const gchar* child;
+	gchar* child_path;
+	gchar* child_name;
+
+	if (lstat(path, &st) != 0)
+		return;
+	/* Follow links to files, but not to directories to avoid loops */
+	if (S_ISLNK(st.st_mode) && (stat(path, &st) != 0 || S_ISDIR(st.st_mode)))
+		return;
+	if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+		return;
+
+	file = g_new0(rfClipboardFile, 1);
+	file->path = g_strdup(path);
+	file->name = g_strdup(name);
+	file->is_dir = S_ISDIR(st.st_mode);
+	file->size = file->is_dir ? 0 : st.st_size;
+	file->has_size = TRUE;
+	file->mtime = st.st_mtime;
+	g_ptr_array_add(list, file);
+
+	if (!file->is_dir)
+		return;
+
+	dir = g_dir_open(path, 0, NULL);
+	if (!dir)
+		return;
+	while ((child = g_dir_read_name(dir)) != NULL)
+	{
+		child_path = g_build_filename(path, child, NULL);
+		child_name = g_strconcat(name, "\\", child, NULL);
+		remmina_rdp_cliprdr_file_local_add(list, child_path, child_name);
+		g_free(child_path);
+		g_free(child_name);
+	}
+	g_dir_close(dir);
+}
+
+/* Build the FileGroupDescriptorW for the local files in uris, and keep
+ * the list around to answer the server FILECONTENTS requests. Called on
+ * the GTK thread. */
+UINT8* remmina_rdp_cliprdr_file_build_descriptor(rfClipboard* clipboard, gchar** uris, int* size)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_file_build_descriptor");
+	GPtrArray* list;
+	rfClipboardFile* file;
+	wStream* s;
+	UINT8* descriptor;
+	gchar* path;
+	gchar* base;
+	gchar* name;
+	gunichar2* wname;
+	glong wlength;
+	UINT64 filetime;
+	UINT64 total = 0;
+	guint i;
+
+	list = g_ptr_array_new_with_free_func(remmina_rdp_cliprdr_file_local_free);
+	for (i = 0; uris && uris[i]; i++)
+	{
+		path = g_filename_from_uri(uris[i], NULL, NULL);
+		if (!path)
+			continue;
+		base = g_path_get_basename(path);
+		remmina_rdp_cliprdr_file_local_add(list, path, base);
+		g_free(base);
+		g_free(path);
+	}
+
+	s = Stream_New(NULL, 4 + list->len * FILE_DESCRIPTOR_SIZE);
+	if (!s)
+	{
+		g_ptr_array_free(list, TRUE);
+		return NULL;
+	}
+	Stream_Write_UINT32(s, list->len);
+	for (i = 0; i < list->len; i++)
+	{
+		file = g_ptr_array_index(list, i);
+		total += file->size;
+		filetime = ((UINT64) file->mtime + FILETIME_UNIX_EPOCH) * 10000000ULL;
+
+		Stream_Write_UINT32(s, FD_ATTRIBUTES | FD_FILESIZE | FD_WRITESTIME | FD_SHOWPROGRESSUI);
+		Stream_Zero(s, 32);	/* clsid, sizel, pointl */
+		Stream_Write_UINT32(s, file->is_dir ? ATTRIBUTE_DIRECTORY : ATTRIBUTE_NORMAL);
+		Stream_Zero(s, 16);	/* ftCreationTime, ftLastAccessTime */
+		Stream_Write_UINT64(s, filetime);
+		Stream_Write_UINT32(s, file->size >> 32);
+		Stream_Write_UINT32(s, file->size & 0xFFFFFFFF);
+
+		name = g_filename_to_utf8(file->name, -1, NULL, NULL, NULL);
+		wname = name ? g_utf8_to_utf16(name, -1, NULL, &wlength, NULL) : NULL;
+		if (!wname)
+			wlength = 0;
+		wlength = MIN(wlength, FILE_DESCRIPTOR_NAME_LENGTH - 1);
+		Stream_Write(s, wname, wlength * 2);
+		Stream_Zero(s, (FILE_DESCRIPTOR_NAME_LENGTH - wlength) * 2);
+		g_free(wname);
+		g_free(name);
+	}
+
+	*size = Stream_GetPosition(s);
+	descriptor = Stream_Buffer(s);
+	Stream_Free(s, FALSE);
+
+	pthread_mutex_lock(&clipboard->transfer_clip_mutex);
+	if (clipboard->local_fd >= 0)
+	{
+		close(clipboard->local_fd);
+		clipboard->local_fd = -1;
+	}
+	if (clipboard->local_files)
+		g_ptr_array_free(clipboard->local_files, TRUE);
+	clipboard->local_files = list;
+	clipboard->local_serial++;
+	clipboard->local_total = total;
+	clipboard->local_sent = 0;
+	clipboard->local_shown = FALSE;
+	clipboard->local_cancelled = FALSE;
+	pthread_mutex_unlock(&clipboard->transfer_clip_mutex);
+
+	return descriptor;
+}
+
+static void remmina_rdp_cliprdr_file_send_response(rfClipboard* clipboard, UINT32 stream_id, BYTE* data, UINT32 length, gboolean ok)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_file_send_response");
+	CLIPRDR_FILE_CONTENTS_RESPONSE response;
+
+	ZeroMemory(&response, sizeof(CLIPRDR_FILE_CONTENTS_RESPONSE));
+	response.msgType = CB_FILECONTENTS_RESPONSE;
+	response.msgFlags = ok ? CB_RESPONSE_OK : CB_RESPONSE_FAIL;
+	response.dataLen = 4 + length;
+	response.streamId = stream_id;
+	response.cbRequested = length;
+	response.requestedData = data;
+	clipboard->context->ClientFileContentsResponse(clipboard->context, &response);
+}
+
+int remmina_rdp_cliprdr_server_file_contents_request(CliprdrClientContext* context, CLIPRDR_FILE_CONTENTS_REQUEST* fileContentsRequest)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_server_file_contents_request");
+	rfClipboard* clipboard = (rfClipboard*) context->custom;
+	RemminaPluginRdpUiObject* ui;
+	rfClipboardFile* file;
+	BYTE* data = NULL;
+	UINT32 length = 0;
+	UINT64 offset;
+	ssize_t n;
+	gboolean ok = FALSE;
+
+	pthread_mutex_lock(&clipboard->transfer_clip_mutex);
+
+	if (!clipboard->local_files || clipboard->local_cancelled || fileContentsRequest->listIndex >= clipboard->local_files->len)
+		goto out;
+	file = g_ptr_array_index(clipboard->local_files, fileContentsRequest->listIndex);
+
+	if (fileContentsRequest->dwFlags & FILECONTENTS_SIZE)
+	{
+		data = (BYTE*) malloc(8);
+		length = 8;
+		data[0] = file->size & 0xFF;
+		data[1] = (file->size >> 8) & 0xFF;
+		data[2] = (file->size >> 16) & 0xFF;
+		data[3] = (file->size >> 24) & 0xFF;
+		data[4] = (file->size >> 32) & 0xFF;
+		data[5] = (file->size >> 40) & 0xFF;
+		data[6] = (file->size >> 48) & 0xFF;
+		data[7] = (file->size >> 56) & 0xFF;
+		ok = TRUE;
+	}
+	else if ((fileContentsRequest->dwFlags & FILECONTENTS_RANGE) && !file->is_dir)
+	{
+		/* Keep the last file open, the server reads it range by range */
+		if (clipboard->local_fd < 0 || clipboard->local_fd_index != fileContentsRequest->listIndex)
+		{
+			if (clipboard->local_fd >= 0)
+				close(clipboard->local_fd);
+			clipboard->local_fd = open(file->path, O_RDONLY | O_CLOEXEC);
+			clipboard->local_fd_index = fileContentsRequest->listIndex;
+			if (clipboard->local_fd < 0)
+			{
+				remmina_plugin_service->log_printf("[RDP] rdp_cliprdr: unable to open %s: %s\n", file->path, g_strerror(errno));
+				goto out;
+			}
+		}
+
+		offset = ((UINT64) fileContentsRequest->nPositionHigh << 32) | fileContentsRequest->nPositionLow;
+		length = MIN(fileContentsRequest->cbRequested, FILE_CHUNK_SIZE_MAX);
+		data = (BYTE*) malloc(length);
+		if (!data)
+			goto out;
+		do
+		{
+			n = pread(clipboard->local_fd, data, length, offset);
+		}
+		while (n < 0 && errno == EINTR);
+		if (n < 0)
+		{
+			remmina_plugin_service->log_printf("[RDP] rdp_cliprdr: unable to read %s: %s\n", file->path, g_strerror(errno));
+			goto out;
+		}
+		length = n;
+		ok = TRUE;
+
+		/* Ranges read again by the server are counted again */
+		clipboard->local_sent = MIN(clipboard->local_sent + length, clipboard->local_total);
+		if (!clipboard->local_shown && clipboard->local_sent < clipboard->local_total)
+		{
+			clipboard->local_shown = TRUE;
+			ui = rf_object_new(clipboard->rfi->protocol_widget);
+			ui->type = REMMINA_RDP_UI_CLIPBOARD;
+			ui->clipboard.clipboard = clipboard;
+			ui->clipboard.type = REMMINA_RDP_UI_CLIPBOARD_UPLOAD_PROGRESS;
+			rf_queue_ui(clipboard->rfi->protocol_widget, ui);
+		}
+
+		if (length > 0 && offset + length >= file->size)
+			remmina_plugin_service->log_printf("[RDP] rdp_cliprdr: %s sent to the server\n", file->path);
+	}
+
+out:
+	pthread_mutex_unlock(&clipboard->transfer_clip_mutex);
+
+	if (!ok)
+		length = 0;
+	remmina_rdp_cliprdr_file_send_response(clipboard, fileContentsRequest->streamId, data, length, ok);
+	free(data);
+
+	return 1;
+}
+
+static void remmina_rdp_cliprdr_file_upload_close(rfClipboard* clipboard)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_file_upload_close");
+	rfClipboardFilesUpload* upload = clipboard->files_upload;
+
+	if (!upload)
+		return;
+	clipboard->files_upload = NULL;
+	if (upload->timer)
+		g_source_remove(upload->timer);
+	if (upload->dialog)
+		gtk_widget_destroy(upload->dialog);
+	g_free(upload);
+}
+
+static gboolean remmina_rdp_cliprdr_file_upload_update(gpointer data)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_file_upload_update");
+	rfClipboardFilesUpload* upload = (rfClipboardFilesUpload*) data;
+	rfClipboard* clipboard = upload->clipboard;
+	gchar* sent_str;
+	gchar* total_str;
+	gchar* text;
+	gboolean done;
+
+	pthread_mutex_lock(&clipboard->transfer_clip_mutex);
+	done = clipboard->local_serial != upload->serial || clipboard->local_cancelled ||
+		clipboard->local_sent >= clipboard->local_total;
+	if (!done && upload->dialog)
+	{
+		sent_str = g_format_size(clipboard->local_sent);
+		total_str = g_format_size(clipboard->local_total);
+		text = g_strdup_printf(_("%s of %s"), sent_str, total_str);
+		gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(upload->progress), (gdouble) clipboard->local_sent / clipboard->local_total);
+		gtk_progress_bar_set_text(GTK_PROGRESS_BAR(upload->progress), text);
+		g_free(text);
+		g_free(sent_str);
+		g_free(total_str);
+	}
+	pthread_mutex_unlock(&clipboard->transfer_clip_mutex);
+
+	if (!done)
+		return TRUE;
+
+	/* The source goes away with the return value */
+	upload->timer = 0;
+	remmina_rdp_cliprdr_file_upload_close(clipboard);
+	return FALSE;
+}
+
+static void remmina_rdp_cliprdr_file_upload_response(GtkDialog* dialog, gint response_id, rfClipboardFilesUpload* upload)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_file_upload_response");
+	rfClipboard* clipboard = upload->clipboard;
+
+	/* The server gets a failure for the ranges it asks for from now on */
+	pthread_mutex_lock(&clipboard->transfer_clip_mutex);
+	if (clipboard->local_serial == upload->serial && !clipboard->local_cancelled)
+	{
+		clipboard->local_cancelled = TRUE;
+		if (clipboard->local_fd >= 0)
+		{
+			close(clipboard->local_fd);
+			clipboard->local_fd = -1;
+		}
+		remmina_plugin_service->log_printf("[RDP] rdp_cliprdr: file transfer to the server cancelled\n");
+	}
+	pthread_mutex_unlock(&clipboard->transfer_clip_mutex);
+
+	remmina_rdp_cliprdr_file_upload_close(clipboard);
+}
+
+void remmina_rdp_cliprdr_file_upload_show(rfClipboard* clipboard)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_file_upload_show");
+	rfClipboardFilesUpload* upload;
+	GtkWidget* toplevel;
+	GtkWidget* content;
+	GtkWidget* label;
+
+	/* Nothing to show for a transfer already over. A dialog still open for
+	 * an older list follows the new one. */
+	pthread_mutex_lock(&clipboard->transfer_clip_mutex);
+	if (clipboard->local_cancelled || clipboard->local_sent >= clipboard->local_total)
+	{
+		pthread_mutex_unlock(&clipboard->transfer_clip_mutex);
+		return;
+	}
+	if (clipboard->files_upload)
+	{
+		clipboard->files_upload->serial = clipboard->local_serial;
+		pthread_mutex_unlock(&clipboard->transfer_clip_mutex);
+		return;
+	}
+	upload = g_new0(rfClipboardFilesUpload, 1);
+	upload->clipboard = clipboard;
+	upload->serial = clipboard->local_serial;
+	clipboard->files_upload = upload;
+	pthread_mutex_unlock(&clipboard->transfer_clip_mutex);
+
+	toplevel = gtk_widget_get_toplevel(GTK_WIDGET(clipboard->rfi->protocol_widget));
+	upload->dialog = gtk_dialog_new_with_buttons(_("Sending files"),
+		gtk_widget_is_toplevel(toplevel) ? GTK_WINDOW(toplevel) : NULL,
+		GTK_DIALOG_DESTROY_WITH_PARENT, _("_Cancel"), GTK_RESPONSE_CANCEL, NULL);
+	content = gtk_dialog_get_content_area(GTK_DIALOG(upload->dialog));
+	gtk_container_set_border_width(GTK_CONTAINER(content), 12);
+	gtk_box_set_spacing(GTK_BOX(content), 6);
+	label = gtk_label_new(_("Sending the copied files to the server"));
+	gtk_box_pack_start(GTK_BOX(content), label, FALSE, FALSE, 0);
+	upload->progress = gtk_progress_bar_new();
+	gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(upload->progress), TRUE);
+	gtk_box_pack_start(GTK_BOX(content), upload->progress, FALSE, FALSE, 0);
+	g_signal_connect(upload->dialog, "response", G_CALLBACK(remmina_rdp_cliprdr_file_upload_response), upload);
+	g_signal_connect(upload->dialog, "destroy", G_CALLBACK(gtk_widget_destroyed), &upload->dialog);
+	gtk_widget_show_all(upload->dialog);
+
+	upload->timer = g_timeout_add(100, remmina_rdp_cliprdr_file_upload_update, upload);
+}
+
+void remmina_rdp_cliprdr_file_free(rfClipboard* clipboard)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_file_free");
+	remmina_rdp_cliprdr_file_upload_close(clipboard);
+	if (clipboard->files_wait)
+	{
+		/* Release a paste waiting in remmina_rdp_cliprdr_file_wait() */
+		if (clipboard->files_wait->dialog)
+			gtk_widget_destroy(clipboard->files_wait->dialog);
+		clipboard->files_wait->clipboard = NULL;
+		g_main_loop_quit(clipboard->files_wait->loop);
+		clipboard->files_wait = NULL;
+	}
+	if (clipboard->srv_files)
+	{
+		remmina_rdp_cliprdr_file_files_free(clipboard->srv_files, FALSE);
+		clipboard->srv_files = NULL;
+	}
+	if (clipboard->local_fd >= 0)
+	{
+		close(clipboard->local_fd);
+		clipboard->local_fd = -1;
+	}
+	if (clipboard->local_files)
+	{
+		g_ptr_array_free(clipboard->local_files, TRUE);
+		clipboard->local_files = NULL;
+	}
+	if (clipboard->files_dir)
+	{
+		remmina_rdp_cliprdr_file_remove_dir(clipboard->files_dir);
+		g_free(clipboard->files_dir);
+		clipboard->files_dir = NULL;
+	}
+}
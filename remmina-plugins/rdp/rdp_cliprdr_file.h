@@ -0,0 +1,65 @@
+/*
+ * Remmina - The GTK+ Remote Desktop Client
+ * Copyright (C) 2010-2011 Vic Lee
+ * Copyright (C) 2014-2015 Antenore Gatta, Fabio Castelli, Giovanni Panozzo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL. *  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so. *  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version. *  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ *
+ */
+
+
+#ifndef __REMMINA_RDP_CLIPRDR_FILE_H__
+#define __REMMINA_RDP_CLIPRDR_FILE_H__
+
+#include <freerdp/freerdp.h>
+#include "rdp_plugin.h"
+
+/* Format id announced to the server for local files, with the
+ * "FileGroupDescriptorW" format name */
+#define REMMINA_RDP_CLIPRDR_FORMAT_FILES	0xC0F0
+
+/* The functions below must be called with transfer_clip_mutex held */
+void remmina_rdp_cliprdr_file_set_descriptor(rfClipboard* clipboard, guint serial, const UINT8* data, size_t size);
+void remmina_rdp_cliprdr_file_download_start(rfClipboard* clipboard);
+void remmina_rdp_cliprdr_file_cancel(rfClipboard* clipboard);
+void remmina_rdp_cliprdr_file_set_selection(rfClipboard* clipboard, GtkSelectionData* selection_data);
+/* Shows the transfer progress until the files are ready, returns TRUE if
+ * they are. Returns with the mutex released, and on FALSE the connection
+ * may be gone. */
+gboolean remmina_rdp_cliprdr_file_wait(rfClipboard* clipboard);
+
+/* Shows the progress of the files being sent, on the GTK thread */
+void remmina_rdp_cliprdr_file_upload_show(rfClipboard* clipboard);
+
+UINT8* remmina_rdp_cliprdr_file_build_descriptor(rfClipboard* clipboard, gchar** uris, int* size);
+int remmina_rdp_cliprdr_server_file_contents_request(CliprdrClientContext* context, CLIPRDR_FILE_CONTENTS_REQUEST* fileContentsRequest);
+int remmina_rdp_cliprdr_server_file_contents_response(CliprdrClientContext* context, CLIPRDR_FILE_CONTENTS_RESPONSE* fileContentsResponse);
+void remmina_rdp_cliprdr_file_free(rfClipboard* clipboard);
+
+#endif
@@ -0,0 +1,328 @@
+/*
+ * Remmina - The GTK+ Remote Desktop Client
+ * Copyright (C) 2010-2011 Vic Lee
+ * Copyright (C) 2012-2012 Jean-Louis Dupond
+ * Copyright (C) 2014-2015 Antenore Gatta, Fabio Castelli, Giovanni Panozzo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL. *  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so. *  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version. *  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ *
+ */
+
+/* Text conversions of the clipboard channel, kept apart from the channel
+ * code so that remmina-rdp-cliprdr-bench can measure them. */
+
+#include "config.h"
+#include <stdlib.h>
+#include "remmina/remmina_trace_calls.h"
+#include "rdp_cliprdr_text.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* The text converters below work in a single pass over the input. With
+ * SSE2, runs of 16 ASCII bytes (8 UTF-16 units) that need no line ending
+ * change are copied as a block. */
+
+UINT8* remmina_rdp_cliprdr_lf2crlf(UINT8* data, int* size)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_lf2crlf");
+	UINT8 c;
+	UINT8* outbuf;
+	UINT8* out;
+	UINT8* in_end;
+	UINT8* in;
+	int out_size;
+
+	out_size = (*size) * 2 + 1;
+	outbuf = (UINT8*) malloc(out_size);
+	out = outbuf;
+	in = data;
+	in_end = data + (*size);
+
+	while (in < in_end)
+	{
+#ifdef __SSE2__
+		__m128i lf = _mm_set1_epi8('\n');
+		__m128i v;
+
+		while (in + 16 <= in_end)
+		{
+			v = _mm_loadu_si128((const __m128i*) in);
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf)))
+				break;
+			_mm_storeu_si128((__m128i*) out, v);
+			in += 16;
+			out += 16;
+		}
+		if (in >= in_end)
+			break;
+#endif
+		c = *in++;
+		if (c == '\n')
+		{
+			*out++ = '\r';
+			*out++ = '\n';
+		}
+		else
+		{
+			*out++ = c;
+		}
+	}
+
+	*out++ = 0;
+	*size = out - outbuf;
+
+	return outbuf;
+}
+
+void remmina_rdp_cliprdr_crlf2lf(UINT8* data, size_t* size)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_crlf2lf");
+	UINT8 c;
+	UINT8* out;
+	UINT8* in;
+	UINT8* in_end;
+
+	out = data;
+	in = data;
+	in_end = data + (*size);
+
+	while (in < in_end)
+	{
+#ifdef __SSE2__
+		__m128i cr = _mm_set1_epi8('\r');
+		__m128i v;
+
+		/* out never gets ahead of in, so the block is read before being
+		 * overwritten */
+		while (in + 16 <= in_end)
+		{
+			v = _mm_loadu_si128((const __m128i*) in);
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, cr)))
+				break;
+			_mm_storeu_si128((__m128i*) out, v);
+			in += 16;
+			out += 16;
+		}
+		if (in >= in_end)
+			break;
+#endif
+		c = *in++;
+		if (c != '\r')
+			*out++ = c;
+	}
+
+	*size = out - data;
+}
+
+/* Convert UTF-16LE text from the server to NUL terminated UTF-8, dropping
+ * carriage returns. Conversion stops at the first NUL character. */
+gchar* remmina_rdp_cliprdr_utf16_to_utf8(const UINT8* data, size_t size, size_t* out_size)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_utf16_to_utf8");
+	gchar* outbuf;
+	UINT8* out;
+	size_t i, n;
+	UINT32 c, c2;
+
+	n = size / 2;
+	/* A unit never takes more than 3 bytes, a surrogate pair takes 4 */
+	outbuf = (gchar*) malloc(n * 3 + 1);
+	if (!outbuf)
+		return NULL;
+	out = (UINT8*) outbuf;
+	i = 0;
+
+	while (i < n)
+	{
+#ifdef __SSE2__
+		__m128i zero = _mm_setzero_si128();
+		__m128i high = _mm_set1_epi16((short) 0xFF80);
+		__m128i cr = _mm_set1_epi16('\r');
+		__m128i v;
+
+		while (i + 8 <= n)
+		{
+			v = _mm_loadu_si128((const __m128i*) (data + i * 2));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, high), zero)) != 0xFFFF)
+				break;
+			if (_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi16(v, cr), _mm_cmpeq_epi16(v, zero))))
+				break;
+			_mm_storel_epi64((__m128i*) out, _mm_packus_epi16(v, v));
+			i += 8;
+			out += 8;
+		}
+		if (i >= n)
+			break;
+#endif
+		c = data[i * 2] | (data[i * 2 + 1] << 8);
+		i++;
+		if (c == 0)
+			break;
+		if (c == '\r')
+			continue;
+
+		if (c >= 0xD800 && c <= 0xDBFF && i < n)
+		{
+			c2 = data[i * 2] | (data[i * 2 + 1] << 8);
+			if (c2 >= 0xDC00 && c2 <= 0xDFFF)
+			{
+				c = 0x10000 + ((c - 0xD800) << 10) + (c2 - 0xDC00);
+				i++;
+			}
+		}
+		if (c >= 0xD800 && c <= 0xDFFF)
+			c = 0xFFFD;
+
+		if (c < 0x80)
+		{
+			*out++ = c;
+		}
+		else if (c < 0x800)
+		{
+			*out++ = 0xC0 | (c >> 6);
+			*out++ = 0x80 | (c & 0x3F);
+		}
+		else if (c < 0x10000)
+		{
+			*out++ = 0xE0 | (c >> 12);
+			*out++ = 0x80 | ((c >> 6) & 0x3F);
+			*out++ = 0x80 | (c & 0x3F);
+		}
+		else
+		{
+			*out++ = 0xF0 | (c >> 18);
+			*out++ = 0x80 | ((c >> 12) & 0x3F);
+			*out++ = 0x80 | ((c >> 6) & 0x3F);
+			*out++ = 0x80 | (c & 0x3F);
+		}
+	}
+
+	*out = 0;
+	*out_size = out - (UINT8*) outbuf;
+
+	return outbuf;
+}
+
+/* Convert UTF-8 text to NUL terminated UTF-16LE for the server, turning LF
+ * into CRLF. *size is the byte size of the result, terminator included. */
+UINT8* remmina_rdp_cliprdr_utf8_to_utf16(const UINT8* data, size_t len, int* size)
+{
+	TRACE_CALL("remmina_rdp_cliprdr_utf8_to_utf16");
+	const UINT8* in = data;
+	const UINT8* in_end = data + len;
+	UINT8* outbuf;
+	UINT8* out;
+	UINT32 c;
+	gint extra;
+
+	/* Worst case is a text of LFs, each one becoming two units */
+	outbuf = (UINT8*) malloc((len * 2 + 1) * 2);
+	if (!outbuf)
+		return NULL;
+	out = outbuf;
+
+	while (in < in_end)
+	{
+#ifdef __SSE2__
+		__m128i zero = _mm_setzero_si128();
+		__m128i lf = _mm_set1_epi8('\n');
+		__m128i v;
+
+		while (in + 16 <= in_end)
+		{
+			v = _mm_loadu_si128((const __m128i*) in);
+			if (_mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, lf))))
+				break;
+			_mm_storeu_si128((__m128i*) out, _mm_unpacklo_epi8(v, zero));
+			_mm_storeu_si128((__m128i*) (out + 16), _mm_unpackhi_epi8(v, zero));
+			in += 16;
+			out += 32;
+		}
+		if (in >= in_end)
+			break;
+#endif
+		c = *in++;
+		if (c == '\n')
+		{
+			*out++ = '\r';
+			*out++ = 0;
+		}
+		else if (c >= 0x80)
+		{
+			if (c >= 0xF0)
+			{
+				c &= 0x07;
+				extra = 3;
+			}
+			else if (c >= 0xE0)
+			{
+				c &= 0x0F;
+				extra = 2;
+			}
+			else if (c >= 0xC0)
+			{
+				c &= 0x1F;
+				extra = 1;
+			}
+			else
+			{
+				c = 0xFFFD;
+				extra = 0;
+			}
+			while (extra > 0 && in < in_end && (*in & 0xC0) == 0x80)
+			{
+				c = (c << 6) | (*in++ & 0x3F);
+				extra--;
+			}
+			if (extra > 0 || c > 0x10FFFF)
+				c = 0xFFFD;
+		}
+
+		if (c >= 0x10000)
+		{
+			c -= 0x10000;
+			*out++ = (0xD800 | (c >> 10)) & 0xFF;
+			*out++ = (0xD800 | (c >> 10)) >> 8;
+			*out++ = (0xDC00 | (c & 0x3FF)) & 0xFF;
+			*out++ = (0xDC00 | (c & 0x3FF)) >> 8;
+		}
+		else
+		{
+			*out++ = c & 0xFF;
+			*out++ = c >> 8;
+		}
+	}
+
+	*out++ = 0;
+	*out++ = 0;
+	*size = out - outbuf;
+
+	return outbuf;
+}
@@ -38,6 +38,7 @@
 #include "rdp_plugin.h"
 #include "rdp_event.h"
 #include "rdp_gdi.h"
+#include "rdp_graphics.h"
 #include "rdp_cliprdr.h"
 #include <gdk/gdkkeysyms.h>
 #include <cairo/cairo-xlib.h>
@@ -84,16 +85,56 @@ static void remmina_rdp_event_event_push(RemminaProtocolWidget* gp, const Remmin
 {
 	TRACE_CALL("remmina_rdp_event_event_push");
 	rfContext* rfi = GET_PLUGIN_DATA(gp);
-	RemminaPluginRdpEvent* event;
+	RemminaPluginRdpEvent* overflow;
+	guint head, tail;
 
 	if ( !rfi )
 		return;
 
-	if (rfi->event_queue)
+	if (rfi->event_pipe[1] == -1)
+		return;
+
+	head = rfi->event_ring_head;
+	tail = g_atomic_int_get(&rfi->event_ring_tail);
+
+	/* Once an event went to the overflow queue, the next ones follow it
+	 * there until it is drained, so that they keep their order */
+	if (head - tail >= REMMINA_RDP_EVENT_RING_SIZE || g_atomic_int_get(&rfi->event_overflow_len) > 0)
 	{
-		event = g_memdup(e, sizeof(RemminaPluginRdpEvent));
-		g_async_queue_push(rfi->event_queue, event);
+		/* The RDP thread is busy or blocked on the network. A motion is
+		 * superseded by the next one and can be dropped, but any other
+		 * event, like a key or button release, must reach the server */
+		if (e->type == REMMINA_RDP_EVENT_TYPE_MOUSE && e->mouse_event.flags == PTR_FLAGS_MOVE &&
+			g_atomic_int_get(&rfi->event_overflow_len) == 0)
+		{
+			rfi->events_dropped++;
+			return;
+		}
+
+		/* An event the RDP thread has already sent, if any */
+		overflow = (RemminaPluginRdpEvent*) g_async_queue_try_pop(rfi->event_overflow_free);
+		if (!overflow)
+			overflow = g_new(RemminaPluginRdpEvent, 1);
+		*overflow = *e;
+
+		g_atomic_int_inc(&rfi->event_overflow_len);
+		g_async_queue_push(rfi->event_overflow, overflow);
+		rfi->events_overflowed++;
+		if (write(rfi->event_pipe[1], "\0", 1))
+		{
+		}
+		return;
+	}
 
+	rfi->event_ring[head & (REMMINA_RDP_EVENT_RING_SIZE - 1)] = *e;
+	g_atomic_int_set(&rfi->event_ring_head, head + 1);
+	if (head + 1 - tail > rfi->event_ring_peak)
+		rfi->event_ring_peak = head + 1 - tail;
+
+	/* Wake up the RDP thread only when it may have already drained the ring,
+	 * otherwise it will pick up this event in its current batch */
+	if ((guint) g_atomic_int_get(&rfi->event_ring_tail) == head)
+	{
 		if (write(rfi->event_pipe[1], "\0", 1))
 		{
 		}
@@ -188,21 +229,99 @@ static void remmina_rdp_event_scale_area(RemminaProtocolWidget* gp, gint* x, gin
 	*h = sh;
 }
 
-void remmina_rdp_event_update_region(RemminaProtocolWidget* gp, RemminaPluginRdpUiObject* ui)
+static void remmina_rdp_event_scaled_surface_update(rfContext* rfi, gint x, gint y, gint w, gint h)
 {
-	TRACE_CALL("remmina_rdp_event_update_region");
+	TRACE_CALL("remmina_rdp_event_scaled_surface_update");
+	cairo_t* cr;
+
+	/* Rescale only the given area, in scaled coordinates */
+	cr = cairo_create(rfi->scaled_surface);
+	cairo_rectangle(cr, x, y, w, h);
+	cairo_clip(cr);
+	cairo_scale(cr, rfi->scale_x, rfi->scale_y);
+	cairo_set_source_surface(cr, rf_present_acquire(rfi), 0, 0);
+	cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_GOOD);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_paint(cr);
+	cairo_destroy(cr);
+	rf_present_release(rfi);
+}
+
+/* Present the whole primary buffer. The surface shown first is filled
+ * through the back surface, the other one catches up at the next present. */
+static void remmina_rdp_event_create_surface(rfContext* rfi)
+{
+	TRACE_CALL("remmina_rdp_event_create_surface");
+	cairo_surface_t* surface;
+	cairo_surface_t* back;
+
+	surface = cairo_image_surface_create(rfi->cairo_format, rfi->width, rfi->height);
+	back = cairo_image_surface_create(rfi->cairo_format, rfi->width, rfi->height);
+
+	LOCK_BUFFER(0)
+	rfi->surface = surface;
+	rfi->back_surface = back;
+	rfi->back_ahead = cairo_region_create();
+	rfi->back_behind = cairo_region_create();
+	rf_present_rect(rfi, 0, 0, rfi->width, rfi->height);
+	rf_present_flip(rfi);
+	UNLOCK_BUFFER(0)
+}
+
+static void remmina_rdp_event_destroy_surface(rfContext* rfi)
+{
+	TRACE_CALL("remmina_rdp_event_destroy_surface");
+	cairo_surface_t* front;
+	cairo_surface_t* back;
+
+	LOCK_BUFFER(0)
+	front = rfi->surface;
+	back = rfi->back_surface;
+	rfi->surface = NULL;
+	rfi->back_surface = NULL;
+	if (rfi->back_ahead)
+	{
+		cairo_region_destroy(rfi->back_ahead);
+		cairo_region_destroy(rfi->back_behind);
+		rfi->back_ahead = NULL;
+		rfi->back_behind = NULL;
+	}
+	rfi->flip_pending = FALSE;
+	UNLOCK_BUFFER(0)
+
+	if (front)
+		cairo_surface_destroy(front);
+	if (back)
+		cairo_surface_destroy(back);
+}
+
+static void remmina_rdp_event_scaled_surface_rebuild(RemminaProtocolWidget* gp)
+{
+	TRACE_CALL("remmina_rdp_event_scaled_surface_rebuild");
 	rfContext* rfi = GET_PLUGIN_DATA(gp);
-	gint x, y, w, h;
 
-	x = ui->region.x;
-	y = ui->region.y;
-	w = ui->region.width;
-	h = ui->region.height;
+	if (rfi->scaled_surface)
+	{
+		cairo_surface_destroy(rfi->scaled_surface);
+		rfi->scaled_surface = NULL;
+	}
 
-	if (remmina_plugin_service->protocol_plugin_get_scale(gp))
-		remmina_rdp_event_scale_area(gp, &x, &y, &w, &h);
+	if (!rfi->surface || !remmina_plugin_service->protocol_plugin_get_scale(gp) || rfi->scale_width < 1 || rfi->scale_height < 1)
+		return;
 
-	gtk_widget_queue_draw_area(rfi->drawing_area, x, y, w, h);
+	/* Nothing to scale when the remote desktop already fits the window */
+	if (rfi->scale_width == rfi->width && rfi->scale_height == rfi->height)
+		return;
+
+	rfi->scaled_surface = cairo_image_surface_create(rfi->cairo_format, rfi->scale_width, rfi->scale_height);
+	remmina_rdp_event_scaled_surface_update(rfi, 0, 0, rfi->scale_width, rfi->scale_height);
+}
+
+void remmina_rdp_event_update_region(RemminaProtocolWidget* gp, RemminaPluginRdpUiObject* ui)
+{
+	TRACE_CALL("remmina_rdp_event_update_region");
+
+	remmina_rdp_event_update_rect(gp, ui->region.x, ui->region.y, ui->region.width, ui->region.height);
 }
 
 void remmina_rdp_event_update_rect(RemminaProtocolWidget* gp, gint x, gint y, gint w, gint h)
@@ -210,8 +329,13 @@ void remmina_rdp_event_update_rect(RemminaProtocolWidget* gp, gint x, gint y, gi
 	TRACE_CALL("remmina_rdp_event_update_rect");
 	rfContext* rfi = GET_PLUGIN_DATA(gp);
 
+	/* The RDP thread has already copied the area to the surface */
 	if (remmina_plugin_service->protocol_plugin_get_scale(gp))
+	{
 		remmina_rdp_event_scale_area(gp, &x, &y, &w, &h);
+		if (rfi->scaled_surface)
+			remmina_rdp_event_scaled_surface_update(rfi, x, y, w, h);
+	}
 
 	gtk_widget_queue_draw_area(rfi->drawing_area, x, y, w, h);
 }
@@ -255,6 +379,8 @@ static gboolean remmina_rdp_event_update_scale_factor(RemminaProtocolWidget* gp)
 		rfi->scale_y = 0;
 	}
 
+	remmina_rdp_event_scaled_surface_rebuild(gp);
+
 	/* Now we have scaling vars calculated, resize drawing_area accordingly */
 
 	if ((gpwidth > 1) && (gpheight > 1))
@@ -269,6 +395,7 @@ static gboolean remmina_rdp_event_on_draw(GtkWidget* widget, cairo_t* context, R
 {
 	TRACE_CALL("remmina_rdp_event_on_draw");
 	gboolean scale;
+	GdkRectangle clip;
 	rfContext* rfi = GET_PLUGIN_DATA(gp);
 
 	if (!rfi) return FALSE;
@@ -276,19 +403,75 @@ static gboolean remmina_rdp_event_on_draw(GtkWidget* widget, cairo_t* context, R
 	if (!rfi->surface)
 		return FALSE;
 
-	scale = remmina_plugin_service->protocol_plugin_get_scale(gp);
+	if (!gdk_cairo_get_clip_rectangle(context, &clip))
+		return TRUE;
 
-	if (scale)
-		cairo_scale(context, rfi->scale_x, rfi->scale_y);
+	scale = remmina_plugin_service->protocol_plugin_get_scale(gp);
 
-	cairo_set_source_surface(context, rfi->surface, 0, 0);
+	if (scale && rfi->scaled_surface)
+	{
+		/* Damaged areas have already been rescaled, this is a 1:1 copy */
+		cairo_set_source_surface(context, rfi->scaled_surface, 0, 0);
+	}
+	else
+	{
+		if (scale)
+			cairo_scale(context, rfi->scale_x, rfi->scale_y);
+		cairo_set_source_surface(context, rf_present_acquire(rfi), 0, 0);
+	}
 
 	cairo_set_operator (context, CAIRO_OPERATOR_SOURCE);	// Ignore alpha channel from FreeRDP
-	cairo_paint(context);
+
+	/* Only repaint what GTK asked for, without the lock */
+	if (scale && !rfi->scaled_surface)
+		cairo_paint(context);
+	else
+	{
+		gdk_cairo_rectangle(context, &clip);
+		cairo_fill(context);
+	}
+
+	if (!scale || !rfi->scaled_surface)
+	{
+		/* The RDP thread may write to the surface once it is released */
+		cairo_set_source_rgb(context, 0, 0, 0);
+		rf_present_release(rfi);
+	}
 
 	return TRUE;
 }
 
+static gboolean remmina_rdp_event_send_layout(RemminaProtocolWidget* gp)
+{
+	TRACE_CALL("remmina_rdp_event_send_layout");
+	RemminaPluginRdpEvent rdp_event = { 0 };
+	GtkAllocation a;
+	gint width, height;
+	rfContext* rfi = GET_PLUGIN_DATA(gp);
+
+	rfi->layout_handler = 0;
+
+	/* MS-RDPEDISP wants an even width, and sizes between 200 and 8192 */
+	gtk_widget_get_allocation(GTK_WIDGET(gp), &a);
+	width = CLAMP(a.width, 200, 8192) & ~1;
+	height = CLAMP(a.height, 200, 8192);
+
+	if (width == rfi->width && height == rfi->height)
+		return FALSE;
+	if (width == rfi->layout_width && height == rfi->layout_height)
+		return FALSE;
+	rfi->layout_width = width;
+	rfi->layout_height = height;
+
+	/* rf_desktop_resize() takes over when the server has switched */
+	rdp_event.type = REMMINA_RDP_EVENT_TYPE_DISPLAY_LAYOUT;
+	rdp_event.display_event.width = width;
+	rdp_event.display_event.height = height;
+	remmina_rdp_event_event_push(gp, &rdp_event);
+
+	return FALSE;
+}
+
 static gboolean remmina_rdp_event_on_configure(GtkWidget* widget, GdkEventConfigure* event, RemminaProtocolWidget* gp)
 {
 	TRACE_CALL("remmina_rdp_event_on_configure");
@@ -303,6 +486,14 @@ static gboolean remmina_rdp_event_on_configure(GtkWidget* widget, GdkEventConfig
 
 	rfi->scale_handler = g_timeout_add(300, (GSourceFunc) remmina_rdp_event_update_scale_factor, gp);
 
+	/* Ask the server for a new desktop size once the user stops resizing */
+	if (rfi->dynamic_resolution && rfi->connected)
+	{
+		if (rfi->layout_handler)
+			g_source_remove(rfi->layout_handler);
+		rfi->layout_handler = g_timeout_add(500, (GSourceFunc) remmina_rdp_event_send_layout, gp);
+	}
+
 	return FALSE;
 }
 
@@ -511,7 +702,7 @@ gboolean remmina_rdp_event_on_clipboard(GtkClipboard *gtkClipboard, GdkEvent *ev
 	clipboard = &(rfi->clipboard);
 
 	if ( clipboard->sync ) {
-		ui = g_new0(RemminaPluginRdpUiObject, 1);
+		ui = rf_object_new(gp);
 		ui->type = REMMINA_RDP_UI_CLIPBOARD;
 		ui->clipboard.clipboard = clipboard;
 		ui->clipboard.type = REMMINA_RDP_UI_CLIPBOARD_FORMATLIST;
@@ -570,10 +761,19 @@ void remmina_rdp_event_init(RemminaProtocolWidget* gp)
 		clipboard = gtk_widget_get_clipboard(rfi->drawing_area, GDK_SELECTION_CLIPBOARD);
 		rfi->clipboard.clipboard_handler = g_signal_connect(clipboard, "owner-change", G_CALLBACK(remmina_rdp_event_on_clipboard), gp);
 	}
+	rfi->dynamic_resolution = remmina_plugin_service->file_get_int(remminafile, "dynamic_resolution", FALSE);
 
 	rfi->pressed_keys = g_array_new(FALSE, TRUE, sizeof (DWORD));
-	rfi->event_queue = g_async_queue_new_full(g_free);
-	rfi->ui_queue = g_async_queue_new();
+	rfi->event_ring_head = 0;
+	rfi->event_ring_tail = 0;
+	rfi->event_ring_peak = 0;
+	rfi->events_dropped = 0;
+	rfi->event_overflow = g_async_queue_new_full(g_free);
+	rfi->event_overflow_free = g_async_queue_new_full(g_free);
+	rfi->event_overflow_len = 0;
+	rfi->events_overflowed = 0;
+	rfi->frame_acks = g_async_queue_new_full(g_free);
+	rf_ui_queue_init(gp);
 
 	if (pipe(rfi->event_pipe))
 	{
@@ -588,16 +788,16 @@ void remmina_rdp_event_init(RemminaProtocolWidget* gp)
 	}
 
 	rfi->object_table = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+	rf_pointer_cache_init(rfi);
 
 	rfi->display = gdk_display_get_default();
-	rfi->bpp = gdk_visual_get_best_depth();
+	rfi->bpp = 32;
 }
 
 void remmina_rdp_event_uninit(RemminaProtocolWidget* gp)
 {
 	TRACE_CALL("remmina_rdp_event_uninit");
 	rfContext* rfi = GET_PLUGIN_DATA(gp);
-	RemminaPluginRdpUiObject* ui;
 
 	if ( !rfi ) return;
 
@@ -612,30 +812,39 @@ void remmina_rdp_event_uninit(RemminaProtocolWidget* gp)
 		g_source_remove(rfi->scale_handler);
 		rfi->scale_handler = 0;
 	}
-	if (rfi->ui_handler)
+	if (rfi->layout_handler)
 	{
-		g_source_remove(rfi->ui_handler);
-		rfi->ui_handler = 0;
+		g_source_remove(rfi->layout_handler);
+		rfi->layout_handler = 0;
 	}
-	while ((ui =(RemminaPluginRdpUiObject*) g_async_queue_try_pop(rfi->ui_queue)) != NULL)
+	if (rfi->event_ring_head > 0)
+		remmina_plugin_service->log_printf("[RDP] input events: %u queued, %u pending at most out of %d, %u overflowed, %u motions dropped\n",
+			(guint) rfi->event_ring_head, rfi->event_ring_peak, REMMINA_RDP_EVENT_RING_SIZE,
+			rfi->events_overflowed, rfi->events_dropped);
+	rf_ui_queue_uninit(gp);
+	if (rfi->reconnect_dialog)
+		gtk_widget_destroy(rfi->reconnect_dialog);
+	if (rfi->scaled_surface)
 	{
-		rf_object_free(gp, ui);
-	}
-	if (rfi->surface)
-	{
-		cairo_surface_destroy(rfi->surface);
-		rfi->surface = NULL;
+		cairo_surface_destroy(rfi->scaled_surface);
+		rfi->scaled_surface = NULL;
 	}
+	remmina_rdp_event_destroy_surface(rfi);
 
 	g_hash_table_destroy(rfi->object_table);
+	rf_pointer_cache_free(rfi);
 
 	g_array_free(rfi->pressed_keys, TRUE);
-	g_async_queue_unref(rfi->event_queue);
-	rfi->event_queue = NULL;
-	g_async_queue_unref(rfi->ui_queue);
-	rfi->ui_queue = NULL;
+	g_async_queue_unref(rfi->event_overflow);
+	rfi->event_overflow = NULL;
+	g_async_queue_unref(rfi->event_overflow_free);
+	rfi->event_overflow_free = NULL;
+	g_async_queue_unref(rfi->frame_acks);
+	rfi->frame_acks = NULL;
 	close(rfi->event_pipe[0]);
 	close(rfi->event_pipe[1]);
+	rfi->event_pipe[0] = -1;
+	rfi->event_pipe[1] = -1;
 }
 
 void remmina_rdp_event_update_scale(RemminaProtocolWidget* gp)
@@ -652,9 +861,10 @@ void remmina_rdp_event_update_scale(RemminaProtocolWidget* gp)
 
 	remmina_rdp_event_update_scale_factor(gp);
 
-	if (rfi->scale)
+	if (rfi->scale || rfi->dynamic_resolution)
 	{
-		/* In scaled mode, drawing_area will get its dimensions from its parent */
+		/* In scaled mode, drawing_area will get its dimensions from its parent.
+		 * With a dynamic resolution, the remote desktop follows them. */
 		gtk_widget_set_size_request(rfi->drawing_area, -1, -1 );
 	}
 	else
@@ -666,16 +876,44 @@ void remmina_rdp_event_update_scale(RemminaProtocolWidget* gp)
 	remmina_plugin_service->protocol_plugin_emit_signal(gp, "update-align");
 }
 
+static void remmina_rdp_event_desktop_resize(RemminaProtocolWidget* gp)
+{
+	TRACE_CALL("remmina_rdp_event_desktop_resize");
+	rfContext* rfi = GET_PLUGIN_DATA(gp);
+	rdpGdi* gdi = ((rdpContext*) rfi)->gdi;
+
+	/* The RDP thread waits for us, and the graphics pipeline waits for
+	 * gfx_mutex: nothing else uses the GDI meanwhile */
+	pthread_mutex_lock(&rfi->gfx_mutex);
+	if (rfi->scaled_surface)
+	{
+		cairo_surface_destroy(rfi->scaled_surface);
+		rfi->scaled_surface = NULL;
+	}
+	remmina_rdp_event_destroy_surface(rfi);
+
+	gdi_resize(gdi, rfi->settings->DesktopWidth, rfi->settings->DesktopHeight);
+	rfi->primary_buffer = gdi->primary_buffer;
+	rfi->width = rfi->settings->DesktopWidth;
+	rfi->height = rfi->settings->DesktopHeight;
+	remmina_plugin_service->protocol_plugin_set_width(gp, rfi->width);
+	remmina_plugin_service->protocol_plugin_set_height(gp, rfi->height);
+
+	remmina_rdp_event_create_surface(rfi);
+	pthread_mutex_unlock(&rfi->gfx_mutex);
+
+	remmina_rdp_event_update_scale(gp);
+	gtk_widget_queue_draw(rfi->drawing_area);
+}
+
 static void remmina_rdp_event_connected(RemminaProtocolWidget* gp, RemminaPluginRdpUiObject* ui)
 {
 	TRACE_CALL("remmina_rdp_event_connected");
 	rfContext* rfi = GET_PLUGIN_DATA(gp);
-	int stride;
 
 	gtk_widget_realize(rfi->drawing_area);
 
-	stride = cairo_format_stride_for_width(rfi->cairo_format, rfi->width);
-	rfi->surface = cairo_image_surface_create_for_data((unsigned char*) rfi->primary_buffer, rfi->cairo_format, rfi->width, rfi->height, stride);
+	remmina_rdp_event_create_surface(rfi);
 	gtk_widget_queue_draw_area(rfi->drawing_area, 0, 0, rfi->width, rfi->height);
 
 	if (rfi->clipboard.clipboard_handler)
@@ -683,6 +921,9 @@ static void remmina_rdp_event_connected(RemminaProtocolWidget* gp, RemminaPlugin
 		remmina_rdp_event_on_clipboard(NULL, NULL, gp);
 	}
 	remmina_rdp_event_update_scale(gp);
+
+	if (rfi->dynamic_resolution && !rfi->layout_handler)
+		rfi->layout_handler = g_timeout_add(500, (GSourceFunc) remmina_rdp_event_send_layout, gp);
 }
 
 static void remmina_rdp_event_create_cursor(RemminaProtocolWidget* gp, RemminaPluginRdpUiObject* ui)
@@ -692,20 +933,22 @@ static void remmina_rdp_event_create_cursor(RemminaProtocolWidget* gp, RemminaPl
 	rfContext* rfi = GET_PLUGIN_DATA(gp);
 	rdpPointer* pointer = (rdpPointer*)ui->cursor.pointer;
 	cairo_surface_t* surface;
+	GdkCursor* cursor;
 	UINT8* data = malloc(pointer->width * pointer->height * 4);
 
 	freerdp_alpha_cursor_convert(data, pointer->xorMaskData, pointer->andMaskData, pointer->width, pointer->height, pointer->xorBpp, rfi->clrconv);
 	surface = cairo_image_surface_create_for_data(data, CAIRO_FORMAT_ARGB32, pointer->width, pointer->height, cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, pointer->width));
+	/* The pixbuf gets its own copy of the pixels */
 	pixbuf = gdk_pixbuf_get_from_surface(surface, 0, 0, pointer->width, pointer->height);
 	cairo_surface_destroy(surface);
-	((rfPointer*)ui->cursor.pointer)->cursor = gdk_cursor_new_from_pixbuf(rfi->display, pixbuf, pointer->xPos, pointer->yPos);
-}
+	free(data);
 
-static void remmina_rdp_event_free_cursor(RemminaProtocolWidget* gp, RemminaPluginRdpUiObject* ui)
-{
-	TRACE_CALL("remmina_rdp_event_free_cursor");
-	g_object_unref(ui->cursor.pointer->cursor);
-	ui->cursor.pointer->cursor = NULL;
+	cursor = gdk_cursor_new_from_pixbuf(rfi->display, pixbuf, pointer->xPos, pointer->yPos);
+	g_object_unref(pixbuf);
+	rf_pointer_cache_insert(rfi, pointer, cursor);
+
+	/* Handed back to rf_Pointer_New() through rf_queue_ui_sync() */
+	ui->retptr = cursor;
 }
 
 static void remmina_rdp_event_cursor(RemminaProtocolWidget* gp, RemminaPluginRdpUiObject* ui)
@@ -720,16 +963,20 @@ static void remmina_rdp_event_cursor(RemminaProtocolWidget* gp, RemminaPluginRdp
 			break;
 
 		case REMMINA_RDP_POINTER_FREE:
-			remmina_rdp_event_free_cursor(gp, ui);
+			/* The cursor reference is dropped by rf_object_free() */
 			break;
 
 		case REMMINA_RDP_POINTER_SET:
-			gdk_window_set_cursor(gtk_widget_get_window(rfi->drawing_area), ui->cursor.pointer->cursor);
+			gdk_window_set_cursor(gtk_widget_get_window(rfi->drawing_area), ui->cursor.cursor);
 			break;
 
 		case REMMINA_RDP_POINTER_NULL:
-			gdk_window_set_cursor(gtk_widget_get_window(rfi->drawing_area), gdk_cursor_new(GDK_BLANK_CURSOR));
+		{
+			GdkCursor* blank = gdk_cursor_new(GDK_BLANK_CURSOR);
+			gdk_window_set_cursor(gtk_widget_get_window(rfi->drawing_area), blank);
+			g_object_unref(blank);
 			break;
+		}
 
 		case REMMINA_RDP_POINTER_DEFAULT:
 			gdk_window_set_cursor(gtk_widget_get_window(rfi->drawing_area), NULL);
@@ -752,9 +999,64 @@ static void remmina_rdp_event_process_event(RemminaProtocolWidget* gp, RemminaPl
 		case REMMINA_RDP_UI_EVENT_UPDATE_SCALE:
 			remmina_rdp_ui_event_update_scale(gp, ui);
 			break;
+
+		case REMMINA_RDP_UI_EVENT_DESKTOP_RESIZE:
+			remmina_rdp_event_desktop_resize(gp);
+			break;
+	}
+}
+
+
+/* Every update of the frame has been handled, let the server send more.
+ * The acknowledge bypasses the input ring, which may drop events. */
+static void remmina_rdp_event_frame_done(RemminaProtocolWidget* gp, RemminaPluginRdpUiObject* ui)
+{
+	TRACE_CALL("remmina_rdp_event_frame_done");
+	rfContext* rfi = GET_PLUGIN_DATA(gp);
+
+	if (rfi->event_pipe[1] == -1)
+		return;
+
+	g_async_queue_push(rfi->frame_acks, g_memdup(&ui->frame.id, sizeof(UINT32)));
+	if (write(rfi->event_pipe[1], "\0", 1))
+	{
 	}
 }
 
+static void remmina_rdp_event_reconnect_response(GtkDialog* dialog, gint response_id, RemminaProtocolWidget* gp)
+{
+	TRACE_CALL("remmina_rdp_event_reconnect_response");
+	gtk_widget_destroy(GTK_WIDGET(dialog));
+	remmina_plugin_service->protocol_plugin_close_connection(gp);
+}
+
+/* The RDP thread is trying to restore a lost connection */
+static void remmina_rdp_event_reconnect(RemminaProtocolWidget* gp, RemminaPluginRdpUiObject* ui)
+{
+	TRACE_CALL("remmina_rdp_event_reconnect");
+	rfContext* rfi = GET_PLUGIN_DATA(gp);
+	GtkWidget* toplevel;
+
+	if (ui->reconnect.attempt == 0)
+	{
+		if (rfi->reconnect_dialog)
+			gtk_widget_destroy(rfi->reconnect_dialog);
+		return;
+	}
+
+	if (!rfi->reconnect_dialog)
+	{
+		toplevel = gtk_widget_get_toplevel(GTK_WIDGET(gp));
+		rfi->reconnect_dialog = gtk_message_dialog_new(gtk_widget_is_toplevel(toplevel) ? GTK_WINDOW(toplevel) : NULL,
+			GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_WARNING, GTK_BUTTONS_CANCEL,
+			_("Connection to RDP server %s lost"), rfi->settings->ServerHostname);
+		g_signal_connect(rfi->reconnect_dialog, "response", G_CALLBACK(remmina_rdp_event_reconnect_response), gp);
+		g_signal_connect(rfi->reconnect_dialog, "destroy", G_CALLBACK(gtk_widget_destroyed), &rfi->reconnect_dialog);
+	}
+	gtk_message_dialog_format_secondary_text(GTK_MESSAGE_DIALOG(rfi->reconnect_dialog),
+		_("Reconnecting, attempt %u of %u..."), ui->reconnect.attempt, ui->reconnect.max_attempts);
+	gtk_widget_show(rfi->reconnect_dialog);
+}
 
 gboolean remmina_rdp_event_queue_ui(RemminaProtocolWidget* gp)
 {
@@ -762,12 +1064,17 @@ gboolean remmina_rdp_event_queue_ui(RemminaProtocolWidget* gp)
 	rfContext* rfi = GET_PLUGIN_DATA(gp);
 	RemminaPluginRdpUiObject* ui;
 
-	LOCK_BUFFER(FALSE);
-	ui = (RemminaPluginRdpUiObject*) g_async_queue_try_pop(rfi->ui_queue);
+	/* The connection was closed while we were scheduled: the queue is gone */
+	if (!rfi)
+	{
+		g_object_unref(gp);
+		return FALSE;
+	}
+
+	ui = rf_ui_queue_pop(gp);
 
 	if (ui)
 	{
-		UNLOCK_BUFFER(FALSE)
 		if ( !rfi->thread_cancelled ) {
 			switch (ui->type)
 			{
@@ -791,28 +1098,30 @@ gboolean remmina_rdp_event_queue_ui(RemminaProtocolWidget* gp)
 					remmina_rdp_event_process_event(gp,ui);
 					break;
 
+				case REMMINA_RDP_UI_FRAME:
+					remmina_rdp_event_frame_done(gp, ui);
+					break;
+
+				case REMMINA_RDP_UI_RECONNECT:
+					remmina_rdp_event_reconnect(gp, ui);
+					break;
+
 				default:
 					break;
 			}
 		}
 
-		// Should we signal the subthread to unlock ?
-		if (ui->sync) {
-			pthread_mutex_unlock(&ui->sync_wait_mutex);
-			/* Freeing ui, when in sync mode, must be done by the just
-			 * unlocked rf_queue_ui() */
-		} else {
-			rf_object_free(gp, ui);
-		}
+		/* Wakes up the waiting thread for sync objects, frees the others */
+		rf_ui_queue_complete(gp, ui);
 
 		return TRUE;
 	}
-	else
-	{
-		rfi->ui_handler = 0;
-		UNLOCK_BUFFER(FALSE)
-		return FALSE;
-	}
+
+	if (rf_ui_queue_reschedule(gp))
+		return TRUE;
+
+	g_object_unref(gp);
+	return FALSE;
 }
 
 void remmina_rdp_event_unfocus(RemminaProtocolWidget* gp)
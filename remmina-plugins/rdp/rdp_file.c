@@ -132,62 +132,73 @@ static void remmina_rdp_file_import_field(RemminaFile* remminafile, const gchar*
 	}
 }
 
-static RemminaFile* remmina_rdp_file_import_channel(GIOChannel* channel)
+/* Files saved by mstsc are in UTF-16LE: decode them whole in a single pass
+ * rather than line by line through iconv. Unpaired surrogates become U+FFFD. */
+static gchar* remmina_rdp_file_utf16le_to_utf8(const guchar* data, gsize size)
 {
-	TRACE_CALL("remmina_rdp_file_import_channel");
-	gchar* p;
-	const gchar* enc;
-	gchar* line = NULL;
-	GError* error = NULL;
-	gsize bytes_read = 0;
-	RemminaFile* remminafile;
-	guchar magic[2] = { 0 };
+	TRACE_CALL("remmina_rdp_file_utf16le_to_utf8");
+	gchar* text;
+	guchar* out;
+	gunichar c, c2;
+	gsize i, n;
 
-	if (g_io_channel_set_encoding(channel, NULL, &error) != G_IO_STATUS_NORMAL)
-	{
-		g_print("g_io_channel_set_encoding: %s\n", error->message);
-		return NULL;
-	}
+	n = size / 2;
+	out = (guchar*) g_malloc(n * 3 + 1);
+	text = (gchar*) out;
 
-	/* Try to detect the UTF-16 encoding */
-	if (g_io_channel_read_chars(channel, (gchar*) magic, 2, &bytes_read, &error) != G_IO_STATUS_NORMAL)
+	for (i = 0; i < n; i++)
 	{
-		g_print("g_io_channel_read_chars: %s\n", error->message);
-		return NULL;
-	}
+		c = data[2 * i] | (data[2 * i + 1] << 8);
 
-	if (magic[0] == 0xFF && magic[1] == 0xFE)
-	{
-		enc = "UTF-16LE";
-	}
-	else if (magic[0] == 0xFE && magic[1] == 0xFF)
-	{
-		enc = "UTF-16BE";
-	}
-	else
-	{
-		enc = "UTF-8";
-		if (g_io_channel_seek_position(channel, 0, G_SEEK_SET, &error) != G_IO_STATUS_NORMAL)
+		if (c < 0x80)
 		{
-			g_print("g_io_channel_seek: failed\n");
-			return NULL;
+			*out++ = c;
+			continue;
 		}
-	}
 
-	if (g_io_channel_set_encoding(channel, enc, &error) != G_IO_STATUS_NORMAL)
-	{
-		g_print("g_io_channel_set_encoding: %s\n", error->message);
-		return NULL;
+		if (c >= 0xD800 && c < 0xE000)
+		{
+			c2 = (i + 1 < n) ? (gunichar) (data[2 * i + 2] | (data[2 * i + 3] << 8)) : 0;
+			if (c < 0xDC00 && c2 >= 0xDC00 && c2 < 0xE000)
+			{
+				/* A surrogate pair is 4 bytes long in both encodings */
+				c = 0x10000 + ((c - 0xD800) << 10) + (c2 - 0xDC00);
+				i++;
+			}
+			else
+			{
+				c = 0xFFFD;
+			}
+		}
+
+		out += g_unichar_to_utf8(c, (gchar*) out);
 	}
+	*out = '\0';
+
+	return text;
+}
+
+static RemminaFile* remmina_rdp_file_import_text(gchar* text)
+{
+	TRACE_CALL("remmina_rdp_file_import_text");
+	gchar* p;
+	gchar* line;
+	gchar* next;
+	gsize len;
+	RemminaFile* remminafile;
 
 	remminafile = remmina_plugin_service->file_new();
 
-	while (g_io_channel_read_line(channel, &line, NULL, &bytes_read, &error) == G_IO_STATUS_NORMAL)
+	for (line = text; line; line = next)
 	{
-		if (line == NULL)
-			break;
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+
+		len = strlen(line);
+		if (len > 0 && line[len - 1] == '\r')
+			line[len - 1] = '\0';
 
-		line[bytes_read] = '\0';
 		p = strchr(line, ':');
 
 		if (p)
@@ -201,8 +212,6 @@ static RemminaFile* remmina_rdp_file_import_channel(GIOChannel* channel)
 				remmina_rdp_file_import_field(remminafile, line, p);
 			}
 		}
-
-		g_free(line);
 	}
 
 	if (remmina_plugin_service->file_get_int(remminafile, "resolution_width", 0) > 0 &&
@@ -222,23 +231,54 @@ static RemminaFile* remmina_rdp_file_import_channel(GIOChannel* channel)
 	return remminafile;
 }
 
+/* Safe to call from any thread, the main window imports several files at once */
 RemminaFile* remmina_rdp_file_import(const gchar* from_file)
 {
 	TRACE_CALL("remmina_rdp_file_import");
-	GIOChannel* channel;
+	gchar* data;
+	gchar* text;
+	gsize size;
 	GError* error = NULL;
 	RemminaFile* remminafile;
+	const guchar* magic;
 
-	channel = g_io_channel_new_file(from_file, "r", &error);
-
-	if (channel == NULL)
+	if (!g_file_get_contents(from_file, &data, &size, &error))
 	{
 		g_print("Failed to import %s: %s\n", from_file, error->message);
+		g_error_free(error);
 		return NULL;
 	}
 
-	remminafile = remmina_rdp_file_import_channel(channel);
-	g_io_channel_shutdown(channel, TRUE, &error);
+	/* Detect the encoding from the byte order mark */
+	magic = (const guchar*) data;
+	if (size >= 2 && magic[0] == 0xFF && magic[1] == 0xFE)
+	{
+		text = remmina_rdp_file_utf16le_to_utf8(magic + 2, size - 2);
+	}
+	else if (size >= 2 && magic[0] == 0xFE && magic[1] == 0xFF)
+	{
+		text = g_convert(data + 2, size - 2, "UTF-8", "UTF-16BE", NULL, NULL, &error);
+		if (!text)
+		{
+			g_print("Failed to import %s: %s\n", from_file, error->message);
+			g_error_free(error);
+			g_free(data);
+			return NULL;
+		}
+	}
+	else if (size >= 3 && magic[0] == 0xEF && magic[1] == 0xBB && magic[2] == 0xBF)
+	{
+		text = g_strndup(data + 3, size - 3);
+	}
+	else
+	{
+		text = data;
+		data = NULL;
+	}
+	g_free(data);
+
+	remminafile = remmina_rdp_file_import_text(text);
+	g_free(text);
 
 	return remminafile;
 }
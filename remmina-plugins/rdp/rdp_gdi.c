@@ -44,176 +44,417 @@
 #include <freerdp/constants.h>
 #include <freerdp/cache/cache.h>
 
-static void rf_desktop_resize(rdpContext* context)
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+void rf_gdi_set_order_support(rdpSettings* settings)
 {
-	TRACE_CALL("rf_desktop_resize");
-	RemminaProtocolWidget* gp;
-	RemminaPluginRdpUiObject* ui;
-	rfContext* rfi;
+	TRACE_CALL("rf_gdi_set_order_support");
+
+	/* Advertise only the orders the FreeRDP software GDI really renders,
+	 * the server falls back to bitmap updates for everything else */
+	settings->OrderSupport[NEG_DSTBLT_INDEX] = True;
+	settings->OrderSupport[NEG_PATBLT_INDEX] = True;
+	settings->OrderSupport[NEG_SCRBLT_INDEX] = True;
+	settings->OrderSupport[NEG_OPAQUE_RECT_INDEX] = True;
+	settings->OrderSupport[NEG_DRAWNINEGRID_INDEX] = False;
+	settings->OrderSupport[NEG_MULTIDSTBLT_INDEX] = False;
+	settings->OrderSupport[NEG_MULTIPATBLT_INDEX] = False;
+	settings->OrderSupport[NEG_MULTISCRBLT_INDEX] = False;
+	settings->OrderSupport[NEG_MULTIOPAQUERECT_INDEX] = True;
+	settings->OrderSupport[NEG_MULTI_DRAWNINEGRID_INDEX] = False;
+	settings->OrderSupport[NEG_LINETO_INDEX] = True;
+	settings->OrderSupport[NEG_POLYLINE_INDEX] = True;
+	settings->OrderSupport[NEG_MEMBLT_INDEX] = settings->BitmapCacheEnabled;
+	settings->OrderSupport[NEG_MEM3BLT_INDEX] = settings->BitmapCacheEnabled;
+	settings->OrderSupport[NEG_MEMBLT_V2_INDEX] = settings->BitmapCacheEnabled;
+	settings->OrderSupport[NEG_MEM3BLT_V2_INDEX] = False;
+	settings->OrderSupport[NEG_SAVEBITMAP_INDEX] = False;
+	settings->OrderSupport[NEG_GLYPH_INDEX_INDEX] = settings->GlyphSupportLevel != GLYPH_SUPPORT_NONE;
+	settings->OrderSupport[NEG_FAST_INDEX_INDEX] = settings->GlyphSupportLevel != GLYPH_SUPPORT_NONE;
+	settings->OrderSupport[NEG_FAST_GLYPH_INDEX] = settings->GlyphSupportLevel != GLYPH_SUPPORT_NONE;
+	settings->OrderSupport[NEG_POLYGON_SC_INDEX] = False;
+	settings->OrderSupport[NEG_POLYGON_CB_INDEX] = False;
+	settings->OrderSupport[NEG_ELLIPSE_SC_INDEX] = False;
+	settings->OrderSupport[NEG_ELLIPSE_CB_INDEX] = False;
+}
 
-	rfi = (rfContext*) context;
-	gp = rfi->protocol_widget;
+void rf_gdi_set_cache_support(rdpSettings* settings)
+{
+	TRACE_CALL("rf_gdi_set_cache_support");
 
-	LOCK_BUFFER(TRUE)
+	/* Bitmap cache, revision 2 with the default cell layout */
+	settings->BitmapCacheEnabled = True;
+	settings->BitmapCacheVersion = 2;
+	settings->AllowCacheWaitingList = True;
 
-	remmina_plugin_service->protocol_plugin_set_width(gp, rfi->settings->DesktopWidth);
-	remmina_plugin_service->protocol_plugin_set_height(gp, rfi->settings->DesktopHeight);
+	/* The cells are not persistent: FreeRDP 1.2 always sends the Persistent
+	 * Key List empty, so the server would send every bitmap anyway */
 
-	UNLOCK_BUFFER(TRUE)
+	/* Glyph cache, used by the GlyphIndex, FastIndex and FastGlyph orders */
+	settings->GlyphSupportLevel = GLYPH_SUPPORT_FULL;
 
-	ui = g_new0(RemminaPluginRdpUiObject, 1);
-	ui->sync = TRUE;	// Wait for completion too
-	ui->type = REMMINA_RDP_UI_EVENT;
-	ui->event.type = REMMINA_RDP_UI_EVENT_UPDATE_SCALE;
-	rf_queue_ui(gp, ui);
+	/* Brush cache, used by PatBlt and Mem3Blt */
+	settings->BrushSupportLevel = BRUSH_COLOR_FULL;
 
-	remmina_plugin_service->protocol_plugin_emit_signal(gp, "desktop-resize");
-}
+	/* Offscreen bitmaps, which the server composes before a ScrBlt/MemBlt */
+	settings->OffscreenSupportLevel = True;
+	if (settings->OffscreenCacheSize == 0)
+		settings->OffscreenCacheSize = 7680;
+	if (settings->OffscreenCacheEntries == 0)
+		settings->OffscreenCacheEntries = 2000;
 
-static void rf_gdi_palette(rdpContext* context, PALETTE_UPDATE* palette)
-{
-	TRACE_CALL("rf_gdi_palette");
-	g_print("palette\n");
+	rf_gdi_set_order_support(settings);
 }
 
-static void rf_gdi_set_bounds(rdpContext* context, rdpBounds* bounds)
-{
-	TRACE_CALL("rf_gdi_set_bounds");
-}
-
-static void rf_gdi_dstblt(rdpContext* context, DSTBLT_ORDER* dstblt)
+/* Colour conversion of uncompressed bitmaps
+ *
+ * The primary buffer is always 32 bpp: bitmaps sent at a lower colour depth
+ * without compression are expanded here straight into it, eight pixels at
+ * a time when SSE2 is available, instead of going through a temporary
+ * bitmap and the generic FreeRDP conversion. */
+
+/* Expand a 5 or 6 bit channel to 8 bits */
+#define RF_GDI_EXPAND5(c)	(((c) << 3) | ((c) >> 2))
+#define RF_GDI_EXPAND6(c)	(((c) << 2) | ((c) >> 4))
+
+#define RF_GDI_PIXEL_FROM_565(p) (0xFF000000 | (RF_GDI_EXPAND5(((p) >> 11) & 0x1F) << 16) | \
+	(RF_GDI_EXPAND6(((p) >> 5) & 0x3F) << 8) | RF_GDI_EXPAND5((p) & 0x1F))
+#define RF_GDI_PIXEL_FROM_555(p) (0xFF000000 | (RF_GDI_EXPAND5(((p) >> 10) & 0x1F) << 16) | \
+	(RF_GDI_EXPAND5(((p) >> 5) & 0x1F) << 8) | RF_GDI_EXPAND5((p) & 0x1F))
+
+#ifdef __SSE2__
+#define RF_GDI_EXPAND5_SSE2(c)	_mm_or_si128(_mm_slli_epi16(c, 3), _mm_srli_epi16(c, 2))
+#define RF_GDI_EXPAND6_SSE2(c)	_mm_or_si128(_mm_slli_epi16(c, 2), _mm_srli_epi16(c, 4))
+
+/* Interleave the B, G and R channels in the low bytes of 16 bit lanes to
+ * eight B8G8R8A8 pixels */
+static void rf_gdi_store_bgra(UINT32* dst, __m128i b, __m128i g, __m128i r)
 {
-	TRACE_CALL("rf_gdi_dstblt");
-	g_print("dstblt\n");
-}
+	TRACE_CALL("rf_gdi_store_bgra");
+	__m128i bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+	__m128i ra = _mm_or_si128(r, _mm_set1_epi16((short) 0xFF00));
 
-static void rf_gdi_patblt(rdpContext* context, PATBLT_ORDER* patblt)
-{
-	TRACE_CALL("rf_gdi_patblt");
-	g_print("patblt\n");
+	_mm_storeu_si128((__m128i*) dst, _mm_unpacklo_epi16(bg, ra));
+	_mm_storeu_si128((__m128i*) (dst + 4), _mm_unpackhi_epi16(bg, ra));
 }
+#endif
 
-static void rf_gdi_scrblt(rdpContext* context, SCRBLT_ORDER* scrblt)
+static void rf_gdi_convert_row(const UINT8* src, UINT32* dst, gint n, gint bpp)
 {
-	TRACE_CALL("rf_gdi_scrblt");
-	g_print("srcblt\n");
+	TRACE_CALL("rf_gdi_convert_row");
+	gint i = 0;
+#ifdef __SSE2__
+	__m128i p;
+	const __m128i mask5 = _mm_set1_epi16(0x1F);
+	const __m128i mask6 = _mm_set1_epi16(0x3F);
+#endif
+#ifdef __SSSE3__
+	const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	const __m128i alpha = _mm_set1_epi32((int) 0xFF000000);
+#endif
+
+	switch (bpp)
+	{
+		case 16:
+#ifdef __SSE2__
+			for (; i + 8 <= n; i += 8)
+			{
+				p = _mm_loadu_si128((const __m128i*) (src + i * 2));
+				rf_gdi_store_bgra(dst + i,
+					RF_GDI_EXPAND5_SSE2(_mm_and_si128(p, mask5)),
+					RF_GDI_EXPAND6_SSE2(_mm_and_si128(_mm_srli_epi16(p, 5), mask6)),
+					RF_GDI_EXPAND5_SSE2(_mm_srli_epi16(p, 11)));
+			}
+#endif
+			for (; i < n; i++)
+				dst[i] = RF_GDI_PIXEL_FROM_565((UINT32) (src[i * 2] | (src[i * 2 + 1] << 8)));
+			break;
+
+		case 15:
+#ifdef __SSE2__
+			for (; i + 8 <= n; i += 8)
+			{
+				p = _mm_loadu_si128((const __m128i*) (src + i * 2));
+				rf_gdi_store_bgra(dst + i,
+					RF_GDI_EXPAND5_SSE2(_mm_and_si128(p, mask5)),
+					RF_GDI_EXPAND5_SSE2(_mm_and_si128(_mm_srli_epi16(p, 5), mask5)),
+					RF_GDI_EXPAND5_SSE2(_mm_and_si128(_mm_srli_epi16(p, 10), mask5)));
+			}
+#endif
+			for (; i < n; i++)
+				dst[i] = RF_GDI_PIXEL_FROM_555((UINT32) (src[i * 2] | (src[i * 2 + 1] << 8)));
+			break;
+
+		case 24:
+#ifdef __SSSE3__
+			/* 16 bytes are loaded for 4 pixels: stay 2 pixels away from the end */
+			for (; i + 6 <= n; i += 4)
+			{
+				p = _mm_loadu_si128((const __m128i*) (src + i * 3));
+				_mm_storeu_si128((__m128i*) (dst + i), _mm_or_si128(_mm_shuffle_epi8(p, shuffle), alpha));
+			}
+#endif
+			for (; i < n; i++)
+				dst[i] = 0xFF000000 | (src[i * 3 + 2] << 16) | (src[i * 3 + 1] << 8) | src[i * 3];
+			break;
+
+		case 32:
+			/* The rows of the bitmap need not be 4 byte aligned */
+#ifdef __SSE2__
+			for (; i + 4 <= n; i += 4)
+			{
+				p = _mm_loadu_si128((const __m128i*) (src + i * 4));
+				_mm_storeu_si128((__m128i*) (dst + i), _mm_or_si128(p, _mm_set1_epi32((int) 0xFF000000)));
+			}
+#endif
+			for (; i < n; i++)
+			{
+				memcpy(&dst[i], src + i * 4, 4);
+				dst[i] |= 0xFF000000;
+			}
+			break;
+	}
 }
 
-static void rf_gdi_opaque_rect(rdpContext* context, OPAQUE_RECT_ORDER* opaque_rect)
+/* Convert a bitmap into the primary buffer, clipped to it. The rows of the
+ * bitmap are stride bytes apart, from the bottom one when bottom_up is set. */
+static void rf_gdi_convert_bitmap(rdpGdi* gdi, const UINT8* data, gint stride, gint bpp, gboolean bottom_up,
+	gint left, gint top, gint width, gint height)
 {
-	TRACE_CALL("rf_gdi_opaque_rect");
-	g_print("opaque_rect\n");
-}
+	TRACE_CALL("rf_gdi_convert_bitmap");
+	gint row, x, w, h;
+	const UINT8* src;
+	UINT32* dst;
+
+	x = MAX(left, 0);
+	w = MIN(left + width, gdi->width) - x;
+	h = MIN(top + height, gdi->height) - MAX(top, 0);
+	if (w <= 0 || h <= 0)
+		return;
+
+	for (row = MAX(top, 0) - top; row < MAX(top, 0) - top + h; row++)
+	{
+		src = data + (bottom_up ? height - 1 - row : row) * stride + (x - left) * ((bpp + 7) / 8);
+		dst = (UINT32*) gdi->primary_buffer + (top + row) * gdi->width + x;
+		rf_gdi_convert_row(src, dst, w, bpp);
+	}
 
-static void rf_gdi_multi_opaque_rect(rdpContext* context, MULTI_OPAQUE_RECT_ORDER* multi_opaque_rect)
-{
-	TRACE_CALL("rf_gdi_multi_opaque_rect");
-	g_print("multi_opaque_rect\n");
+	gdi_InvalidateRegion(gdi->primary->hdc, x, MAX(top, 0), w, h);
 }
 
-static void rf_gdi_line_to(rdpContext* context, LINE_TO_ORDER* line_to)
+static gboolean rf_gdi_convertible_bpp(gint bpp)
 {
-	TRACE_CALL("rf_gdi_line_to");
-	g_print("line_to\n");
+	TRACE_CALL("rf_gdi_convertible_bpp");
+	return bpp == 15 || bpp == 16 || bpp == 24 || bpp == 32;
 }
 
-static void rf_gdi_polyline(rdpContext* context, POLYLINE_ORDER* polyline)
+static void rf_gdi_bitmap_update(rdpContext* context, BITMAP_UPDATE* bitmap)
 {
-	TRACE_CALL("rf_gdi_polyline");
-	g_print("polyline\n");
-}
+	TRACE_CALL("rf_gdi_bitmap_update");
+	rfContext* rfi = (rfContext*) context;
+	rdpGdi* gdi = context->gdi;
+	BITMAP_UPDATE single;
+	BITMAP_DATA* b;
+	gint stride;
+	UINT32 i;
 
-static void rf_gdi_memblt(rdpContext* context, MEMBLT_ORDER* memblt)
-{
-	TRACE_CALL("rf_gdi_memblt");
-	g_print("memblt\n");
+	for (i = 0; i < bitmap->number; i++)
+	{
+		b = &bitmap->rectangles[i];
+		stride = b->width * ((b->bitsPerPixel + 7) / 8);
+
+		/* Uncompressed bitmaps are stored bottom up */
+		if (!b->compressed && gdi->dstBpp == 32 && rf_gdi_convertible_bpp(b->bitsPerPixel) &&
+			b->bitmapLength >= (UINT32) (stride * b->height))
+		{
+			rf_gdi_convert_bitmap(gdi, b->bitmapDataStream, stride, b->bitsPerPixel, TRUE, b->destLeft, b->destTop,
+				MIN(b->width, b->destRight - b->destLeft + 1), b->height);
+			continue;
+		}
+
+		/* Compressed ones are left to the GDI, one at a time */
+		single = *bitmap;
+		single.number = 1;
+		single.rectangles = b;
+		rfi->gdi_bitmap_update(context, &single);
+	}
 }
 
-static void rf_gdi_fast_index(rdpContext* context, FAST_INDEX_ORDER* fast_index)
+/* Copy the decoded tiles straight into the primary buffer, clipped by the
+ * message rectangles and the primary surface */
+static void rf_gdi_composite_tiles(rdpGdi* gdi, RFX_MESSAGE* message, gint left, gint top)
 {
-	TRACE_CALL("rf_gdi_fast_index");
-	g_print("fast_index\n");
+	TRACE_CALL("rf_gdi_composite_tiles");
+	RFX_TILE* tile;
+	RFX_RECT* rect;
+	gint i, j, row;
+	gint x1, y1, x2, y2;
+	UINT8* src;
+	UINT8* dst;
+
+	for (i = 0; i < message->numTiles; i++)
+	{
+		tile = message->tiles[i];
+
+		for (j = 0; j < message->numRects; j++)
+		{
+			rect = &message->rects[j];
+
+			x1 = MAX(MAX(tile->x, rect->x), -left);
+			y1 = MAX(MAX(tile->y, rect->y), -top);
+			x2 = MIN(MIN(tile->x + 64, rect->x + rect->width), gdi->width - left);
+			y2 = MIN(MIN(tile->y + 64, rect->y + rect->height), gdi->height - top);
+
+			if (x1 >= x2 || y1 >= y2)
+				continue;
+
+			for (row = y1; row < y2; row++)
+			{
+				src = tile->data + ((row - tile->y) * 64 + (x1 - tile->x)) * 4;
+				dst = gdi->primary_buffer + ((top + row) * gdi->width + left + x1) * 4;
+				memcpy(dst, src, (x2 - x1) * 4);
+			}
+		}
+	}
 }
 
 static void rf_gdi_surface_bits(rdpContext* context, SURFACE_BITS_COMMAND* surface_bits_command)
 {
 	TRACE_CALL("rf_gdi_surface_bits");
-	UINT8* bitmap;
-	RFX_MESSAGE* message;
-	RemminaPluginRdpUiObject* ui;
 	rfContext* rfi = (rfContext*) context;
+	rdpGdi* gdi = context->gdi;
+	RFX_MESSAGE* message;
+	gint i;
 
-	if (surface_bits_command->codecID == RDP_CODEC_ID_REMOTEFX && rfi->rfx_context)
+	if (surface_bits_command->codecID == RDP_CODEC_ID_NONE && gdi->dstBpp == 32 &&
+		rf_gdi_convertible_bpp(surface_bits_command->bpp) &&
+		surface_bits_command->bitmapDataLength >= surface_bits_command->width * surface_bits_command->height *
+			((surface_bits_command->bpp + 7) / 8))
 	{
-		message = rfx_process_message(rfi->rfx_context, surface_bits_command->bitmapData,
-				surface_bits_command->bitmapDataLength);
-
-		ui = g_new0(RemminaPluginRdpUiObject, 1);
-		ui->type = REMMINA_RDP_UI_RFX;
-		ui->rfx.left = surface_bits_command->destLeft;
-		ui->rfx.top = surface_bits_command->destTop;
-		ui->rfx.message = message;
-
-		rf_queue_ui(rfi->protocol_widget, ui);
+		/* Bottom up, like uncompressed bitmap updates */
+		rf_gdi_convert_bitmap(gdi, surface_bits_command->bitmapData,
+			surface_bits_command->width * ((surface_bits_command->bpp + 7) / 8), surface_bits_command->bpp, TRUE,
+			surface_bits_command->destLeft, surface_bits_command->destTop,
+			surface_bits_command->width, surface_bits_command->height);
+		return;
 	}
-	else if (surface_bits_command->codecID == RDP_CODEC_ID_NONE)
+
+	if (surface_bits_command->codecID != RDP_CODEC_ID_REMOTEFX || !rfi->rfx_context || gdi->dstBpp != 32)
 	{
-		bitmap = (UINT8*) calloc(1, surface_bits_command->width * surface_bits_command->height * 4);
+		rfi->gdi_surface_bits(context, surface_bits_command);
+		return;
+	}
 
-		freerdp_image_flip(surface_bits_command->bitmapData, bitmap,
-				surface_bits_command->width, surface_bits_command->height, 32);
+	/* Entropy decoding and inverse transform of the tiles, which FreeRDP
+	 * spreads over its own pool of CPU count threads */
+	message = rfx_process_message(rfi->rfx_context, surface_bits_command->bitmapData,
+			surface_bits_command->bitmapDataLength);
+	if (!message)
+		return;
 
-		ui = g_new0(RemminaPluginRdpUiObject, 1);
-		ui->type = REMMINA_RDP_UI_NOCODEC;
-		ui->nocodec.left = surface_bits_command->destLeft;
-		ui->nocodec.top = surface_bits_command->destTop;
-		ui->nocodec.width = surface_bits_command->width;
-		ui->nocodec.height = surface_bits_command->height;
-		ui->nocodec.bitmap = bitmap;
+	rf_gdi_composite_tiles(gdi, message, surface_bits_command->destLeft, surface_bits_command->destTop);
 
-		rf_queue_ui(rfi->protocol_widget, ui);
+	for (i = 0; i < message->numRects; i++)
+	{
+		gdi_InvalidateRegion(gdi->primary->hdc,
+			surface_bits_command->destLeft + message->rects[i].x,
+			surface_bits_command->destTop + message->rects[i].y,
+			message->rects[i].width, message->rects[i].height);
 	}
-	else
+
+	rfx_message_free(rfi->rfx_context, message);
+}
+
+static void rf_gdi_surface_frame_marker(rdpContext* context, SURFACE_FRAME_MARKER* surface_frame_marker)
+{
+	TRACE_CALL("rf_gdi_surface_frame_marker");
+	rfContext* rfi = (rfContext*) context;
+
+	/* The marker comes before the end of the update carrying the frame, the
+	 * acknowledge is queued by rf_end_paint() */
+	if (surface_frame_marker->frameAction == SURFACECMD_FRAMEACTION_END && rfi->settings->FrameAcknowledge > 0)
 	{
-		printf("Unsupported codecID %d\n", surface_bits_command->codecID);
+		rfi->frame_end = TRUE;
+		rfi->frame_id = surface_frame_marker->frameId;
 	}
 }
 
 void rf_gdi_register_update_callbacks(rdpUpdate* update)
 {
 	TRACE_CALL("rf_gdi_register_update_callbacks");
-	rdpPrimaryUpdate* primary;
-	rdpSecondaryUpdate* secondary;
-
-	primary = update->primary;
-	secondary = update->secondary;
-
-	update->DesktopResize = rf_desktop_resize;
-	update->Palette = rf_gdi_palette;
-	update->SetBounds = rf_gdi_set_bounds;
-
-	primary->DstBlt = rf_gdi_dstblt;
-	primary->PatBlt = rf_gdi_patblt;
-	primary->ScrBlt = rf_gdi_scrblt;
-	primary->OpaqueRect = rf_gdi_opaque_rect;
-	primary->DrawNineGrid = NULL;
-	primary->MultiDstBlt = NULL;
-	primary->MultiPatBlt = NULL;
-	primary->MultiScrBlt = NULL;
-	primary->MultiOpaqueRect = rf_gdi_multi_opaque_rect;
-	primary->MultiDrawNineGrid = NULL;
-	primary->LineTo = rf_gdi_line_to;
-	primary->Polyline = rf_gdi_polyline;
-	primary->MemBlt = rf_gdi_memblt;
-	primary->Mem3Blt = NULL;
-	primary->SaveBitmap = NULL;
-	primary->GlyphIndex = NULL;
-	primary->FastIndex = rf_gdi_fast_index;
-	primary->FastGlyph = NULL;
-	primary->PolygonSC = NULL;
-	primary->PolygonCB = NULL;
-	primary->EllipseSC = NULL;
-	primary->EllipseCB = NULL;
+	rfContext* rfi = (rfContext*) update->context;
 
+	/* gdi_init() has already installed the drawing order handlers and the
+	 * glyph, brush, bitmap, offscreen and palette cache callbacks: registering
+	 * those caches again would make them call themselves. The pointer cache
+	 * is the only one left to the client. */
+	pointer_cache_register_callbacks(update);
+
+	update->SurfaceFrameMarker = rf_gdi_surface_frame_marker;
+
+	/* Uncompressed bitmaps are converted here, the others decoded by the GDI */
+	rfi->gdi_bitmap_update = update->BitmapUpdate;
+	update->BitmapUpdate = rf_gdi_bitmap_update;
+	rfi->gdi_surface_bits = update->SurfaceBits;
 	update->SurfaceBits = rf_gdi_surface_bits;
+
+	/* RemoteFX tiles are decoded by FreeRDP, and composited here */
+	if (rfi->rfx_context)
+		rfx_context_set_pixel_format(rfi->rfx_context, RDP_PIXEL_FORMAT_B8G8R8A8);
+}
+
+/* The graphics pipeline PDUs are handled on the dynamic channel thread. They
+ * draw into the GDI surfaces, and each end of frame outputs them to the
+ * primary buffer through rf_begin_paint() and rf_end_paint(). gfx_mutex
+ * keeps them away from the GTK thread resizing the GDI. rfi->mutex cannot
+ * be used for this, rf_end_paint() takes it to publish the frame. */
+#define RF_GDI_GFX_CALLBACK(name, pdu_type) \
+static int rf_gdi_gfx_##name(RdpgfxClientContext* context, pdu_type* pdu) \
+{ \
+	TRACE_CALL("rf_gdi_gfx_" #name); \
+	rfContext* rfi = (rfContext*) ((rdpGdi*) context->custom)->context; \
+	int status; \
+ \
+	pthread_mutex_lock(&rfi->gfx_mutex); \
+	status = rfi->gdi_gfx.name(context, pdu); \
+	pthread_mutex_unlock(&rfi->gfx_mutex); \
+	return status; \
+}
+
+RF_GDI_GFX_CALLBACK(ResetGraphics, RDPGFX_RESET_GRAPHICS_PDU)
+RF_GDI_GFX_CALLBACK(StartFrame, RDPGFX_START_FRAME_PDU)
+RF_GDI_GFX_CALLBACK(EndFrame, RDPGFX_END_FRAME_PDU)
+RF_GDI_GFX_CALLBACK(SurfaceCommand, RDPGFX_SURFACE_COMMAND)
+RF_GDI_GFX_CALLBACK(CreateSurface, RDPGFX_CREATE_SURFACE_PDU)
+RF_GDI_GFX_CALLBACK(DeleteSurface, RDPGFX_DELETE_SURFACE_PDU)
+RF_GDI_GFX_CALLBACK(SolidFill, RDPGFX_SOLID_FILL_PDU)
+RF_GDI_GFX_CALLBACK(SurfaceToSurface, RDPGFX_SURFACE_TO_SURFACE_PDU)
+RF_GDI_GFX_CALLBACK(SurfaceToCache, RDPGFX_SURFACE_TO_CACHE_PDU)
+RF_GDI_GFX_CALLBACK(CacheToSurface, RDPGFX_CACHE_TO_SURFACE_PDU)
+RF_GDI_GFX_CALLBACK(EvictCacheEntry, RDPGFX_EVICT_CACHE_ENTRY_PDU)
+RF_GDI_GFX_CALLBACK(MapSurfaceToOutput, RDPGFX_MAP_SURFACE_TO_OUTPUT_PDU)
+
+/* Called once gdi_graphics_pipeline_init() has installed the GDI callbacks */
+void rf_gdi_gfx_init(rfContext* rfi, RdpgfxClientContext* gfx)
+{
+	TRACE_CALL("rf_gdi_gfx_init");
+
+	rfi->gdi_gfx = *gfx;
+	gfx->ResetGraphics = rf_gdi_gfx_ResetGraphics;
+	gfx->StartFrame = rf_gdi_gfx_StartFrame;
+	gfx->EndFrame = rf_gdi_gfx_EndFrame;
+	gfx->SurfaceCommand = rf_gdi_gfx_SurfaceCommand;
+	gfx->CreateSurface = rf_gdi_gfx_CreateSurface;
+	gfx->DeleteSurface = rf_gdi_gfx_DeleteSurface;
+	gfx->SolidFill = rf_gdi_gfx_SolidFill;
+	gfx->SurfaceToSurface = rf_gdi_gfx_SurfaceToSurface;
+	gfx->SurfaceToCache = rf_gdi_gfx_SurfaceToCache;
+	gfx->CacheToSurface = rf_gdi_gfx_CacheToSurface;
+	gfx->EvictCacheEntry = rf_gdi_gfx_EvictCacheEntry;
+	gfx->MapSurfaceToOutput = rf_gdi_gfx_MapSurfaceToOutput;
 }
@@ -39,7 +39,10 @@
 
 G_BEGIN_DECLS
 
+void rf_gdi_set_order_support(rdpSettings* settings);
+void rf_gdi_set_cache_support(rdpSettings* settings);
 void rf_gdi_register_update_callbacks(rdpUpdate* update);
+void rf_gdi_gfx_init(rfContext* rfi, RdpgfxClientContext* gfx);
 
 G_END_DECLS
 
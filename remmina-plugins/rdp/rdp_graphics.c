@@ -43,144 +43,152 @@
 #include <freerdp/codec/bitmap.h>
 #include <winpr/memory.h>
 
-//#define RF_BITMAP
-//#define RF_GLYPH
+/* Bitmaps and glyphs are rendered by the FreeRDP software GDI: gdi_init()
+ * registers its own Bitmap and Glyph classes, together with the bitmap,
+ * glyph, brush, offscreen and palette caches. Only the Pointer class,
+ * which needs GDK, is provided here. */
 
-/* Bitmap Class */
+/* Pointer shape cache
+ *
+ * The FreeRDP pointer cache maps the server cache indexes to rdpPointers,
+ * and cached pointers are set again without any conversion. Servers still
+ * send the same few shapes over and over as new pointers, so the GdkCursors
+ * are also kept by shape: a known shape is then reused straight from the
+ * RDP thread, without converting it nor waiting for the GTK thread. */
 
-void rf_Bitmap_New(rdpContext* context, rdpBitmap* bitmap)
+typedef struct rf_pointer_key
 {
-	TRACE_CALL("rf_Bitmap_New");
-#ifdef RF_BITMAP
-	UINT8* data;
-	Pixmap pixmap;
-	XImage* image;
-	rfContext* rfi = (rfContext*) context;
-
-	XSetFunction(rfi->display, rfi->gc, GXcopy);
-	pixmap = XCreatePixmap(rfi->display, rfi->drawable, bitmap->width, bitmap->height, rfi->depth);
-
-	if (bitmap->data != NULL)
-	{
-		data = freerdp_image_convert(bitmap->data, NULL,
-				bitmap->width, bitmap->height, rfi->srcBpp, rfi->bpp, rfi->clrconv);
-
-		if (bitmap->ephemeral != TRUE)
-		{
-			image = XCreateImage(rfi->display, rfi->visual, rfi->depth,
-				ZPixmap, 0, (char*) data, bitmap->width, bitmap->height, rfi->scanline_pad, 0);
-
-			XPutImage(rfi->display, pixmap, rfi->gc, image, 0, 0, 0, 0, bitmap->width, bitmap->height);
-			XFree(image);
-
-			if (data != bitmap->data) && (data != NULL)
-				free(data);
-		}
-		else
-		{
-			if (data != bitmap->data) && (data != NULL)
-				free(bitmap->data);
-
-			bitmap->data = data;
-		}
-	}
-
-	((rfBitmap*) bitmap)->pixmap = pixmap;
-#endif
+	guint hash;
+	UINT32 xPos;
+	UINT32 yPos;
+	UINT32 width;
+	UINT32 height;
+	UINT32 xorBpp;
+	UINT32 lengthAndMask;
+	UINT32 lengthXorMask;
+	BYTE* andMaskData;
+	BYTE* xorMaskData;
+} rfPointerKey;
+
+static void rf_pointer_key_init(rfPointerKey* key, rdpPointer* pointer)
+{
+	TRACE_CALL("rf_pointer_key_init");
+	guint32 hash = 2166136261u;
+	UINT32 i;
+
+	key->xPos = pointer->xPos;
+	key->yPos = pointer->yPos;
+	key->width = pointer->width;
+	key->height = pointer->height;
+	key->xorBpp = pointer->xorBpp;
+	key->lengthAndMask = pointer->lengthAndMask;
+	key->lengthXorMask = pointer->lengthXorMask;
+	key->andMaskData = pointer->andMaskData;
+	key->xorMaskData = pointer->xorMaskData;
+
+	/* FNV-1a */
+	for (i = 0; i < key->lengthXorMask; i++)
+		hash = (hash ^ key->xorMaskData[i]) * 16777619u;
+	for (i = 0; i < key->lengthAndMask; i++)
+		hash = (hash ^ key->andMaskData[i]) * 16777619u;
+	key->hash = hash ^ (key->width << 16) ^ key->height ^ (key->xPos << 8) ^ (key->yPos << 24) ^ key->xorBpp;
 }
 
-void rf_Bitmap_Free(rdpContext* context, rdpBitmap* bitmap)
+static guint rf_pointer_key_hash(gconstpointer v)
 {
-	TRACE_CALL("rf_Bitmap_Free");
-#ifdef RF_BITMAP
-	rfContext* rfi = (rfContext*) context;
-
-	printf("rf_Bitmap_Free\n");
-
-	if (((rfBitmap*) bitmap)->pixmap != 0)
-		XFreePixmap(rfi->display, ((rfBitmap*) bitmap)->pixmap);
-#endif
+	TRACE_CALL("rf_pointer_key_hash");
+	return ((const rfPointerKey*) v)->hash;
 }
 
-void rf_Bitmap_Paint(rdpContext* context, rdpBitmap* bitmap)
+static gboolean rf_pointer_key_equal(gconstpointer v1, gconstpointer v2)
 {
-	TRACE_CALL("rf_Bitmap_Paint");
-#ifdef RF_BITMAP
-	XImage* image;
-	int width, height;
-	rfContext* rfi = (rfContext*) context;
+	TRACE_CALL("rf_pointer_key_equal");
+	const rfPointerKey* k1 = v1;
+	const rfPointerKey* k2 = v2;
+
+	return k1->hash == k2->hash && k1->xPos == k2->xPos && k1->yPos == k2->yPos &&
+		k1->width == k2->width && k1->height == k2->height && k1->xorBpp == k2->xorBpp &&
+		k1->lengthAndMask == k2->lengthAndMask && k1->lengthXorMask == k2->lengthXorMask &&
+		memcmp(k1->xorMaskData, k2->xorMaskData, k1->lengthXorMask) == 0 &&
+		memcmp(k1->andMaskData, k2->andMaskData, k1->lengthAndMask) == 0;
+}
 
-	printf("rf_Bitmap_Paint\n");
+static void rf_pointer_key_free(gpointer data)
+{
+	TRACE_CALL("rf_pointer_key_free");
+	rfPointerKey* key = data;
 
-	width = bitmap->right - bitmap->left + 1;
-	height = bitmap->bottom - bitmap->top + 1;
+	g_free(key->andMaskData);
+	g_free(key->xorMaskData);
+	g_free(key);
+}
 
-	XSetFunction(rfi->display, rfi->gc, GXcopy);
+void rf_pointer_cache_init(rfContext* rfi)
+{
+	TRACE_CALL("rf_pointer_cache_init");
+	pthread_mutex_init(&rfi->pointer_cache_mutex, NULL);
+	rfi->pointer_cache = g_hash_table_new_full(rf_pointer_key_hash, rf_pointer_key_equal,
+		rf_pointer_key_free, g_object_unref);
+}
 
-	image = XCreateImage(rfi->display, rfi->visual, rfi->depth,
-			ZPixmap, 0, (char*) bitmap->data, bitmap->width, bitmap->height, rfi->scanline_pad, 0);
+void rf_pointer_cache_free(rfContext* rfi)
+{
+	TRACE_CALL("rf_pointer_cache_free");
+	if (!rfi->pointer_cache)
+		return;
+	g_hash_table_destroy(rfi->pointer_cache);
+	rfi->pointer_cache = NULL;
+	pthread_mutex_destroy(&rfi->pointer_cache_mutex);
+}
 
-	XPutImage(rfi->display, rfi->primary, rfi->gc,
-			image, 0, 0, bitmap->left, bitmap->top, width, height);
+/* Return a new reference to the cursor already made for this shape, if any */
+static GdkCursor* rf_pointer_cache_lookup(rfContext* rfi, rdpPointer* pointer)
+{
+	TRACE_CALL("rf_pointer_cache_lookup");
+	rfPointerKey key;
+	GdkCursor* cursor;
 
-	XFree(image);
+	if (!rfi->pointer_cache)
+		return NULL;
 
-	//XCopyArea(rfi->display, rfi->primary, rfi->drawable, rfi->gc,
-	//			bitmap->left, bitmap->top, width, height, bitmap->left, bitmap->top);
+	rf_pointer_key_init(&key, pointer);
+	pthread_mutex_lock(&rfi->pointer_cache_mutex);
+	cursor = g_hash_table_lookup(rfi->pointer_cache, &key);
+	if (cursor)
+		g_object_ref(cursor);
+	pthread_mutex_unlock(&rfi->pointer_cache_mutex);
 
-	//gdi_InvalidateRegion(rfi->hdc, bitmap->left, bitmap->top, width, height);
-#endif
+	return cursor;
 }
 
-void rf_Bitmap_Decompress(rdpContext* context, rdpBitmap* bitmap,
-	BYTE* data, int width, int height, int bpp, int length, BOOL compressed, int codec_id)
+/* Called by the GTK thread, which owns the cursors, once one is created */
+void rf_pointer_cache_insert(rfContext* rfi, rdpPointer* pointer, GdkCursor* cursor)
 {
-	TRACE_CALL("rf_Bitmap_Decompress");
-#ifdef RF_BITMAP
-	UINT16 size;
+	TRACE_CALL("rf_pointer_cache_insert");
+	rfPointerKey* key;
+	GHashTableIter iter;
+	guint size;
 
-	printf("rf_Bitmap_Decompress\n");
+	if (!rfi->pointer_cache || !cursor)
+		return;
 
-	size = width * height * (bpp + 7) / 8;
+	key = g_new(rfPointerKey, 1);
+	rf_pointer_key_init(key, pointer);
+	key->andMaskData = g_memdup(pointer->andMaskData, pointer->lengthAndMask);
+	key->xorMaskData = g_memdup(pointer->xorMaskData, pointer->lengthXorMask);
 
-	if (bitmap->data == NULL)
-		bitmap->data = (UINT8*) xmalloc(size);
-	else
-		bitmap->data = (UINT8*) xrealloc(bitmap->data, size);
+	/* Keep no more shapes than the server can have in its cache */
+	size = rfi->settings->PointerCacheSize > 0 ? rfi->settings->PointerCacheSize : 32;
 
-	if (compressed)
+	pthread_mutex_lock(&rfi->pointer_cache_mutex);
+	if (g_hash_table_size(rfi->pointer_cache) >= size)
 	{
-		BOOL status;
-
-		status = bitmap_decompress(data, bitmap->data, width, height, length, bpp, bpp);
-
-		if (status != TRUE)
-		{
-			printf("Bitmap Decompression Failed\n");
-		}
+		g_hash_table_iter_init(&iter, rfi->pointer_cache);
+		if (g_hash_table_iter_next(&iter, NULL, NULL))
+			g_hash_table_iter_remove(&iter);
 	}
-	else
-	{
-		freerdp_image_flip(data, bitmap->data, width, height, bpp);
-	}
-
-	bitmap->compressed = FALSE;
-	bitmap->length = size;
-	bitmap->bpp = bpp;
-#endif
-}
-
-void rf_Bitmap_SetSurface(rdpContext* context, rdpBitmap* bitmap, BOOL primary)
-{
-	TRACE_CALL("rf_Bitmap_SetSurface");
-#ifdef RF_BITMAP
-	rfContext* rfi = (rfContext*) context;
-
-	if (primary)
-		rfi->drawing = rfi->primary;
-	else
-		rfi->drawing = ((rfBitmap*) bitmap)->pixmap;
-#endif
+	g_hash_table_replace(rfi->pointer_cache, key, g_object_ref(cursor));
+	pthread_mutex_unlock(&rfi->pointer_cache_mutex);
 }
 
 /* Pointer Class */
@@ -190,16 +198,24 @@ void rf_Pointer_New(rdpContext* context, rdpPointer* pointer)
 	TRACE_CALL("rf_Pointer_New");
 	RemminaPluginRdpUiObject* ui;
 	rfContext* rfi = (rfContext*) context;
+	GdkCursor* cursor;
 
 	if ((pointer->andMaskData != 0) && (pointer->xorMaskData != 0))
 	{
-		ui = g_new0(RemminaPluginRdpUiObject, 1);
+		cursor = rf_pointer_cache_lookup(rfi, pointer);
+		if (cursor)
+		{
+			((rfPointer*) pointer)->cursor = cursor;
+			return;
+		}
+
+		/* The only pointer operation which needs an answer from the GTK thread */
+		ui = rf_object_new(rfi->protocol_widget);
 		ui->type = REMMINA_RDP_UI_CURSOR;
-		ui->sync = TRUE;	// Also wait for completion
 		ui->cursor.pointer = (rfPointer*) pointer;
 		ui->cursor.type = REMMINA_RDP_POINTER_NEW;
 
-		rf_queue_ui(rfi->protocol_widget, ui);
+		((rfPointer*) pointer)->cursor = rf_queue_ui_sync(rfi->protocol_widget, ui);
 	}
 }
 
@@ -215,11 +231,12 @@ void rf_Pointer_Free(rdpContext* context, rdpPointer* pointer)
 	if (G_IS_OBJECT(((rfPointer*) pointer)->cursor))
 #endif
 	{
-		ui = g_new0(RemminaPluginRdpUiObject, 1);
+		/* Hand our reference over to the GTK thread, which releases it */
+		ui = rf_object_new(rfi->protocol_widget);
 		ui->type = REMMINA_RDP_UI_CURSOR;
-		ui->sync = TRUE;	// Also wait for completion
-		ui->cursor.pointer = (rfPointer*) pointer;
+		ui->cursor.cursor = ((rfPointer*) pointer)->cursor;
 		ui->cursor.type = REMMINA_RDP_POINTER_FREE;
+		((rfPointer*) pointer)->cursor = NULL;
 
 		rf_queue_ui(rfi->protocol_widget, ui);
 	}
@@ -231,10 +248,13 @@ void rf_Pointer_Set(rdpContext* context, rdpPointer* pointer)
 	RemminaPluginRdpUiObject* ui;
 	rfContext* rfi = (rfContext*) context;
 
-	ui = g_new0(RemminaPluginRdpUiObject, 1);
+	ui = rf_object_new(rfi->protocol_widget);
 	ui->type = REMMINA_RDP_UI_CURSOR;
-	ui->sync = TRUE;	// Also wait for completion
 	ui->cursor.pointer = (rfPointer*) pointer;
+	/* Keep the cursor alive until the GTK thread has set it, even if the
+	 * pointer is freed in the meantime */
+	if (((rfPointer*) pointer)->cursor)
+		ui->cursor.cursor = g_object_ref(((rfPointer*) pointer)->cursor);
 	ui->cursor.type = REMMINA_RDP_POINTER_SET;
 
 	rf_queue_ui(rfi->protocol_widget, ui);
@@ -246,9 +266,8 @@ void rf_Pointer_SetNull(rdpContext* context)
 	RemminaPluginRdpUiObject* ui;
 	rfContext* rfi = (rfContext*) context;
 
-	ui = g_new0(RemminaPluginRdpUiObject, 1);
+	ui = rf_object_new(rfi->protocol_widget);
 	ui->type = REMMINA_RDP_UI_CURSOR;
-	ui->sync = TRUE;	// Also wait for completion
 	ui->cursor.type = REMMINA_RDP_POINTER_NULL;
 
 	rf_queue_ui(rfi->protocol_widget, ui);
@@ -260,131 +279,19 @@ void rf_Pointer_SetDefault(rdpContext* context)
 	RemminaPluginRdpUiObject* ui;
 	rfContext* rfi = (rfContext*) context;
 
-	ui = g_new0(RemminaPluginRdpUiObject, 1);
+	ui = rf_object_new(rfi->protocol_widget);
 	ui->type = REMMINA_RDP_UI_CURSOR;
-	ui->sync = TRUE;	// Also wait for completion
 	ui->cursor.type = REMMINA_RDP_POINTER_DEFAULT;
 
 	rf_queue_ui(rfi->protocol_widget, ui);
 }
 
-/* Glyph Class */
-
-void rf_Glyph_New(rdpContext* context, rdpGlyph* glyph)
-{
-	TRACE_CALL("rf_Glyph_New");
-#ifdef RF_GLYPH
-	int scanline;
-	XImage* image;
-	rfContext* rfi;
-	rfGlyph* rf_glyph;
-
-	rf_glyph = (rfGlyph*) glyph;
-	rfi = (rfContext*) context;
-
-	scanline = (glyph->cx + 7) / 8;
-
-	rf_glyph->pixmap = XCreatePixmap(rfi->display, rfi->drawing, glyph->cx, glyph->cy, 1);
-
-	image = XCreateImage(rfi->display, rfi->visual, 1,
-			ZPixmap, 0, (char*) glyph->aj, glyph->cx, glyph->cy, 8, scanline);
-
-	image->byte_order = MSBFirst;
-	image->bitmap_bit_order = MSBFirst;
-
-	XInitImage(image);
-	XPutImage(rfi->display, rf_glyph->pixmap, rfi->gc_mono, image, 0, 0, 0, 0, glyph->cx, glyph->cy);
-	XFree(image);
-#endif
-}
-
-void rf_Glyph_Free(rdpContext* context, rdpGlyph* glyph)
-{
-	TRACE_CALL("rf_Glyph_Free");
-#ifdef RF_GLYPH
-	rfContext* rfi = (rfContext*) context;
-
-	if (((rfGlyph*) glyph)->pixmap != 0)
-		XFreePixmap(rfi->display, ((rfGlyph*) glyph)->pixmap);
-#endif
-}
-
-void rf_Glyph_Draw(rdpContext* context, rdpGlyph* glyph, int x, int y)
-{
-	TRACE_CALL("rf_Glyph_Draw");
-#ifdef RF_GLYPH
-	rfGlyph* rf_glyph;
-	rfContext* rfi = (rfContext*) context;
-
-	rf_glyph = (rfGlyph*) glyph;
-
-	XSetStipple(rfi->display, rfi->gc, rf_glyph->pixmap);
-	XSetTSOrigin(rfi->display, rfi->gc, x, y);
-	XFillRectangle(rfi->display, rfi->drawing, rfi->gc, x, y, glyph->cx, glyph->cy);
-	XSetStipple(rfi->display, rfi->gc, rfi->bitmap_mono);
-#endif
-}
-
-void rf_Glyph_BeginDraw(rdpContext* context, int x, int y, int width, int height, UINT32 bgcolor, UINT32 fgcolor, BOOL fOpRedundant)
-{
-	TRACE_CALL("rf_Glyph_BeginDraw");
-#ifdef RF_GLYPH
-	rfContext* rfi = (rfContext*) context;
-
-	bgcolor = (rfi->clrconv->invert)?
-		freerdp_color_convert_var_bgr(bgcolor, rfi->srcBpp, 32, rfi->clrconv):
-		freerdp_color_convert_var_rgb(bgcolor, rfi->srcBpp, 32, rfi->clrconv);
-
-	fgcolor = (rfi->clrconv->invert)?
-		freerdp_color_convert_var_bgr(fgcolor, rfi->srcBpp, 32, rfi->clrconv):
-		freerdp_color_convert_var_rgb(fgcolor, rfi->srcBpp, 32, rfi->clrconv);
-
-	XSetFunction(rfi->display, rfi->gc, GXcopy);
-	XSetFillStyle(rfi->display, rfi->gc, FillSolid);
-	XSetForeground(rfi->display, rfi->gc, fgcolor);
-	XFillRectangle(rfi->display, rfi->drawing, rfi->gc, x, y, width, height);
-
-	XSetForeground(rfi->display, rfi->gc, bgcolor);
-	XSetBackground(rfi->display, rfi->gc, fgcolor);
-	XSetFillStyle(rfi->display, rfi->gc, FillStippled);
-#endif
-}
-
-void rf_Glyph_EndDraw(rdpContext* context, int x, int y, int width, int height, UINT32 bgcolor, UINT32 fgcolor)
-{
-	TRACE_CALL("rf_Glyph_EndDraw");
-#ifdef RF_GLYPH
-	rfContext* rfi = (rfContext*) context;
-
-	if (rfi->drawing == rfi->primary)
-	{
-		//XCopyArea(rfi->display, rfi->primary, rfi->drawable, rfi->gc, x, y, width, height, x, y);
-		//gdi_InvalidateRegion(rfi->hdc, x, y, width, height);
-	}
-#endif
-}
-
 /* Graphics Module */
 
 void rf_register_graphics(rdpGraphics* graphics)
 {
 	TRACE_CALL("rf_register_graphics");
-	rdpBitmap* bitmap;
 	rdpPointer* pointer;
-	rdpGlyph* glyph;
-
-	bitmap = (rdpBitmap*) malloc(sizeof(rdpBitmap));
-	ZeroMemory(bitmap, sizeof(rdpBitmap));
-	bitmap->size = sizeof(rfBitmap);
-
-	bitmap->New = rf_Bitmap_New;
-	bitmap->Free = rf_Bitmap_Free;
-	bitmap->Paint = rf_Bitmap_Paint;
-	bitmap->Decompress = rf_Bitmap_Decompress;
-	bitmap->SetSurface = rf_Bitmap_SetSurface;
-
-	graphics_register_bitmap(graphics, bitmap);
-	free(bitmap);
 
 	pointer = (rdpPointer*) malloc(sizeof(rdpPointer));
 	ZeroMemory(pointer, sizeof(rdpPointer));
@@ -400,19 +307,4 @@ void rf_register_graphics(rdpGraphics* graphics)
 	graphics_register_pointer(graphics, pointer);
 
 	free(pointer);
-
-	glyph = (rdpGlyph*) malloc(sizeof(rdpGlyph));
-	ZeroMemory(glyph, sizeof(rdpGlyph));
-
-	glyph->size = sizeof(rfGlyph);
-
-	glyph->New = rf_Glyph_New;
-	glyph->Free = rf_Glyph_Free;
-	glyph->Draw = rf_Glyph_Draw;
-	glyph->BeginDraw = rf_Glyph_BeginDraw;
-	glyph->EndDraw = rf_Glyph_EndDraw;
-
-	graphics_register_glyph(graphics, glyph);
-
-	free(glyph);
 }
@@ -38,6 +38,9 @@
 #include "rdp_plugin.h"
 
 void rf_register_graphics(rdpGraphics* graphics);
+void rf_pointer_cache_init(rfContext* rfi);
+void rf_pointer_cache_free(rfContext* rfi);
+void rf_pointer_cache_insert(rfContext* rfi, rdpPointer* pointer, GdkCursor* cursor);
 
 #endif
 
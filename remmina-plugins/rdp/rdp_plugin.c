@@ -41,9 +41,16 @@
 #include "rdp_settings.h"
 #include "rdp_cliprdr.h"
 #include "rdp_channels.h"
+#include "rdp_record.h"
 
 #include <errno.h>
 #include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 #include <cairo/cairo-xlib.h>
 #include <freerdp/freerdp.h>
 #include <freerdp/constants.h>
@@ -58,6 +65,11 @@
 #define REMMINA_RDP_FEATURE_UNFOCUS              3
 #define REMMINA_RDP_FEATURE_TOOL_SENDCTRLALTDEL  4
 
+/* Reconnection attempts after a network failure, and the longest wait between
+ * two of them in seconds */
+#define REMMINA_RDP_RECONNECT_MAX_RETRIES	20
+#define REMMINA_RDP_RECONNECT_MAX_DELAY		16
+
 RemminaPluginService* remmina_plugin_service = NULL;
 static char remmina_rdp_plugin_default_drive_name[]="RemminaDisk";
 
@@ -73,133 +85,124 @@ void rf_get_fds(RemminaProtocolWidget* gp, void** rfds, int* rcount)
 	}
 }
 
-BOOL rf_check_fds(RemminaProtocolWidget* gp)
+static void rf_input_cork(rfContext* rfi, int cork)
 {
-	TRACE_CALL("rf_check_fds");
-	UINT16 flags;
-	gchar buf[100];
-	rdpInput* input;
-	rfContext* rfi = GET_PLUGIN_DATA(gp);
-	RemminaPluginRdpEvent* event;
-
-	if (rfi->event_queue == NULL)
-		return True;
+	TRACE_CALL("rf_input_cork");
+#ifdef TCP_CORK
+	/* While corked, the kernel packs the fast-path input PDUs of a batch
+	 * into as few TCP segments as possible */
+	if (rfi->input_sockfd >= 0)
+		setsockopt(rfi->input_sockfd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+#endif
+}
 
-	input = rfi->instance->input;
+static void rf_send_event(rfContext* rfi, RemminaPluginRdpEvent* event)
+{
+	TRACE_CALL("rf_send_event");
+	rdpInput* input = rfi->instance->input;
+	DISPLAY_CONTROL_MONITOR_LAYOUT layout;
+	UINT16 flags;
 
-	while ((event =(RemminaPluginRdpEvent*) g_async_queue_try_pop(rfi->event_queue)) != NULL)
+	switch (event->type)
 	{
-		switch (event->type)
-		{
-			case REMMINA_RDP_EVENT_TYPE_SCANCODE:
-				flags = event->key_event.extended ? KBD_FLAGS_EXTENDED : 0;
-				flags |= event->key_event.up ? KBD_FLAGS_RELEASE : KBD_FLAGS_DOWN;
-				input->KeyboardEvent(input, flags, event->key_event.key_code);
-				break;
-
-			case REMMINA_RDP_EVENT_TYPE_MOUSE:
-				input->MouseEvent(input, event->mouse_event.flags,
-						event->mouse_event.x, event->mouse_event.y);
-				break;
-		}
+		case REMMINA_RDP_EVENT_TYPE_SCANCODE:
+			flags = event->key_event.extended ? KBD_FLAGS_EXTENDED : 0;
+			flags |= event->key_event.up ? KBD_FLAGS_RELEASE : KBD_FLAGS_DOWN;
+			input->KeyboardEvent(input, flags, event->key_event.key_code);
+			break;
 
-		g_free(event);
-	}
+		case REMMINA_RDP_EVENT_TYPE_MOUSE:
+			input->MouseEvent(input, event->mouse_event.flags,
+					event->mouse_event.x, event->mouse_event.y);
+			break;
 
-	if (read(rfi->event_pipe[0], buf, sizeof (buf)))
-	{
+		case REMMINA_RDP_EVENT_TYPE_DISPLAY_LAYOUT:
+			if (!rfi->dispcontext)
+				break;
+			ZeroMemory(&layout, sizeof(layout));
+			layout.Flags = DISPLAY_CONTROL_MONITOR_PRIMARY;
+			layout.Width = event->display_event.width;
+			layout.Height = event->display_event.height;
+			layout.DesktopScaleFactor = 100;
+			layout.DeviceScaleFactor = 100;
+			rfi->dispcontext->SendMonitorLayout(rfi->dispcontext, 1, &layout);
+			break;
 	}
-
-	return True;
 }
 
-void rf_queue_ui(RemminaProtocolWidget* gp, RemminaPluginRdpUiObject* ui)
+static gboolean rf_event_is_motion(RemminaPluginRdpEvent* event)
 {
-	TRACE_CALL("rf_queue_ui");
-	rfContext* rfi = GET_PLUGIN_DATA(gp);
-	gboolean ui_sync_save;
-
-	ui_sync_save = ui->sync;
-
-	if (ui_sync_save) {
-		pthread_mutex_init(&ui->sync_wait_mutex,NULL);
-		pthread_mutex_lock(&ui->sync_wait_mutex);
-	}
-
-	LOCK_BUFFER(TRUE)
-	g_async_queue_push(rfi->ui_queue, ui);
-	if (!rfi->ui_handler)
-		rfi->ui_handler = IDLE_ADD((GSourceFunc) remmina_rdp_event_queue_ui, gp);
-	UNLOCK_BUFFER(TRUE)
-
-	if (ui_sync_save) {
-		/* Wait for main thread function completion before returning */
-		pthread_mutex_lock(&ui->sync_wait_mutex);
-		pthread_mutex_unlock(&ui->sync_wait_mutex);
-		rf_object_free(gp, ui);
-	}
+	TRACE_CALL("rf_event_is_motion");
+	return event->type == REMMINA_RDP_EVENT_TYPE_MOUSE && event->mouse_event.flags == PTR_FLAGS_MOVE;
 }
 
-void rf_object_free(RemminaProtocolWidget* gp, RemminaPluginRdpUiObject* obj)
+BOOL rf_check_fds(RemminaProtocolWidget* gp)
 {
-	TRACE_CALL("rf_object_free");
+	TRACE_CALL("rf_check_fds");
+	gchar buf[100];
 	rfContext* rfi = GET_PLUGIN_DATA(gp);
+	RemminaPluginRdpEvent* event;
+	UINT32* frame_id;
+	guint head, tail;
+	gboolean corked;
 
-	switch (obj->type)
-	{
-		case REMMINA_RDP_UI_RFX:
-			rfx_message_free(rfi->rfx_context, obj->rfx.message);
-			break;
+	if (rfi->event_pipe[0] == -1)
+		return True;
 
-		case REMMINA_RDP_UI_NOCODEC:
-			free(obj->nocodec.bitmap);
-			break;
+	/* Consume the wake up before draining the ring: an event pushed after
+	 * the drain will write a new one */
+	while (read(rfi->event_pipe[0], buf, sizeof (buf)) > 0)
+	{
+	}
 
-		default:
-			break;
+	while ((frame_id = (UINT32*) g_async_queue_try_pop(rfi->frame_acks)))
+	{
+		IFCALL(rfi->instance->update->SurfaceFrameAcknowledge, rfi->instance->context, *frame_id);
+		g_free(frame_id);
 	}
 
-	g_free(obj);
-}
+	tail = rfi->event_ring_tail;
+	head = g_atomic_int_get(&rfi->event_ring_head);
 
-void rf_begin_paint(rdpContext* context)
-{
-	TRACE_CALL("rf_begin_paint");
-	rdpGdi* gdi = context->gdi;
-	gdi->primary->hdc->hwnd->invalid->null = 1;
-	gdi->primary->hdc->hwnd->ninvalid = 0;
-}
+	corked = (head - tail > 1);
+	if (corked)
+		rf_input_cork(rfi, 1);
 
-void rf_end_paint(rdpContext* context)
-{
-	TRACE_CALL("rf_end_paint");
-	INT32 x, y;
-	UINT32 w, h;
-	rdpGdi* gdi;
-	rfContext* rfi;
-	RemminaProtocolWidget* gp;
-	RemminaPluginRdpUiObject* ui;
+	while (tail != head)
+	{
+		event = &rfi->event_ring[tail & (REMMINA_RDP_EVENT_RING_SIZE - 1)];
 
-	gdi = context->gdi;
-	rfi = (rfContext*) context;
-	gp = rfi->protocol_widget;
+		/* Consecutive motions collapse into the last one */
+		if (!(rf_event_is_motion(event) && tail + 1 != head &&
+			rf_event_is_motion(&rfi->event_ring[(tail + 1) & (REMMINA_RDP_EVENT_RING_SIZE - 1)])))
+		{
+			rf_send_event(rfi, event);
+		}
 
-	if (gdi->primary->hdc->hwnd->invalid->null)
-		return;
+		tail++;
+		g_atomic_int_set(&rfi->event_ring_tail, tail);
+
+		if (tail == head)
+			head = g_atomic_int_get(&rfi->event_ring_head);
+	}
 
-	x = gdi->primary->hdc->hwnd->invalid->x;
-	y = gdi->primary->hdc->hwnd->invalid->y;
-	w = gdi->primary->hdc->hwnd->invalid->w;
-	h = gdi->primary->hdc->hwnd->invalid->h;
+	/* Then the events which did not fit in the ring, in order */
+	while ((event = (RemminaPluginRdpEvent*) g_async_queue_try_pop(rfi->event_overflow)))
+	{
+		if (!corked)
+		{
+			corked = TRUE;
+			rf_input_cork(rfi, 1);
+		}
+		rf_send_event(rfi, event);
+		g_atomic_int_add(&rfi->event_overflow_len, -1);
+		g_async_queue_push(rfi->event_overflow_free, event);
+	}
 
-	ui = g_new0(RemminaPluginRdpUiObject, 1);
-	ui->type = REMMINA_RDP_UI_UPDATE_REGION;
-	ui->region.x = x;
-	ui->region.y = y;
-	ui->region.width = w;
-	ui->region.height = h;
+	if (corked)
+		rf_input_cork(rfi, 0);
 
-	rf_queue_ui(rfi->protocol_widget, ui);
+	return True;
 }
 
 static void rf_desktop_resize(rdpContext* context)
@@ -212,22 +215,31 @@ static void rf_desktop_resize(rdpContext* context)
 	rfi = (rfContext*) context;
 	gp = rfi->protocol_widget;
 
-	LOCK_BUFFER(TRUE)
-
-	remmina_plugin_service->protocol_plugin_set_width(gp, rfi->settings->DesktopWidth);
-	remmina_plugin_service->protocol_plugin_set_height(gp, rfi->settings->DesktopHeight);
+	/* The server has confirmed a new desktop size. The GTK thread must let
+	 * go of the surface on the old primary buffer before the GDI frees it,
+	 * so the whole resize is done there while we wait. */
+	ui = rf_object_new(gp);
+	ui->type = REMMINA_RDP_UI_EVENT;
+	ui->event.type = REMMINA_RDP_UI_EVENT_DESKTOP_RESIZE;
+	rf_queue_ui_sync(gp, ui);
 
-	UNLOCK_BUFFER(TRUE)
+	remmina_plugin_service->protocol_plugin_emit_signal(gp, "desktop-resize");
+}
 
-	/* Call to remmina_rdp_event_update_scale(gp) on the main UI thread */
+/* The server sends the bandwidth and RTT it measured once the session is up,
+ * they are kept for the next connection, see remmina_rdp_network_quality() */
+static BOOL remmina_rdp_network_characteristics_result(rdpContext* context, UINT16 sequenceNumber)
+{
+	TRACE_CALL("remmina_rdp_network_characteristics_result");
+	rfContext* rfi = (rfContext*) context;
+	rdpAutoDetect* autodetect = context->autodetect;
 
-	ui = g_new0(RemminaPluginRdpUiObject, 1);
-	ui->sync = TRUE;	// Wait for completion too
-	ui->type = REMMINA_RDP_UI_EVENT;
-	ui->event.type = REMMINA_RDP_UI_EVENT_UPDATE_SCALE;
-	rf_queue_ui(gp, ui);
+	rfi->net_bandwidth = autodetect->netCharBandwidth;
+	rfi->net_rtt = autodetect->netCharAverageRTT;
+	remmina_plugin_service->log_printf("[RDP] network auto-detect: %u kbit/s, %u ms RTT\n",
+		rfi->net_bandwidth, rfi->net_rtt);
 
-	remmina_plugin_service->protocol_plugin_emit_signal(gp, "desktop-resize");
+	return TRUE;
 }
 
 static BOOL remmina_rdp_pre_connect(freerdp* instance)
@@ -243,43 +255,17 @@ static BOOL remmina_rdp_pre_connect(freerdp* instance)
 	gp = rfi->protocol_widget;
 	channels = instance->context->channels;
 
-	settings->BitmapCacheEnabled = True;
-	settings->OffscreenSupportLevel = True;
-
-	settings->OrderSupport[NEG_DSTBLT_INDEX] = True;
-	settings->OrderSupport[NEG_PATBLT_INDEX] = True;
-	settings->OrderSupport[NEG_SCRBLT_INDEX] = True;
-	settings->OrderSupport[NEG_OPAQUE_RECT_INDEX] = True;
-	settings->OrderSupport[NEG_DRAWNINEGRID_INDEX] = False;
-	settings->OrderSupport[NEG_MULTIDSTBLT_INDEX] = False;
-	settings->OrderSupport[NEG_MULTIPATBLT_INDEX] = False;
-	settings->OrderSupport[NEG_MULTISCRBLT_INDEX] = False;
-	settings->OrderSupport[NEG_MULTIOPAQUERECT_INDEX] = True;
-	settings->OrderSupport[NEG_MULTI_DRAWNINEGRID_INDEX] = False;
-	settings->OrderSupport[NEG_LINETO_INDEX] = True;
-	settings->OrderSupport[NEG_POLYLINE_INDEX] = True;
-	settings->OrderSupport[NEG_MEMBLT_INDEX] = settings->BitmapCacheEnabled;
-	settings->OrderSupport[NEG_MEM3BLT_INDEX] = True;
-	settings->OrderSupport[NEG_MEMBLT_V2_INDEX] = settings->BitmapCacheEnabled;
-	settings->OrderSupport[NEG_MEM3BLT_V2_INDEX] = False;
-	settings->OrderSupport[NEG_SAVEBITMAP_INDEX] = False;
-	settings->OrderSupport[NEG_GLYPH_INDEX_INDEX] = True;
-	settings->OrderSupport[NEG_FAST_INDEX_INDEX] = True;
-	settings->OrderSupport[NEG_FAST_GLYPH_INDEX] = True;
-	settings->OrderSupport[NEG_POLYGON_SC_INDEX] = False;
-	settings->OrderSupport[NEG_POLYGON_CB_INDEX] = False;
-	settings->OrderSupport[NEG_ELLIPSE_SC_INDEX] = False;
-	settings->OrderSupport[NEG_ELLIPSE_CB_INDEX] = False;
-
 	if (settings->RemoteFxCodec == True)
 	{
-		settings->FrameAcknowledge = False;
 		settings->LargePointerFlag = True;
 		settings->PerformanceFlags = PERF_FLAG_NONE;
 
 		rfi->rfx_context = rfx_context_new(FALSE);
 	}
 
+	if (rfi->network_autodetect && instance->context->autodetect)
+		instance->context->autodetect->NetworkCharacteristicsResult = remmina_rdp_network_characteristics_result;
+
 	PubSub_SubscribeChannelConnected(instance->context->pubSub,
 		(pChannelConnectedEventHandler)remmina_rdp_OnChannelConnectedEventHandler);
 	PubSub_SubscribeChannelDisconnected(instance->context->pubSub,
@@ -296,6 +282,30 @@ static BOOL remmina_rdp_pre_connect(freerdp* instance)
 }
 
 
+static int remmina_rdp_get_input_socket(freerdp* instance)
+{
+	TRACE_CALL("remmina_rdp_get_input_socket");
+	void* rfds[32];
+	void* wfds[32];
+	int rcount = 0, wcount = 0;
+	int i, fd, type;
+	socklen_t len;
+
+	/* The transport socket is the first stream socket FreeRDP waits on */
+	if (!freerdp_get_fds(instance, rfds, &rcount, wfds, &wcount))
+		return -1;
+
+	for (i = 0; i < rcount; i++)
+	{
+		fd = (int)(long) rfds[i];
+		len = sizeof(type);
+		if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 && type == SOCK_STREAM)
+			return fd;
+	}
+
+	return -1;
+}
+
 static BOOL remmina_rdp_post_connect(freerdp* instance)
 {
 	TRACE_CALL("remmina_rdp_post_connect");
@@ -315,61 +325,33 @@ static BOOL remmina_rdp_post_connect(freerdp* instance)
 	if (rfi->settings->RemoteFxCodec == FALSE)
 		rfi->sw_gdi = TRUE;
 
-	rf_register_graphics(instance->context->graphics);
-
-	flags = CLRCONV_ALPHA;
-
-	if (rfi->bpp == 32)
-	{
-		flags |= CLRBUF_32BPP;
-		rfi->cairo_format = CAIRO_FORMAT_ARGB32;
-	}
-	else
-	{
-		flags |= CLRBUF_16BPP;
-		rfi->cairo_format = CAIRO_FORMAT_RGB16_565;
-	}
+	/* Whatever the server colour depth, the primary buffer is 32 bpp, which
+	 * cairo paints without any conversion */
+	flags = CLRCONV_ALPHA | CLRBUF_32BPP;
+	rfi->cairo_format = CAIRO_FORMAT_ARGB32;
 
 	gdi_init(instance, flags, NULL);
 	gdi = instance->context->gdi;
 	rfi->primary_buffer = gdi->primary_buffer;
 
-	rfi->hdc = gdi_GetDC();
-	rfi->hdc->bitsPerPixel = rfi->bpp;
-	rfi->hdc->bytesPerPixel = rfi->bpp / 8;
-
-	rfi->hdc->hwnd = (HGDI_WND) malloc(sizeof(GDI_WND));
-	rfi->hdc->hwnd->invalid = gdi_CreateRectRgn(0, 0, 0, 0);
-	rfi->hdc->hwnd->invalid->null = 1;
-
-	rfi->hdc->hwnd->count = 32;
-	rfi->hdc->hwnd->cinvalid = (HGDI_RGN) malloc(sizeof(GDI_RGN) * rfi->hdc->hwnd->count);
-	rfi->hdc->hwnd->ninvalid = 0;
-
-	pointer_cache_register_callbacks(instance->update);
-
-/*
-	if (rfi->sw_gdi != TRUE)
-	{
-		glyph_cache_register_callbacks(instance->update);
-		brush_cache_register_callbacks(instance->update);
-		bitmap_cache_register_callbacks(instance->update);
-		offscreen_cache_register_callbacks(instance->update);
-		palette_cache_register_callbacks(instance->update);
-	}
-*/
+	/* Must follow gdi_init(), which registers the GDI Bitmap and Glyph
+	 * classes and the order and cache callbacks */
+	rf_register_graphics(instance->context->graphics);
+	rf_gdi_register_update_callbacks(instance->update);
 
 	instance->update->BeginPaint = rf_begin_paint;
 	instance->update->EndPaint = rf_end_paint;
 	instance->update->DesktopResize = rf_desktop_resize;
+	rf_record_open(rfi);
 
 	remmina_rdp_clipboard_init(rfi);
 	freerdp_channels_post_connect(instance->context->channels, instance);
+	rfi->input_sockfd = remmina_rdp_get_input_socket(instance);
 	rfi->connected = True;
 
 	remmina_plugin_service->protocol_plugin_emit_signal(gp, "connect");
 
-	ui = g_new0(RemminaPluginRdpUiObject, 1);
+	ui = rf_object_new(gp);
 	ui->type = REMMINA_RDP_UI_CONNECTED;
 	rf_queue_ui(gp, ui);
 
@@ -474,9 +456,268 @@ static int remmina_rdp_receive_channel_data(freerdp* instance, int channelId, UI
 	return freerdp_channels_data(instance, channelId, data, size, flags, total_size);
 }
 
-static void remmina_rdp_main_loop(RemminaProtocolWidget* gp)
+/* Whether the main loop failed because the link to the server broke, as
+ * opposed to a session ended by the server or a protocol error. The
+ * transport socket of a broken link reports an error or its end. */
+static gboolean remmina_rdp_transport_lost(rfContext* rfi)
+{
+	TRACE_CALL("remmina_rdp_transport_lost");
+	char c;
+	ssize_t n;
+
+	if (freerdp_shall_disconnect(rfi->instance) || freerdp_error_info(rfi->instance) != 0)
+		return FALSE;
+	if (rfi->input_sockfd < 0)
+		return FALSE;
+
+	n = recv(rfi->input_sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	if (n == 0)
+		return TRUE;
+	return n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+
+#define REMMINA_RDP_MAX_FDS	64
+
+typedef struct
+{
+	int fd;
+	uint32_t events;
+} RemminaRdpPollFd;
+
+static int remmina_rdp_poll_fd_compare(const void* a, const void* b)
+{
+	TRACE_CALL("remmina_rdp_poll_fd_compare");
+	return ((const RemminaRdpPollFd*) a)->fd - ((const RemminaRdpPollFd*) b)->fd;
+}
+
+static int remmina_rdp_poll_fds_build(void** rfds, int rcount, void** wfds, int wcount, RemminaRdpPollFd* pfds)
+{
+	TRACE_CALL("remmina_rdp_poll_fds_build");
+	int i, j, n;
+
+	/* Merge read and write fds into a list sorted by fd */
+	n = 0;
+	for (i = 0; i < rcount + wcount; i++)
+	{
+		pfds[n].fd = GPOINTER_TO_INT(i < rcount ? rfds[i] : wfds[i - rcount]);
+		pfds[n].events = i < rcount ? EPOLLIN : EPOLLOUT;
+		n++;
+	}
+
+	qsort(pfds, n, sizeof(RemminaRdpPollFd), remmina_rdp_poll_fd_compare);
+
+	for (i = 0, j = 0; i < n; i++)
+	{
+		if (j > 0 && pfds[j - 1].fd == pfds[i].fd)
+			pfds[j - 1].events |= pfds[i].events;
+		else
+			pfds[j++] = pfds[i];
+	}
+
+	return j;
+}
+
+static gboolean remmina_rdp_poll_fd_ctl(int epfd, int op, RemminaRdpPollFd* pfd)
+{
+	TRACE_CALL("remmina_rdp_poll_fd_ctl");
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = pfd->events;
+	ev.data.fd = pfd->fd;
+	if (epoll_ctl(epfd, op, pfd->fd, &ev) == 0)
+		return TRUE;
+
+	/* A closed fd leaves the set on its own, and its number may come back
+	 * with another file: add what is missing, modify what is there */
+	if (op == EPOLL_CTL_MOD && errno == ENOENT && epoll_ctl(epfd, EPOLL_CTL_ADD, pfd->fd, &ev) == 0)
+		return TRUE;
+	if (op == EPOLL_CTL_ADD && errno == EEXIST && epoll_ctl(epfd, EPOLL_CTL_MOD, pfd->fd, &ev) == 0)
+		return TRUE;
+
+	remmina_plugin_service->log_printf("[RDP] unable to watch fd %d: %s\n", pfd->fd, g_strerror(errno));
+	return FALSE;
+}
+
+/* Apply the differences between the watched fds and the wanted ones, both
+ * sorted by fd. Unchanged fds cost no system call. */
+static gboolean remmina_rdp_poll_fds_update(int epfd, RemminaRdpPollFd* old, int nold, RemminaRdpPollFd* new, int nnew)
+{
+	TRACE_CALL("remmina_rdp_poll_fds_update");
+	struct epoll_event ev;
+	int i, j;
+
+	i = 0;
+	j = 0;
+	while (i < nold || j < nnew)
+	{
+		if (j >= nnew || (i < nold && old[i].fd < new[j].fd))
+		{
+			memset(&ev, 0, sizeof(ev));
+			epoll_ctl(epfd, EPOLL_CTL_DEL, old[i].fd, &ev);
+			i++;
+		}
+		else if (i >= nold || new[j].fd < old[i].fd)
+		{
+			if (!remmina_rdp_poll_fd_ctl(epfd, EPOLL_CTL_ADD, &new[j]))
+				return FALSE;
+			j++;
+		}
+		else
+		{
+			if (old[i].events != new[j].events && !remmina_rdp_poll_fd_ctl(epfd, EPOLL_CTL_MOD, &new[j]))
+				return FALSE;
+			i++;
+			j++;
+		}
+	}
+
+	return TRUE;
+}
+
+/* An fd reported hung up may be closed and its number reused before the
+ * next update: forget its events, so that it is armed again */
+static void remmina_rdp_poll_fds_hangup(RemminaRdpPollFd* pfds, int n, struct epoll_event* events, int nevents)
+{
+	TRACE_CALL("remmina_rdp_poll_fds_hangup");
+	RemminaRdpPollFd key;
+	RemminaRdpPollFd* pfd;
+	int i;
+
+	for (i = 0; i < nevents; i++)
+	{
+		if (!(events[i].events & (EPOLLHUP | EPOLLERR)))
+			continue;
+		key.fd = events[i].data.fd;
+		pfd = bsearch(&key, pfds, n, sizeof(RemminaRdpPollFd), remmina_rdp_poll_fd_compare);
+		if (pfd)
+			pfd->events = 0;
+	}
+}
+
+static void remmina_rdp_main_loop_cleanup(void* data)
+{
+	TRACE_CALL("remmina_rdp_main_loop_cleanup");
+	close(GPOINTER_TO_INT(data));
+}
+
+static gboolean remmina_rdp_main_loop(RemminaProtocolWidget* gp)
 {
 	TRACE_CALL("remmina_rdp_main_loop");
+	gboolean lost = FALSE;
+	int epfd;
+	int rcount;
+	int wcount;
+	int nfds, nwatched, nevents;
+	void *rfds[32];
+	void *wfds[32];
+	RemminaRdpPollFd pfds[2][REMMINA_RDP_MAX_FDS];
+	int cur;
+	struct epoll_event events[REMMINA_RDP_MAX_FDS];
+	rfContext* rfi = GET_PLUGIN_DATA(gp);
+
+	rdpChannels *channels;
+
+	memset(rfds, 0, sizeof(rfds));
+	memset(wfds, 0, sizeof(wfds));
+
+	channels = rfi->instance->context->channels;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+	{
+		remmina_plugin_service->log_printf("[RDP] epoll_create1 failed: %s\n", g_strerror(errno));
+		return FALSE;
+	}
+
+	/* The epoll set is kept across iterations. The fds are still collected
+	 * every time, because FreeRDP and the channels may replace them, but
+	 * only the changes reach the kernel. */
+	cur = 0;
+	nwatched = 0;
+	CANCEL_DEFER
+	pthread_cleanup_push(remmina_rdp_main_loop_cleanup, GINT_TO_POINTER(epfd));
+	CANCEL_ASYNC
+
+	while (!freerdp_shall_disconnect(rfi->instance))
+	{
+		rcount = 0;
+		wcount = 0;
+
+		if (!freerdp_get_fds(rfi->instance, rfds, &rcount, wfds, &wcount))
+		{
+			break;
+		}
+		if (!freerdp_channels_get_fds(channels, rfi->instance, rfds, &rcount, wfds, &wcount))
+		{
+			break;
+		}
+		rf_get_fds(gp, rfds, &rcount);
+
+		nfds = remmina_rdp_poll_fds_build(rfds, rcount, wfds, wcount, pfds[1 - cur]);
+
+		/* exit if nothing to do */
+		if (nfds == 0)
+		{
+			break;
+		}
+
+		if (!remmina_rdp_poll_fds_update(epfd, pfds[cur], nwatched, pfds[1 - cur], nfds))
+		{
+			break;
+		}
+		cur = 1 - cur;
+		nwatched = nfds;
+
+		/* do the wait */
+		nevents = epoll_wait(epfd, events, REMMINA_RDP_MAX_FDS, -1);
+		if (nevents < 0)
+		{
+			if (errno != EINTR)
+			{
+				break;
+			}
+		}
+		else
+		{
+			remmina_rdp_poll_fds_hangup(pfds[cur], nwatched, events, nevents);
+		}
+
+		/* Drain every source, each check function handles all it has pending */
+
+		/* check the libfreerdp fds */
+		if (!freerdp_check_fds(rfi->instance))
+		{
+			lost = remmina_rdp_transport_lost(rfi);
+			break;
+		}
+		/* check channel fds */
+		if (!freerdp_channels_check_fds(channels, rfi->instance))
+		{
+			break;
+		}
+		/* check ui */
+		if (!rf_check_fds(gp))
+		{
+			break;
+		}
+	}
+
+	CANCEL_DEFER
+	pthread_cleanup_pop(1);
+	CANCEL_ASYNC
+
+	return lost;
+}
+
+#else
+
+static gboolean remmina_rdp_main_loop(RemminaProtocolWidget* gp)
+{
+	TRACE_CALL("remmina_rdp_main_loop");
+	gboolean lost = FALSE;
 	int i;
 	int fds;
 	int rcount;
@@ -555,6 +796,7 @@ static void remmina_rdp_main_loop(RemminaProtocolWidget* gp)
 		/* check the libfreerdp fds */
 		if (!freerdp_check_fds(rfi->instance))
 		{
+			lost = remmina_rdp_transport_lost(rfi);
 			break;
 		}
 		/* check channel fds */
@@ -568,8 +810,12 @@ static void remmina_rdp_main_loop(RemminaProtocolWidget* gp)
 			break;
 		}
 	}
+
+	return lost;
 }
 
+#endif
+
 int remmina_rdp_load_static_channel_addin(rdpChannels* channels, rdpSettings* settings, char* name, void* data)
 {
 	TRACE_CALL("remmina_rdp_load_static_channel_addin");
@@ -619,6 +865,77 @@ static void remmina_rdp_send_ctrlaltdel(RemminaProtocolWidget *gp)
 		keys, G_N_ELEMENTS(keys), GDK_KEY_PRESS | GDK_KEY_RELEASE);
 }
 
+/* Map the link measured during the previous session to a quality preset,
+ * or return -1 if it was never measured */
+static gint remmina_rdp_network_quality(RemminaFile* remminafile)
+{
+	TRACE_CALL("remmina_rdp_network_quality");
+	gint bandwidth, rtt;
+
+	bandwidth = remmina_plugin_service->file_get_int(remminafile, "rdp_net_bandwidth", 0);
+	rtt = remmina_plugin_service->file_get_int(remminafile, "rdp_net_rtt", 0);
+
+	if (bandwidth <= 0)
+		return -1;
+	if (bandwidth >= 10000 && rtt <= 20)
+		return 9;
+	if (bandwidth >= 2000 && rtt <= 100)
+		return 2;
+	if (bandwidth >= 512)
+		return 1;
+	return 0;
+}
+
+static void remmina_rdp_reconnect_status(RemminaProtocolWidget* gp, guint attempt, guint max_attempts)
+{
+	TRACE_CALL("remmina_rdp_reconnect_status");
+	RemminaPluginRdpUiObject* ui;
+
+	ui = rf_object_new(gp);
+	ui->type = REMMINA_RDP_UI_RECONNECT;
+	ui->reconnect.attempt = attempt;
+	ui->reconnect.max_attempts = max_attempts;
+	rf_queue_ui(gp, ui);
+}
+
+/* The connection was lost: reconnect with backoff. The auto-reconnect cookie
+ * the server sent in its save session info is presented by freerdp_reconnect(),
+ * so the server resumes the session without a new logon. Meanwhile the last
+ * frame stays displayed, under a dialog whose Cancel closes the connection. */
+static gboolean remmina_rdp_auto_reconnect(RemminaProtocolWidget* gp)
+{
+	TRACE_CALL("remmina_rdp_auto_reconnect");
+	rfContext* rfi = GET_PLUGIN_DATA(gp);
+	UINT32 retry;
+	gint delay;
+
+	rfi->input_sockfd = -1;
+	delay = 1;
+	for (retry = 1; retry <= rfi->settings->AutoReconnectMaxRetries; retry++)
+	{
+		remmina_plugin_service->log_printf("[RDP] connection lost, reconnecting to %s (attempt %u/%u)\n",
+			rfi->settings->ServerHostname, retry, rfi->settings->AutoReconnectMaxRetries);
+		remmina_rdp_reconnect_status(gp, retry, rfi->settings->AutoReconnectMaxRetries);
+
+		/* PostConnect is not called again: the GDI, the surface and the
+		 * clipboard are kept, the desktop may only have changed size */
+		if (freerdp_reconnect(rfi->instance))
+		{
+			rfi->input_sockfd = remmina_rdp_get_input_socket(rfi->instance);
+			if (rfi->settings->DesktopWidth != rfi->width || rfi->settings->DesktopHeight != rfi->height)
+				rf_desktop_resize(rfi->instance->context);
+			remmina_rdp_reconnect_status(gp, 0, 0);
+			return TRUE;
+		}
+
+		g_usleep(delay * G_USEC_PER_SEC);
+		delay = MIN(delay * 2, REMMINA_RDP_RECONNECT_MAX_DELAY);
+	}
+
+	remmina_rdp_reconnect_status(gp, 0, 0);
+	return FALSE;
+}
+
 static gboolean remmina_rdp_main(RemminaProtocolWidget* gp)
 {
 	TRACE_CALL("remmina_rdp_main");
@@ -639,8 +956,10 @@ static gboolean remmina_rdp_main(RemminaProtocolWidget* gp)
 	const gchar *cert_hostport;
 	gchar *cert_host;
 	gint cert_port;
+	gboolean lost;
 	gchar *gateway_host;
 	gint gateway_port;
+	gint quality, detected;
 
 	remminafile = remmina_plugin_service->protocol_plugin_get_file(gp);
 	s = remmina_plugin_service->protocol_plugin_start_direct_tunnel(gp, 3389, FALSE);
@@ -684,6 +1003,13 @@ static gboolean remmina_rdp_main(RemminaProtocolWidget* gp)
 		rfi->settings->RemoteFxCodec = True;
 		rfi->settings->ColorDepth = 32;
 	}
+	else if (rfi->settings->ColorDepth == 64)
+	{
+		/* Graphics pipeline, with the planar, progressive and RemoteFX codecs */
+		rfi->settings->SupportGraphicsPipeline = True;
+		rfi->settings->SupportDynamicChannels = True;
+		rfi->settings->ColorDepth = 32;
+	}
 
 	rfi->settings->DesktopWidth = remmina_plugin_service->file_get_int(remminafile, "resolution_width", 1024);
 	rfi->settings->DesktopHeight = remmina_plugin_service->file_get_int(remminafile, "resolution_height", 768);
@@ -775,7 +1101,28 @@ static gboolean remmina_rdp_main(RemminaProtocolWidget* gp)
 		rfi->settings->ShellWorkingDirectory = strdup(remmina_plugin_service->file_get_string(remminafile, "execpath"));
 	}
 
-	s = g_strdup_printf("rdp_quality_%i", remmina_plugin_service->file_get_int(remminafile, "quality", DEFAULT_QUALITY_0));
+	quality = remmina_plugin_service->file_get_int(remminafile, "quality", DEFAULT_QUALITY_0);
+
+	rfi->network_autodetect = remmina_plugin_service->file_get_int(remminafile, "network_autodetect", FALSE);
+	if (rfi->network_autodetect)
+	{
+		/* Let the server measure the link, the effects and the color depth
+		 * follow what it measured during the previous session */
+		rfi->settings->NetworkAutoDetect = TRUE;
+		rfi->settings->ConnectionType = CONNECTION_TYPE_AUTODETECT;
+
+		detected = remmina_rdp_network_quality(remminafile);
+		if (detected >= 0)
+		{
+			quality = detected;
+			/* RemoteFX and the graphics pipeline need 32 bpp */
+			if (quality == 0 && !rfi->settings->RemoteFxCodec && !rfi->settings->SupportGraphicsPipeline &&
+				rfi->settings->ColorDepth > 16)
+				rfi->settings->ColorDepth = 16;
+		}
+	}
+
+	s = g_strdup_printf("rdp_quality_%i", quality);
 	value = remmina_plugin_service->pref_get_value(s);
 	g_free(s);
 
@@ -785,7 +1132,7 @@ static gboolean remmina_rdp_main(RemminaProtocolWidget* gp)
 	}
 	else
 	{
-		switch (remmina_plugin_service->file_get_int(remminafile, "quality", DEFAULT_QUALITY_0))
+		switch (quality)
 		{
 			case 9:
 				rfi->settings->PerformanceFlags = DEFAULT_QUALITY_9;
@@ -841,10 +1188,21 @@ static gboolean remmina_rdp_main(RemminaProtocolWidget* gp)
 		rfi->settings->NlaSecurity = True;
 	}
 
+	rfi->settings->AutoReconnectionEnabled = True;
+	rfi->settings->AutoReconnectMaxRetries = REMMINA_RDP_RECONNECT_MAX_RETRIES;
+
+	/* Flow control: the server sends no more than this many frames ahead of
+	 * what has been handled here, and skips the intermediate ones */
+	rfi->settings->SurfaceFrameMarkerEnabled = True;
+	rfi->settings->FrameAcknowledge = remmina_plugin_service->file_get_int(remminafile, "frames_in_flight", REMMINA_RDP_FRAMES_IN_FLIGHT);
+
 	rfi->settings->CompressionEnabled = True;
 	rfi->settings->FastPathInput = True;
 	rfi->settings->FastPathOutput = True;
 
+	/* Drawing orders and the bitmap, glyph, brush and offscreen caches,
+	 * also negotiated with RemoteFX for the non surface command updates */
+	rf_gdi_set_cache_support(rfi->settings);
 
 	cs = remmina_plugin_service->file_get_string(remminafile, "sound");
 
@@ -885,6 +1243,23 @@ static gboolean remmina_rdp_main(RemminaProtocolWidget* gp)
 
 	rfi->settings->RedirectClipboard = ( remmina_plugin_service->file_get_int(remminafile, "disableclipboard", FALSE) ? FALSE: TRUE );
 
+	if (remmina_plugin_service->file_get_int(remminafile, "dynamic_resolution", FALSE))
+	{
+		/* Loads the disp dynamic channel */
+		rfi->settings->SupportDisplayControl = TRUE;
+		rfi->settings->SupportDynamicChannels = TRUE;
+	}
+
+	if (remmina_plugin_service->file_get_int(remminafile, "multimedia", FALSE))
+	{
+		/* Videos are decoded here, the GStreamer decoder would draw them in
+		 * a window of its own */
+		char* tsmf_params[] = { "tsmf", "decoder:ffmpeg" };
+
+		freerdp_client_add_dynamic_channel(rfi->settings, 2, tsmf_params);
+		rfi->settings->SupportDynamicChannels = TRUE;
+	}
+
 	cs = remmina_plugin_service->file_get_string(remminafile, "sharefolder");
 
 	if (cs && cs[0] == '/')
@@ -969,8 +1344,10 @@ static gboolean remmina_rdp_main(RemminaProtocolWidget* gp)
 	}
 
 
-
-	remmina_rdp_main_loop(gp);
+	/* Only a broken network link is worth a reconnection */
+	lost = remmina_rdp_main_loop(gp);
+	while (lost && remmina_rdp_auto_reconnect(gp))
+		lost = remmina_rdp_main_loop(gp);
 
 	return TRUE;
 }
@@ -1020,8 +1397,10 @@ static void remmina_rdp_init(RemminaProtocolWidget* gp)
 	rfi->settings = instance->settings;
 	rfi->instance->context->channels = freerdp_channels_new();
 	rfi->connected = False;
+	rfi->input_sockfd = -1;
 
 	pthread_mutex_init(&rfi->mutex, NULL);
+	pthread_mutex_init(&rfi->gfx_mutex, NULL);
 
 	freerdp_register_addin_provider(freerdp_channels_load_static_addin_entry, 0);
 
@@ -1052,6 +1431,7 @@ static gboolean remmina_rdp_close_connection(RemminaProtocolWidget* gp)
 {
 	TRACE_CALL("remmina_rdp_close_connection");
 	rfContext* rfi = GET_PLUGIN_DATA(gp);
+	RemminaFile* remminafile;
 	freerdp* instance;
 
 	instance = rfi->instance;
@@ -1067,6 +1447,14 @@ static gboolean remmina_rdp_close_connection(RemminaProtocolWidget* gp)
 
 	pthread_mutex_destroy(&rfi->mutex);
 
+	/* Saved with the runtime settings of the profile */
+	if (rfi->net_bandwidth > 0)
+	{
+		remminafile = remmina_plugin_service->protocol_plugin_get_file(gp);
+		remmina_plugin_service->file_set_int(remminafile, "rdp_net_bandwidth", rfi->net_bandwidth);
+		remmina_plugin_service->file_set_int(remminafile, "rdp_net_rtt", rfi->net_rtt);
+	}
+
 	remmina_rdp_event_uninit(gp);
 	remmina_plugin_service->protocol_plugin_emit_signal(gp, "disconnect");
 
@@ -1081,6 +1469,9 @@ static gboolean remmina_rdp_close_connection(RemminaProtocolWidget* gp)
 	}
 
 	remmina_rdp_clipboard_free(rfi);
+	rf_record_close(rfi);
+	/* The channels are closed, the graphics pipeline with them */
+	pthread_mutex_destroy(&rfi->gfx_mutex);
 
 	if (rfi->rfx_context)
 	{
@@ -1165,6 +1556,7 @@ static gpointer colordepth_list[] =
 	"24", N_("True color (24 bpp)"),
 	"32", N_("True color (32 bpp)"),
 	"0", N_("RemoteFX (32 bpp)"),
+	"64", N_("Graphics pipeline (32 bpp)"),
 	NULL
 };
 
@@ -1200,6 +1592,17 @@ static gpointer security_list[] =
 	NULL
 };
 
+/* Array of key/value pairs for the frames the server may send ahead of
+ * those displayed, the default REMMINA_RDP_FRAMES_IN_FLIGHT first */
+static gpointer frames_in_flight_list[] =
+{
+	"2", N_("Two (balanced)"),
+	"1", N_("One (lowest latency)"),
+	"4", N_("Four (smoothest)"),
+	"0", N_("Unlimited"),
+	NULL
+};
+
 /* Array of RemminaProtocolSetting for basic settings.
  * Each item is composed by:
  * a) RemminaProtocolSettingType for setting type
@@ -1236,12 +1639,16 @@ static const RemminaProtocolSetting remmina_rdp_advanced_settings[] =
 	{ REMMINA_PROTOCOL_SETTING_TYPE_SELECT, "quality", N_("Quality"), FALSE, quality_list, NULL },
 	{ REMMINA_PROTOCOL_SETTING_TYPE_SELECT, "sound", N_("Sound"), FALSE, sound_list, NULL },
 	{ REMMINA_PROTOCOL_SETTING_TYPE_SELECT, "security", N_("Security"), FALSE, security_list, NULL },
+	{ REMMINA_PROTOCOL_SETTING_TYPE_SELECT, "frames_in_flight", N_("Frames ahead of the display"), FALSE, frames_in_flight_list, NULL },
 	{ REMMINA_PROTOCOL_SETTING_TYPE_TEXT, "clientname", N_("Client name"), FALSE, NULL, NULL },
 	{ REMMINA_PROTOCOL_SETTING_TYPE_TEXT, "exec", N_("Startup program"), FALSE, NULL, NULL },
 	{ REMMINA_PROTOCOL_SETTING_TYPE_TEXT, "execpath", N_("Startup path"), FALSE, NULL, NULL },
 	{ REMMINA_PROTOCOL_SETTING_TYPE_CHECK, "shareprinter", N_("Share local printers"), FALSE, NULL, NULL },
 	{ REMMINA_PROTOCOL_SETTING_TYPE_CHECK, "sharesmartcard", N_("Share smartcard"), FALSE, NULL, NULL },
 	{ REMMINA_PROTOCOL_SETTING_TYPE_CHECK, "disableclipboard", N_("Disable clipboard sync"), FALSE, NULL, NULL },
+	{ REMMINA_PROTOCOL_SETTING_TYPE_CHECK, "dynamic_resolution", N_("Resize the remote desktop with the window"), FALSE, NULL, NULL },
+	{ REMMINA_PROTOCOL_SETTING_TYPE_CHECK, "network_autodetect", N_("Adapt quality to the network"), FALSE, NULL, NULL },
+	{ REMMINA_PROTOCOL_SETTING_TYPE_CHECK, "multimedia", N_("Play videos locally (multimedia redirection)"), FALSE, NULL, NULL },
 	{ REMMINA_PROTOCOL_SETTING_TYPE_CHECK, "console", N_("Attach to console (Windows 2003 / 2003 R2)"), FALSE, NULL, NULL },
 	{ REMMINA_PROTOCOL_SETTING_TYPE_CHECK, "disablepasswordstoring", N_("Disable password storing"), FALSE, NULL, NULL },
 	{ REMMINA_PROTOCOL_SETTING_TYPE_CHECK, "gateway_usage", N_("Use RD Gateway server for server detection"), FALSE, NULL, NULL },
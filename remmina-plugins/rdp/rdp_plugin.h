@@ -45,11 +45,15 @@
 #include <freerdp/gdi/dc.h>
 #include <freerdp/gdi/region.h>
 #include <freerdp/client/cliprdr.h>
+#include <freerdp/client/disp.h>
+#include <freerdp/client/rdpgfx.h>
+#include <freerdp/autodetect.h>
 #include <gdk/gdkx.h>
 
 #include <winpr/clipboard.h>
 
 typedef struct rf_context rfContext;
+typedef struct remmina_plugin_rdp_ui_object RemminaPluginRdpUiObject;
 
 #define LOCK_BUFFER(t)	  	if (t) {CANCEL_DEFER} pthread_mutex_lock(&rfi->mutex);
 #define UNLOCK_BUFFER(t)	pthread_mutex_unlock(&rfi->mutex); if (t) {CANCEL_ASYNC}
@@ -61,11 +65,33 @@ typedef struct rf_context rfContext;
 #define DEFAULT_QUALITY_2	0x01
 #define DEFAULT_QUALITY_9	0x80
 
+/* Number of preallocated UI objects, must be a multiple of 32 */
+#define REMMINA_RDP_UI_POOL_SIZE	256
+
+/* Frames the server may send before waiting for our acknowledge */
+#define REMMINA_RDP_FRAMES_IN_FLIGHT	2
+
+/* Size of the input event ring buffer, must be a power of two */
+#define REMMINA_RDP_EVENT_RING_SIZE	512
+
 extern RemminaPluginService* remmina_plugin_service;
 
 
 
 
+struct rf_clipboard_request
+{
+	guint serial;
+	UINT32 format;
+};
+typedef struct rf_clipboard_request rfClipboardRequest;
+
+typedef struct rf_clipboard_files rfClipboardFiles;
+typedef struct rf_clipboard_files_wait rfClipboardFilesWait;
+typedef struct rf_clipboard_files_upload rfClipboardFilesUpload;
+
+typedef struct rf_recorder rfRecorder;
+
 struct rf_clipboard
 {
 	rfContext* rfi;
@@ -79,10 +105,34 @@ struct rf_clipboard
 	gulong clipboard_handler;
 
 
+	/* Server data is prefetched when the server announces new content.
+	 * srv_serial is bumped whenever newer content replaces it, responses
+	 * to requests made for an older serial are dropped. */
 	pthread_mutex_t transfer_clip_mutex;
-	pthread_cond_t transfer_clip_cond;
-	enum  { SCDW_NONE, SCDW_BUSY_WAIT, SCDW_ASYNCWAIT } srv_clip_data_wait ;
+	enum  { SCDW_NONE, SCDW_FETCHING, SCDW_ASYNCWAIT } srv_clip_data_wait ;
+	guint srv_serial;
+	GQueue* srv_requests;
 	gpointer srv_data;
+	UINT32 srv_format;
+	gboolean owner_set;
+
+	/* File transfers, see rdp_cliprdr_file.c */
+	UINT32 srv_file_format;
+	rfClipboardFiles* srv_files;
+	rfClipboardFilesWait* files_wait;
+	gchar* files_dir;
+	UINT32 stream_id;
+	GPtrArray* local_files;
+	gint local_fd;
+	guint local_fd_index;
+	/* Progress of the files being sent. local_serial is bumped with each
+	 * new list, a cancelled list is refused to the server. */
+	guint local_serial;
+	UINT64 local_total;
+	UINT64 local_sent;
+	gboolean local_shown;
+	gboolean local_cancelled;
+	rfClipboardFilesUpload* files_upload;
 
 };
 typedef struct rf_clipboard rfClipboard;
@@ -94,20 +144,38 @@ struct rf_pointer
 };
 typedef struct rf_pointer rfPointer;
 
-struct rf_bitmap
+typedef enum
 {
-	rdpBitmap bitmap;
-	Pixmap pixmap;
-	cairo_surface_t* surface;
-};
-typedef struct rf_bitmap rfBitmap;
+	REMMINA_RDP_EVENT_TYPE_SCANCODE,
+	REMMINA_RDP_EVENT_TYPE_MOUSE,
+	REMMINA_RDP_EVENT_TYPE_DISPLAY_LAYOUT
+} RemminaPluginRdpEventType;
 
-struct rf_glyph
+struct remmina_plugin_rdp_event
 {
-	rdpGlyph glyph;
-	Pixmap pixmap;
+	RemminaPluginRdpEventType type;
+	union
+	{
+		struct
+		{
+			BOOL up;
+			BOOL extended;
+			UINT8 key_code;
+		} key_event;
+		struct
+		{
+			UINT16 flags;
+			UINT16 x;
+			UINT16 y;
+		} mouse_event;
+		struct
+		{
+			UINT32 width;
+			UINT32 height;
+		} display_event;
+	};
 };
-typedef struct rf_glyph rfGlyph;
+typedef struct remmina_plugin_rdp_event RemminaPluginRdpEvent;
 
 struct rf_context
 {
@@ -127,14 +195,45 @@ struct rf_context
 
 	CliprdrClientContext* cliprdr;
 
+	/* Display control channel: the remote desktop follows the widget size */
+	DispClientContext* dispcontext;
+	gboolean dynamic_resolution;
+	guint layout_handler;
+	gint layout_width;
+	gint layout_height;
+
+	/* Shown while the connection is being restored after a network loss */
+	GtkWidget* reconnect_dialog;
+
+	/* Link characteristics measured by the server, in kbit/s and ms */
+	gboolean network_autodetect;
+	UINT32 net_bandwidth;
+	UINT32 net_rtt;
+
 	RDP_PLUGIN_DATA rdpdr_data[5];
 	RDP_PLUGIN_DATA drdynvc_data[5];
 	gchar rdpsnd_options[20];
 
 	RFX_CONTEXT* rfx_context;
 
+	/* Uncompressed bitmaps are converted to 32 bpp by the plugin */
+	pBitmapUpdate gdi_bitmap_update;
+
+	/* RemoteFX tiles are composited straight into the primary buffer */
+	pSurfaceBits gdi_surface_bits;
+
+	/* Graphics pipeline callbacks of the GDI, run on the dynamic channel
+	 * thread with gfx_mutex held, see rf_gdi_gfx_init() */
+	RdpgfxClientContext gdi_gfx;
+	pthread_mutex_t gfx_mutex;
+
 	gboolean connected;
 
+	/* Surface frame ended in the update being processed, to be acknowledged
+	 * once the GTK thread has handled its damage */
+	gboolean frame_end;
+	UINT32 frame_id;
+
 	gboolean sw_gdi;
 	GtkWidget* drawing_area;
 	gint scale_width;
@@ -144,11 +243,24 @@ struct rf_context
 	guint scale_handler;
 	gboolean use_client_keymap;
 
-	HGDI_DC hdc;
 	gint srcBpp;
 	GdkDisplay* display;
 	GdkVisual* visual;
+	/* Double buffered copy of the primary buffer. The damaged areas are
+	 * copied into back_surface, which is then swapped with surface, all
+	 * with rfi->mutex held. The GTK thread paints from surface without the
+	 * mutex once it has set front_busy, a swap is then left to it. See
+	 * rf_present_flip(). */
 	cairo_surface_t* surface;
+	cairo_surface_t* back_surface;
+	/* Areas where back_surface is newer than surface, and older */
+	cairo_region_t* back_ahead;
+	cairo_region_t* back_behind;
+	gboolean front_busy;
+	gboolean flip_pending;
+	/* surface scaled to scale_width x scale_height, kept up to date for the
+	 * damaged areas only */
+	cairo_surface_t* scaled_surface;
 	cairo_format_t cairo_format;
 	gint bpp;
 	gint width;
@@ -161,54 +273,60 @@ struct rf_context
 	guint object_id_seq;
 	GHashTable* object_table;
 
-	GAsyncQueue* ui_queue;
-	guint ui_handler;
-
-
+	/* GdkCursors by pointer shape, see rdp_graphics.c */
+	GHashTable* pointer_cache;
+	pthread_mutex_t pointer_cache_mutex;
+
+	/* UI objects are pushed by any thread on the lock-free ui_queue stack,
+	 * and consumed in FIFO order through ui_fifo by the GTK thread only */
+	RemminaPluginRdpUiObject* ui_queue;
+	RemminaPluginRdpUiObject* ui_fifo;
+	gint ui_scheduled;
+	gint ui_queued;
+	RemminaPluginRdpUiObject* ui_pool;
+	gint ui_pool_used[REMMINA_RDP_UI_POOL_SIZE / 32];
+	/* Pool statistics, logged when the session is closed */
+	gint ui_pool_hits;
+	gint ui_pool_misses;
+	gint ui_objects_live;
+	gint ui_objects_peak;
+	pthread_mutex_t ui_sync_mutex;
+	pthread_cond_t ui_sync_cond;
 
 	GArray* pressed_keys;
-	GAsyncQueue* event_queue;
+	/* Input events ring buffer: the GTK thread is the only producer and
+	 * moves event_ring_head, the RDP thread is the only consumer and moves
+	 * event_ring_tail. Events which do not fit wait in the overflow queue,
+	 * drained after the ring, then handed back for reuse through the free
+	 * queue. The pipe wakes up the RDP thread. */
+	RemminaPluginRdpEvent event_ring[REMMINA_RDP_EVENT_RING_SIZE];
+	gint event_ring_head;
+	gint event_ring_tail;
+	GAsyncQueue* event_overflow;
+	GAsyncQueue* event_overflow_free;
+	gint event_overflow_len;
+	guint event_ring_peak;
+	guint events_overflowed;
+	guint events_dropped;
+	/* Ids of the frames to acknowledge, never dropped like input may be */
+	GAsyncQueue* frame_acks;
 	gint event_pipe[2];
+	gint input_sockfd;
 
-	rfClipboard clipboard;
-};
-
-typedef enum
-{
-	REMMINA_RDP_EVENT_TYPE_SCANCODE,
-	REMMINA_RDP_EVENT_TYPE_MOUSE
-} RemminaPluginRdpEventType;
+	rfRecorder* recorder;
 
-struct remmina_plugin_rdp_event
-{
-	RemminaPluginRdpEventType type;
-	union
-	{
-		struct
-		{
-			BOOL up;
-			BOOL extended;
-			UINT8 key_code;
-		} key_event;
-		struct
-		{
-			UINT16 flags;
-			UINT16 x;
-			UINT16 y;
-		} mouse_event;
-	};
+	rfClipboard clipboard;
 };
-typedef struct remmina_plugin_rdp_event RemminaPluginRdpEvent;
 
 typedef enum
 {
 	REMMINA_RDP_UI_UPDATE_REGION = 0,
 	REMMINA_RDP_UI_CONNECTED,
 	REMMINA_RDP_UI_CURSOR,
-	REMMINA_RDP_UI_RFX,
-	REMMINA_RDP_UI_NOCODEC,
 	REMMINA_RDP_UI_CLIPBOARD,
-	REMMINA_RDP_UI_EVENT
+	REMMINA_RDP_UI_EVENT,
+	REMMINA_RDP_UI_FRAME,
+	REMMINA_RDP_UI_RECONNECT
 } RemminaPluginRdpUiType;
 
 typedef enum
@@ -217,7 +335,8 @@ typedef enum
 	REMMINA_RDP_UI_CLIPBOARD_FORMATLIST,
 	REMMINA_RDP_UI_CLIPBOARD_GET_DATA,
 	REMMINA_RDP_UI_CLIPBOARD_SET_DATA,
-	REMMINA_RDP_UI_CLIPBOARD_SET_CONTENT
+	REMMINA_RDP_UI_CLIPBOARD_SET_CONTENT,
+	REMMINA_RDP_UI_CLIPBOARD_UPLOAD_PROGRESS
 } RemminaPluginRdpUiClipboardType;
 
 typedef enum
@@ -231,14 +350,17 @@ typedef enum
 
 typedef enum
 {
-	REMMINA_RDP_UI_EVENT_UPDATE_SCALE
+	REMMINA_RDP_UI_EVENT_UPDATE_SCALE,
+	REMMINA_RDP_UI_EVENT_DESKTOP_RESIZE
 } RemminaPluginRdpUiEeventType;
 
 struct remmina_plugin_rdp_ui_object
 {
 	RemminaPluginRdpUiType type;
 	gboolean sync;
-	pthread_mutex_t sync_wait_mutex;
+	gboolean complete;
+	gpointer retptr;
+	RemminaPluginRdpUiObject* next;
 	union
 	{
 		struct
@@ -251,23 +373,10 @@ struct remmina_plugin_rdp_ui_object
 		struct
 		{
 			rfPointer* pointer;
+			GdkCursor* cursor;
 			RemminaPluginRdpUiPointerType type;
 		} cursor;
 		struct
-		{
-			gint left;
-			gint top;
-			RFX_MESSAGE* message;
-		} rfx;
-		struct
-		{
-			gint left;
-			gint top;
-			gint width;
-			gint height;
-			UINT8* bitmap;
-		} nocodec;
-		struct
 		{
 			RemminaPluginRdpUiClipboardType type;
 			GtkTargetList* targetlist;
@@ -278,16 +387,35 @@ struct remmina_plugin_rdp_ui_object
 		struct {
 			RemminaPluginRdpUiEeventType type;
 		} event;
+		struct {
+			UINT32 id;
+		} frame;
+		struct {
+			guint attempt;	/* 0 once over */
+			guint max_attempts;
+		} reconnect;
 	};
 };
-typedef struct remmina_plugin_rdp_ui_object RemminaPluginRdpUiObject;
 
 void rf_init(RemminaProtocolWidget* gp);
 void rf_uninit(RemminaProtocolWidget* gp);
 void rf_get_fds(RemminaProtocolWidget* gp, void** rfds, int* rcount);
 BOOL rf_check_fds(RemminaProtocolWidget* gp);
+void rf_ui_queue_init(RemminaProtocolWidget* gp);
+void rf_ui_queue_uninit(RemminaProtocolWidget* gp);
+RemminaPluginRdpUiObject* rf_ui_queue_pop(RemminaProtocolWidget* gp);
+void rf_ui_queue_complete(RemminaProtocolWidget* gp, RemminaPluginRdpUiObject* ui);
+gboolean rf_ui_queue_reschedule(RemminaProtocolWidget* gp);
 void rf_queue_ui(RemminaProtocolWidget* gp, RemminaPluginRdpUiObject* ui);
+gpointer rf_queue_ui_sync(RemminaProtocolWidget* gp, RemminaPluginRdpUiObject* ui);
+RemminaPluginRdpUiObject* rf_object_new(RemminaProtocolWidget* gp);
 void rf_object_free(RemminaProtocolWidget* gp, RemminaPluginRdpUiObject* obj);
+void rf_begin_paint(rdpContext* context);
+void rf_end_paint(rdpContext* context);
+void rf_present_rect(rfContext* rfi, gint x, gint y, gint w, gint h);
+void rf_present_flip(rfContext* rfi);
+cairo_surface_t* rf_present_acquire(rfContext* rfi);
+void rf_present_release(rfContext* rfi);
 
 #endif
 
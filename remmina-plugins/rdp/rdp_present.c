@@ -0,0 +1,498 @@
+/*
+ * Remmina - The GTK+ Remote Desktop Client
+ * Copyright (C) 2010-2011 Vic Lee
+ * Copyright (C) 2014-2015 Antenore Gatta, Fabio Castelli, Giovanni Panozzo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL. *  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so. *  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version. *  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ *
+ */
+
+/* The way from the GDI primary buffer to the window.
+ *
+ * The RDP thread publishes the damage of every paint into a double buffered
+ * surface, then tells the GTK thread about it through a lock-free queue of
+ * UI objects, which that thread drains from an idle handler. Kept apart from
+ * rdp_plugin.c so that remmina-rdp-replay runs this very code. */
+
+#include "rdp_plugin.h"
+#include "rdp_event.h"
+
+/* Above this many damaged rectangles in a frame, their bounding box is redrawn */
+#define REMMINA_RDP_MAX_DAMAGE_RECTS	16
+
+void rf_ui_queue_init(RemminaProtocolWidget* gp)
+{
+	TRACE_CALL("rf_ui_queue_init");
+	rfContext* rfi = GET_PLUGIN_DATA(gp);
+
+	rfi->ui_queue = NULL;
+	rfi->ui_fifo = NULL;
+	rfi->ui_scheduled = 0;
+	rfi->ui_queued = 0;
+	rfi->ui_pool = g_new0(RemminaPluginRdpUiObject, REMMINA_RDP_UI_POOL_SIZE);
+	memset(rfi->ui_pool_used, 0, sizeof(rfi->ui_pool_used));
+	rfi->ui_pool_hits = 0;
+	rfi->ui_pool_misses = 0;
+	rfi->ui_objects_live = 0;
+	rfi->ui_objects_peak = 0;
+	pthread_mutex_init(&rfi->ui_sync_mutex, NULL);
+	pthread_cond_init(&rfi->ui_sync_cond, NULL);
+}
+
+void rf_ui_queue_uninit(RemminaProtocolWidget* gp)
+{
+	TRACE_CALL("rf_ui_queue_uninit");
+	rfContext* rfi = GET_PLUGIN_DATA(gp);
+	RemminaPluginRdpUiObject* ui;
+	guint hits, misses;
+
+	/* The RDP thread has already been joined here, so nobody can push
+	 * new objects or wait for a sync object anymore. A pending handler
+	 * finds no plugin data once the connection is closed. */
+	while ((ui = rf_ui_queue_pop(gp)) != NULL)
+		rf_object_free(gp, ui);
+
+	hits = g_atomic_int_get(&rfi->ui_pool_hits);
+	misses = g_atomic_int_get(&rfi->ui_pool_misses);
+	if (hits + misses > 0)
+		remmina_plugin_service->log_printf("[RDP] UI objects: %u allocated, %.1f%% from the pool of %d, %d in use at most\n",
+			hits + misses, 100.0 * hits / (hits + misses), REMMINA_RDP_UI_POOL_SIZE,
+			g_atomic_int_get(&rfi->ui_objects_peak));
+
+	pthread_cond_destroy(&rfi->ui_sync_cond);
+	pthread_mutex_destroy(&rfi->ui_sync_mutex);
+	g_free(rfi->ui_pool);
+	rfi->ui_pool = NULL;
+}
+
+static void rf_object_count(rfContext* rfi, gint* counter)
+{
+	TRACE_CALL("rf_object_count");
+	gint live, peak;
+
+	g_atomic_int_inc(counter);
+
+	/* Keep the high-water mark of the objects in use, pool or heap */
+	live = g_atomic_int_add(&rfi->ui_objects_live, 1) + 1;
+	do
+	{
+		peak = g_atomic_int_get(&rfi->ui_objects_peak);
+	}
+	while (live > peak && !g_atomic_int_compare_and_exchange(&rfi->ui_objects_peak, peak, live));
+}
+
+RemminaPluginRdpUiObject* rf_object_new(RemminaProtocolWidget* gp)
+{
+	TRACE_CALL("rf_object_new");
+	rfContext* rfi = GET_PLUGIN_DATA(gp);
+	RemminaPluginRdpUiObject* obj;
+	gint i, bit, used;
+
+	/* Grab a free slot of the preallocated pool, one bitmap word at a time */
+	for (i = 0; i < REMMINA_RDP_UI_POOL_SIZE / 32; i++)
+	{
+		do
+		{
+			used = g_atomic_int_get(&rfi->ui_pool_used[i]);
+			if ((guint) used == 0xffffffff)
+				break;
+			bit = g_bit_nth_lsf(~(gulong)(guint) used & 0xffffffff, -1);
+		}
+		while (!g_atomic_int_compare_and_exchange(&rfi->ui_pool_used[i], used, (gint)((guint) used | (1u << bit))));
+
+		if ((guint) used != 0xffffffff)
+		{
+			obj = &rfi->ui_pool[i * 32 + bit];
+			memset(obj, 0, sizeof(RemminaPluginRdpUiObject));
+			rf_object_count(rfi, &rfi->ui_pool_hits);
+			return obj;
+		}
+	}
+
+	/* Pool exhausted, fall back to the heap */
+	rf_object_count(rfi, &rfi->ui_pool_misses);
+	return g_new0(RemminaPluginRdpUiObject, 1);
+}
+
+void rf_object_free(RemminaProtocolWidget* gp, RemminaPluginRdpUiObject* obj)
+{
+	TRACE_CALL("rf_object_free");
+	rfContext* rfi = GET_PLUGIN_DATA(gp);
+	gint idx;
+
+	switch (obj->type)
+	{
+		case REMMINA_RDP_UI_CURSOR:
+			if (obj->cursor.cursor)
+				g_object_unref(obj->cursor.cursor);
+			break;
+
+		default:
+			break;
+	}
+
+	g_atomic_int_add(&rfi->ui_objects_live, -1);
+
+	if (rfi->ui_pool && obj >= rfi->ui_pool && obj < rfi->ui_pool + REMMINA_RDP_UI_POOL_SIZE)
+	{
+		idx = obj - rfi->ui_pool;
+		g_atomic_int_and((guint*) &rfi->ui_pool_used[idx / 32], ~(1u << (idx % 32)));
+	}
+	else
+	{
+		g_free(obj);
+	}
+}
+
+void rf_queue_ui(RemminaProtocolWidget* gp, RemminaPluginRdpUiObject* ui)
+{
+	TRACE_CALL("rf_queue_ui");
+	rfContext* rfi = GET_PLUGIN_DATA(gp);
+	RemminaPluginRdpUiObject* head;
+
+	/* Lock-free push: producers never wait for the GTK thread */
+	g_atomic_int_inc(&rfi->ui_queued);
+	do
+	{
+		head = g_atomic_pointer_get(&rfi->ui_queue);
+		ui->next = head;
+	}
+	while (!g_atomic_pointer_compare_and_exchange(&rfi->ui_queue, head, ui));
+
+	/* Only the producer which flips ui_scheduled adds the idle handler,
+	 * which holds a reference on gp until it is done */
+	if (g_atomic_int_compare_and_exchange(&rfi->ui_scheduled, 0, 1))
+		IDLE_ADD((GSourceFunc) remmina_rdp_event_queue_ui, g_object_ref(gp));
+}
+
+gpointer rf_queue_ui_sync(RemminaProtocolWidget* gp, RemminaPluginRdpUiObject* ui)
+{
+	TRACE_CALL("rf_queue_ui_sync");
+	rfContext* rfi = GET_PLUGIN_DATA(gp);
+	gpointer retptr;
+
+	/* Queue ui and wait for its result, to be used only when the caller
+	 * really needs something back from the GTK thread */
+	ui->sync = TRUE;
+	ui->complete = FALSE;
+	rf_queue_ui(gp, ui);
+
+	CANCEL_DEFER
+	pthread_mutex_lock(&rfi->ui_sync_mutex);
+	pthread_cleanup_push((PThreadCleanupFunc) pthread_mutex_unlock, &rfi->ui_sync_mutex);
+	while (!ui->complete)
+		pthread_cond_wait(&rfi->ui_sync_cond, &rfi->ui_sync_mutex);
+	pthread_cleanup_pop(1);
+	CANCEL_ASYNC
+
+	retptr = ui->retptr;
+	rf_object_free(gp, ui);
+
+	return retptr;
+}
+
+RemminaPluginRdpUiObject* rf_ui_queue_pop(RemminaProtocolWidget* gp)
+{
+	TRACE_CALL("rf_ui_queue_pop");
+	rfContext* rfi = GET_PLUGIN_DATA(gp);
+	RemminaPluginRdpUiObject *ui, *list, *next;
+
+	/* Must be called by the GTK thread only */
+	if (!rfi->ui_fifo)
+	{
+		/* Detach the whole stack at once and reverse it into push order */
+		do
+		{
+			list = g_atomic_pointer_get(&rfi->ui_queue);
+		}
+		while (list && !g_atomic_pointer_compare_and_exchange(&rfi->ui_queue, list, NULL));
+
+		while (list)
+		{
+			next = list->next;
+			list->next = rfi->ui_fifo;
+			rfi->ui_fifo = list;
+			list = next;
+		}
+	}
+
+	ui = rfi->ui_fifo;
+	if (ui)
+	{
+		rfi->ui_fifo = ui->next;
+		ui->next = NULL;
+		g_atomic_int_add(&rfi->ui_queued, -1);
+	}
+
+	return ui;
+}
+
+void rf_ui_queue_complete(RemminaProtocolWidget* gp, RemminaPluginRdpUiObject* ui)
+{
+	TRACE_CALL("rf_ui_queue_complete");
+	rfContext* rfi = GET_PLUGIN_DATA(gp);
+
+	if (ui->sync)
+	{
+		/* Wake up rf_queue_ui_sync(), which owns and frees ui */
+		pthread_mutex_lock(&rfi->ui_sync_mutex);
+		ui->complete = TRUE;
+		pthread_cond_broadcast(&rfi->ui_sync_cond);
+		pthread_mutex_unlock(&rfi->ui_sync_mutex);
+	}
+	else
+	{
+		rf_object_free(gp, ui);
+	}
+}
+
+/* Called by the idle handler once the queue looks drained. Lets producers
+ * schedule it again, and returns TRUE when an object was pushed meanwhile
+ * and the handler must keep running */
+gboolean rf_ui_queue_reschedule(RemminaProtocolWidget* gp)
+{
+	TRACE_CALL("rf_ui_queue_reschedule");
+	rfContext* rfi = GET_PLUGIN_DATA(gp);
+
+	g_atomic_int_set(&rfi->ui_scheduled, 0);
+	return g_atomic_pointer_get(&rfi->ui_queue) != NULL && g_atomic_int_compare_and_exchange(&rfi->ui_scheduled, 0, 1);
+}
+
+void rf_begin_paint(rdpContext* context)
+{
+	TRACE_CALL("rf_begin_paint");
+	rdpGdi* gdi = context->gdi;
+	gdi->primary->hdc->hwnd->invalid->null = 1;
+	gdi->primary->hdc->hwnd->ninvalid = 0;
+}
+
+/* Queued after the damage of the frame, so that the GTK thread acknowledges
+ * the frame once it has handled it */
+static void rf_end_frame(rfContext* rfi)
+{
+	TRACE_CALL("rf_end_frame");
+	RemminaPluginRdpUiObject* ui;
+
+	if (!rfi->frame_end)
+		return;
+
+	ui = rf_object_new(rfi->protocol_widget);
+	ui->type = REMMINA_RDP_UI_FRAME;
+	ui->frame.id = rfi->frame_id;
+	rfi->frame_end = FALSE;
+
+	rf_queue_ui(rfi->protocol_widget, ui);
+}
+
+static void rf_present_copy(rfContext* rfi, gint x, gint y, gint w, gint h)
+{
+	TRACE_CALL("rf_present_copy");
+	rdpGdi* gdi = ((rdpContext*) rfi)->gdi;
+	gint bytes, src_stride, dst_stride, row;
+	UINT8* src;
+	UINT8* dst;
+
+	x = MAX(x, 0);
+	y = MAX(y, 0);
+	w = MIN(w, MIN(gdi->width, cairo_image_surface_get_width(rfi->back_surface)) - x);
+	h = MIN(h, MIN(gdi->height, cairo_image_surface_get_height(rfi->back_surface)) - y);
+	if (w <= 0 || h <= 0)
+		return;
+
+	/* The rows are copied with memcpy(), which the C library already
+	 * implements with the widest vector instructions available */
+	bytes = gdi->bytesPerPixel;
+	src_stride = gdi->width * bytes;
+	dst_stride = cairo_image_surface_get_stride(rfi->back_surface);
+	src = gdi->primary_buffer + y * src_stride + x * bytes;
+	dst = cairo_image_surface_get_data(rfi->back_surface) + y * dst_stride + x * bytes;
+
+	cairo_surface_flush(rfi->back_surface);
+	for (row = 0; row < h; row++)
+	{
+		memcpy(dst, src, w * bytes);
+		src += src_stride;
+		dst += dst_stride;
+	}
+	cairo_surface_mark_dirty_rectangle(rfi->back_surface, x, y, w, h);
+}
+
+/* Copy an area of the primary buffer to the back surface, published by
+ * rf_present_flip(). Must be called with rfi->mutex held. */
+void rf_present_rect(rfContext* rfi, gint x, gint y, gint w, gint h)
+{
+	TRACE_CALL("rf_present_rect");
+	cairo_rectangle_int_t rect;
+	gint i, n;
+
+	if (!rfi->back_surface || !((rdpContext*) rfi)->gdi)
+		return;
+
+	/* The back surface first catches up with what the last swap
+	 * published, the primary buffer still holds it */
+	n = cairo_region_num_rectangles(rfi->back_behind);
+	for (i = 0; i < n; i++)
+	{
+		cairo_region_get_rectangle(rfi->back_behind, i, &rect);
+		rf_present_copy(rfi, rect.x, rect.y, rect.width, rect.height);
+	}
+	if (n > 0)
+	{
+		cairo_region_destroy(rfi->back_behind);
+		rfi->back_behind = cairo_region_create();
+	}
+
+	rf_present_copy(rfi, x, y, w, h);
+	rect.x = x;
+	rect.y = y;
+	rect.width = w;
+	rect.height = h;
+	cairo_region_union_rectangle(rfi->back_ahead, &rect);
+}
+
+/* Make what was presented visible to the GTK thread, at once. When it is
+ * painting from the front surface, the swap is done by rf_present_release().
+ * Must be called with rfi->mutex held. */
+void rf_present_flip(rfContext* rfi)
+{
+	TRACE_CALL("rf_present_flip");
+	cairo_surface_t* surface;
+	cairo_region_t* region;
+
+	if (!rfi->back_surface || cairo_region_is_empty(rfi->back_ahead))
+		return;
+	if (rfi->front_busy)
+	{
+		rfi->flip_pending = TRUE;
+		return;
+	}
+
+	surface = rfi->surface;
+	rfi->surface = rfi->back_surface;
+	rfi->back_surface = surface;
+
+	/* back_behind is empty since the last rf_present_rect() */
+	region = rfi->back_behind;
+	rfi->back_behind = rfi->back_ahead;
+	rfi->back_ahead = region;
+	rfi->flip_pending = FALSE;
+}
+
+/* The front surface, which the GTK thread may read until
+ * rf_present_release() without holding rfi->mutex */
+cairo_surface_t* rf_present_acquire(rfContext* rfi)
+{
+	TRACE_CALL("rf_present_acquire");
+	cairo_surface_t* surface;
+
+	LOCK_BUFFER(0)
+	rfi->front_busy = TRUE;
+	surface = rfi->surface;
+	UNLOCK_BUFFER(0)
+
+	return surface;
+}
+
+void rf_present_release(rfContext* rfi)
+{
+	TRACE_CALL("rf_present_release");
+
+	LOCK_BUFFER(0)
+	rfi->front_busy = FALSE;
+	if (rfi->flip_pending)
+		rf_present_flip(rfi);
+	UNLOCK_BUFFER(0)
+}
+
+static void rf_queue_damage(rfContext* rfi, gint x, gint y, gint w, gint h)
+{
+	TRACE_CALL("rf_queue_damage");
+	RemminaPluginRdpUiObject* ui;
+
+	rf_present_rect(rfi, x, y, w, h);
+
+	ui = rf_object_new(rfi->protocol_widget);
+	ui->type = REMMINA_RDP_UI_UPDATE_REGION;
+	ui->region.x = x;
+	ui->region.y = y;
+	ui->region.width = w;
+	ui->region.height = h;
+	rf_queue_ui(rfi->protocol_widget, ui);
+}
+
+void rf_end_paint(rdpContext* context)
+{
+	TRACE_CALL("rf_end_paint");
+	int i;
+	guint64 area;
+	gboolean scattered;
+	rdpGdi* gdi;
+	HGDI_WND hwnd;
+	rfContext* rfi;
+
+	gdi = context->gdi;
+	rfi = (rfContext*) context;
+	hwnd = gdi->primary->hdc->hwnd;
+
+	if (!hwnd->invalid->null)
+	{
+		/* The decoded areas are published all at once: the GTK thread
+		 * only waits for these copies and the swap, never for the
+		 * decoding */
+		LOCK_BUFFER(1)
+
+		/* Graphics pipeline frames often damage a few small areas far
+		 * apart: redraw them alone rather than their whole bounding box */
+		scattered = FALSE;
+		if (hwnd->ninvalid > 1 && hwnd->ninvalid <= REMMINA_RDP_MAX_DAMAGE_RECTS)
+		{
+			area = 0;
+			for (i = 0; i < hwnd->ninvalid; i++)
+				area += (guint64) hwnd->cinvalid[i].w * hwnd->cinvalid[i].h;
+			scattered = area * 2 < (guint64) hwnd->invalid->w * hwnd->invalid->h;
+		}
+
+		if (scattered)
+		{
+			for (i = 0; i < hwnd->ninvalid; i++)
+				rf_queue_damage(rfi, hwnd->cinvalid[i].x, hwnd->cinvalid[i].y,
+					hwnd->cinvalid[i].w, hwnd->cinvalid[i].h);
+		}
+		else
+		{
+			rf_queue_damage(rfi, hwnd->invalid->x, hwnd->invalid->y,
+				hwnd->invalid->w, hwnd->invalid->h);
+		}
+		rf_present_flip(rfi);
+
+		UNLOCK_BUFFER(1)
+	}
+
+	rf_end_frame(rfi);
+}
@@ -0,0 +1,522 @@
+/*
+ * Remmina - The GTK+ Remote Desktop Client
+ * Copyright (C) 2010-2011 Vic Lee
+ * Copyright (C) 2014-2015 Antenore Gatta, Fabio Castelli, Giovanni Panozzo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL. *  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so. *  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version. *  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ *
+ */
+
+/* Capture of the updates sent by the server.
+ *
+ * When the profile has a "capture" file name, the bitmap updates, surface
+ * bits, graphics pipeline PDUs and pointer updates are written to it as they
+ * arrive, together with the paint boundaries. remmina-rdp-replay (rdp_replay.c) replays such a
+ * capture offline, without a server or a window, to measure the rendering
+ * path. The format is described in rdp_record.h. */
+
+#include "rdp_plugin.h"
+#include "rdp_record.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+struct rf_recorder
+{
+	FILE* file;
+	pBeginPaint BeginPaint;
+	pEndPaint EndPaint;
+	pBitmapUpdate BitmapUpdate;
+	pSurfaceBits SurfaceBits;
+	pPointerPosition PointerPosition;
+	pPointerSystem PointerSystem;
+	pPointerNew PointerNew;
+	pPointerCached PointerCached;
+	/* Graphics pipeline callbacks of the GDI */
+	RdpgfxClientContext gfx;
+};
+
+/* Set on the dynamic channel thread while it handles a graphics pipeline
+ * PDU: the paints it does then are replayed with the PDU, not recorded */
+static GPrivate rf_record_in_gfx;
+
+static void rf_record_write(rfContext* rfi, rfRecordType type, const guint32* fields, guint32 nfields,
+	const void* data0, guint32 length0, const void* data1, guint32 length1)
+{
+	TRACE_CALL("rf_record_write");
+	rfRecorder* rec = rfi->recorder;
+	rfRecordHeader header;
+	gboolean ok;
+
+	if (!rec->file)
+		return;
+
+	header.type = type;
+	header.nfields = nfields;
+	header.length[0] = data0 ? length0 : 0;
+	header.length[1] = data1 ? length1 : 0;
+
+	/* Never leave the stream locked if we are cancelled. The graphics
+	 * pipeline records come from another thread than the others. */
+	CANCEL_DEFER
+	flockfile(rec->file);
+	ok = fwrite(&header, sizeof(header), 1, rec->file) == 1 &&
+		fwrite(fields, sizeof(guint32), nfields, rec->file) == nfields &&
+		fwrite(data0, 1, header.length[0], rec->file) == header.length[0] &&
+		fwrite(data1, 1, header.length[1], rec->file) == header.length[1];
+	funlockfile(rec->file);
+	if (!ok)
+	{
+		remmina_plugin_service->log_printf("[RDP] unable to write the capture, recording stopped: %s\n",
+			g_strerror(errno));
+		fclose(rec->file);
+		rec->file = NULL;
+	}
+	CANCEL_ASYNC
+}
+
+static void rf_record_begin_paint(rdpContext* context)
+{
+	TRACE_CALL("rf_record_begin_paint");
+	rfContext* rfi = (rfContext*) context;
+
+	if (!g_private_get(&rf_record_in_gfx))
+		rf_record_write(rfi, RF_RECORD_BEGIN_PAINT, NULL, 0, NULL, 0, NULL, 0);
+	IFCALL(rfi->recorder->BeginPaint, context);
+}
+
+static void rf_record_end_paint(rdpContext* context)
+{
+	TRACE_CALL("rf_record_end_paint");
+	rfContext* rfi = (rfContext*) context;
+
+	if (!g_private_get(&rf_record_in_gfx))
+		rf_record_write(rfi, RF_RECORD_END_PAINT, NULL, 0, NULL, 0, NULL, 0);
+	IFCALL(rfi->recorder->EndPaint, context);
+}
+
+static void rf_record_bitmap_update(rdpContext* context, BITMAP_UPDATE* bitmap)
+{
+	TRACE_CALL("rf_record_bitmap_update");
+	rfContext* rfi = (rfContext*) context;
+	BITMAP_DATA* b;
+	guint32 fields[13];
+	UINT32 i;
+
+	/* One record per rectangle, each is replayed as an update of its own */
+	for (i = 0; i < bitmap->number; i++)
+	{
+		b = &bitmap->rectangles[i];
+		fields[0] = b->destLeft;
+		fields[1] = b->destTop;
+		fields[2] = b->destRight;
+		fields[3] = b->destBottom;
+		fields[4] = b->width;
+		fields[5] = b->height;
+		fields[6] = b->bitsPerPixel;
+		fields[7] = b->flags;
+		fields[8] = b->compressed;
+		fields[9] = b->cbCompFirstRowSize;
+		fields[10] = b->cbCompMainBodySize;
+		fields[11] = b->cbScanWidth;
+		fields[12] = b->cbUncompressedSize;
+		rf_record_write(rfi, RF_RECORD_BITMAP, fields, 13, b->bitmapDataStream, b->bitmapLength, NULL, 0);
+	}
+
+	IFCALL(rfi->recorder->BitmapUpdate, context, bitmap);
+}
+
+static void rf_record_surface_bits(rdpContext* context, SURFACE_BITS_COMMAND* cmd)
+{
+	TRACE_CALL("rf_record_surface_bits");
+	rfContext* rfi = (rfContext*) context;
+	guint32 fields[9];
+
+	fields[0] = cmd->cmdType;
+	fields[1] = cmd->destLeft;
+	fields[2] = cmd->destTop;
+	fields[3] = cmd->destRight;
+	fields[4] = cmd->destBottom;
+	fields[5] = cmd->bpp;
+	fields[6] = cmd->codecID;
+	fields[7] = cmd->width;
+	fields[8] = cmd->height;
+	rf_record_write(rfi, RF_RECORD_SURFACE_BITS, fields, 9, cmd->bitmapData, cmd->bitmapDataLength, NULL, 0);
+
+	IFCALL(rfi->recorder->SurfaceBits, context, cmd);
+}
+
+static void rf_record_pointer_position(rdpContext* context, POINTER_POSITION_UPDATE* pointer_position)
+{
+	TRACE_CALL("rf_record_pointer_position");
+	rfContext* rfi = (rfContext*) context;
+	guint32 fields[2];
+
+	fields[0] = pointer_position->xPos;
+	fields[1] = pointer_position->yPos;
+	rf_record_write(rfi, RF_RECORD_POINTER_POSITION, fields, 2, NULL, 0, NULL, 0);
+
+	IFCALL(rfi->recorder->PointerPosition, context, pointer_position);
+}
+
+static void rf_record_pointer_system(rdpContext* context, POINTER_SYSTEM_UPDATE* pointer_system)
+{
+	TRACE_CALL("rf_record_pointer_system");
+	rfContext* rfi = (rfContext*) context;
+	guint32 fields[1];
+
+	fields[0] = pointer_system->type;
+	rf_record_write(rfi, RF_RECORD_POINTER_SYSTEM, fields, 1, NULL, 0, NULL, 0);
+
+	IFCALL(rfi->recorder->PointerSystem, context, pointer_system);
+}
+
+static void rf_record_pointer_new(rdpContext* context, POINTER_NEW_UPDATE* pointer_new)
+{
+	TRACE_CALL("rf_record_pointer_new");
+	rfContext* rfi = (rfContext*) context;
+	POINTER_COLOR_UPDATE* color = &pointer_new->colorPtrAttr;
+	guint32 fields[6];
+
+	fields[0] = pointer_new->xorBpp;
+	fields[1] = color->cacheIndex;
+	fields[2] = color->xPos;
+	fields[3] = color->yPos;
+	fields[4] = color->width;
+	fields[5] = color->height;
+	rf_record_write(rfi, RF_RECORD_POINTER_NEW, fields, 6,
+		color->xorMaskData, color->lengthXorMask, color->andMaskData, color->lengthAndMask);
+
+	IFCALL(rfi->recorder->PointerNew, context, pointer_new);
+}
+
+static void rf_record_pointer_cached(rdpContext* context, POINTER_CACHED_UPDATE* pointer_cached)
+{
+	TRACE_CALL("rf_record_pointer_cached");
+	rfContext* rfi = (rfContext*) context;
+	guint32 fields[1];
+
+	fields[0] = pointer_cached->cacheIndex;
+	rf_record_write(rfi, RF_RECORD_POINTER_CACHED, fields, 1, NULL, 0, NULL, 0);
+
+	IFCALL(rfi->recorder->PointerCached, context, pointer_cached);
+}
+
+/* Record a graphics pipeline PDU before the GDI handles it, the paints
+ * done meanwhile are part of it */
+static rfRecorder* rf_record_gfx_begin(RdpgfxClientContext* context, rfRecordType type, const guint32* fields, guint32 nfields,
+	const void* data, guint32 length)
+{
+	TRACE_CALL("rf_record_gfx_begin");
+	rfContext* rfi = (rfContext*) ((rdpGdi*) context->custom)->context;
+
+	rf_record_write(rfi, type, fields, nfields, data, length, NULL, 0);
+	g_private_set(&rf_record_in_gfx, GINT_TO_POINTER(TRUE));
+
+	return rfi->recorder;
+}
+
+static int rf_record_gfx_end(int status)
+{
+	TRACE_CALL("rf_record_gfx_end");
+	g_private_set(&rf_record_in_gfx, NULL);
+	return status;
+}
+
+static int rf_record_gfx_reset_graphics(RdpgfxClientContext* context, RDPGFX_RESET_GRAPHICS_PDU* pdu)
+{
+	TRACE_CALL("rf_record_gfx_reset_graphics");
+	rfRecorder* rec;
+	guint32 fields[3];
+
+	fields[0] = pdu->width;
+	fields[1] = pdu->height;
+	fields[2] = pdu->monitorCount;
+	rec = rf_record_gfx_begin(context, RF_RECORD_GFX_RESET_GRAPHICS, fields, 3,
+		pdu->monitorDefArray, pdu->monitorCount * sizeof(MONITOR_DEF));
+	return rf_record_gfx_end(rec->gfx.ResetGraphics(context, pdu));
+}
+
+static int rf_record_gfx_start_frame(RdpgfxClientContext* context, RDPGFX_START_FRAME_PDU* pdu)
+{
+	TRACE_CALL("rf_record_gfx_start_frame");
+	rfRecorder* rec;
+	guint32 fields[2];
+
+	fields[0] = pdu->timestamp;
+	fields[1] = pdu->frameId;
+	rec = rf_record_gfx_begin(context, RF_RECORD_GFX_START_FRAME, fields, 2, NULL, 0);
+	return rf_record_gfx_end(rec->gfx.StartFrame(context, pdu));
+}
+
+static int rf_record_gfx_end_frame(RdpgfxClientContext* context, RDPGFX_END_FRAME_PDU* pdu)
+{
+	TRACE_CALL("rf_record_gfx_end_frame");
+	rfRecorder* rec;
+	guint32 fields[1];
+
+	fields[0] = pdu->frameId;
+	rec = rf_record_gfx_begin(context, RF_RECORD_GFX_END_FRAME, fields, 1, NULL, 0);
+	return rf_record_gfx_end(rec->gfx.EndFrame(context, pdu));
+}
+
+static int rf_record_gfx_surface_command(RdpgfxClientContext* context, RDPGFX_SURFACE_COMMAND* cmd)
+{
+	TRACE_CALL("rf_record_gfx_surface_command");
+	rfRecorder* rec;
+	guint32 fields[10];
+
+	/* The H.264 metablock parsed by the channel (cmd->extra) is not kept,
+	 * such commands are counted but not replayed */
+	fields[0] = cmd->surfaceId;
+	fields[1] = cmd->codecId;
+	fields[2] = cmd->contextId;
+	fields[3] = cmd->format;
+	fields[4] = cmd->left;
+	fields[5] = cmd->top;
+	fields[6] = cmd->right;
+	fields[7] = cmd->bottom;
+	fields[8] = cmd->width;
+	fields[9] = cmd->height;
+	rec = rf_record_gfx_begin(context, RF_RECORD_GFX_SURFACE_COMMAND, fields, 10, cmd->data, cmd->length);
+	return rf_record_gfx_end(rec->gfx.SurfaceCommand(context, cmd));
+}
+
+static int rf_record_gfx_create_surface(RdpgfxClientContext* context, RDPGFX_CREATE_SURFACE_PDU* pdu)
+{
+	TRACE_CALL("rf_record_gfx_create_surface");
+	rfRecorder* rec;
+	guint32 fields[4];
+
+	fields[0] = pdu->surfaceId;
+	fields[1] = pdu->width;
+	fields[2] = pdu->height;
+	fields[3] = pdu->pixelFormat;
+	rec = rf_record_gfx_begin(context, RF_RECORD_GFX_CREATE_SURFACE, fields, 4, NULL, 0);
+	return rf_record_gfx_end(rec->gfx.CreateSurface(context, pdu));
+}
+
+static int rf_record_gfx_delete_surface(RdpgfxClientContext* context, RDPGFX_DELETE_SURFACE_PDU* pdu)
+{
+	TRACE_CALL("rf_record_gfx_delete_surface");
+	rfRecorder* rec;
+	guint32 fields[1];
+
+	fields[0] = pdu->surfaceId;
+	rec = rf_record_gfx_begin(context, RF_RECORD_GFX_DELETE_SURFACE, fields, 1, NULL, 0);
+	return rf_record_gfx_end(rec->gfx.DeleteSurface(context, pdu));
+}
+
+static int rf_record_gfx_solid_fill(RdpgfxClientContext* context, RDPGFX_SOLID_FILL_PDU* pdu)
+{
+	TRACE_CALL("rf_record_gfx_solid_fill");
+	rfRecorder* rec;
+	guint32 fields[3];
+
+	fields[0] = pdu->surfaceId;
+	fields[1] = pdu->fillPixel.B | (pdu->fillPixel.G << 8) | (pdu->fillPixel.R << 16) | ((guint32) pdu->fillPixel.XA << 24);
+	fields[2] = pdu->fillRectCount;
+	rec = rf_record_gfx_begin(context, RF_RECORD_GFX_SOLID_FILL, fields, 3,
+		pdu->fillRects, pdu->fillRectCount * sizeof(RDPGFX_RECT16));
+	return rf_record_gfx_end(rec->gfx.SolidFill(context, pdu));
+}
+
+static int rf_record_gfx_surface_to_surface(RdpgfxClientContext* context, RDPGFX_SURFACE_TO_SURFACE_PDU* pdu)
+{
+	TRACE_CALL("rf_record_gfx_surface_to_surface");
+	rfRecorder* rec;
+	guint32 fields[7];
+
+	fields[0] = pdu->surfaceIdSrc;
+	fields[1] = pdu->surfaceIdDest;
+	fields[2] = pdu->rectSrc.left;
+	fields[3] = pdu->rectSrc.top;
+	fields[4] = pdu->rectSrc.right;
+	fields[5] = pdu->rectSrc.bottom;
+	fields[6] = pdu->destPtsCount;
+	rec = rf_record_gfx_begin(context, RF_RECORD_GFX_SURFACE_TO_SURFACE, fields, 7,
+		pdu->destPts, pdu->destPtsCount * sizeof(RDPGFX_POINT16));
+	return rf_record_gfx_end(rec->gfx.SurfaceToSurface(context, pdu));
+}
+
+static int rf_record_gfx_surface_to_cache(RdpgfxClientContext* context, RDPGFX_SURFACE_TO_CACHE_PDU* pdu)
+{
+	TRACE_CALL("rf_record_gfx_surface_to_cache");
+	rfRecorder* rec;
+	guint32 fields[8];
+
+	fields[0] = pdu->surfaceId;
+	fields[1] = pdu->cacheKey & 0xFFFFFFFF;
+	fields[2] = pdu->cacheKey >> 32;
+	fields[3] = pdu->cacheSlot;
+	fields[4] = pdu->rectSrc.left;
+	fields[5] = pdu->rectSrc.top;
+	fields[6] = pdu->rectSrc.right;
+	fields[7] = pdu->rectSrc.bottom;
+	rec = rf_record_gfx_begin(context, RF_RECORD_GFX_SURFACE_TO_CACHE, fields, 8, NULL, 0);
+	return rf_record_gfx_end(rec->gfx.SurfaceToCache(context, pdu));
+}
+
+static int rf_record_gfx_cache_to_surface(RdpgfxClientContext* context, RDPGFX_CACHE_TO_SURFACE_PDU* pdu)
+{
+	TRACE_CALL("rf_record_gfx_cache_to_surface");
+	rfRecorder* rec;
+	guint32 fields[3];
+
+	fields[0] = pdu->cacheSlot;
+	fields[1] = pdu->surfaceId;
+	fields[2] = pdu->destPtsCount;
+	rec = rf_record_gfx_begin(context, RF_RECORD_GFX_CACHE_TO_SURFACE, fields, 3,
+		pdu->destPts, pdu->destPtsCount * sizeof(RDPGFX_POINT16));
+	return rf_record_gfx_end(rec->gfx.CacheToSurface(context, pdu));
+}
+
+static int rf_record_gfx_evict_cache_entry(RdpgfxClientContext* context, RDPGFX_EVICT_CACHE_ENTRY_PDU* pdu)
+{
+	TRACE_CALL("rf_record_gfx_evict_cache_entry");
+	rfRecorder* rec;
+	guint32 fields[1];
+
+	fields[0] = pdu->cacheSlot;
+	rec = rf_record_gfx_begin(context, RF_RECORD_GFX_EVICT_CACHE_ENTRY, fields, 1, NULL, 0);
+	return rf_record_gfx_end(rec->gfx.EvictCacheEntry(context, pdu));
+}
+
+static int rf_record_gfx_map_surface_to_output(RdpgfxClientContext* context, RDPGFX_MAP_SURFACE_TO_OUTPUT_PDU* pdu)
+{
+	TRACE_CALL("rf_record_gfx_map_surface_to_output");
+	rfRecorder* rec;
+	guint32 fields[3];
+
+	fields[0] = pdu->surfaceId;
+	fields[1] = pdu->outputOriginX;
+	fields[2] = pdu->outputOriginY;
+	rec = rf_record_gfx_begin(context, RF_RECORD_GFX_MAP_SURFACE_TO_OUTPUT, fields, 3, NULL, 0);
+	return rf_record_gfx_end(rec->gfx.MapSurfaceToOutput(context, pdu));
+}
+
+/* Start recording if asked to, once the update callbacks are all in place */
+void rf_record_open(rfContext* rfi)
+{
+	TRACE_CALL("rf_record_open");
+	rdpUpdate* update = rfi->instance->update;
+	rfRecorder* rec;
+	rfRecordFileHeader header;
+	RemminaFile* remminafile;
+	const gchar* filename;
+	FILE* file;
+
+	remminafile = remmina_plugin_service->protocol_plugin_get_file(rfi->protocol_widget);
+	filename = remmina_plugin_service->file_get_string(remminafile, "capture");
+	if (!filename || !filename[0] || rfi->recorder)
+		return;
+
+	file = fopen(filename, "wb");
+	if (!file)
+	{
+		remmina_plugin_service->log_printf("[RDP] unable to create capture %s: %s\n", filename, g_strerror(errno));
+		return;
+	}
+
+	header.magic = RF_RECORD_MAGIC;
+	header.version = RF_RECORD_VERSION;
+	header.width = rfi->settings->DesktopWidth;
+	header.height = rfi->settings->DesktopHeight;
+	header.depth = rfi->settings->ColorDepth;
+	header.remotefx = rfi->settings->RemoteFxCodec;
+	if (fwrite(&header, sizeof(header), 1, file) != 1)
+	{
+		remmina_plugin_service->log_printf("[RDP] unable to write capture %s: %s\n", filename, g_strerror(errno));
+		fclose(file);
+		return;
+	}
+
+	rec = g_new0(rfRecorder, 1);
+	rec->file = file;
+
+	rec->BeginPaint = update->BeginPaint;
+	update->BeginPaint = rf_record_begin_paint;
+	rec->EndPaint = update->EndPaint;
+	update->EndPaint = rf_record_end_paint;
+	rec->BitmapUpdate = update->BitmapUpdate;
+	update->BitmapUpdate = rf_record_bitmap_update;
+	rec->SurfaceBits = update->SurfaceBits;
+	update->SurfaceBits = rf_record_surface_bits;
+	rec->PointerPosition = update->pointer->PointerPosition;
+	update->pointer->PointerPosition = rf_record_pointer_position;
+	rec->PointerSystem = update->pointer->PointerSystem;
+	update->pointer->PointerSystem = rf_record_pointer_system;
+	rec->PointerNew = update->pointer->PointerNew;
+	update->pointer->PointerNew = rf_record_pointer_new;
+	rec->PointerCached = update->pointer->PointerCached;
+	update->pointer->PointerCached = rf_record_pointer_cached;
+
+	rfi->recorder = rec;
+	remmina_plugin_service->log_printf("[RDP] recording updates to %s\n", filename);
+}
+
+/* Record the graphics pipeline too, once gdi_graphics_pipeline_init() has
+ * installed the GDI callbacks */
+void rf_record_gfx_open(rfContext* rfi, RdpgfxClientContext* gfx)
+{
+	TRACE_CALL("rf_record_gfx_open");
+	rfRecorder* rec = rfi->recorder;
+
+	if (!rec)
+		return;
+
+	rec->gfx = *gfx;
+	gfx->ResetGraphics = rf_record_gfx_reset_graphics;
+	gfx->StartFrame = rf_record_gfx_start_frame;
+	gfx->EndFrame = rf_record_gfx_end_frame;
+	gfx->SurfaceCommand = rf_record_gfx_surface_command;
+	gfx->CreateSurface = rf_record_gfx_create_surface;
+	gfx->DeleteSurface = rf_record_gfx_delete_surface;
+	gfx->SolidFill = rf_record_gfx_solid_fill;
+	gfx->SurfaceToSurface = rf_record_gfx_surface_to_surface;
+	gfx->SurfaceToCache = rf_record_gfx_surface_to_cache;
+	gfx->CacheToSurface = rf_record_gfx_cache_to_surface;
+	gfx->EvictCacheEntry = rf_record_gfx_evict_cache_entry;
+	gfx->MapSurfaceToOutput = rf_record_gfx_map_surface_to_output;
+}
+
+/* Called once the RDP thread and the channels are gone */
+void rf_record_close(rfContext* rfi)
+{
+	TRACE_CALL("rf_record_close");
+
+	if (!rfi->recorder)
+		return;
+
+	if (rfi->recorder->file)
+		fclose(rfi->recorder->file);
+	g_free(rfi->recorder);
+	rfi->recorder = NULL;
+}
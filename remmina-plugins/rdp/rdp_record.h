@@ -0,0 +1,104 @@
+/*
+ * Remmina - The GTK+ Remote Desktop Client
+ * Copyright (C) 2010-2011 Vic Lee
+ * Copyright (C) 2014-2015 Antenore Gatta, Fabio Castelli, Giovanni Panozzo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL. *  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so. *  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version. *  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ *
+ */
+
+#ifndef __REMMINA_RDP_RECORD_H__
+#define __REMMINA_RDP_RECORD_H__
+
+#include "rdp_plugin.h"
+
+G_BEGIN_DECLS
+
+/* Capture of the updates received from the server, replayed offline by
+ * remmina-rdp-replay (rdp_replay.c).
+ *
+ * A capture is a file header followed by records. Each record is a header,
+ * nfields 32 bit fields, then two data blocks of the given lengths, all in
+ * host byte order: a capture is replayed where it was made. */
+
+#define RF_RECORD_MAGIC		0x43524452	/* "RDRC" */
+#define RF_RECORD_VERSION	2
+#define RF_RECORD_MAX_FIELDS	16
+
+typedef enum
+{
+	RF_RECORD_BEGIN_PAINT,
+	RF_RECORD_END_PAINT,
+	RF_RECORD_BITMAP,
+	RF_RECORD_SURFACE_BITS,
+	RF_RECORD_POINTER_POSITION,
+	RF_RECORD_POINTER_SYSTEM,
+	RF_RECORD_POINTER_NEW,
+	RF_RECORD_POINTER_CACHED,
+	/* Graphics pipeline PDUs, arrays in host layout as data blocks */
+	RF_RECORD_GFX_RESET_GRAPHICS,
+	RF_RECORD_GFX_START_FRAME,
+	RF_RECORD_GFX_END_FRAME,
+	RF_RECORD_GFX_SURFACE_COMMAND,
+	RF_RECORD_GFX_CREATE_SURFACE,
+	RF_RECORD_GFX_DELETE_SURFACE,
+	RF_RECORD_GFX_SOLID_FILL,
+	RF_RECORD_GFX_SURFACE_TO_SURFACE,
+	RF_RECORD_GFX_SURFACE_TO_CACHE,
+	RF_RECORD_GFX_CACHE_TO_SURFACE,
+	RF_RECORD_GFX_EVICT_CACHE_ENTRY,
+	RF_RECORD_GFX_MAP_SURFACE_TO_OUTPUT,
+	RF_RECORD_TYPES
+} rfRecordType;
+
+typedef struct
+{
+	guint32 magic;
+	guint32 version;
+	guint32 width;
+	guint32 height;
+	guint32 depth;
+	guint32 remotefx;
+} rfRecordFileHeader;
+
+typedef struct
+{
+	guint32 type;
+	guint32 nfields;
+	guint32 length[2];
+} rfRecordHeader;
+
+void rf_record_open(rfContext* rfi);
+void rf_record_gfx_open(rfContext* rfi, RdpgfxClientContext* gfx);
+void rf_record_close(rfContext* rfi);
+
+G_END_DECLS
+
+#endif
+
@@ -0,0 +1,853 @@
+/*
+ * Remmina - The GTK+ Remote Desktop Client
+ * Copyright (C) 2010-2011 Vic Lee
+ * Copyright (C) 2014-2015 Antenore Gatta, Fabio Castelli, Giovanni Panozzo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL. *  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so. *  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version. *  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ *
+ */
+
+/* Offline replay of the updates captured by the RDP plugin, see rdp_record.c.
+ *
+ *   remmina-rdp-replay [--scale=WIDTHxHEIGHT] CAPTURE
+ *
+ * Nothing is connected and nothing is displayed. A thread standing for the
+ * RDP thread sends the captured updates, as fast as possible, through the
+ * FreeRDP GDI, the plugin update and pointer callbacks of rdp_gdi.c and
+ * rdp_graphics.c and the paint path of rdp_present.c: the double buffered
+ * surface and the UI queue. The main thread stands for the GTK thread: its
+ * main loop runs the queue handler, which paints the damage from the front
+ * surface onto a surface standing for the window, scaled when asked to.
+ *
+ * That handler is the replay's own, rdp_event.c needs a widget: it paints
+ * the way the draw handler does, and converts new cursors into pixbufs as
+ * there is no display to make cursors for. Each frame is timed from its
+ * first update until the queue handler finds the queue empty after its end.
+ * Graphics pipeline PDUs go through the GDI pipeline callbacks, H.264
+ * surface commands excepted: their metablock is not captured. */
+
+#include "rdp_plugin.h"
+#include "rdp_gdi.h"
+#include "rdp_graphics.h"
+#include "rdp_event.h"
+#include "rdp_record.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <freerdp/freerdp.h>
+#include <freerdp/gdi/gdi.h>
+#include <freerdp/codec/rfx.h>
+#include <freerdp/gdi/gfx.h>
+
+static const gchar* rf_replay_type_names[RF_RECORD_TYPES] =
+{
+	"begin paint",
+	"end paint",
+	"bitmap",
+	"surface bits",
+	"pointer position",
+	"pointer system",
+	"pointer new",
+	"pointer cached",
+	"gfx reset",
+	"gfx start frame",
+	"gfx end frame",
+	"gfx surface cmd",
+	"gfx create surf",
+	"gfx delete surf",
+	"gfx solid fill",
+	"gfx surf to surf",
+	"gfx surf to cache",
+	"gfx cache to surf",
+	"gfx evict cache",
+	"gfx map surface"
+};
+
+typedef struct
+{
+	const gchar* name;
+	const gchar* contents;
+	gsize size;
+	rdpContext* context;
+	RdpgfxClientContext* gfx;
+	GMainLoop* loop;
+
+	/* The surface standing for the window */
+	cairo_surface_t* window;
+	gdouble scale_x;
+	gdouble scale_y;
+
+	/* Start time of the frames not known to be on the window yet, oldest
+	 * first. Pushed by the RDP thread, popped by the GTK thread. */
+	GAsyncQueue* frames_pending;
+	gint64 frame_start;
+
+	/* Data the graphics pipeline channel keeps for the GDI */
+	GHashTable* gfx_surfaces;
+	GHashTable* gfx_cache_slots;
+
+	/* RDP thread statistics */
+	gint64 calls[RF_RECORD_TYPES];
+	gint64 skipped[RF_RECORD_TYPES];
+	gint64 elapsed[RF_RECORD_TYPES];
+	gint64 queued_sum;
+	gint queued_peak;
+	guint paints;
+
+	/* GTK thread statistics */
+	gint64 latency_sum;
+	gint64 latency_max;
+	guint frames;
+	gint64 region_time;
+	guint regions;
+	guint frame_acks;
+	guint cursors_new;
+	guint cursors_changed;
+} rfReplay;
+
+static rfReplay replay;
+
+/* rdp_present.c logs through the plugin service, here to the standard output */
+static RemminaPluginService rf_replay_service;
+RemminaPluginService* remmina_plugin_service = &rf_replay_service;
+
+static void rf_replay_log_printf(const gchar* fmt, ...)
+{
+	TRACE_CALL("rf_replay_log_printf");
+	va_list args;
+
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+}
+
+static int rf_replay_gfx_get_surface_ids(RdpgfxClientContext* context, UINT16** ids, UINT16* count)
+{
+	TRACE_CALL("rf_replay_gfx_get_surface_ids");
+	GHashTableIter iter;
+	gpointer key;
+	UINT16 i = 0;
+
+	*count = g_hash_table_size(replay.gfx_surfaces);
+	*ids = *count ? (UINT16*) calloc(*count, sizeof(UINT16)) : NULL;
+	g_hash_table_iter_init(&iter, replay.gfx_surfaces);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+		(*ids)[i++] = GPOINTER_TO_UINT(key);
+
+	return 1;
+}
+
+static int rf_replay_gfx_set_surface_data(RdpgfxClientContext* context, UINT16 id, void* data)
+{
+	TRACE_CALL("rf_replay_gfx_set_surface_data");
+	if (data)
+		g_hash_table_insert(replay.gfx_surfaces, GUINT_TO_POINTER(id), data);
+	else
+		g_hash_table_remove(replay.gfx_surfaces, GUINT_TO_POINTER(id));
+	return 1;
+}
+
+static void* rf_replay_gfx_get_surface_data(RdpgfxClientContext* context, UINT16 id)
+{
+	TRACE_CALL("rf_replay_gfx_get_surface_data");
+	return g_hash_table_lookup(replay.gfx_surfaces, GUINT_TO_POINTER(id));
+}
+
+static int rf_replay_gfx_set_cache_slot_data(RdpgfxClientContext* context, UINT16 slot, void* data)
+{
+	TRACE_CALL("rf_replay_gfx_set_cache_slot_data");
+	if (data)
+		g_hash_table_insert(replay.gfx_cache_slots, GUINT_TO_POINTER(slot), data);
+	else
+		g_hash_table_remove(replay.gfx_cache_slots, GUINT_TO_POINTER(slot));
+	return 1;
+}
+
+static void* rf_replay_gfx_get_cache_slot_data(RdpgfxClientContext* context, UINT16 slot)
+{
+	TRACE_CALL("rf_replay_gfx_get_cache_slot_data");
+	return g_hash_table_lookup(replay.gfx_cache_slots, GUINT_TO_POINTER(slot));
+}
+
+/* The frame reaches the window once the queue handler has drained what
+ * this paint queued */
+static void rf_replay_end_paint(rdpContext* context)
+{
+	TRACE_CALL("rf_replay_end_paint");
+	rfContext* rfi = (rfContext*) context;
+	gboolean shown;
+	gint64* start;
+	gint queued;
+
+	shown = !context->gdi->primary->hdc->hwnd->invalid->null || rfi->frame_end;
+
+	rf_end_paint(context);
+
+	if (shown)
+	{
+		start = g_slice_new(gint64);
+		*start = replay.frame_start;
+		g_async_queue_push(replay.frames_pending, start);
+	}
+	replay.frame_start = 0;
+
+	queued = g_atomic_int_get(&rfi->ui_queued);
+	replay.queued_peak = MAX(replay.queued_peak, queued);
+	replay.queued_sum += queued;
+	replay.paints++;
+}
+
+/* Same painting as remmina_rdp_event_on_draw(), and the rescaling of
+ * remmina_rdp_event_scaled_surface_update(), at once */
+static void rf_replay_update_region(rfContext* rfi, RemminaPluginRdpUiObject* ui)
+{
+	TRACE_CALL("rf_replay_update_region");
+	gint64 t;
+	cairo_t* cr;
+
+	t = g_get_monotonic_time();
+
+	cr = cairo_create(replay.window);
+	cairo_scale(cr, replay.scale_x, replay.scale_y);
+	cairo_rectangle(cr, ui->region.x, ui->region.y, ui->region.width, ui->region.height);
+	cairo_clip(cr);
+	cairo_set_source_surface(cr, rf_present_acquire(rfi), 0, 0);
+	if (replay.scale_x != 1.0 || replay.scale_y != 1.0)
+		cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_GOOD);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_paint(cr);
+	cairo_destroy(cr);
+	rf_present_release(rfi);
+	cairo_surface_flush(replay.window);
+
+	replay.region_time += g_get_monotonic_time() - t;
+	replay.regions++;
+}
+
+static void rf_replay_cursor(rfContext* rfi, RemminaPluginRdpUiObject* ui)
+{
+	TRACE_CALL("rf_replay_cursor");
+	rdpPointer* pointer;
+	cairo_surface_t* surface;
+	GdkPixbuf* pixbuf;
+	UINT8* data;
+
+	switch (ui->cursor.type)
+	{
+		case REMMINA_RDP_POINTER_NEW:
+			/* As remmina_rdp_event_create_cursor(), the pixbuf standing
+			 * for the cursor */
+			pointer = (rdpPointer*) ui->cursor.pointer;
+			data = malloc(pointer->width * pointer->height * 4);
+			freerdp_alpha_cursor_convert(data, pointer->xorMaskData, pointer->andMaskData, pointer->width, pointer->height, pointer->xorBpp, rfi->clrconv);
+			surface = cairo_image_surface_create_for_data(data, CAIRO_FORMAT_ARGB32, pointer->width, pointer->height, cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, pointer->width));
+			pixbuf = gdk_pixbuf_get_from_surface(surface, 0, 0, pointer->width, pointer->height);
+			cairo_surface_destroy(surface);
+			free(data);
+
+			rf_pointer_cache_insert(rfi, pointer, (GdkCursor*) pixbuf);
+			ui->retptr = pixbuf;
+			replay.cursors_new++;
+			break;
+
+		case REMMINA_RDP_POINTER_FREE:
+			break;
+
+		default:
+			replay.cursors_changed++;
+			break;
+	}
+}
+
+/* Every frame which ended before the queue was found empty is on the window */
+static void rf_replay_frames_shown(gint n)
+{
+	TRACE_CALL("rf_replay_frames_shown");
+	gint64 now, latency;
+	gint64* start;
+
+	now = g_get_monotonic_time();
+	while (n-- > 0)
+	{
+		start = g_async_queue_pop(replay.frames_pending);
+		latency = now - *start;
+		replay.latency_sum += latency;
+		replay.latency_max = MAX(replay.latency_max, latency);
+		replay.frames++;
+		g_slice_free(gint64, start);
+	}
+}
+
+/* The queue handler of the GTK thread, in place of the one of rdp_event.c */
+gboolean remmina_rdp_event_queue_ui(RemminaProtocolWidget* gp)
+{
+	TRACE_CALL("remmina_rdp_event_queue_ui");
+	rfContext* rfi = GET_PLUGIN_DATA(gp);
+	RemminaPluginRdpUiObject* ui;
+	gint ended;
+
+	ended = g_async_queue_length(replay.frames_pending);
+	ui = rf_ui_queue_pop(gp);
+
+	if (ui)
+	{
+		switch (ui->type)
+		{
+			case REMMINA_RDP_UI_UPDATE_REGION:
+				rf_replay_update_region(rfi, ui);
+				break;
+
+			case REMMINA_RDP_UI_CURSOR:
+				rf_replay_cursor(rfi, ui);
+				break;
+
+			case REMMINA_RDP_UI_FRAME:
+				replay.frame_acks++;
+				break;
+
+			default:
+				break;
+		}
+
+		rf_ui_queue_complete(gp, ui);
+
+		return TRUE;
+	}
+
+	rf_replay_frames_shown(ended);
+
+	if (rf_ui_queue_reschedule(gp))
+		return TRUE;
+
+	g_object_unref(gp);
+	return FALSE;
+}
+
+/* The arrays of the graphics pipeline records must match their counts, the
+ * masks of a new pointer must cover its size */
+static gboolean rf_replay_check_array(const rfRecordHeader* header, const guint32* fields)
+{
+	TRACE_CALL("rf_replay_check_array");
+	switch (header->type)
+	{
+		case RF_RECORD_POINTER_NEW:
+			return header->nfields > 5 && fields[4] <= 384 && fields[5] <= 384 && fields[0] <= 32 &&
+				header->length[0] >= (fields[4] * fields[0] + 15) / 16 * 2 * fields[5] &&
+				header->length[1] >= (fields[4] + 15) / 16 * 2 * fields[5];
+		case RF_RECORD_GFX_RESET_GRAPHICS:
+			return header->nfields > 2 && header->length[0] == fields[2] * sizeof(MONITOR_DEF);
+		case RF_RECORD_GFX_SOLID_FILL:
+			return header->nfields > 2 && header->length[0] == fields[2] * sizeof(RDPGFX_RECT16);
+		case RF_RECORD_GFX_SURFACE_TO_SURFACE:
+			return header->nfields > 6 && header->length[0] == fields[6] * sizeof(RDPGFX_POINT16);
+		case RF_RECORD_GFX_CACHE_TO_SURFACE:
+			return header->nfields > 2 && header->length[0] == fields[2] * sizeof(RDPGFX_POINT16);
+		default:
+			return TRUE;
+	}
+}
+
+static gboolean rf_replay_parse_size(const gchar* size, gint* width, gint* height)
+{
+	TRACE_CALL("rf_replay_parse_size");
+	return size && sscanf(size, "%dx%d", width, height) == 2 && *width > 0 && *height > 0;
+}
+
+static gboolean rf_replay_quit(gpointer data)
+{
+	TRACE_CALL("rf_replay_quit");
+	g_main_loop_quit(replay.loop);
+	return FALSE;
+}
+
+/* Stands for the RDP thread, the records are handed to the callbacks the
+ * way libfreerdp and the graphics pipeline channel would */
+static gpointer rf_replay_thread(gpointer data)
+{
+	TRACE_CALL("rf_replay_thread");
+	rdpContext* context = replay.context;
+	rdpUpdate* update = context->update;
+	RdpgfxClientContext* gfx = replay.gfx;
+	rfRecordHeader header;
+	guint32 fields[RF_RECORD_MAX_FIELDS];
+	const guint8* data[2];
+	BITMAP_DATA bitmap_data;
+	BITMAP_UPDATE bitmap;
+	SURFACE_BITS_COMMAND cmd;
+	POINTER_POSITION_UPDATE pointer_position;
+	POINTER_SYSTEM_UPDATE pointer_system;
+	POINTER_NEW_UPDATE pointer_new;
+	POINTER_CACHED_UPDATE pointer_cached;
+	RDPGFX_RESET_GRAPHICS_PDU gfx_reset;
+	RDPGFX_START_FRAME_PDU gfx_start;
+	RDPGFX_END_FRAME_PDU gfx_end;
+	RDPGFX_SURFACE_COMMAND gfx_cmd;
+	RDPGFX_CREATE_SURFACE_PDU gfx_create;
+	RDPGFX_DELETE_SURFACE_PDU gfx_delete;
+	RDPGFX_SOLID_FILL_PDU gfx_fill;
+	RDPGFX_SURFACE_TO_SURFACE_PDU gfx_copy;
+	RDPGFX_SURFACE_TO_CACHE_PDU gfx_store;
+	RDPGFX_CACHE_TO_SURFACE_PDU gfx_load;
+	RDPGFX_EVICT_CACHE_ENTRY_PDU gfx_evict;
+	RDPGFX_MAP_SURFACE_TO_OUTPUT_PDU gfx_map;
+	gsize offset;
+	gint64 t;
+
+	memset(&bitmap, 0, sizeof(bitmap));
+	bitmap.number = 1;
+	bitmap.count = 1;
+	bitmap.rectangles = &bitmap_data;
+
+	offset = sizeof(rfRecordFileHeader);
+	while (offset + sizeof(header) <= replay.size)
+	{
+		memcpy(&header, replay.contents + offset, sizeof(header));
+		offset += sizeof(header);
+
+		if (header.type >= RF_RECORD_TYPES || header.nfields > RF_RECORD_MAX_FIELDS ||
+			replay.size - offset < (gsize) header.nfields * sizeof(guint32) + header.length[0] + header.length[1])
+		{
+			fprintf(stderr, "%s is truncated or corrupted\n", replay.name);
+			break;
+		}
+
+		memset(fields, 0, sizeof(fields));
+		memcpy(fields, replay.contents + offset, header.nfields * sizeof(guint32));
+		offset += header.nfields * sizeof(guint32);
+		data[0] = (const guint8*) replay.contents + offset;
+		offset += header.length[0];
+		data[1] = (const guint8*) replay.contents + offset;
+		offset += header.length[1];
+		if (!rf_replay_check_array(&header, fields))
+		{
+			fprintf(stderr, "%s is corrupted\n", replay.name);
+			break;
+		}
+
+		t = g_get_monotonic_time();
+		if (replay.frame_start == 0)
+			replay.frame_start = t;
+
+		switch (header.type)
+		{
+			case RF_RECORD_BEGIN_PAINT:
+				update->BeginPaint(context);
+				break;
+
+			case RF_RECORD_END_PAINT:
+				update->EndPaint(context);
+				break;
+
+			case RF_RECORD_BITMAP:
+				memset(&bitmap_data, 0, sizeof(bitmap_data));
+				bitmap_data.destLeft = fields[0];
+				bitmap_data.destTop = fields[1];
+				bitmap_data.destRight = fields[2];
+				bitmap_data.destBottom = fields[3];
+				bitmap_data.width = fields[4];
+				bitmap_data.height = fields[5];
+				bitmap_data.bitsPerPixel = fields[6];
+				bitmap_data.flags = fields[7];
+				bitmap_data.compressed = fields[8];
+				bitmap_data.cbCompFirstRowSize = fields[9];
+				bitmap_data.cbCompMainBodySize = fields[10];
+				bitmap_data.cbScanWidth = fields[11];
+				bitmap_data.cbUncompressedSize = fields[12];
+				bitmap_data.bitmapDataStream = (BYTE*) data[0];
+				bitmap_data.bitmapLength = header.length[0];
+				IFCALL(update->BitmapUpdate, context, &bitmap);
+				break;
+
+			case RF_RECORD_SURFACE_BITS:
+				memset(&cmd, 0, sizeof(cmd));
+				cmd.cmdType = fields[0];
+				cmd.destLeft = fields[1];
+				cmd.destTop = fields[2];
+				cmd.destRight = fields[3];
+				cmd.destBottom = fields[4];
+				cmd.bpp = fields[5];
+				cmd.codecID = fields[6];
+				cmd.width = fields[7];
+				cmd.height = fields[8];
+				cmd.bitmapData = (BYTE*) data[0];
+				cmd.bitmapDataLength = header.length[0];
+				IFCALL(update->SurfaceBits, context, &cmd);
+				break;
+
+			case RF_RECORD_POINTER_POSITION:
+				pointer_position.xPos = fields[0];
+				pointer_position.yPos = fields[1];
+				IFCALL(update->pointer->PointerPosition, context, &pointer_position);
+				break;
+
+			case RF_RECORD_POINTER_SYSTEM:
+				pointer_system.type = fields[0];
+				IFCALL(update->pointer->PointerSystem, context, &pointer_system);
+				break;
+
+			case RF_RECORD_POINTER_NEW:
+				memset(&pointer_new, 0, sizeof(pointer_new));
+				pointer_new.xorBpp = fields[0];
+				pointer_new.colorPtrAttr.cacheIndex = fields[1];
+				pointer_new.colorPtrAttr.xPos = fields[2];
+				pointer_new.colorPtrAttr.yPos = fields[3];
+				pointer_new.colorPtrAttr.width = fields[4];
+				pointer_new.colorPtrAttr.height = fields[5];
+				pointer_new.colorPtrAttr.xorMaskData = (BYTE*) data[0];
+				pointer_new.colorPtrAttr.lengthXorMask = header.length[0];
+				pointer_new.colorPtrAttr.andMaskData = (BYTE*) data[1];
+				pointer_new.colorPtrAttr.lengthAndMask = header.length[1];
+				IFCALL(update->pointer->PointerNew, context, &pointer_new);
+				break;
+
+			case RF_RECORD_POINTER_CACHED:
+				pointer_cached.cacheIndex = fields[0];
+				IFCALL(update->pointer->PointerCached, context, &pointer_cached);
+				break;
+
+			case RF_RECORD_GFX_RESET_GRAPHICS:
+				gfx_reset.width = fields[0];
+				gfx_reset.height = fields[1];
+				gfx_reset.monitorCount = fields[2];
+				gfx_reset.monitorDefArray = (MONITOR_DEF*) data[0];
+				gfx->ResetGraphics(gfx, &gfx_reset);
+				break;
+
+			case RF_RECORD_GFX_START_FRAME:
+				gfx_start.timestamp = fields[0];
+				gfx_start.frameId = fields[1];
+				gfx->StartFrame(gfx, &gfx_start);
+				break;
+
+			case RF_RECORD_GFX_END_FRAME:
+				gfx_end.frameId = fields[0];
+				gfx->EndFrame(gfx, &gfx_end);
+				break;
+
+			case RF_RECORD_GFX_SURFACE_COMMAND:
+				memset(&gfx_cmd, 0, sizeof(gfx_cmd));
+				gfx_cmd.surfaceId = fields[0];
+				gfx_cmd.codecId = fields[1];
+				gfx_cmd.contextId = fields[2];
+				gfx_cmd.format = fields[3];
+				gfx_cmd.left = fields[4];
+				gfx_cmd.top = fields[5];
+				gfx_cmd.right = fields[6];
+				gfx_cmd.bottom = fields[7];
+				gfx_cmd.width = fields[8];
+				gfx_cmd.height = fields[9];
+				gfx_cmd.data = (BYTE*) data[0];
+				gfx_cmd.length = header.length[0];
+				if (gfx_cmd.codecId == RDPGFX_CODECID_H264)
+					replay.skipped[header.type]++;
+				else
+					gfx->SurfaceCommand(gfx, &gfx_cmd);
+				break;
+
+			case RF_RECORD_GFX_CREATE_SURFACE:
+				gfx_create.surfaceId = fields[0];
+				gfx_create.width = fields[1];
+				gfx_create.height = fields[2];
+				gfx_create.pixelFormat = fields[3];
+				gfx->CreateSurface(gfx, &gfx_create);
+				break;
+
+			case RF_RECORD_GFX_DELETE_SURFACE:
+				gfx_delete.surfaceId = fields[0];
+				gfx->DeleteSurface(gfx, &gfx_delete);
+				break;
+
+			case RF_RECORD_GFX_SOLID_FILL:
+				gfx_fill.surfaceId = fields[0];
+				gfx_fill.fillPixel.B = fields[1] & 0xFF;
+				gfx_fill.fillPixel.G = (fields[1] >> 8) & 0xFF;
+				gfx_fill.fillPixel.R = (fields[1] >> 16) & 0xFF;
+				gfx_fill.fillPixel.XA = fields[1] >> 24;
+				gfx_fill.fillRectCount = fields[2];
+				gfx_fill.fillRects = (RDPGFX_RECT16*) data[0];
+				gfx->SolidFill(gfx, &gfx_fill);
+				break;
+
+			case RF_RECORD_GFX_SURFACE_TO_SURFACE:
+				gfx_copy.surfaceIdSrc = fields[0];
+				gfx_copy.surfaceIdDest = fields[1];
+				gfx_copy.rectSrc.left = fields[2];
+				gfx_copy.rectSrc.top = fields[3];
+				gfx_copy.rectSrc.right = fields[4];
+				gfx_copy.rectSrc.bottom = fields[5];
+				gfx_copy.destPtsCount = fields[6];
+				gfx_copy.destPts = (RDPGFX_POINT16*) data[0];
+				gfx->SurfaceToSurface(gfx, &gfx_copy);
+				break;
+
+			case RF_RECORD_GFX_SURFACE_TO_CACHE:
+				gfx_store.surfaceId = fields[0];
+				gfx_store.cacheKey = fields[1] | ((UINT64) fields[2] << 32);
+				gfx_store.cacheSlot = fields[3];
+				gfx_store.rectSrc.left = fields[4];
+				gfx_store.rectSrc.top = fields[5];
+				gfx_store.rectSrc.right = fields[6];
+				gfx_store.rectSrc.bottom = fields[7];
+				gfx->SurfaceToCache(gfx, &gfx_store);
+				break;
+
+			case RF_RECORD_GFX_CACHE_TO_SURFACE:
+				gfx_load.cacheSlot = fields[0];
+				gfx_load.surfaceId = fields[1];
+				gfx_load.destPtsCount = fields[2];
+				gfx_load.destPts = (RDPGFX_POINT16*) data[0];
+				gfx->CacheToSurface(gfx, &gfx_load);
+				break;
+
+			case RF_RECORD_GFX_EVICT_CACHE_ENTRY:
+				gfx_evict.cacheSlot = fields[0];
+				gfx->EvictCacheEntry(gfx, &gfx_evict);
+				break;
+
+			case RF_RECORD_GFX_MAP_SURFACE_TO_OUTPUT:
+				memset(&gfx_map, 0, sizeof(gfx_map));
+				gfx_map.surfaceId = fields[0];
+				gfx_map.outputOriginX = fields[1];
+				gfx_map.outputOriginY = fields[2];
+				gfx->MapSurfaceToOutput(gfx, &gfx_map);
+				break;
+		}
+
+		replay.elapsed[header.type] += g_get_monotonic_time() - t;
+		replay.calls[header.type]++;
+	}
+
+	g_idle_add(rf_replay_quit, NULL);
+
+	return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+	TRACE_CALL("main");
+	gchar* scale = NULL;
+	GOptionEntry entries[] =
+	{
+		{ "scale", 's', 0, G_OPTION_ARG_STRING, &scale, "Size of the window the desktop is scaled to", "WIDTHxHEIGHT" },
+		{ NULL }
+	};
+	GOptionContext* option_context;
+	RemminaProtocolWidget* gp;
+	freerdp* instance;
+	rdpContext* context;
+	rfContext* rfi;
+	rfRecordFileHeader fheader;
+	RdpgfxClientContext* gfx;
+	GThread* thread;
+	gint64 start, t;
+	gint window_width, window_height;
+	guint i;
+	gchar* contents;
+	gsize size;
+	GError* error = NULL;
+
+	option_context = g_option_context_new("CAPTURE - replay a capture of RDP updates");
+	g_option_context_add_main_entries(option_context, entries, NULL);
+	if (!g_option_context_parse(option_context, &argc, &argv, &error) || argc != 2)
+	{
+		fprintf(stderr, "%s\n", error ? error->message : "One capture file is expected");
+		return 1;
+	}
+	g_option_context_free(option_context);
+
+	if (!g_file_get_contents(argv[1], &contents, &size, &error))
+	{
+		fprintf(stderr, "%s\n", error->message);
+		g_error_free(error);
+		return 1;
+	}
+
+	if (size >= sizeof(fheader))
+		memcpy(&fheader, contents, sizeof(fheader));
+	if (size < sizeof(fheader) || fheader.magic != RF_RECORD_MAGIC || fheader.version != RF_RECORD_VERSION ||
+		fheader.width == 0 || fheader.height == 0)
+	{
+		fprintf(stderr, "%s is not an RDP capture\n", argv[1]);
+		g_free(contents);
+		return 1;
+	}
+
+	window_width = fheader.width;
+	window_height = fheader.height;
+	if (scale && !rf_replay_parse_size(scale, &window_width, &window_height))
+	{
+		fprintf(stderr, "Invalid window size %s\n", scale);
+		g_free(contents);
+		return 1;
+	}
+
+	rf_replay_service.log_printf = rf_replay_log_printf;
+
+	/* Set up the session as the server described it, without connecting */
+	instance = freerdp_new();
+	instance->ContextSize = sizeof(rfContext);
+	freerdp_context_new(instance);
+	context = instance->context;
+	rfi = (rfContext*) context;
+	rfi->instance = instance;
+	rfi->settings = instance->settings;
+	rfi->settings->DesktopWidth = fheader.width;
+	rfi->settings->DesktopHeight = fheader.height;
+	rfi->settings->ColorDepth = fheader.depth;
+	rfi->settings->RemoteFxCodec = fheader.remotefx;
+	rf_gdi_set_cache_support(rfi->settings);
+	if (fheader.remotefx)
+		rfi->rfx_context = rfx_context_new(FALSE);
+	rfi->clrconv = freerdp_clrconv_new(CLRCONV_ALPHA);
+	pthread_mutex_init(&rfi->mutex, NULL);
+	pthread_mutex_init(&rfi->gfx_mutex, NULL);
+
+	/* Only the plugin data of the protocol widget is ever used */
+	gp = (RemminaProtocolWidget*) g_object_new(G_TYPE_OBJECT, NULL);
+	g_object_set_data(G_OBJECT(gp), "plugin-data", rfi);
+	rfi->protocol_widget = gp;
+	rf_ui_queue_init(gp);
+	rf_pointer_cache_init(rfi);
+
+	/* As remmina_rdp_post_connect() does */
+	gdi_init(instance, CLRCONV_ALPHA | CLRBUF_32BPP, NULL);
+	rfi->width = fheader.width;
+	rfi->height = fheader.height;
+	rfi->primary_buffer = context->gdi->primary_buffer;
+	rfi->cairo_format = CAIRO_FORMAT_ARGB32;
+	rf_register_graphics(context->graphics);
+	rf_gdi_register_update_callbacks(instance->update);
+	context->update->BeginPaint = rf_begin_paint;
+	context->update->EndPaint = rf_replay_end_paint;
+
+	/* The graphics pipeline as the channel would set it up */
+	replay.gfx_surfaces = g_hash_table_new(NULL, NULL);
+	replay.gfx_cache_slots = g_hash_table_new(NULL, NULL);
+	gfx = (RdpgfxClientContext*) calloc(1, sizeof(RdpgfxClientContext));
+	gfx->GetSurfaceIds = rf_replay_gfx_get_surface_ids;
+	gfx->SetSurfaceData = rf_replay_gfx_set_surface_data;
+	gfx->GetSurfaceData = rf_replay_gfx_get_surface_data;
+	gfx->SetCacheSlotData = rf_replay_gfx_set_cache_slot_data;
+	gfx->GetCacheSlotData = rf_replay_gfx_get_cache_slot_data;
+	gdi_graphics_pipeline_init(context->gdi, gfx);
+	rf_gdi_gfx_init(rfi, gfx);
+
+	/* As remmina_rdp_event_create_surface() does */
+	LOCK_BUFFER(0)
+	rfi->surface = cairo_image_surface_create(rfi->cairo_format, rfi->width, rfi->height);
+	rfi->back_surface = cairo_image_surface_create(rfi->cairo_format, rfi->width, rfi->height);
+	rfi->back_ahead = cairo_region_create();
+	rfi->back_behind = cairo_region_create();
+	rf_present_rect(rfi, 0, 0, rfi->width, rfi->height);
+	rf_present_flip(rfi);
+	UNLOCK_BUFFER(0)
+
+	replay.name = argv[1];
+	replay.contents = contents;
+	replay.size = size;
+	replay.context = context;
+	replay.gfx = gfx;
+	replay.loop = g_main_loop_new(NULL, FALSE);
+	replay.frames_pending = g_async_queue_new();
+	replay.window = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, window_width, window_height);
+	replay.scale_x = (gdouble) window_width / fheader.width;
+	replay.scale_y = (gdouble) window_height / fheader.height;
+
+	start = g_get_monotonic_time();
+
+	thread = g_thread_new("replay", rf_replay_thread, NULL);
+	g_main_loop_run(replay.loop);
+	g_thread_join(thread);
+
+	/* What the RDP thread queued last */
+	while (g_main_context_iteration(NULL, FALSE))
+		;
+	rf_replay_frames_shown(g_async_queue_length(replay.frames_pending));
+
+	t = MAX(g_get_monotonic_time() - start, 1);
+	printf("%u frames in %.3f s, %.1f frames/s, %ux%u", replay.frames, t / 1000000.0,
+		replay.frames * 1000000.0 / t, fheader.width, fheader.height);
+	if (scale)
+		printf(" scaled to %dx%d", window_width, window_height);
+	printf("\n");
+	if (replay.frames)
+		printf("decode to window: %.3f ms per frame on average, %.3f ms at most\n",
+			replay.latency_sum / 1000.0 / replay.frames, replay.latency_max / 1000.0);
+	if (replay.paints)
+		printf("UI queue: %.1f objects waiting at the end of a paint on average, %d at most\n",
+			(gdouble) replay.queued_sum / replay.paints, replay.queued_peak);
+	for (i = 0; i < RF_RECORD_TYPES; i++)
+	{
+		if (replay.calls[i] && replay.skipped[i] == replay.calls[i])
+			printf("%-17s %8" G_GINT64_FORMAT " calls, not replayed\n", rf_replay_type_names[i], replay.calls[i]);
+		else if (replay.calls[i])
+			printf("%-17s %8" G_GINT64_FORMAT " calls %10.3f ms, %8.1f us/call%s\n",
+				rf_replay_type_names[i], replay.calls[i], replay.elapsed[i] / 1000.0,
+				(gdouble) replay.elapsed[i] / replay.calls[i], replay.skipped[i] ? ", some not replayed" : "");
+	}
+	if (replay.regions)
+		printf("window paints     %8u calls %10.3f ms, %8.1f us/call\n",
+			replay.regions, replay.region_time / 1000.0, (gdouble) replay.region_time / replay.regions);
+	if (replay.cursors_new || replay.cursors_changed)
+		printf("cursors: %u made, %u changes\n", replay.cursors_new, replay.cursors_changed);
+	if (replay.frame_acks)
+		printf("frame acknowledges: %u\n", replay.frame_acks);
+
+	/* The pointers freed with the GDI are released by the GTK thread */
+	gdi_graphics_pipeline_uninit(context->gdi, gfx);
+	free(gfx);
+	g_hash_table_destroy(replay.gfx_surfaces);
+	g_hash_table_destroy(replay.gfx_cache_slots);
+	gdi_free(instance);
+	while (g_main_context_iteration(NULL, FALSE))
+		;
+	rf_ui_queue_uninit(gp);
+	g_object_unref(gp);
+
+	cairo_surface_destroy(replay.window);
+	cairo_surface_destroy(rfi->surface);
+	cairo_surface_destroy(rfi->back_surface);
+	cairo_region_destroy(rfi->back_ahead);
+	cairo_region_destroy(rfi->back_behind);
+	g_async_queue_unref(replay.frames_pending);
+	g_main_loop_unref(replay.loop);
+	rf_pointer_cache_free(rfi);
+	freerdp_clrconv_free(rfi->clrconv);
+	pthread_mutex_destroy(&rfi->gfx_mutex);
+	pthread_mutex_destroy(&rfi->mutex);
+	if (rfi->rfx_context)
+		rfx_context_free(rfi->rfx_context);
+	freerdp_context_free(instance);
+	freerdp_free(instance);
+	g_free(contents);
+	g_free(scale);
+
+	return 0;
+}
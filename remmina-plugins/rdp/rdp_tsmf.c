@@ -0,0 +1,194 @@
+/*
+ * Remmina - The GTK+ Remote Desktop Client
+ * Copyright (C) 2010-2011 Vic Lee
+ * Copyright (C) 2014-2015 Antenore Gatta, Fabio Castelli, Giovanni Panozzo
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL. *  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so. *  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version. *  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ *
+ */
+
+/* Multimedia redirection.
+ *
+ * The tsmf channel receives the compressed video played in the remote
+ * session and decodes it here with its software (ffmpeg) decoder. The
+ * decoded YUV frames are converted into the primary buffer, at the
+ * position of the video on the remote desktop and clipped to its visible
+ * parts, then presented like any other damage. Later updates from the
+ * server which cover the video overwrite it there, as they would on the
+ * remote desktop. */
+
+#include "rdp_plugin.h"
+#include "rdp_tsmf.h"
+
+/* YUV 4:2:0 BT.601 to BGRX of the pixels [left, right) of the desktop row dy.
+ * xmap gives the frame column of each column of the video. */
+static void remmina_rdp_tsmf_draw_row(rdpGdi* gdi, TSMF_VIDEO_FRAME_EVENT* event, const gint* xmap,
+	const BYTE* yplane, const BYTE* uplane, const BYTE* vplane, gint dy, gint left, gint right)
+{
+	TRACE_CALL("remmina_rdp_tsmf_draw_row");
+	const BYTE* yrow;
+	const BYTE* urow;
+	const BYTE* vrow;
+	UINT8* dst;
+	gint dx, sx, sy, cw, c, u, v, r, g, b;
+
+	sy = (dy - event->y) * event->frameHeight / event->height;
+	cw = (event->frameWidth + 1) / 2;
+	yrow = yplane + sy * event->frameWidth;
+	urow = uplane + (sy / 2) * cw;
+	vrow = vplane + (sy / 2) * cw;
+	dst = gdi->primary_buffer + (dy * gdi->width + left) * 4;
+	xmap -= event->x;
+
+	for (dx = left; dx < right; dx++)
+	{
+		sx = xmap[dx];
+		c = (yrow[sx] - 16) * 298;
+		u = urow[sx / 2] - 128;
+		v = vrow[sx / 2] - 128;
+
+		r = (c + 409 * v + 128) >> 8;
+		g = (c - 100 * u - 208 * v + 128) >> 8;
+		b = (c + 516 * u + 128) >> 8;
+
+		*dst++ = CLAMP(b, 0, 255);
+		*dst++ = CLAMP(g, 0, 255);
+		*dst++ = CLAMP(r, 0, 255);
+		*dst++ = 0xFF;
+	}
+}
+
+/* Runs in the tsmf decoder thread */
+static int remmina_rdp_tsmf_frame_event(TsmfClientContext* tsmf, TSMF_VIDEO_FRAME_EVENT* event)
+{
+	TRACE_CALL("remmina_rdp_tsmf_frame_event");
+	rfContext* rfi = (rfContext*) tsmf->custom;
+	rdpGdi* gdi = ((rdpContext*) rfi)->gdi;
+	RemminaPluginRdpUiObject* ui;
+	const BYTE* yplane;
+	const BYTE* uplane;
+	const BYTE* vplane;
+	RECTANGLE_16 whole;
+	RECTANGLE_16* rects;
+	gint* xmap;
+	gint nrects, i, dy;
+	gint left, top, right, bottom;
+	gsize luma, chroma;
+
+	if (event->framePixFmt != RDP_PIXFMT_I420 && event->framePixFmt != RDP_PIXFMT_YV12)
+		return 0;
+	if (!gdi || gdi->bytesPerPixel != 4 || event->frameWidth <= 0 || event->frameHeight <= 0 || event->width <= 0 || event->height <= 0)
+		return 0;
+
+	luma = (gsize) event->frameWidth * event->frameHeight;
+	chroma = (gsize) ((event->frameWidth + 1) / 2) * ((event->frameHeight + 1) / 2);
+	if (event->frameSize < luma + 2 * chroma)
+		return 0;
+
+	yplane = event->frameData;
+	if (event->framePixFmt == RDP_PIXFMT_I420)
+	{
+		uplane = yplane + luma;
+		vplane = uplane + chroma;
+	}
+	else
+	{
+		vplane = yplane + luma;
+		uplane = vplane + chroma;
+	}
+
+	/* Visible rectangles are relative to the video */
+	rects = event->visibleRects;
+	nrects = event->numVisibleRects;
+	if (nrects == 0)
+	{
+		whole.left = 0;
+		whole.top = 0;
+		whole.right = event->width;
+		whole.bottom = event->height;
+		rects = &whole;
+		nrects = 1;
+	}
+
+	/* The frame column of each video column, instead of a division per pixel */
+	xmap = g_new(gint, event->width);
+	for (i = 0; i < event->width; i++)
+		xmap[i] = i * event->frameWidth / event->width;
+
+	/* While the surface is missing, the GTK thread may be resizing the
+	 * primary buffer */
+	LOCK_BUFFER(0)
+
+	if (rfi->surface)
+	{
+		for (i = 0; i < nrects; i++)
+		{
+			left = MAX(event->x + rects[i].left, MAX(event->x, 0));
+			top = MAX(event->y + rects[i].top, MAX(event->y, 0));
+			right = MIN(event->x + rects[i].right, MIN(event->x + event->width, gdi->width));
+			bottom = MIN(event->y + rects[i].bottom, MIN(event->y + event->height, gdi->height));
+			if (left >= right || top >= bottom)
+				continue;
+
+			for (dy = top; dy < bottom; dy++)
+				remmina_rdp_tsmf_draw_row(gdi, event, xmap, yplane, uplane, vplane, dy, left, right);
+			rf_present_rect(rfi, left, top, right - left, bottom - top);
+		}
+		rf_present_flip(rfi);
+	}
+
+	UNLOCK_BUFFER(0)
+
+	g_free(xmap);
+
+	left = MAX(event->x, 0);
+	top = MAX(event->y, 0);
+	right = MIN(event->x + event->width, rfi->width);
+	bottom = MIN(event->y + event->height, rfi->height);
+	if (left < right && top < bottom)
+	{
+		ui = rf_object_new(rfi->protocol_widget);
+		ui->type = REMMINA_RDP_UI_UPDATE_REGION;
+		ui->region.x = left;
+		ui->region.y = top;
+		ui->region.width = right - left;
+		ui->region.height = bottom - top;
+		rf_queue_ui(rfi->protocol_widget, ui);
+	}
+
+	return 1;
+}
+
+void remmina_rdp_tsmf_init(rfContext* rfi, TsmfClientContext* tsmf)
+{
+	TRACE_CALL("remmina_rdp_tsmf_init");
+
+	tsmf->custom = (void*) rfi;
+	tsmf->FrameEvent = remmina_rdp_tsmf_frame_event;
+}
@@ -75,6 +75,8 @@ const RemminaSetting remmina_system_settings[] =
 { "window_height", REMMINA_SETTING_GROUP_RUNTIME, FALSE },
 { "window_maximize", REMMINA_SETTING_GROUP_RUNTIME, FALSE },
 { "toolbar_opacity", REMMINA_SETTING_GROUP_RUNTIME, FALSE },
+{ "rdp_net_bandwidth", REMMINA_SETTING_GROUP_RUNTIME, FALSE },
+{ "rdp_net_rtt", REMMINA_SETTING_GROUP_RUNTIME, FALSE },
 
 { NULL, 0, FALSE } };
 
@@ -135,11 +137,20 @@ void remmina_file_generate_filename(RemminaFile *remminafile)
 {
 	TRACE_CALL("remmina_file_generate_filename");
 	GTimeVal gtime;
+	gint64 msec;
 
 	g_free(remminafile->filename);
 	g_get_current_time(&gtime);
-	remminafile->filename = g_strdup_printf("%s/.remmina/%li%03li.remmina", g_get_home_dir(), gtime.tv_sec,
-			gtime.tv_usec / 1000);
+	msec = (gint64) gtime.tv_sec * 1000 + gtime.tv_usec / 1000;
+	/* Several files may be saved within the same millisecond when importing */
+	for (;;)
+	{
+		remminafile->filename = g_strdup_printf("%s/.remmina/%" G_GINT64_FORMAT ".remmina", g_get_home_dir(), msec);
+		if (!g_file_test(remminafile->filename, G_FILE_TEST_EXISTS))
+			break;
+		g_free(remminafile->filename);
+		msec++;
+	}
 }
 
 void remmina_file_set_filename(RemminaFile *remminafile, const gchar *filename)
@@ -134,6 +134,7 @@ void remmina_main_destroy(GtkWidget *widget, gpointer user_data)
 	g_free(remminamain->priv->selected_name);
 	g_free(remminamain->priv);
 	g_free(remminamain);
+	remminamain = NULL;
 }
 
 static void remmina_main_clear_selection_data(void)
@@ -735,54 +736,157 @@ void remmina_main_on_action_view_file_mode(GtkRadioAction *action, gpointer user
 	previous_action = action;
 }
 
-static void remmina_main_import_file_list(GSList *files)
+/* Files are parsed by a pool of worker threads, then saved a few at a time
+ * from the main loop, so importing many files does not freeze the window */
+#define REMMINA_MAIN_IMPORT_SAVE_CHUNK 50
+
+typedef struct _RemminaMainImportJob
 {
-	TRACE_CALL("remmina_main_import_file_list");
-	GtkWidget *dlg;
-	GSList *element;
 	gchar *path;
-	RemminaFilePlugin *plugin;
+	RemminaFile *remminafile;
+} RemminaMainImportJob;
+
+typedef struct _RemminaMainImport
+{
+	RemminaMainImportJob *jobs;
+	guint count;
+	gint parsed;
+	guint saved;
+	GThreadPool *pool;
 	GString *err;
-	RemminaFile *remminafile = NULL;
 	gboolean imported;
+} RemminaMainImport;
+
+static void remmina_main_import_parse(gpointer data, gpointer user_data)
+{
+	TRACE_CALL("remmina_main_import_parse");
+	RemminaMainImportJob *job = (RemminaMainImportJob*) data;
+	RemminaMainImport *import = (RemminaMainImport*) user_data;
+	RemminaFilePlugin *plugin;
+
+	plugin = remmina_plugin_manager_get_import_file_handler(job->path);
+	if (plugin)
+		job->remminafile = plugin->import_func(job->path);
+	g_atomic_int_inc(&import->parsed);
+}
+
+static void remmina_main_import_status(RemminaMainImport *import, guint done)
+{
+	TRACE_CALL("remmina_main_import_status");
+	guint context_id;
+	gchar *buf;
 
-	err = g_string_new(NULL);
-	imported = FALSE;
-	for (element = files; element; element = element->next)
+	if (!remminamain)
+		return;
+	context_id = gtk_statusbar_get_context_id(remminamain->statusbar_main, "import");
+	gtk_statusbar_pop(remminamain->statusbar_main, context_id);
+	if (done < import->count)
 	{
-		path = (gchar*) element->data;
-		plugin = remmina_plugin_manager_get_import_file_handler(path);
-		if (plugin && (remminafile = plugin->import_func(path)) != NULL && remmina_file_get_string(remminafile, "name"))
-		{
-			remmina_file_generate_filename(remminafile);
-			remmina_file_save_all(remminafile);
-			imported = TRUE;
-		}
-		else
-		{
-			g_string_append(err, path);
-			g_string_append_c(err, '\n');
-		}
-		if (remminafile)
-		{
-			remmina_file_free(remminafile);
-			remminafile = NULL;
-		}
-		g_free(path);
+		buf = g_strdup_printf(_("Importing %u/%u files"), done, import->count);
+		gtk_statusbar_push(remminamain->statusbar_main, context_id, buf);
+		g_free(buf);
 	}
-	g_slist_free(files);
-	if (err->len > 0)
+}
+
+static void remmina_main_import_done(RemminaMainImport *import)
+{
+	TRACE_CALL("remmina_main_import_done");
+	GtkWidget *dlg;
+
+	remmina_main_import_status(import, import->count);
+	if (remminamain && import->err->len > 0)
 	{
 		dlg = gtk_message_dialog_new(remminamain->window, GTK_DIALOG_MODAL, GTK_MESSAGE_ERROR, GTK_BUTTONS_OK,
-				_("Unable to import:\n%s"), err->str);
+				_("Unable to import:\n%s"), import->err->str);
 		g_signal_connect(G_OBJECT(dlg), "response", G_CALLBACK(gtk_widget_destroy), NULL);
 		gtk_widget_show(dlg);
 	}
-	g_string_free(err, TRUE);
-	if (imported)
+	if (remminamain && import->imported)
 	{
 		remmina_main_load_files(TRUE);
 	}
+	g_string_free(import->err, TRUE);
+	g_free(import->jobs);
+	g_free(import);
+}
+
+static gboolean remmina_main_import_save(gpointer data)
+{
+	TRACE_CALL("remmina_main_import_save");
+	RemminaMainImport *import = (RemminaMainImport*) data;
+	RemminaMainImportJob *job;
+	guint end;
+
+	end = MIN(import->saved + REMMINA_MAIN_IMPORT_SAVE_CHUNK, import->count);
+	for (; import->saved < end; import->saved++)
+	{
+		job = &import->jobs[import->saved];
+		if (job->remminafile && remmina_file_get_string(job->remminafile, "name"))
+		{
+			remmina_file_generate_filename(job->remminafile);
+			remmina_file_save_all(job->remminafile);
+			import->imported = TRUE;
+		}
+		else
+		{
+			g_string_append(import->err, job->path);
+			g_string_append_c(import->err, '\n');
+		}
+		if (job->remminafile)
+			remmina_file_free(job->remminafile);
+		g_free(job->path);
+	}
+
+	if (import->saved < import->count)
+		return TRUE;
+
+	remmina_main_import_done(import);
+	return FALSE;
+}
+
+static gboolean remmina_main_import_progress(gpointer data)
+{
+	TRACE_CALL("remmina_main_import_progress");
+	RemminaMainImport *import = (RemminaMainImport*) data;
+	guint parsed;
+
+	parsed = g_atomic_int_get(&import->parsed);
+	remmina_main_import_status(import, parsed);
+	if (parsed < import->count)
+		return TRUE;
+
+	/* All the workers are idle, the results can be saved */
+	g_thread_pool_free(import->pool, FALSE, TRUE);
+	import->pool = NULL;
+	g_idle_add(remmina_main_import_save, import);
+	return FALSE;
+}
+
+static void remmina_main_import_file_list(GSList *files)
+{
+	TRACE_CALL("remmina_main_import_file_list");
+	RemminaMainImport *import;
+	GSList *element;
+	guint i;
+
+	if (!files)
+		return;
+
+	import = g_new0(RemminaMainImport, 1);
+	import->count = g_slist_length(files);
+	import->jobs = g_new0(RemminaMainImportJob, import->count);
+	import->err = g_string_new(NULL);
+	import->pool = g_thread_pool_new(remmina_main_import_parse, import, MAX(g_get_num_processors(), 1), FALSE, NULL);
+
+	for (element = files, i = 0; element; element = element->next, i++)
+	{
+		import->jobs[i].path = (gchar*) element->data;
+		g_thread_pool_push(import->pool, &import->jobs[i], NULL);
+	}
+	g_slist_free(files);
+
+	remmina_main_import_status(import, 0);
+	g_timeout_add(100, remmina_main_import_progress, import);
 }
 
 static void remmina_main_action_tools_import_on_response(GtkDialog *dialog, gint response_id, gpointer user_data)
@@ -694,59 +694,17 @@ gboolean remmina_protocol_widget_ssh_exec(RemminaProtocolWidget* gp, gboolean wa
 {
 	TRACE_CALL("remmina_protocol_widget_ssh_exec");
 #ifdef HAVE_LIBSSH
-		RemminaSSHTunnel *tunnel = gp->priv->ssh_tunnel;
-		ssh_channel channel;
-		gint status;
-		gboolean ret = FALSE;
-		gchar *cmd, *ptr;
+		gboolean ret;
+		gchar *cmd;
 		va_list args;
 
-		if ((channel = channel_new (REMMINA_SSH (tunnel)->session)) == NULL)
-		{
-			return FALSE;
-		}
-
 		va_start (args, fmt);
 		cmd = g_strdup_vprintf (fmt, args);
 		va_end (args);
 
-		if (channel_open_session (channel) == SSH_OK &&
-				channel_request_exec (channel, cmd) == SSH_OK)
-		{
-			if (wait)
-			{
-				channel_send_eof (channel);
-				status = channel_get_exit_status (channel);
-				ptr = strchr (cmd, ' ');
-				if (ptr) *ptr = '\0';
-				switch (status)
-				{
-					case 0:
-						ret = TRUE;
-						break;
-					case 127:
-						remmina_ssh_set_application_error (REMMINA_SSH (tunnel),
-								_("Command %s not found on SSH server"), cmd);
-						break;
-					default:
-						remmina_ssh_set_application_error (REMMINA_SSH (tunnel),
-								_("Command %s failed on SSH server (status = %i)."), cmd,status);
-						break;
-				}
-			}
-			else
-			{
-				ret = TRUE;
-			}
-		}
-		else
-		{
-			remmina_ssh_set_error (REMMINA_SSH (tunnel), _("Failed to execute command: %s"));
-		}
+		/* The session may be forwarded by the tunnel engine */
+		ret = remmina_ssh_tunnel_exec (gp->priv->ssh_tunnel, wait, cmd);
 		g_free(cmd);
-		if (wait)
-			channel_close (channel);
-		channel_free (channel);
 		return ret;
 
 #else
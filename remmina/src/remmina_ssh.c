@@ -48,6 +48,10 @@
 #include <time.h>
 #include <sys/types.h>
 #include <pthread.h>
+#include <poll.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 #ifdef HAVE_NETDB_H
 #include <netdb.h>
 #endif
@@ -536,23 +540,26 @@ remmina_ssh_free (RemminaSSH *ssh)
 }
 
 /*************************** SSH Tunnel *********************************/
+/* Bounded ring buffer of the data going one way through a channel */
 struct _RemminaSSHTunnelBuffer
 {
 	gchar *data;
-	gchar *ptr;
-	ssize_t len;
+	gsize head;
+	gsize len;
 };
 
+#define REMMINA_SSH_TUNNEL_BUFFER_SIZE 65536
+
 static RemminaSSHTunnelBuffer*
-remmina_ssh_tunnel_buffer_new (ssize_t len)
+remmina_ssh_tunnel_buffer_new (void)
 {
 	TRACE_CALL("remmina_ssh_tunnel_buffer_new");
 	RemminaSSHTunnelBuffer *buffer;
 
 	buffer = g_new (RemminaSSHTunnelBuffer, 1);
-	buffer->data = (gchar*) g_malloc (len);
-	buffer->ptr = buffer->data;
-	buffer->len = len;
+	buffer->data = (gchar*) g_malloc (REMMINA_SSH_TUNNEL_BUFFER_SIZE);
+	buffer->head = 0;
+	buffer->len = 0;
 	return buffer;
 }
 
@@ -567,6 +574,180 @@ remmina_ssh_tunnel_buffer_free (RemminaSSHTunnelBuffer *buffer)
 	}
 }
 
+/* Contiguous free space after the data, to be filled then committed */
+static gsize
+remmina_ssh_tunnel_buffer_space (RemminaSSHTunnelBuffer *buffer, gchar **ptr)
+{
+	TRACE_CALL("remmina_ssh_tunnel_buffer_space");
+	gsize tail;
+
+	tail = (buffer->head + buffer->len) % REMMINA_SSH_TUNNEL_BUFFER_SIZE;
+	*ptr = buffer->data + tail;
+	if (buffer->len == REMMINA_SSH_TUNNEL_BUFFER_SIZE)
+		return 0;
+	return (tail >= buffer->head ? REMMINA_SSH_TUNNEL_BUFFER_SIZE - tail : buffer->head - tail);
+}
+
+/* Contiguous data at the head, to be sent then consumed */
+static gsize
+remmina_ssh_tunnel_buffer_data (RemminaSSHTunnelBuffer *buffer, gchar **ptr)
+{
+	TRACE_CALL("remmina_ssh_tunnel_buffer_data");
+	*ptr = buffer->data + buffer->head;
+	return MIN (buffer->len, REMMINA_SSH_TUNNEL_BUFFER_SIZE - buffer->head);
+}
+
+static void
+remmina_ssh_tunnel_buffer_consume (RemminaSSHTunnelBuffer *buffer, gsize len)
+{
+	TRACE_CALL("remmina_ssh_tunnel_buffer_consume");
+	buffer->head = (buffer->head + len) % REMMINA_SSH_TUNNEL_BUFFER_SIZE;
+	buffer->len -= len;
+	if (buffer->len == 0)
+		buffer->head = 0;
+}
+
+/* The channels of every tunnel are forwarded by a single engine thread,
+ * woken up by the readiness of the local sockets and of the SSH sessions.
+ * A tunnel is registered once its setup is done, and its session is then
+ * in non blocking mode and only used by the engine. */
+
+#define REMMINA_SSH_TUNNEL_MAX_EVENTS 64
+
+/* Bytes a channel may move each way in a turn, before the next channel's turn */
+#define REMMINA_SSH_TUNNEL_QUOTA 16384
+
+enum
+{
+	REMMINA_SSH_TUNNEL_WATCH_SESSION,
+	REMMINA_SSH_TUNNEL_WATCH_SERVER,
+	REMMINA_SSH_TUNNEL_WATCH_SOCKET
+};
+
+enum
+{
+	REMMINA_SSH_TUNNEL_CHANNEL_OPENING,
+	REMMINA_SSH_TUNNEL_CHANNEL_FORWARDING,
+	REMMINA_SSH_TUNNEL_CHANNEL_CLOSED
+};
+
+enum
+{
+	REMMINA_SSH_TUNNEL_REQUEST_ADD,
+	REMMINA_SSH_TUNNEL_REQUEST_REMOVE,
+	REMMINA_SSH_TUNNEL_REQUEST_CANCEL_ACCEPT,
+	REMMINA_SSH_TUNNEL_REQUEST_PAUSE,
+	REMMINA_SSH_TUNNEL_REQUEST_RESUME
+};
+
+struct _RemminaSSHTunnelWatch
+{
+	gint fd;
+	gint type;
+	gshort events;
+	RemminaSSHTunnel *tunnel;
+	RemminaSSHTunnelChannel *channel;
+};
+
+struct _RemminaSSHTunnelChannel
+{
+	ssh_channel channel;
+	gint sock;
+	gint state;
+	RemminaSSHTunnelWatch watch;
+	/* A side is only read while the buffer toward its peer has room */
+	RemminaSSHTunnelBuffer *to_socket;
+	RemminaSSHTunnelBuffer *to_channel;
+	gboolean socket_eof;
+	gboolean channel_eof;
+	/* Each side is shut down on its own once drained, and the channel is
+	 * closed when both are */
+	gboolean socket_shut;
+	gboolean eof_sent;
+};
+
+typedef struct _RemminaSSHTunnelRequest
+{
+	gint type;
+	RemminaSSHTunnel *tunnel;
+	gboolean done;
+} RemminaSSHTunnelRequest;
+
+typedef struct _RemminaSSHTunnelEngine
+{
+	pthread_t thread;
+
+	/* Requests from the other threads, which wait for them to be done */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	GSList *requests;
+	gint wakeup[2];
+
+#ifdef HAVE_SYS_EPOLL_H
+	gint epollfd;
+#else
+	GPtrArray *watches;
+#endif
+
+	/* The registered tunnels, and those which may have more data buffered
+	 * by libssh than their fds tell */
+	GPtrArray *tunnels;
+	GPtrArray *ready;
+
+	/* Counts the rounds, in which each tunnel gets one turn */
+	guint round;
+
+	/* Channels closed during the current round, which later events of
+	 * the round may still refer to */
+	GSList *garbage;
+} RemminaSSHTunnelEngine;
+
+static RemminaSSHTunnelEngine *remmina_ssh_tunnel_engine = NULL;
+
+static void
+remmina_ssh_tunnel_engine_watch (RemminaSSHTunnelEngine *engine, RemminaSSHTunnelWatch *watch, gshort events)
+{
+	TRACE_CALL("remmina_ssh_tunnel_engine_watch");
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+#endif
+
+	if (watch->fd < 0)
+		events = 0;
+	if (watch->events == events)
+		return;
+
+#ifdef HAVE_SYS_EPOLL_H
+	memset (&ev, 0, sizeof (ev));
+	ev.events = ((events & POLLIN) ? EPOLLIN : 0) | ((events & POLLOUT) ? EPOLLOUT : 0);
+	ev.data.ptr = watch;
+	if (watch->events == 0)
+		epoll_ctl (engine->epollfd, EPOLL_CTL_ADD, watch->fd, &ev);
+	else if (events == 0)
+		epoll_ctl (engine->epollfd, EPOLL_CTL_DEL, watch->fd, &ev);
+	else
+		epoll_ctl (engine->epollfd, EPOLL_CTL_MOD, watch->fd, &ev);
+#else
+	if (watch->events == 0)
+		g_ptr_array_add (engine->watches, watch);
+	else if (events == 0)
+		g_ptr_array_remove_fast (engine->watches, watch);
+#endif
+
+	watch->events = events;
+}
+
+static void
+remmina_ssh_tunnel_watch_init (RemminaSSHTunnelWatch *watch, gint type, RemminaSSHTunnel *tunnel, RemminaSSHTunnelChannel *channel)
+{
+	TRACE_CALL("remmina_ssh_tunnel_watch_init");
+	watch->fd = -1;
+	watch->type = type;
+	watch->events = 0;
+	watch->tunnel = tunnel;
+	watch->channel = channel;
+}
+
 RemminaSSHTunnel*
 remmina_ssh_tunnel_new_from_file (RemminaFile *remminafile)
 {
@@ -578,20 +759,22 @@ remmina_ssh_tunnel_new_from_file (RemminaFile *remminafile)
 	remmina_ssh_init_from_file (REMMINA_SSH (tunnel), remminafile);
 
 	tunnel->tunnel_type = -1;
-	tunnel->channels = NULL;
-	tunnel->sockets = NULL;
-	tunnel->socketbuffers = NULL;
-	tunnel->num_channels = 0;
-	tunnel->max_channels = 0;
+	tunnel->channels = g_ptr_array_new ();
+	tunnel->next_channel = 0;
+	tunnel->serviced_round = 0;
 	tunnel->x11_channel = NULL;
 	tunnel->thread = 0;
 	tunnel->running = FALSE;
+	tunnel->forwarding = 0;
+	tunnel->paused = 0;
+	tunnel->event = NULL;
+	tunnel->session_watch = g_new (RemminaSSHTunnelWatch, 1);
+	remmina_ssh_tunnel_watch_init (tunnel->session_watch, REMMINA_SSH_TUNNEL_WATCH_SESSION, tunnel, NULL);
+	tunnel->server_watch = g_new (RemminaSSHTunnelWatch, 1);
+	remmina_ssh_tunnel_watch_init (tunnel->server_watch, REMMINA_SSH_TUNNEL_WATCH_SERVER, tunnel, NULL);
 	tunnel->server_sock = -1;
 	tunnel->dest = NULL;
 	tunnel->port = 0;
-	tunnel->buffer = NULL;
-	tunnel->buffer_len = 0;
-	tunnel->channels_out = NULL;
 	tunnel->remotedisplay = 0;
 	tunnel->localdisplay = NULL;
 	tunnel->init_func = NULL;
@@ -602,29 +785,25 @@ remmina_ssh_tunnel_new_from_file (RemminaFile *remminafile)
 	return tunnel;
 }
 
+/* Close the channels of a tunnel the engine does not forward */
 static void
 remmina_ssh_tunnel_close_all_channels (RemminaSSHTunnel *tunnel)
 {
 	TRACE_CALL("remmina_ssh_tunnel_close_all_channels");
-	int i;
+	RemminaSSHTunnelChannel *ch;
+	guint i;
 
-	for (i = 0; i < tunnel->num_channels; i++)
+	for (i = 0; i < tunnel->channels->len; i++)
 	{
-		close (tunnel->sockets[i]);
-		remmina_ssh_tunnel_buffer_free (tunnel->socketbuffers[i]);
-		channel_close (tunnel->channels[i]);
-		channel_free (tunnel->channels[i]);
+		ch = (RemminaSSHTunnelChannel*) g_ptr_array_index (tunnel->channels, i);
+		close (ch->sock);
+		remmina_ssh_tunnel_buffer_free (ch->to_socket);
+		remmina_ssh_tunnel_buffer_free (ch->to_channel);
+		channel_close (ch->channel);
+		channel_free (ch->channel);
+		g_free(ch);
 	}
-
-	g_free(tunnel->channels);
-	tunnel->channels = NULL;
-	g_free(tunnel->sockets);
-	tunnel->sockets = NULL;
-	g_free(tunnel->socketbuffers);
-	tunnel->socketbuffers = NULL;
-
-	tunnel->num_channels = 0;
-	tunnel->max_channels = 0;
+	g_ptr_array_set_size (tunnel->channels, 0);
 
 	if (tunnel->x11_channel)
 	{
@@ -634,121 +813,732 @@ remmina_ssh_tunnel_close_all_channels (RemminaSSHTunnel *tunnel)
 	}
 }
 
+/* Register the new channel/socket pair */
+static RemminaSSHTunnelChannel*
+remmina_ssh_tunnel_add_channel (RemminaSSHTunnel *tunnel, ssh_channel channel, gint sock, gint state)
+{
+	TRACE_CALL("remmina_ssh_tunnel_add_channel");
+	RemminaSSHTunnelChannel *ch;
+	gint flags;
+
+	ch = g_new0 (RemminaSSHTunnelChannel, 1);
+	ch->channel = channel;
+	ch->sock = sock;
+	ch->state = state;
+	remmina_ssh_tunnel_watch_init (&ch->watch, REMMINA_SSH_TUNNEL_WATCH_SOCKET, tunnel, ch);
+	ch->watch.fd = sock;
+	ch->to_socket = remmina_ssh_tunnel_buffer_new ();
+	ch->to_channel = remmina_ssh_tunnel_buffer_new ();
+	g_ptr_array_add (tunnel->channels, ch);
+
+	flags = fcntl (sock, F_GETFL, 0);
+	fcntl (sock, F_SETFL, flags | O_NONBLOCK);
+
+	return ch;
+}
+
 static void
-remmina_ssh_tunnel_remove_channel (RemminaSSHTunnel *tunnel, gint n)
+remmina_ssh_tunnel_engine_close_channel (RemminaSSHTunnelEngine *engine, RemminaSSHTunnel *tunnel, RemminaSSHTunnelChannel *ch)
 {
-	TRACE_CALL("remmina_ssh_tunnel_remove_channel");
-	channel_close (tunnel->channels[n]);
-	channel_free (tunnel->channels[n]);
-	close (tunnel->sockets[n]);
-	remmina_ssh_tunnel_buffer_free (tunnel->socketbuffers[n]);
-	tunnel->num_channels--;
-	tunnel->channels[n] = tunnel->channels[tunnel->num_channels];
-	tunnel->channels[tunnel->num_channels] = NULL;
-	tunnel->sockets[n] = tunnel->sockets[tunnel->num_channels];
-	tunnel->socketbuffers[n] = tunnel->socketbuffers[tunnel->num_channels];
+	TRACE_CALL("remmina_ssh_tunnel_engine_close_channel");
+	remmina_ssh_tunnel_engine_watch (engine, &ch->watch, 0);
+	close (ch->sock);
+	ch->sock = -1;
+	ch->watch.fd = -1;
+	channel_close (ch->channel);
+	channel_free (ch->channel);
+	ch->channel = NULL;
+	remmina_ssh_tunnel_buffer_free (ch->to_socket);
+	ch->to_socket = NULL;
+	remmina_ssh_tunnel_buffer_free (ch->to_channel);
+	ch->to_channel = NULL;
+	ch->state = REMMINA_SSH_TUNNEL_CHANNEL_CLOSED;
+
+	g_ptr_array_remove (tunnel->channels, ch);
+	engine->garbage = g_slist_prepend (engine->garbage, ch);
 }
 
-/* Register the new channel/socket pair */
+/* Stop watching a tunnel, and give its session back in blocking mode */
 static void
-remmina_ssh_tunnel_add_channel (RemminaSSHTunnel *tunnel, ssh_channel channel, gint sock)
+remmina_ssh_tunnel_engine_unregister (RemminaSSHTunnelEngine *engine, RemminaSSHTunnel *tunnel)
 {
-	TRACE_CALL("remmina_ssh_tunnel_add_channel");
-	gint flags;
-	gint i;
+	TRACE_CALL("remmina_ssh_tunnel_engine_unregister");
+	guint i;
+
+	remmina_ssh_tunnel_engine_watch (engine, tunnel->session_watch, 0);
+	remmina_ssh_tunnel_engine_watch (engine, tunnel->server_watch, 0);
+	for (i = 0; i < tunnel->channels->len; i++)
+		remmina_ssh_tunnel_engine_watch (engine,
+				&((RemminaSSHTunnelChannel*) g_ptr_array_index (tunnel->channels, i))->watch, 0);
+
+	ssh_event_remove_session (tunnel->event, REMMINA_SSH (tunnel)->session);
+	ssh_event_free (tunnel->event);
+	tunnel->event = NULL;
+	ssh_set_blocking (REMMINA_SSH (tunnel)->session, 1);
+	g_ptr_array_remove (engine->tunnels, tunnel);
+	g_ptr_array_remove (engine->ready, tunnel);
+	g_atomic_int_set (&tunnel->forwarding, 0);
+}
+
+/* The tunnel is over: close its channels now, so the local ends see it */
+static void
+remmina_ssh_tunnel_engine_finish (RemminaSSHTunnelEngine *engine, RemminaSSHTunnel *tunnel)
+{
+	TRACE_CALL("remmina_ssh_tunnel_engine_finish");
+	remmina_ssh_tunnel_engine_unregister (engine, tunnel);
+	while (tunnel->channels->len > 0)
+		remmina_ssh_tunnel_engine_close_channel (engine, tunnel,
+				(RemminaSSHTunnelChannel*) g_ptr_array_index (tunnel->channels, 0));
+}
 
-	i = tunnel->num_channels++;
-	if (tunnel->num_channels > tunnel->max_channels)
+/* Local socket to channel, within the quota and the SSH window. Returns the
+ * number of bytes sent, or -1 when the channel must be closed. */
+static gssize
+remmina_ssh_tunnel_engine_socket_to_channel (RemminaSSHTunnelChannel *ch)
+{
+	TRACE_CALL("remmina_ssh_tunnel_engine_socket_to_channel");
+	gchar *ptr;
+	gsize n;
+	ssize_t len;
+	gboolean moved;
+	gssize sent = 0;
+
+	do
 	{
-		/* Allocate an extra NULL pointer in channels for ssh_select */
-		tunnel->channels = (ssh_channel*) g_realloc (tunnel->channels,
-				sizeof (ssh_channel) * (tunnel->num_channels + 1));
-		tunnel->sockets = (gint*) g_realloc (tunnel->sockets,
-				sizeof (gint) * tunnel->num_channels);
-		tunnel->socketbuffers = (RemminaSSHTunnelBuffer**) g_realloc (tunnel->socketbuffers,
-				sizeof (RemminaSSHTunnelBuffer*) * tunnel->num_channels);
-		tunnel->max_channels = tunnel->num_channels;
+		moved = FALSE;
+
+		n = remmina_ssh_tunnel_buffer_space (ch->to_channel, &ptr);
+		if (n > 0 && !ch->socket_eof)
+		{
+			len = read (ch->sock, ptr, MIN (n, REMMINA_SSH_TUNNEL_QUOTA - sent));
+			if (len > 0)
+			{
+				ch->to_channel->len += len;
+				moved = TRUE;
+			}
+			else if (len == 0)
+			{
+				ch->socket_eof = TRUE;
+			}
+			else if (errno != EAGAIN && errno != EINTR)
+			{
+				return -1;
+			}
+		}
+
+		/* A full window is reopened by the server, waking up the session */
+		n = remmina_ssh_tunnel_buffer_data (ch->to_channel, &ptr);
+		n = MIN (n, MIN (REMMINA_SSH_TUNNEL_QUOTA - sent, ssh_channel_window_size (ch->channel)));
+		if (n > 0)
+		{
+			len = channel_write (ch->channel, ptr, n);
+			if (len == SSH_ERROR)
+				return -1;
+			if (len > 0)
+			{
+				remmina_ssh_tunnel_buffer_consume (ch->to_channel, len);
+				sent += len;
+				moved = TRUE;
+			}
+		}
+	} while (moved && sent < REMMINA_SSH_TUNNEL_QUOTA);
 
-		tunnel->channels_out = (ssh_channel*) g_realloc (tunnel->channels_out,
-				sizeof (ssh_channel) * (tunnel->num_channels + 1));
+	if (ch->socket_eof && ch->to_channel->len == 0 && !ch->eof_sent)
+	{
+		channel_send_eof (ch->channel);
+		ch->eof_sent = TRUE;
 	}
-	tunnel->channels[i] = channel;
-	tunnel->channels[i + 1] = NULL;
-	tunnel->sockets[i] = sock;
-	tunnel->socketbuffers[i] = NULL;
 
-	flags = fcntl (sock, F_GETFL, 0);
-	fcntl (sock, F_SETFL, flags | O_NONBLOCK);
+	return sent;
 }
 
-static gpointer
-remmina_ssh_tunnel_main_thread_proc (gpointer data)
+/* Channel to local socket, within the quota. Returns the number of bytes
+ * written, or -1 when the channel must be closed. */
+static gssize
+remmina_ssh_tunnel_engine_channel_to_socket (RemminaSSHTunnelChannel *ch)
 {
-	TRACE_CALL("remmina_ssh_tunnel_main_thread_proc");
-	RemminaSSHTunnel *tunnel = (RemminaSSHTunnel*) data;
+	TRACE_CALL("remmina_ssh_tunnel_engine_channel_to_socket");
 	gchar *ptr;
-	ssize_t len = 0, lenw = 0;
-	fd_set set;
-	struct timeval timeout;
-	GTimeVal t1, t2;
-	glong diff;
-	ssh_channel channel = NULL;
-	gboolean first = TRUE;
-	gboolean disconnected;
-	gint sock;
-	gint maxfd;
-	gint i;
-	gint ret;
-	struct sockaddr_in sin;
-
-	g_get_current_time (&t1);
-	t2 = t1;
+	gsize n;
+	ssize_t len;
+	gboolean moved;
+	gssize sent = 0;
 
-	switch (tunnel->tunnel_type)
+	do
 	{
-		case REMMINA_SSH_TUNNEL_OPEN:
-		/* Accept a local connection */
-		sock = accept (tunnel->server_sock, NULL, NULL);
-		if (sock < 0)
+		moved = FALSE;
+
+		/* Unread data keeps the SSH window closed, which holds the server back */
+		n = remmina_ssh_tunnel_buffer_space (ch->to_socket, &ptr);
+		if (n > 0 && !ch->channel_eof)
 		{
-			REMMINA_SSH (tunnel)->error = g_strdup ("Failed to accept local socket");
-			tunnel->thread = 0;
-			return NULL;
+			len = channel_read_nonblocking (ch->channel, ptr, MIN (n, REMMINA_SSH_TUNNEL_QUOTA - sent), 0);
+			if (len == SSH_ERROR)
+				return -1;
+			if (len > 0)
+			{
+				ch->to_socket->len += len;
+				moved = TRUE;
+			}
+			else if (channel_is_eof (ch->channel))
+			{
+				ch->channel_eof = TRUE;
+			}
 		}
 
-		if ((channel = channel_new (tunnel->ssh.session)) == NULL)
+		n = remmina_ssh_tunnel_buffer_data (ch->to_socket, &ptr);
+		n = MIN (n, REMMINA_SSH_TUNNEL_QUOTA - sent);
+		if (n > 0)
 		{
-			close (sock);
-			remmina_ssh_set_error (REMMINA_SSH (tunnel), "Failed to createt channel : %s");
-			tunnel->thread = 0;
-			return NULL;
+			len = write (ch->sock, ptr, n);
+			if (len > 0)
+			{
+				remmina_ssh_tunnel_buffer_consume (ch->to_socket, len);
+				sent += len;
+				moved = TRUE;
+			}
+			else if (len < 0 && errno != EAGAIN && errno != EINTR)
+			{
+				return -1;
+			}
+		}
+	} while (moved && sent < REMMINA_SSH_TUNNEL_QUOTA);
+
+	/* The local end sees the EOF, and may still send the rest of its data */
+	if (ch->channel_eof && ch->to_socket->len == 0 && !ch->socket_shut)
+	{
+		shutdown (ch->sock, SHUT_WR);
+		ch->socket_shut = TRUE;
+	}
+
+	return sent;
+}
+
+/* Open the forward of a channel accepted on the local port, without waiting
+ * for the answer of the server. Returns FALSE on failure. */
+static gboolean
+remmina_ssh_tunnel_engine_open_channel (RemminaSSHTunnel *tunnel, RemminaSSHTunnelChannel *ch)
+{
+	TRACE_CALL("remmina_ssh_tunnel_engine_open_channel");
+	gint ret;
+
+	ret = channel_open_forward (ch->channel, tunnel->dest, tunnel->port, "127.0.0.1", 0);
+	if (ret == SSH_AGAIN)
+		return TRUE;
+	if (ret != SSH_OK)
+	{
+		remmina_ssh_set_error (REMMINA_SSH (tunnel), _("Failed to connect to the SSH tunnel destination: %s"));
+		return FALSE;
+	}
+	ch->state = REMMINA_SSH_TUNNEL_CHANNEL_FORWARDING;
+	return TRUE;
+}
+
+static gboolean
+remmina_ssh_tunnel_engine_accept (RemminaSSHTunnel *tunnel)
+{
+	TRACE_CALL("remmina_ssh_tunnel_engine_accept");
+	ssh_channel channel;
+	gint sock;
+
+	sock = accept (tunnel->server_sock, NULL, NULL);
+	if (sock < 0)
+		return TRUE;
+
+	if ((channel = channel_new (tunnel->ssh.session)) == NULL)
+	{
+		close (sock);
+		remmina_ssh_set_error (REMMINA_SSH (tunnel), "Failed to createt channel : %s");
+		return FALSE;
+	}
+	remmina_ssh_tunnel_add_channel (tunnel, channel, sock, REMMINA_SSH_TUNNEL_CHANNEL_OPENING);
+	return TRUE;
+}
+
+/* Channels opened by the server for X11 and XPORT tunnels */
+static void
+remmina_ssh_tunnel_engine_accept_remote (RemminaSSHTunnel *tunnel)
+{
+	TRACE_CALL("remmina_ssh_tunnel_engine_accept_remote");
+	ssh_channel channel;
+	gint sock;
+
+	while (TRUE)
+	{
+		if (tunnel->tunnel_type == REMMINA_SSH_TUNNEL_X11)
+			channel = channel_accept_x11 (tunnel->x11_channel, 0);
+		else
+			channel = channel_forward_accept (REMMINA_SSH (tunnel)->session, 0);
+		if (!channel)
+			break;
+
+		sock = remmina_public_open_xdisplay (tunnel->localdisplay);
+		if (sock >= 0)
+		{
+			remmina_ssh_tunnel_add_channel (tunnel, channel, sock, REMMINA_SSH_TUNNEL_CHANNEL_FORWARDING);
 		}
-		/* Request the SSH server to connect to the destination */
-		if (channel_open_forward (channel, tunnel->dest, tunnel->port, "127.0.0.1", 0) != SSH_OK)
+		else
 		{
-			close (sock);
 			channel_close (channel);
 			channel_free (channel);
-			remmina_ssh_set_error (REMMINA_SSH (tunnel), _("Failed to connect to the SSH tunnel destination: %s"));
-			tunnel->thread = 0;
-			return NULL;
 		}
-		remmina_ssh_tunnel_add_channel (tunnel, channel, sock);
+	}
+}
+
+/* Have the tunnel serviced again at the end of the round */
+static void
+remmina_ssh_tunnel_engine_defer (RemminaSSHTunnelEngine *engine, RemminaSSHTunnel *tunnel)
+{
+	TRACE_CALL("remmina_ssh_tunnel_engine_defer");
+	guint i;
+
+	for (i = 0; i < engine->ready->len; i++)
+	{
+		if (g_ptr_array_index (engine->ready, i) == tunnel)
+			return;
+	}
+	g_ptr_array_add (engine->ready, tunnel);
+}
+
+/* Give every channel of the tunnel a turn, then watch what each of them
+ * waits for. Each turn moves a bounded amount of data each way, starting
+ * from a different channel every time, so that a bulk transfer cannot hold
+ * up the other channels of the tunnel. A tunnel only gets one turn in a
+ * round, however many of its fds woke up, so that a busy tunnel cannot
+ * hold up the other tunnels either. */
+static void
+remmina_ssh_tunnel_engine_service (RemminaSSHTunnelEngine *engine, RemminaSSHTunnel *tunnel)
+{
+	TRACE_CALL("remmina_ssh_tunnel_engine_service");
+	RemminaSSHTunnelChannel *ch;
+	GSList *closed = NULL, *element;
+	gboolean more = FALSE;
+	gssize in, out;
+	guint i, n, start;
+
+	if (!g_atomic_int_get (&tunnel->forwarding))
+		return;
+
+	if (tunnel->serviced_round == engine->round)
+	{
+		remmina_ssh_tunnel_engine_defer (engine, tunnel);
+		return;
+	}
+	tunnel->serviced_round = engine->round;
+
+	if (tunnel->tunnel_type == REMMINA_SSH_TUNNEL_X11 || tunnel->tunnel_type == REMMINA_SSH_TUNNEL_XPORT)
+		remmina_ssh_tunnel_engine_accept_remote (tunnel);
+
+	n = tunnel->channels->len;
+	start = (n > 0 ? tunnel->next_channel % n : 0);
+	for (i = 0; i < n; i++)
+	{
+		ch = (RemminaSSHTunnelChannel*) g_ptr_array_index (tunnel->channels, (start + i) % n);
+
+		if (ch->state == REMMINA_SSH_TUNNEL_CHANNEL_OPENING)
+		{
+			if (!remmina_ssh_tunnel_engine_open_channel (tunnel, ch))
+			{
+				g_slist_free (closed);
+				remmina_ssh_tunnel_engine_finish (engine, tunnel);
+				return;
+			}
+			if (ch->state == REMMINA_SSH_TUNNEL_CHANNEL_OPENING)
+				continue;
+		}
+
+		in = remmina_ssh_tunnel_engine_channel_to_socket (ch);
+		out = (in < 0 ? -1 : remmina_ssh_tunnel_engine_socket_to_channel (ch));
+		if (in < 0 || out < 0 || (ch->socket_shut && (ch->eof_sent || channel_is_closed (ch->channel))))
+		{
+			closed = g_slist_prepend (closed, ch);
+			continue;
+		}
+		/* A used up quota may leave data behind no fd will tell about */
+		if (in == REMMINA_SSH_TUNNEL_QUOTA || out == REMMINA_SSH_TUNNEL_QUOTA)
+			more = TRUE;
+	}
+	tunnel->next_channel = start + 1;
+
+	for (element = closed; element; element = element->next)
+		remmina_ssh_tunnel_engine_close_channel (engine, tunnel, (RemminaSSHTunnelChannel*) element->data);
+	g_slist_free (closed);
+
+	if (!ssh_is_connected (REMMINA_SSH (tunnel)->session) ||
+			(tunnel->channels->len == 0 &&
+			 (tunnel->tunnel_type != REMMINA_SSH_TUNNEL_OPEN || tunnel->server_sock < 0)))
+	{
+		/* No more connections */
+		remmina_ssh_tunnel_engine_finish (engine, tunnel);
+		return;
+	}
+
+	/* Come back in the next round for the rest */
+	if (more)
+		remmina_ssh_tunnel_engine_defer (engine, tunnel);
+
+	/* A side is only watched for reading while its peer's buffer has room,
+	 * and for writing while it has data waiting */
+	remmina_ssh_tunnel_engine_watch (engine, tunnel->session_watch,
+			POLLIN | ((ssh_get_poll_flags (REMMINA_SSH (tunnel)->session) & SSH_WRITE_PENDING) ? POLLOUT : 0));
+	remmina_ssh_tunnel_engine_watch (engine, tunnel->server_watch, POLLIN);
+	for (i = 0; i < tunnel->channels->len; i++)
+	{
+		ch = (RemminaSSHTunnelChannel*) g_ptr_array_index (tunnel->channels, i);
+		if (ch->state == REMMINA_SSH_TUNNEL_CHANNEL_FORWARDING)
+			remmina_ssh_tunnel_engine_watch (engine, &ch->watch,
+					((!ch->socket_eof && ch->to_channel->len < REMMINA_SSH_TUNNEL_BUFFER_SIZE) ? POLLIN : 0) |
+					(ch->to_socket->len > 0 ? POLLOUT : 0));
+	}
+}
+
+static void
+remmina_ssh_tunnel_engine_dispatch (RemminaSSHTunnelEngine *engine, RemminaSSHTunnelWatch *watch, gshort revents)
+{
+	TRACE_CALL("remmina_ssh_tunnel_engine_dispatch");
+	RemminaSSHTunnel *tunnel = watch->tunnel;
+
+	/* Unwatched by an earlier event of the same round */
+	if (watch->events == 0)
+		return;
+
+	switch (watch->type)
+	{
+		case REMMINA_SSH_TUNNEL_WATCH_SESSION:
+		/* Read the incoming packets into the channels, even those whose
+		 * buffers are full, and send what is pending */
+		if (revents & (POLLIN | POLLHUP | POLLERR))
+			ssh_event_dopoll (tunnel->event, 0);
+		if (revents & POLLOUT)
+			ssh_blocking_flush (REMMINA_SSH (tunnel)->session, 0);
+		break;
+
+		case REMMINA_SSH_TUNNEL_WATCH_SERVER:
+		if (!remmina_ssh_tunnel_engine_accept (tunnel))
+		{
+			remmina_ssh_tunnel_engine_finish (engine, tunnel);
+			return;
+		}
 		break;
 
+		case REMMINA_SSH_TUNNEL_WATCH_SOCKET:
+		/* Serviced with the other channels, in turn */
+		break;
+	}
+
+	remmina_ssh_tunnel_engine_service (engine, tunnel);
+}
+
+/* Take the session of the tunnel over in non blocking mode, and forward it */
+static void
+remmina_ssh_tunnel_engine_register (RemminaSSHTunnelEngine *engine, RemminaSSHTunnel *tunnel)
+{
+	TRACE_CALL("remmina_ssh_tunnel_engine_register");
+	if (!g_atomic_int_get (&tunnel->forwarding))
+	{
+		ssh_set_blocking (REMMINA_SSH (tunnel)->session, 0);
+		tunnel->event = ssh_event_new ();
+		ssh_event_add_session (tunnel->event, REMMINA_SSH (tunnel)->session);
+		tunnel->session_watch->fd = ssh_get_fd (REMMINA_SSH (tunnel)->session);
+		g_ptr_array_add (engine->tunnels, tunnel);
+		g_atomic_int_set (&tunnel->forwarding, 1);
+	}
+	tunnel->server_watch->fd = tunnel->server_sock;
+	remmina_ssh_tunnel_engine_service (engine, tunnel);
+}
+
+static void
+remmina_ssh_tunnel_engine_process_requests (RemminaSSHTunnelEngine *engine)
+{
+	TRACE_CALL("remmina_ssh_tunnel_engine_process_requests");
+	RemminaSSHTunnelRequest *request;
+	RemminaSSHTunnel *tunnel;
+	GSList *requests, *element;
+
+	pthread_mutex_lock (&engine->mutex);
+	requests = engine->requests;
+	engine->requests = NULL;
+	pthread_mutex_unlock (&engine->mutex);
+
+	for (element = requests; element; element = element->next)
+	{
+		request = (RemminaSSHTunnelRequest*) element->data;
+		tunnel = request->tunnel;
+
+		switch (request->type)
+		{
+			case REMMINA_SSH_TUNNEL_REQUEST_ADD:
+			remmina_ssh_tunnel_engine_register (engine, tunnel);
+			break;
+
+			case REMMINA_SSH_TUNNEL_REQUEST_REMOVE:
+			if (g_atomic_int_get (&tunnel->forwarding))
+				remmina_ssh_tunnel_engine_unregister (engine, tunnel);
+			break;
+
+			case REMMINA_SSH_TUNNEL_REQUEST_CANCEL_ACCEPT:
+			remmina_ssh_tunnel_engine_watch (engine, tunnel->server_watch, 0);
+			tunnel->server_watch->fd = -1;
+			if (tunnel->server_sock >= 0)
+			{
+				close (tunnel->server_sock);
+				tunnel->server_sock = -1;
+			}
+			remmina_ssh_tunnel_engine_service (engine, tunnel);
+			break;
+
+			case REMMINA_SSH_TUNNEL_REQUEST_PAUSE:
+			if (g_atomic_int_get (&tunnel->forwarding))
+			{
+				g_atomic_int_set (&tunnel->paused, 1);
+				remmina_ssh_tunnel_engine_unregister (engine, tunnel);
+			}
+			break;
+
+			case REMMINA_SSH_TUNNEL_REQUEST_RESUME:
+			if (g_atomic_int_get (&tunnel->paused))
+			{
+				remmina_ssh_tunnel_engine_register (engine, tunnel);
+				g_atomic_int_set (&tunnel->paused, 0);
+			}
+			break;
+		}
+	}
+
+	pthread_mutex_lock (&engine->mutex);
+	for (element = requests; element; element = element->next)
+		((RemminaSSHTunnelRequest*) element->data)->done = TRUE;
+	pthread_cond_broadcast (&engine->cond);
+	pthread_mutex_unlock (&engine->mutex);
+
+	g_slist_free (requests);
+}
+
+static void
+remmina_ssh_tunnel_engine_round_end (RemminaSSHTunnelEngine *engine)
+{
+	TRACE_CALL("remmina_ssh_tunnel_engine_round_end");
+	GPtrArray *ready;
+	guint i;
+
+	engine->round++;
+
+	/* Give another turn to the tunnels which still had data, or which
+	 * woke up again after their turn */
+	if (engine->ready->len > 0)
+	{
+		ready = engine->ready;
+		engine->ready = g_ptr_array_new ();
+		for (i = 0; i < ready->len; i++)
+			remmina_ssh_tunnel_engine_service (engine, (RemminaSSHTunnel*) g_ptr_array_index (ready, i));
+		g_ptr_array_free (ready, TRUE);
+	}
+
+	g_slist_free_full (engine->garbage, g_free);
+	engine->garbage = NULL;
+}
+
+static gpointer
+remmina_ssh_tunnel_engine_thread (gpointer data)
+{
+	TRACE_CALL("remmina_ssh_tunnel_engine_thread");
+	RemminaSSHTunnelEngine *engine = (RemminaSSHTunnelEngine*) data;
+	RemminaSSHTunnelWatch *watch;
+	gchar drain[64];
+	gint n, i;
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event events[REMMINA_SSH_TUNNEL_MAX_EVENTS];
+	gshort revents;
+#else
+	struct pollfd *pfds = NULL;
+	RemminaSSHTunnelWatch **watches = NULL;
+	guint count = 0;
+#endif
+
+	while (TRUE)
+	{
+		remmina_ssh_tunnel_engine_process_requests (engine);
+
+#ifdef HAVE_SYS_EPOLL_H
+		n = epoll_wait (engine->epollfd, events, REMMINA_SSH_TUNNEL_MAX_EVENTS, engine->ready->len > 0 ? 0 : -1);
+		for (i = 0; i < n; i++)
+		{
+			watch = (RemminaSSHTunnelWatch*) events[i].data.ptr;
+			if (!watch)
+			{
+				while (read (engine->wakeup[0], drain, sizeof (drain)) > 0);
+				continue;
+			}
+			revents = ((events[i].events & EPOLLIN) ? POLLIN : 0) | ((events[i].events & EPOLLOUT) ? POLLOUT : 0) |
+					((events[i].events & EPOLLHUP) ? POLLHUP : 0) | ((events[i].events & EPOLLERR) ? POLLERR : 0);
+			remmina_ssh_tunnel_engine_dispatch (engine, watch, revents);
+		}
+#else
+		/* Dispatching may change the watches: work on a copy */
+		if (count < engine->watches->len + 1)
+		{
+			count = engine->watches->len + 1;
+			pfds = g_renew (struct pollfd, pfds, count);
+			watches = g_renew (RemminaSSHTunnelWatch*, watches, count);
+		}
+		pfds[0].fd = engine->wakeup[0];
+		pfds[0].events = POLLIN;
+		watches[0] = NULL;
+		for (i = 0; i < (gint) engine->watches->len; i++)
+		{
+			watches[i + 1] = (RemminaSSHTunnelWatch*) g_ptr_array_index (engine->watches, i);
+			pfds[i + 1].fd = watches[i + 1]->fd;
+			pfds[i + 1].events = watches[i + 1]->events;
+		}
+		n = poll (pfds, engine->watches->len + 1, engine->ready->len > 0 ? 0 : -1);
+		for (i = 0; n > 0 && i < (gint) engine->watches->len + 1; i++)
+		{
+			if (pfds[i].revents == 0)
+				continue;
+			n--;
+			if (!watches[i])
+			{
+				while (read (engine->wakeup[0], drain, sizeof (drain)) > 0);
+				continue;
+			}
+			remmina_ssh_tunnel_engine_dispatch (engine, watches[i], pfds[i].revents);
+		}
+#endif
+
+		remmina_ssh_tunnel_engine_round_end (engine);
+	}
+
+	return NULL;
+}
+
+static gpointer
+remmina_ssh_tunnel_engine_new (gpointer data)
+{
+	TRACE_CALL("remmina_ssh_tunnel_engine_new");
+	RemminaSSHTunnelEngine *engine;
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+#endif
+
+	engine = g_new0 (RemminaSSHTunnelEngine, 1);
+	if (pipe (engine->wakeup))
+	{
+		g_free(engine);
+		return NULL;
+	}
+	fcntl (engine->wakeup[0], F_SETFL, fcntl (engine->wakeup[0], F_GETFL, 0) | O_NONBLOCK);
+	fcntl (engine->wakeup[1], F_SETFL, fcntl (engine->wakeup[1], F_GETFL, 0) | O_NONBLOCK);
+
+#ifdef HAVE_SYS_EPOLL_H
+	engine->epollfd = epoll_create1 (EPOLL_CLOEXEC);
+	memset (&ev, 0, sizeof (ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (engine->epollfd < 0 || epoll_ctl (engine->epollfd, EPOLL_CTL_ADD, engine->wakeup[0], &ev) < 0)
+	{
+		if (engine->epollfd >= 0)
+			close (engine->epollfd);
+		close (engine->wakeup[0]);
+		close (engine->wakeup[1]);
+		g_free(engine);
+		return NULL;
+	}
+#else
+	engine->watches = g_ptr_array_new ();
+#endif
+
+	pthread_mutex_init (&engine->mutex, NULL);
+	pthread_cond_init (&engine->cond, NULL);
+	engine->tunnels = g_ptr_array_new ();
+	engine->ready = g_ptr_array_new ();
+	engine->round = 1;
+
+	/* The engine serves the tunnels until the application exits */
+	if (pthread_create (&engine->thread, NULL, remmina_ssh_tunnel_engine_thread, engine))
+	{
+		g_warning ("Failed to start the SSH tunnel engine");
+		g_ptr_array_free (engine->ready, TRUE);
+		g_ptr_array_free (engine->tunnels, TRUE);
+		pthread_cond_destroy (&engine->cond);
+		pthread_mutex_destroy (&engine->mutex);
+#ifdef HAVE_SYS_EPOLL_H
+		close (engine->epollfd);
+#else
+		g_ptr_array_free (engine->watches, TRUE);
+#endif
+		close (engine->wakeup[0]);
+		close (engine->wakeup[1]);
+		g_free(engine);
+		return NULL;
+	}
+	pthread_detach (engine->thread);
+
+	g_atomic_pointer_set (&remmina_ssh_tunnel_engine, engine);
+	return engine;
+}
+
+/* Hand a request over to the engine thread and wait for it to be done.
+ * Returns FALSE if there is no engine. */
+static gboolean
+remmina_ssh_tunnel_engine_request (RemminaSSHTunnel *tunnel, gint type)
+{
+	TRACE_CALL("remmina_ssh_tunnel_engine_request");
+	static GOnce engine_once = G_ONCE_INIT;
+	RemminaSSHTunnelEngine *engine;
+	RemminaSSHTunnelRequest request;
+	gint cancel_state;
+
+	/* Only registering a tunnel starts the engine */
+	if (type == REMMINA_SSH_TUNNEL_REQUEST_ADD)
+		engine = (RemminaSSHTunnelEngine*) g_once (&engine_once, remmina_ssh_tunnel_engine_new, NULL);
+	else
+		engine = (RemminaSSHTunnelEngine*) g_atomic_pointer_get (&remmina_ssh_tunnel_engine);
+	if (!engine)
+		return FALSE;
+
+	request.type = type;
+	request.tunnel = tunnel;
+	request.done = FALSE;
+
+	pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &cancel_state);
+	pthread_mutex_lock (&engine->mutex);
+	engine->requests = g_slist_append (engine->requests, &request);
+	if (write (engine->wakeup[1], "", 1) < 0)
+	{
+		/* The pipe is already full of wake ups */
+	}
+	while (!request.done)
+		pthread_cond_wait (&engine->cond, &engine->mutex);
+	pthread_mutex_unlock (&engine->mutex);
+	pthread_setcancelstate (cancel_state, NULL);
+
+	return TRUE;
+}
+
+/* Setup of the X11, XPORT and reverse tunnels, up to their first channel */
+static gboolean
+remmina_ssh_tunnel_setup (RemminaSSHTunnel *tunnel)
+{
+	TRACE_CALL("remmina_ssh_tunnel_setup");
+	gchar *ptr;
+	ssh_channel channel = NULL;
+	gint sock;
+	gint i;
+	struct sockaddr_in sin;
+
+	switch (tunnel->tunnel_type)
+	{
 		case REMMINA_SSH_TUNNEL_X11:
 		if ((tunnel->x11_channel = channel_new (tunnel->ssh.session)) == NULL)
 		{
 			remmina_ssh_set_error (REMMINA_SSH (tunnel), "Failed to create channel : %s");
-			tunnel->thread = 0;
-			return NULL;
+			return FALSE;
 		}
 		if (!remmina_public_get_xauth_cookie (tunnel->localdisplay, &ptr))
 		{
 			remmina_ssh_set_application_error (REMMINA_SSH (tunnel), "%s", ptr);
 			g_free(ptr);
-			tunnel->thread = 0;
-			return NULL;
+			return FALSE;
 		}
 		if (channel_open_session (tunnel->x11_channel) ||
 				channel_request_x11 (tunnel->x11_channel, TRUE, NULL, ptr,
@@ -756,8 +1546,7 @@ remmina_ssh_tunnel_main_thread_proc (gpointer data)
 		{
 			g_free(ptr);
 			remmina_ssh_set_error (REMMINA_SSH (tunnel), "Failed to open channel : %s");
-			tunnel->thread = 0;
-			return NULL;
+			return FALSE;
 		}
 		g_free(ptr);
 		if (channel_request_exec (tunnel->x11_channel, tunnel->dest))
@@ -765,8 +1554,7 @@ remmina_ssh_tunnel_main_thread_proc (gpointer data)
 			ptr = g_strdup_printf(_("Failed to execute %s on SSH server : %%s"), tunnel->dest);
 			remmina_ssh_set_error (REMMINA_SSH (tunnel), ptr);
 			g_free(ptr);
-			tunnel->thread = 0;
-			return NULL;
+			return FALSE;
 		}
 
 		if (tunnel->init_func &&
@@ -776,8 +1564,7 @@ remmina_ssh_tunnel_main_thread_proc (gpointer data)
 			{
 				(*tunnel->disconnect_func) (tunnel, tunnel->callback_data);
 			}
-			tunnel->thread = 0;
-			return NULL;
+			return FALSE;
 		}
 
 		break;
@@ -804,8 +1591,7 @@ remmina_ssh_tunnel_main_thread_proc (gpointer data)
 			{
 				(*tunnel->disconnect_func) (tunnel, tunnel->callback_data);
 			}
-			tunnel->thread = 0;
-			return NULL;
+			return FALSE;
 		}
 
 		if (tunnel->init_func &&
@@ -815,8 +1601,7 @@ remmina_ssh_tunnel_main_thread_proc (gpointer data)
 			{
 				(*tunnel->disconnect_func) (tunnel, tunnel->callback_data);
 			}
-			tunnel->thread = 0;
-			return NULL;
+			return FALSE;
 		}
 
 		break;
@@ -829,8 +1614,7 @@ remmina_ssh_tunnel_main_thread_proc (gpointer data)
 			{
 				(*tunnel->disconnect_func) (tunnel, tunnel->callback_data);
 			}
-			tunnel->thread = 0;
-			return NULL;
+			return FALSE;
 		}
 
 		if (tunnel->init_func &&
@@ -840,232 +1624,66 @@ remmina_ssh_tunnel_main_thread_proc (gpointer data)
 			{
 				(*tunnel->disconnect_func) (tunnel, tunnel->callback_data);
 			}
-			tunnel->thread = 0;
-			return NULL;
+			return FALSE;
 		}
 
 		break;
 	}
 
-	tunnel->buffer_len = 10240;
-	tunnel->buffer = g_malloc (tunnel->buffer_len);
-
-	/* Start the tunnel data transmittion */
-	while (tunnel->running)
+	/* Wait for a period of time for the first incoming connection */
+	if (tunnel->tunnel_type == REMMINA_SSH_TUNNEL_X11)
 	{
-		if (tunnel->tunnel_type == REMMINA_SSH_TUNNEL_XPORT ||
-				tunnel->tunnel_type == REMMINA_SSH_TUNNEL_X11 ||
-				tunnel->tunnel_type == REMMINA_SSH_TUNNEL_REVERSE)
-		{
-			if (first)
-			{
-				first = FALSE;
-				/* Wait for a period of time for the first incoming connection */
-				if (tunnel->tunnel_type == REMMINA_SSH_TUNNEL_X11)
-				{
-					channel = channel_accept_x11 (tunnel->x11_channel, 15000);
-				}
-				else
-				{
-					channel = channel_forward_accept (REMMINA_SSH (tunnel)->session, 15000);
-				}
-				if (!channel)
-				{
-					remmina_ssh_set_application_error (REMMINA_SSH (tunnel), _("No response from the server."));
-					if (tunnel->disconnect_func)
-					{
-						(*tunnel->disconnect_func) (tunnel, tunnel->callback_data);
-					}
-					tunnel->thread = 0;
-					return NULL;
-				}
-				if (tunnel->connect_func)
-				{
-					(*tunnel->connect_func) (tunnel, tunnel->callback_data);
-				}
-				if (tunnel->tunnel_type == REMMINA_SSH_TUNNEL_REVERSE)
-				{
-					/* For reverse tunnel, we only need one connection. */
-					channel_forward_cancel (REMMINA_SSH (tunnel)->session, NULL, tunnel->port);
-				}
-			}
-			else if (tunnel->tunnel_type != REMMINA_SSH_TUNNEL_REVERSE)
-			{
-				/* Poll once per some period of time if no incoming connections.
-				 * Don't try to poll continuously as it will significantly slow down the loop */
-				g_get_current_time (&t1);
-				diff = (t1.tv_sec - t2.tv_sec) * 10 + (t1.tv_usec - t2.tv_usec) / 100000;
-				if (diff > 1)
-				{
-					if (tunnel->tunnel_type == REMMINA_SSH_TUNNEL_X11)
-					{
-						channel = channel_accept_x11 (tunnel->x11_channel, 0);
-					}
-					else
-					{
-						channel = channel_forward_accept (REMMINA_SSH (tunnel)->session, 0);
-					}
-					if (channel == NULL)
-					{
-						t2 = t1;
-					}
-				}
-			}
-
-			if (channel)
-			{
-				if (tunnel->tunnel_type == REMMINA_SSH_TUNNEL_REVERSE)
-				{
-					sin.sin_family = AF_INET;
-					sin.sin_port = htons (tunnel->localport);
-					sin.sin_addr.s_addr = inet_addr ("127.0.0.1");
-					sock = socket (AF_INET, SOCK_STREAM, 0);
-					if (connect (sock, (struct sockaddr *) &sin, sizeof (sin)) < 0)
-					{
-						remmina_ssh_set_application_error (REMMINA_SSH (tunnel),
-								"Cannot connect to local port %i.", tunnel->localport);
-						close (sock);
-						sock = -1;
-					}
-				}
-				else
-				{
-					sock = remmina_public_open_xdisplay (tunnel->localdisplay);
-				}
-				if (sock >= 0)
-				{
-					remmina_ssh_tunnel_add_channel (tunnel, channel, sock);
-				}
-				else
-				{
-					/* Failed to create unix socket. Will this happen? */
-					channel_close (channel);
-					channel_free (channel);
-				}
-				channel = NULL;
-			}
-		}
-
-		if (tunnel->num_channels <= 0)
-		{
-			/* No more connections. We should quit */
-			break;
-		}
-
-		timeout.tv_sec = 0;
-		timeout.tv_usec = 200000;
-
-		FD_ZERO (&set);
-		maxfd = 0;
-		for (i = 0; i < tunnel->num_channels; i++)
-		{
-			if (tunnel->sockets[i] > maxfd)
-			{
-				maxfd = tunnel->sockets[i];
-			}
-			FD_SET (tunnel->sockets[i], &set);
-		}
-
-		ret = ssh_select (tunnel->channels, tunnel->channels_out, maxfd + 1, &set, &timeout);
-		if (!tunnel->running) break;
-		if (ret == SSH_EINTR) continue;
-		if (ret == -1) break;
-
-		i = 0;
-		while (tunnel->running && i < tunnel->num_channels)
+		channel = channel_accept_x11 (tunnel->x11_channel, 15000);
+	}
+	else
+	{
+		channel = channel_forward_accept (REMMINA_SSH (tunnel)->session, 15000);
+	}
+	if (!channel)
+	{
+		remmina_ssh_set_application_error (REMMINA_SSH (tunnel), _("No response from the server."));
+		if (tunnel->disconnect_func)
 		{
-			disconnected = FALSE;
-			if (FD_ISSET (tunnel->sockets[i], &set))
-			{
-				while (!disconnected &&
-						(len = read (tunnel->sockets[i], tunnel->buffer, tunnel->buffer_len)) > 0)
-				{
-					for (ptr = tunnel->buffer, lenw = 0; len > 0; len -= lenw, ptr += lenw)
-					{
-						lenw = channel_write (tunnel->channels[i], (char*) ptr, len);
-						if (lenw <= 0)
-						{
-							disconnected = TRUE;
-							break;
-						}
-					}
-				}
-				if (len == 0) disconnected = TRUE;
-			}
-			if (disconnected)
-			{
-				remmina_ssh_tunnel_remove_channel (tunnel, i);
-				continue;
-			}
-			i++;
+			(*tunnel->disconnect_func) (tunnel, tunnel->callback_data);
 		}
-		if (!tunnel->running) break;
+		return FALSE;
+	}
+	if (tunnel->connect_func)
+	{
+		(*tunnel->connect_func) (tunnel, tunnel->callback_data);
+	}
 
-		i = 0;
-		while (tunnel->running && i < tunnel->num_channels)
+	if (tunnel->tunnel_type == REMMINA_SSH_TUNNEL_REVERSE)
+	{
+		/* For reverse tunnel, we only need one connection. */
+		channel_forward_cancel (REMMINA_SSH (tunnel)->session, NULL, tunnel->port);
+
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons (tunnel->localport);
+		sin.sin_addr.s_addr = inet_addr ("127.0.0.1");
+		sock = socket (AF_INET, SOCK_STREAM, 0);
+		if (connect (sock, (struct sockaddr *) &sin, sizeof (sin)) < 0)
 		{
-			disconnected = FALSE;
-
-			if (!tunnel->socketbuffers[i])
-			{
-				len = channel_poll (tunnel->channels[i], 0);
-				if (len == SSH_ERROR || len == SSH_EOF)
-				{
-					disconnected = TRUE;
-				}
-				else if (len > 0)
-				{
-					tunnel->socketbuffers[i] = remmina_ssh_tunnel_buffer_new (len);
-					len = channel_read_nonblocking (tunnel->channels[i], tunnel->socketbuffers[i]->data, len, 0);
-					if (len <= 0)
-					{
-						disconnected = TRUE;
-					}
-					else
-					{
-						tunnel->socketbuffers[i]->len = len;
-					}
-				}
-			}
-
-			if (!disconnected && tunnel->socketbuffers[i])
-			{
-				for (lenw = 0; tunnel->socketbuffers[i]->len > 0;
-						tunnel->socketbuffers[i]->len -= lenw, tunnel->socketbuffers[i]->ptr += lenw)
-				{
-					lenw = write (tunnel->sockets[i], tunnel->socketbuffers[i]->ptr, tunnel->socketbuffers[i]->len);
-					if (lenw == -1 && errno == EAGAIN && tunnel->running)
-					{
-						/* Sometimes we cannot write to a socket (always EAGAIN), probably because it's internal
-						 * buffer is full. We need read the pending bytes from the socket first. so here we simply
-						 * break, leave the buffer there, and continue with other data */
-						break;
-					}
-					if (lenw <= 0)
-					{
-						disconnected = TRUE;
-						break;
-					}
-				}
-				if (tunnel->socketbuffers[i]->len <= 0)
-				{
-					remmina_ssh_tunnel_buffer_free (tunnel->socketbuffers[i]);
-					tunnel->socketbuffers[i] = NULL;
-				}
-			}
-
-			if (disconnected)
-			{
-				remmina_ssh_tunnel_remove_channel (tunnel, i);
-				continue;
-			}
-			i++;
+			remmina_ssh_set_application_error (REMMINA_SSH (tunnel),
+					"Cannot connect to local port %i.", tunnel->localport);
+			close (sock);
+			sock = -1;
 		}
 	}
+	else
+	{
+		sock = remmina_public_open_xdisplay (tunnel->localdisplay);
+	}
+	if (sock < 0)
+	{
+		/* Failed to create unix socket. Will this happen? */
+		channel_close (channel);
+		channel_free (channel);
+		return FALSE;
+	}
+	remmina_ssh_tunnel_add_channel (tunnel, channel, sock, REMMINA_SSH_TUNNEL_CHANNEL_FORWARDING);
 
-	remmina_ssh_tunnel_close_all_channels (tunnel);
-
-	return NULL;
+	return TRUE;
 }
 
 static gpointer
@@ -1076,11 +1694,14 @@ remmina_ssh_tunnel_main_thread (gpointer data)
 
 	pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
 
-	while (TRUE)
+	/* Once set up, the tunnel is forwarded by the engine */
+	if (remmina_ssh_tunnel_setup (tunnel) && tunnel->running &&
+			!remmina_ssh_tunnel_engine_request (tunnel, REMMINA_SSH_TUNNEL_REQUEST_ADD))
 	{
-		remmina_ssh_tunnel_main_thread_proc (data);
-		if (tunnel->server_sock < 0 || tunnel->thread == 0 || !tunnel->running) break;
+		remmina_ssh_set_application_error (REMMINA_SSH (tunnel), "Failed to start the SSH tunnel engine.");
+		remmina_ssh_tunnel_close_all_channels (tunnel);
 	}
+
 	tunnel->thread = 0;
 	return NULL;
 }
@@ -1091,8 +1712,12 @@ remmina_ssh_tunnel_cancel_accept (RemminaSSHTunnel *tunnel)
 	TRACE_CALL("remmina_ssh_tunnel_cancel_accept");
 	if (tunnel->server_sock >= 0)
 	{
-		close (tunnel->server_sock);
-		tunnel->server_sock = -1;
+		/* The engine may be accepting on it */
+		if (!remmina_ssh_tunnel_engine_request (tunnel, REMMINA_SSH_TUNNEL_REQUEST_CANCEL_ACCEPT))
+		{
+			close (tunnel->server_sock);
+			tunnel->server_sock = -1;
+		}
 	}
 }
 
@@ -1105,6 +1730,7 @@ remmina_ssh_tunnel_open (RemminaSSHTunnel* tunnel, const gchar *host, gint port,
 	struct sockaddr_in sin;
 
 	tunnel->tunnel_type = REMMINA_SSH_TUNNEL_OPEN;
+	g_free(tunnel->dest);
 	tunnel->dest = g_strdup (host);
 	tunnel->port = port;
 	if (tunnel->port == 0)
@@ -1140,13 +1766,14 @@ remmina_ssh_tunnel_open (RemminaSSHTunnel* tunnel, const gchar *host, gint port,
 		return FALSE;
 	}
 
+	/* Connections are accepted by the engine */
+	fcntl (sock, F_SETFL, fcntl (sock, F_GETFL, 0) | O_NONBLOCK);
 	tunnel->server_sock = sock;
 	tunnel->running = TRUE;
 
-	if (pthread_create (&tunnel->thread, NULL, remmina_ssh_tunnel_main_thread, tunnel))
+	if (!remmina_ssh_tunnel_engine_request (tunnel, REMMINA_SSH_TUNNEL_REQUEST_ADD))
 	{
-		remmina_ssh_set_application_error (REMMINA_SSH (tunnel), "Failed to initialize pthread.");
-		tunnel->thread = 0;
+		remmina_ssh_set_application_error (REMMINA_SSH (tunnel), "Failed to start the SSH tunnel engine.");
 		return FALSE;
 	}
 	return TRUE;
@@ -1208,7 +1835,94 @@ gboolean
 remmina_ssh_tunnel_terminated (RemminaSSHTunnel* tunnel)
 {
 	TRACE_CALL("remmina_ssh_tunnel_terminated");
-	return (tunnel->thread == 0);
+	return (tunnel->thread == 0 && !g_atomic_int_get (&tunnel->forwarding) && !g_atomic_int_get (&tunnel->paused));
+}
+
+typedef struct _RemminaSSHTunnelExec
+{
+	RemminaSSHTunnel *tunnel;
+	pthread_mutex_t *mutex;
+} RemminaSSHTunnelExec;
+
+/* Also run when the thread is cancelled in remmina_ssh_tunnel_exec() */
+static void
+remmina_ssh_tunnel_exec_cleanup (gpointer data)
+{
+	TRACE_CALL("remmina_ssh_tunnel_exec_cleanup");
+	RemminaSSHTunnelExec *exec = (RemminaSSHTunnelExec*) data;
+
+	remmina_ssh_tunnel_engine_request (exec->tunnel, REMMINA_SSH_TUNNEL_REQUEST_RESUME);
+	pthread_mutex_unlock (exec->mutex);
+}
+
+gboolean
+remmina_ssh_tunnel_exec (RemminaSSHTunnel *tunnel, gboolean wait, const gchar *cmd)
+{
+	TRACE_CALL("remmina_ssh_tunnel_exec");
+	static pthread_mutex_t exec_mutex = PTHREAD_MUTEX_INITIALIZER;
+	RemminaSSHTunnelExec exec;
+	ssh_channel channel;
+	gint status;
+	gboolean ret = FALSE;
+	gchar *name, *ptr;
+
+	/* The engine forwards the session in non blocking mode: pause the
+	 * forwarding of this tunnel while the session is used here. Every
+	 * channel of the tunnel stalls meanwhile, until the command exits
+	 * when wait is TRUE. */
+	exec.tunnel = tunnel;
+	exec.mutex = &exec_mutex;
+	pthread_mutex_lock (&exec_mutex);
+	pthread_cleanup_push (remmina_ssh_tunnel_exec_cleanup, &exec);
+	remmina_ssh_tunnel_engine_request (tunnel, REMMINA_SSH_TUNNEL_REQUEST_PAUSE);
+
+	if ((channel = channel_new (REMMINA_SSH (tunnel)->session)) == NULL)
+	{
+		remmina_ssh_set_error (REMMINA_SSH (tunnel), _("Failed to execute command: %s"));
+	}
+	else if (channel_open_session (channel) == SSH_OK &&
+			channel_request_exec (channel, cmd) == SSH_OK)
+	{
+		if (wait)
+		{
+			channel_send_eof (channel);
+			status = channel_get_exit_status (channel);
+			name = g_strdup (cmd);
+			ptr = strchr (name, ' ');
+			if (ptr) *ptr = '\0';
+			switch (status)
+			{
+				case 0:
+					ret = TRUE;
+					break;
+				case 127:
+					remmina_ssh_set_application_error (REMMINA_SSH (tunnel),
+							_("Command %s not found on SSH server"), name);
+					break;
+				default:
+					remmina_ssh_set_application_error (REMMINA_SSH (tunnel),
+							_("Command %s failed on SSH server (status = %i)."), name, status);
+					break;
+			}
+			g_free(name);
+			channel_close (channel);
+		}
+		else
+		{
+			ret = TRUE;
+		}
+		channel_free (channel);
+	}
+	else
+	{
+		remmina_ssh_set_error (REMMINA_SSH (tunnel), _("Failed to execute command: %s"));
+		channel_free (channel);
+	}
+
+	/* Resumes the forwarding */
+	pthread_cleanup_pop (1);
+
+	return ret;
 }
 
 void
@@ -1226,6 +1940,9 @@ remmina_ssh_tunnel_free (RemminaSSHTunnel* tunnel)
 		tunnel->thread = 0;
 	}
 
+	/* Take the session back from the engine */
+	remmina_ssh_tunnel_engine_request (tunnel, REMMINA_SSH_TUNNEL_REQUEST_REMOVE);
+
 	if (tunnel->tunnel_type == REMMINA_SSH_TUNNEL_XPORT && tunnel->remotedisplay > 0)
 	{
 		channel_forward_cancel (REMMINA_SSH (tunnel)->session,
@@ -1238,8 +1955,9 @@ remmina_ssh_tunnel_free (RemminaSSHTunnel* tunnel)
 	}
 	remmina_ssh_tunnel_close_all_channels (tunnel);
 
-	g_free(tunnel->buffer);
-	g_free(tunnel->channels_out);
+	g_ptr_array_free (tunnel->channels, TRUE);
+	g_free(tunnel->session_watch);
+	g_free(tunnel->server_watch);
 	g_free(tunnel->dest);
 	g_free(tunnel->localdisplay);
 
@@ -104,6 +104,8 @@ void remmina_ssh_free (RemminaSSH *ssh);
 /* ------------------- SSH Tunnel ---------------------- */
 typedef struct _RemminaSSHTunnel RemminaSSHTunnel;
 typedef struct _RemminaSSHTunnelBuffer RemminaSSHTunnelBuffer;
+typedef struct _RemminaSSHTunnelChannel RemminaSSHTunnelChannel;
+typedef struct _RemminaSSHTunnelWatch RemminaSSHTunnelWatch;
 
 typedef gboolean (*RemminaSSHTunnelCallback) (RemminaSSHTunnel*, gpointer);
 
@@ -121,20 +123,26 @@ struct _RemminaSSHTunnel
 
 	gint tunnel_type;
 
-	ssh_channel *channels;
-	gint *sockets;
-	RemminaSSHTunnelBuffer **socketbuffers;
-	gint num_channels;
-	gint max_channels;
+	/* The forwarded RemminaSSHTunnelChannels, and the one to be served first */
+	GPtrArray *channels;
+	guint next_channel;
+	/* The round of the tunnel engine in which the tunnel had its last turn */
+	guint serviced_round;
 
 	ssh_channel x11_channel;
 
+	/* Setup of the X11, XPORT and reverse tunnels, which wait for the server */
 	pthread_t thread;
 	gboolean running;
 
-	gchar *buffer;
-	gint buffer_len;
-	ssh_channel *channels_out;
+	/* Set while the channels are forwarded by the shared tunnel engine, which
+	 * then is the only user of the session */
+	gint forwarding;
+	/* Set while the forwarding is paused for a command run on the session */
+	gint paused;
+	ssh_event event;
+	RemminaSSHTunnelWatch *session_watch;
+	RemminaSSHTunnelWatch *server_watch;
 
 	gint server_sock;
 	gchar *dest;
@@ -154,7 +162,7 @@ struct _RemminaSSHTunnel
 /* Create a new SSH Tunnel session and connects to the SSH server */
 RemminaSSHTunnel* remmina_ssh_tunnel_new_from_file (RemminaFile *remminafile);
 
-/* Open the tunnel. A new thread will be started and listen on a local port.
+/* Open the tunnel. The shared tunnel engine will listen on a local port.
  * dest: The host:port of the remote destination
  * local_port: The listening local port for the tunnel
  */
@@ -181,6 +189,11 @@ gboolean remmina_ssh_tunnel_xport (RemminaSSHTunnel *tunnel, gboolean bindlocalh
  */
 gboolean remmina_ssh_tunnel_reverse (RemminaSSHTunnel *tunnel, gint port, gint local_port);
 
+/* Execute a command on the SSH server, pausing the forwarding of the tunnel
+ * meanwhile. With wait, return whether the command exited successfully.
+ */
+gboolean remmina_ssh_tunnel_exec (RemminaSSHTunnel *tunnel, gboolean wait, const gchar *cmd);
+
 /* Tells if the tunnel is terminated after start */
 gboolean remmina_ssh_tunnel_terminated (RemminaSSHTunnel *tunnel);
 